@@ -34,6 +34,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,43 +42,1213 @@
 #include <time.h>
 #include <stdbool.h>
 #include <pthread.h> 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#undef BLOCK_SIZE // linux/fs.h has its own, ours follows
+#define HDB_HAVE_URING 1
+#endif
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HDB_HAVE_AVX2 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define HDB_HAVE_NEON 1
+#endif
+#ifdef HDB_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// fcntl.h only declares O_DIRECT for _GNU_SOURCE, the flag itself is fixed per architecture
+#if defined(O_DIRECT)
+#define HDB_O_DIRECT O_DIRECT
+#elif defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#define HDB_O_DIRECT 040000
+#elif defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#define HDB_O_DIRECT 0200000
+#else
+#define HDB_O_DIRECT 0 // the buffer pool still reads whole pages, through the page cache
+#endif
 
 #define BLOCK_SIZE 1024 // number of blocks to read at a time
 
+// The hash file is an extendible hash table made of fixed size pages.
+// Page 0 holds the header, the directory occupies a run of pages and every
+// other page is a bucket.  A full bucket is split in two on its own, so the
+// table grows one bucket at a time instead of being rebuilt.
+// Hash files from before the magic kept bare values in the data file, with
+// no key to rebuild an index from, so they cannot be upgraded: the open
+// fails with errno set to HDB_EFORMAT, as it does for versions it does not
+// know.  Their keys and values have to be loaded again into new files.
+#define HDB_MAGIC 0x31424448 // "HDB1"
+#define HDB_FORMAT_VERSION 1
+#define HDB_EFORMAT EPROTO
+#define HDB_PAGE_SIZE 4096 // size of the header page and of every bucket page
+#define HDB_MAX_DEPTH 32 // a directory index never uses more bits than the hash has
+#define HDB_SLOT_SIZE 32 // two slots per cache line, none straddles one
+#define HDB_BUCKET_SLOTS (HDB_PAGE_SIZE / HDB_SLOT_SIZE - 1) // the first slot's worth holds the bucket header
+#define HDB_MAX_PROBE 32 // a key always sits within this many slots of its home slot
+
+// The header records whether the last session ended with db_close.  Only then
+// are the free space and filter files current, and they are read when first
+// needed instead of at open.  Otherwise both are rebuilt from the data file
+// and the index.
+#define HDB_STATE_OPEN 0 // the other files may be stale until the next close
+#define HDB_STATE_CLEAN 1 // written by db_close once everything else is synced
+#define HDB_STATE_SWAP 2 // a compacted data file is being swapped in, see hdb_finish_swap
+#define HDB_STATE_BLOB_SWAP 3 // a compacted blob file is being swapped in, see hdb_finish_blob_swap
+#define HDB_START_CLAIM 0 // new files, free space and filter are claimed at open
+#define HDB_START_CLEAN 1 // the last close was clean, free space and filter load on first use
+#define HDB_START_RECOVER 2 // the last session did not close, free space and filter are rebuilt
+#define HDB_RECOVERY_CHUNK (1 << 20) // bytes of the data file read at a time by the recovery scan
+
+#define HDB_SLOT_USED 1
+#define HDB_SLOT_CODEC_SHIFT 8 // the second byte of the flags holds the HDB_CODEC_* of the value
+
+// Hash algorithms a hash file can be created with.  The choice is recorded in
+// the header and an existing file keeps the algorithm it was built with.
+#define HDB_HASH_LEGACY32 1 // the original byte-at-a-time 32-bit hash_function
+#define HDB_HASH_MIX64 2 // word-at-a-time 64-bit hash, the default
+
+#define HDB_HASH_LONG_KEY 256 // keys at least this long go through the striped loop
+#define HDB_HASH_STRIPE 64 // bytes consumed by one step of the striped loop
+#define HDB_HASH_SCRAMBLE 16 // stripes between two scrambles of the accumulators
+
+// The data file is a log: records are only ever appended, and a record that
+// is overwritten or deleted is flagged dead where it lies.  Compaction copies
+// the live records into a new file once enough of the log is dead.
+#define HDB_RECORD_DEAD 1 // superseded by a later record or deleted
+#define HDB_RECORD_TOMBSTONE 2 // the key was deleted, the record carries no value
+#define HDB_RECORD_PADDING_SHIFT 24 // the top byte of the flags counts unused bytes after the record
+#define HDB_RECORD_CODEC_SHIFT 8 // the second byte of the flags holds the HDB_CODEC_* of the value
+
+// Codecs a value can be stored with.  A compressed value is the length of the
+// original followed by the compressed bytes, and is only kept when smaller.
+#define HDB_CODEC_NONE 0
+#define HDB_CODEC_LZ4 1 // the LZ4 block format, built in
+#define HDB_CODEC_ZSTD 2 // needs HDB_WITH_ZSTD and libzstd
+#define HDB_CODEC_BLOB 0x80 // added to the codec of a value moved to the blob file, the record holds its struct hdb_blob_ref
+#define HDB_CODEC_EXPIRES 0x40 // added to the codec of a value put with a time to live, its stored bytes end in the expiry
+#define HDB_COMPRESSION_THRESHOLD 256 // shorter values are stored as they are
+#define HDB_ZSTD_LEVEL 3
+
+// Values of options.blob_threshold bytes and more, as stored, go to a log of
+// their own next to the data file, in records laid out as in the data file.
+// Their records in the data file only point there, so compaction of the data
+// file never copies them.  The blob file is compacted on its own once enough
+// of it is dead.
+
+#define HDB_LZ4_HASH_BITS 12
+#define HDB_LZ4_MIN_MATCH 4
+#define HDB_LZ4_LAST_LITERALS 5 // a block ends with at least this many literals
+#define HDB_LZ4_MATCH_LIMIT 12 // and no match starts this close to its end
+#define HDB_LZ4_MAX_OFFSET 65535
+
+// Dead extents are reused by later records.  A record placed in a larger
+// extent is followed by a dead filler record covering the rest, or by
+// padding when the rest is too small for a record header, so the data file
+// can always be walked record by record.
+#define HDB_FREE_SPACE_MAGIC 0x46424448 // "HDBF"
+#define HDB_FREE_SPACE_VERSION 1
+
+#define HDB_OPEN_NO_COMPACTION 1 // do not start the background compaction thread
+#define HDB_OPEN_MMAP 2 // serve reads from memory mappings of the hash and data files
+#define HDB_OPEN_SORTED_INDEX 4 // keep every key in order in memory, for range and prefix cursors
+#define HDB_OPEN_DIRECT 8 // read the data file with O_DIRECT through the buffer pool, not with HDB_OPEN_MMAP
+#define HDB_OPEN_FOLLOWER 16 // read only, changes only come from db_follower_apply
+
+#define HDB_CURSOR_CHUNK (1 << 20) // a scan of the data file reads ahead this much at a time
+
+#define HDB_MMAP_CHUNK (64 << 20) // mappings grow by this much at a time
+#define HDB_MMAP_RESERVE (sizeof(void*) == 8 ? (uint64_t)1 << 40 : (uint64_t)1 << 30) // address space held per mapped file
+
+// With HDB_OPEN_DIRECT the data file is read around the page cache, in whole
+// aligned pages kept in a buffer pool of a fixed size.  Writes still go
+// through the page cache and drop the pages they cover from the pool, the
+// pages they leave in the page cache are dropped after every sync.
+#define HDB_POOL_SIZE (64 << 20) // bytes of pages held when options.buffer_pool is 0
+#define HDB_POOL_SHARDS 16 // independently locked parts of the pool, picked by page
+#define HDB_POOL_BLOCK 64 // frames a shard allocates memory for at a time
+#define HDB_POOL_READ_PAGES 32 // longer reads go straight to the file, a scan would only flush the pool
+#define HDB_POOL_CLOCK 1 // second chance: a hit sets a bit, the default
+#define HDB_POOL_LRU 2 // exact recency: a hit moves the page to the front
+
+// Readers take no lock.  They run inside a read section, validate what they
+// read against sequence counters and retry when a writer got in the way.
+// Writers to a bucket hold the mutex of its stripe, splits and compaction
+// hold the structure lock exclusively.
+#define HDB_LOCK_STRIPES 64 // bucket pages share this many write locks
+#define HDB_READER_SLOTS 64 // threads share this many read section counters
+
+#define HDB_COMPACTION_RATIO 0.5 // dead share of the data file that triggers compaction
+#define HDB_COMPACTION_MIN_SIZE (1 << 20) // smaller data files are never compacted in the background
+#define HDB_COMPACTION_RATE (64 << 20) // bytes per second the background compaction reads
+#define HDB_COMPACTION_CHUNK (1 << 20) // bytes scanned per hold of the database lock
+
+// Durability of acknowledged writes.  Unless it is HDB_DURABILITY_NONE every
+// put and delete is appended to a write-ahead log next to the data file, which
+// db_open replays.  A checkpoint syncs the hash and data files and empties it.
+#define HDB_DURABILITY_NONE 1 // no log, the files are synced on close
+#define HDB_DURABILITY_PERIODIC 2 // the log is synced every sync interval, the default
+#define HDB_DURABILITY_COMMIT 3 // writes return once their log record is synced, waiting writers share one sync
+
+#define HDB_SYNC_INTERVAL 100 // milliseconds between syncs of the log with HDB_DURABILITY_PERIODIC
+#define HDB_WAL_CHECKPOINT_SIZE (64 << 20) // log size that triggers a checkpoint
+#define HDB_WAL_BUFFER (1 << 20) // appended bytes let pile up before a writer writes them out
+
+// Statistics kept unless HDB_NO_STATS is defined, which compiles them out.
+// Counters and latency histograms are split in shards picked by thread, so
+// threads counting at the same time rarely share a cache line.  Latencies
+// are in nanoseconds, in buckets of one eighth of a power of two.
+#define HDB_STAT_GETS 0
+#define HDB_STAT_GET_MISSES 1
+#define HDB_STAT_PUTS 2
+#define HDB_STAT_DELETES 3
+#define HDB_STAT_PROBES 4 // lookups in the index
+#define HDB_STAT_PROBE_RETRIES 5 // lookups a writer got in the way of
+#define HDB_STAT_BYTES_READ 6 // of the values db_get returned
+#define HDB_STAT_BYTES_WRITTEN 7 // of the records written to the data file
+#define HDB_STAT_EXTENT_REUSES 8 // records placed in dead space
+#define HDB_STAT_APPENDS 9 // records placed at the end of the data file
+#define HDB_STAT_SPLITS 10
+#define HDB_STAT_COMPACTIONS 11
+#define HDB_STAT_BLOB_WRITES 12 // values written to the blob file
+#define HDB_STAT_BLOB_COMPACTIONS 13
+#define HDB_STAT_EXPIRED 14 // expired keys compaction dropped
+#define HDB_STAT_IN_PLACE_UPDATES 15 // values db_cas and db_incr wrote over the old ones
+#define HDB_STAT_COUNT 16
+
+#define HDB_LATENCY_GET 0
+#define HDB_LATENCY_PUT 1
+#define HDB_LATENCY_DELETE 2
+#define HDB_LATENCY_SYNC 3 // syncs of the log, by the background thread or a committing writer
+#define HDB_LATENCY_CHECKPOINT 4
+#define HDB_LATENCY_COUNT 5
+
+#define HDB_STATS_SHARDS 16
+#define HDB_HISTOGRAM_SUB_BITS 3
+#define HDB_HISTOGRAM_BUCKETS ((64 - HDB_HISTOGRAM_SUB_BITS + 1) << HDB_HISTOGRAM_SUB_BITS)
+
+#define HDB_STATS_TEXT 0
+#define HDB_STATS_JSON 1
+
+#define HDB_WAL_PUT 1
+#define HDB_WAL_DELETE 2
+#define HDB_WAL_PUT_EXPIRES 3 // the value is followed by its expiry
+#define HDB_WAL_SEQUENCE 4 // starts the log of a database whose changes are numbered, the value is the number of the next
+
+// With options.replication_backlog every change logged is also numbered and
+// kept in memory, as a stream followers read with db_changes_read and apply
+// with db_follower_apply.  The number of the next change is kept in the
+// header, and a log replayed at open numbers its records again the same way.
+// A follower too far behind for the backlog starts over from a snapshot, and
+// so do all of them when a leader without a log crashes, since the changes
+// they already have are lost to it.
+#define HDB_STREAM_SEGMENT (1 << 20) // the backlog is allocated and dropped this many bytes at a time
+
+// A value put with db_put_ttl expires at a wall clock time in milliseconds,
+// kept after its stored bytes.  Reads treat it as gone from then on, and
+// compaction drops it.  With background compaction a timer wheel of
+// HDB_WHEEL_LEVELS levels of 2^HDB_WHEEL_BITS slots, the first of them
+// HDB_WHEEL_TICK milliseconds apart, counts the bytes that expire, so they
+// trigger compaction as dead bytes do.
+#define HDB_WHEEL_LEVELS 4
+#define HDB_WHEEL_BITS 6
+#define HDB_WHEEL_TICK 1000
+
+// Engines behind db_async_open.  Either way writes run on a worker thread,
+// since they take locks the polling thread must not wait for.
+#define HDB_ASYNC_URING 1 // reads through io_uring, the default, falls back to HDB_ASYNC_THREADS
+#define HDB_ASYNC_THREADS 2 // reads and writes on worker threads calling db_get, db_put and db_delete
+#define HDB_ASYNC_DEPTH 256 // reads in flight at once with io_uring
+#define HDB_ASYNC_WORKERS 4 // worker threads of HDB_ASYNC_THREADS, io_uring uses one
+
+#define HDB_REQUEST_GET 1
+#define HDB_REQUEST_PUT 2
+#define HDB_REQUEST_DELETE 3
+
+#define HDB_BATCH_IOV 1020 // iovecs per pwritev of a batch, three per record and within the usual IOV_MAX
+#define HDB_BATCH_PREFETCH (16 << 10) // values at least this long are announced to the kernel before a batch reads them
+
+#define HDB_GET_SCRATCH 4096 // records up to this long are read by db_get into a buffer on the stack
+
+#define HDB_BULK_CHUNK (8 << 20) // bytes of records a loader thread hashes and compresses at a time
+#define HDB_BULK_FILL 80 // keys a bulk loaded bucket is sized for, out of HDB_BUCKET_SLOTS
+#define HDB_BULK_PARTITION_BITS 8 // the index is built in up to 1 << this many parts at once
+#define HDB_BULK_WRITE_PAGES 256 // bucket pages a loader thread writes at once
+
+#define HDB_SHARDS_MAGIC 0x53424448 // "HDBS"
+#define HDB_SHARDS_VERSION 1
+#define HDB_SHARDS_FILENAME "hdb_shards" // in the first directory, records the number of shards
+#define HDB_MAX_SHARDS 256
+
+// The value cache follows S3-FIFO: new entries go to a small queue, and the
+// ones hit again before they reach its head move on to the main queue, which
+// gives every entry another round per hit.  Keys evicted from the small queue
+// are remembered as ghosts and go straight to the main queue when they come
+// back.  A scan therefore only ever churns the small queue.
+#define HDB_CACHE_SHARDS 32 // independently locked parts of the value cache, picked by hash
+#define HDB_CACHE_SMALL_SHARE 10 // percent of a shard's budget held by the small queue
+#define HDB_CACHE_MAX_FREQUENCY 3 // hits an entry remembers
+
+// Gets for absent keys are answered by a blocked Bloom filter over the index
+// when options.filter_bits is set.  Each key sets its bits within one cache
+// line.  Deletes leave their bits behind until compaction rebuilds the filter
+// from the index, which also happens once the keys outgrow it.
+#define HDB_FILTER_MAGIC 0x4c424448 // "HDBL"
+#define HDB_FILTER_VERSION 1
+#define HDB_FILTER_BLOCK_BITS 512
+#define HDB_FILTER_MIN_KEYS 4096 // a filter is sized for at least this many keys, and twice those in the index
+
+#define HDB_SLAB_FIRST_CHUNK 64 // objects in the first chunk of a slab
+#define HDB_SLAB_MAX_CHUNK 65536 // objects in its largest chunks
+
+#define HDB_CACHE_SMALL 0
+#define HDB_CACHE_MAIN 1
+#define HDB_CACHE_GHOST 2
+
+struct hdb_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t global_depth; // the directory has 1 << global_depth entries
+    uint32_t bucket_count; // number of bucket pages in use
+    uint32_t page_count; // number of pages allocated in the hash file
+    uint32_t directory_page; // first page of the directory
+    uint64_t key_count;
+    uint32_t hash_algorithm; // HDB_HASH_*
+    uint64_t dead_bytes; // bytes of dead records and tombstones in the data file
+    uint32_t state; // HDB_STATE_*
+    uint32_t compactions; // of the data file swapped in so far
+    uint64_t data_end; // length of the data file at the last clean close
+    uint64_t free_space_count; // extents in the free space file at the last clean close
+    uint64_t blob_end; // length of the blob file at the last clean close
+    uint64_t blob_dead_bytes; // bytes of dead records in the blob file
+    uint64_t sequence; // of the next change, see options.replication_backlog
+    uint64_t checksum; // of everything before it
+};
+
+// Memory hook for db_open_with_options.  Called like realloc(ptr, size) for
+// every block the handle owns, and to free ptr when size is 0.
+struct hdb_allocator {
+    void *(*reallocate)(void *context, void *ptr, size_t size);
+    void *context; // passed through
+};
+
+// Settings for db_open_with_options.  A zeroed struct gives the defaults.
+struct hdb_options {
+    uint32_t hash_algorithm; // HDB_HASH_* for a new hash file, HDB_HASH_MIX64 when 0
+    uint32_t flags; // HDB_OPEN_*
+    double compaction_ratio; // HDB_COMPACTION_RATIO when 0
+    uint64_t compaction_min_size; // HDB_COMPACTION_MIN_SIZE when 0
+    uint64_t compaction_rate; // HDB_COMPACTION_RATE when 0, UINT64_MAX for no limit
+    uint64_t mmap_chunk; // HDB_MMAP_CHUNK when 0, only used with HDB_OPEN_MMAP
+    uint64_t mmap_reserve; // HDB_MMAP_RESERVE when 0, less when the address space is short, a mapped file cannot grow past it
+    uint32_t durability; // HDB_DURABILITY_*, HDB_DURABILITY_PERIODIC when 0
+    uint32_t sync_interval; // HDB_SYNC_INTERVAL when 0
+    uint64_t wal_checkpoint_size; // HDB_WAL_CHECKPOINT_SIZE when 0
+    const char *wal_filename; // the data file name followed by ".wal" when NULL
+    uint64_t index_cache; // bytes of bucket pages kept in memory, 0 for none, UINT64_MAX for all, not used with HDB_OPEN_MMAP
+    uint64_t value_cache; // bytes of keys and values db_get keeps in memory, 0 for none
+    uint32_t filter_bits; // bits per key of the filter for absent keys, 0 for none, 10 gives about 1% false positives
+    const char *filter_filename; // the hash file name followed by ".filter" when NULL
+    const struct hdb_allocator *allocator; // the C library when NULL, copied by db_open_with_options
+    uint32_t compression; // HDB_CODEC_* for values written from now on, HDB_CODEC_NONE when 0
+    uint32_t compression_threshold; // HDB_COMPRESSION_THRESHOLD when 0
+    int compression_level; // for HDB_CODEC_ZSTD, HDB_ZSTD_LEVEL when 0
+    uint64_t buffer_pool; // bytes of data file pages held with HDB_OPEN_DIRECT, HDB_POOL_SIZE when 0
+    uint32_t buffer_pool_policy; // HDB_POOL_* the pool evicts by, HDB_POOL_CLOCK when 0
+    uint64_t blob_threshold; // values of this many bytes and more as stored go to the blob file, 0 for none
+    const char *blob_filename; // the data file name followed by ".blob" when NULL
+    uint64_t replication_backlog; // bytes of the latest changes kept for db_changes_read, 0 for no change stream
+};
+
+// One index entry.  Everything a probe needs sits in a single record, so
+// checking a slot is one contiguous read.
+struct hdb_slot {
+    uint64_t hash; // full hash of the key
+    uint64_t position; // offset of the record in the data file
+    uint64_t length; // length of the value
+    uint32_t fingerprint; // second, independent hash of the key, also picks the home slot
+    uint32_t flags; // HDB_SLOT_USED and the codec of the value
+};
+
+struct hdb_bucket {
+    uint32_t local_depth; // number of low hash bits shared by every key in the bucket
+    uint32_t count; // number of used slots
+    uint32_t compaction; // header.compactions when its positions were last remapped
+    uint8_t reserved[HDB_SLOT_SIZE - 3 * sizeof(uint32_t)];
+    struct hdb_slot slots[HDB_BUCKET_SLOTS];
+};
+
+// Every record in the data file is this header followed by the key and the value.
+struct hdb_record_header {
+    uint32_t key_length;
+    uint32_t flags; // HDB_RECORD_*
+    uint64_t value_length; // as stored, compressed or not
+};
+
+// What the data file holds of a value that went to the blob file.  The
+// length comes first, where a compressed value has it too.
+struct hdb_blob_ref {
+    uint64_t length; // of the original value
+    uint64_t position; // of the value in the blob file, its record starts the key and a header earlier
+    uint64_t stored_length; // of the value in that record
+};
+
+// A dead extent of the data file.  Every extent sits in two treaps sharing the
+// nodes: one ordered by offset to find neighbours to coalesce with, one
+// ordered by length then offset to find the best fit.
+#define HDB_BY_OFFSET 0
+#define HDB_BY_LENGTH 1
+
+struct hdb_extent {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t priority;
+    struct hdb_extent *child[2][2]; // [HDB_BY_OFFSET or HDB_BY_LENGTH][left or right]
+};
+
+// Fixed size objects carved out of chunks that double in size, up to
+// HDB_SLAB_MAX_CHUNK objects.  Freed objects are kept for reuse and the chunks
+// only go back to the allocator when the slab is destroyed.
+struct hdb_slab {
+    const struct hdb_allocator *allocator;
+    size_t object_size;
+    void *free_list; // freed objects, linked through their first word
+    void *chunks; // linked through their first word
+    uint8_t *next; // unused part of the newest chunk
+    uint8_t *end;
+    size_t chunk_objects; // objects in the next chunk
+};
+
+// A record that expires, filed in the slot of the timer wheel its expiry
+// falls into.
+struct hdb_wheel_entry {
+    struct hdb_wheel_entry *next;
+    uint64_t expires;
+    uint64_t position; // of the record in the data file
+};
+
+struct hdb_wheel {
+    struct hdb_slab entries;
+    struct hdb_wheel_entry *slots[HDB_WHEEL_LEVELS][1 << HDB_WHEEL_BITS];
+    uint64_t tick; // the next one to reap
+};
+
+struct hdb_free_space {
+    struct hdb_slab extents; // nodes of both treaps
+    struct hdb_extent *root[2];
+    uint64_t count; // number of extents
+    uint64_t bytes; // total length of the extents
+    uint32_t seed; // state of the priority generator
+};
+
+// On disk form of the free space: this header and then count pairs of
+// offset and length, ordered by offset.
+struct hdb_free_space_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+};
+
+// A read only shared mapping of a file.  The whole reserve is taken from the
+// address space up front and the file is mapped into its start, a chunk at a
+// time as it grows, so the base never moves under a lock-free reader.  Writes
+// go to the kernel with pwrite, which the mapping sees at once.
+struct hdb_map {
+    uint8_t *base; // NULL when the file is not mapped
+    uint64_t capacity; // bytes of the reserve backed by the file, reads past it fail
+    uint64_t reserve; // bytes of address space held
+    uint64_t chunk; // the capacity is a multiple of this
+};
+
+// Write lock and sequence counter shared by the buckets whose page falls in
+// the stripe.  Each one sits on its own cache lines.
+struct hdb_stripe {
+    pthread_mutex_t lock;
+    uint32_t seq; // odd while a bucket of the stripe is being written
+} __attribute__((aligned(64)));
+
+// Read sections in progress, counted by phase.  The first half of the
+// threads hashes to one counter each, the rest share them.
+struct hdb_reader_slot {
+    uint64_t active[2];
+} __attribute__((aligned(64)));
+
+// A value borrowed with db_get_ref.  With HDB_OPEN_MMAP data points into the
+// mapping of the data file, otherwise at a private copy.  Either way it stays
+// valid, and unchanged, until db_release_ref, even if the key is overwritten
+// or the data file is compacted meanwhile.  The struct itself is linked into
+// the database while held and must not be moved or copied.
+struct hdb_ref {
+    const uint8_t *data;
+    size_t length;
+    struct hdb *db;
+    uint8_t *copy; // the private copy, NULL when data points into a mapping
+    uint64_t epoch; // epoch of the database when the ref was taken
+    struct hdb_ref *prev; // held refs, oldest first
+    struct hdb_ref *next;
+};
+
+// A key and value for db_put_batch.
+struct hdb_put_item {
+    const uint8_t *key;
+    size_t key_length;
+    const uint8_t *value;
+    size_t value_length;
+};
+
+// Pairs for db_bulk_load.  next points item at the next pair and returns 0,
+// or returns 1 after the last one and -1 on failure.  The key and value only
+// have to stay valid until the following call.
+struct hdb_bulk_source {
+    int (*next)(void *context, struct hdb_put_item *item);
+    void *context;
+};
+
+// A key for db_get_batch.  value must have room for the value, value_length
+// receives its length and rc is 0 when the key was found and -1 otherwise.
+struct hdb_get_item {
+    const uint8_t *key;
+    size_t key_length;
+    uint8_t *value;
+    size_t value_length;
+    int rc;
+};
+
+// A value written a piece at a time, from db_put_begin to db_put_commit.
+// Readers see the key as it was until the commit.
+struct hdb_value_writer {
+    uint64_t length; // of the whole value
+    uint64_t written; // so far
+    struct hdb *db;
+    uint8_t *key;
+    size_t key_length;
+    uint64_t position; // of the record, in the blob file when blob is set
+    bool blob;
+};
+
+// A value read a piece at a time with db_read_at, as it was when
+// db_get_open found it, whatever happens to the key meanwhile.
+struct hdb_value_reader {
+    uint64_t length; // of the whole value
+    struct hdb *db;
+    uint64_t offset; // of the value, in the blob file when blob is set
+    bool blob;
+    uint8_t *decoded; // the whole value, when it is stored compressed
+};
+
+struct hdb_snapshot;
+
+// A scan opened with db_cursor_open, db_cursor_open_range,
+// db_cursor_open_prefix or db_snapshot_cursor.  After db_cursor_next returned 0, key and value
+// hold the current key and its value until the next call.
+struct hdb_cursor {
+    const uint8_t *key;
+    size_t key_length;
+    const uint8_t *value;
+    size_t value_length;
+    struct hdb *db;
+    bool sorted; // walks the sorted index, otherwise the data file
+    // A scan of the data file
+    uint64_t position; // of the next record
+    uint64_t end; // of the data file when the cursor or its snapshot was opened
+    struct hdb_snapshot *snapshot; // the view records are checked against, NULL for the live index
+    uint8_t *buffer; // read ahead from buffer_start
+    size_t buffer_capacity;
+    uint64_t buffer_start;
+    size_t buffer_length;
+    uint8_t *decoded; // the value of the current record, when it was compressed
+    size_t decoded_capacity;
+    // A scan of the sorted index
+    uint8_t *last; // the key returned last, or the start of the range
+    size_t last_length;
+    size_t last_capacity;
+    bool inclusive; // whether last itself is still to come
+    uint8_t *high; // the end of the range, itself excluded, NULL for none
+    size_t high_length;
+    struct hdb_ref ref; // holds the current value
+    bool held;
+};
+
+// A request for db_async_submit.  For a get value must have room for the
+// value and value_length receives its length, for a put they give the value
+// to store.  rc is what db_get, db_put or db_delete would have returned.  The
+// request belongs to the engine until its callback runs.
+struct hdb_request {
+    uint32_t type; // HDB_REQUEST_*
+    const uint8_t *key;
+    size_t key_length;
+    uint8_t *value;
+    size_t value_length;
+    int rc;
+    void (*callback)(struct hdb_request *request); // called from db_async_poll, may be NULL
+    void *user_data;
+    struct hdb_request *next;
+};
+
+// Every log record is this header followed by the key and the value.  The
+// checksum covers everything after it, so a torn tail is told apart.
+struct hdb_wal_record {
+    uint64_t checksum;
+    uint32_t type; // HDB_WAL_*
+    uint32_t key_length;
+    uint64_t value_length;
+};
+
+// A change as db_changes_read hands it out: this header followed by the key
+// and the value, which ends in its expiry for HDB_WAL_PUT_EXPIRES.  The
+// checksum covers everything after it.
+struct hdb_change {
+    uint64_t checksum;
+    uint64_t sequence;
+    uint32_t type; // HDB_WAL_*
+    uint32_t key_length;
+    uint64_t value_length;
+};
+
+// A piece of the change stream backlog.  Each change in it is preceded by
+// the position the log ended at once it was logged, 0 when it was not.
+struct hdb_stream_segment {
+    struct hdb_stream_segment *next;
+    uint64_t first; // sequence of its first change
+    size_t length;
+    size_t capacity;
+    uint8_t data[];
+};
+
+// The latest changes, with options.replication_backlog.  Guarded by the lock
+// of the log, so they are numbered in the order they are logged.
+struct hdb_stream {
+    struct hdb_stream_segment *head; // oldest
+    struct hdb_stream_segment *tail;
+    uint64_t bytes; // held by the segments
+    uint32_t waiters; // readers waiting for a change
+};
+
+// The write-ahead log.  Positions count every byte ever appended, so they
+// keep growing when a checkpoint empties the file.  Writers append to the
+// buffer, whoever finds no flush running writes out everything appended so
+// far and syncs it for the others waiting.
+struct hdb_wal {
+    FILE *file; // NULL with HDB_DURABILITY_NONE
+    pthread_mutex_t lock;
+    pthread_cond_t flushed; // signalled when a flush or checkpoint finishes
+    uint8_t *buffer; // records appended and not written out yet
+    size_t length;
+    size_t capacity;
+    uint8_t *spare; // the buffer a flush is writing out
+    size_t spare_capacity;
+    size_t reserved; // bytes writers hold room for in the buffer, see hdb_wal_reserve
+    uint64_t base; // position of the start of the file
+    uint64_t end; // position after the last record appended
+    uint64_t written; // position up to which the file holds the records
+    uint64_t durable; // position up to which the file is synced
+    bool flushing;
+    bool failed; // a write or sync failed, nothing is acknowledged any more
+    uint64_t syncs; // number of syncs of the file
+    struct hdb_stream *stream; // with options.replication_backlog
+    bool replaying; // changes are numbered by the replay, not as they are appended
+};
+
+// Something a held ref may still point into.  It is kept until every ref
+// taken at or before its epoch is released.
+struct hdb_limbo {
+    uint64_t epoch;
+    uint8_t *base; // the mapping of a data file replaced by compaction, NULL for an extent
+    uint64_t reserve;
+    uint64_t offset; // a dead extent of the data file, withheld from the free space
+    uint64_t length;
+    struct hdb_limbo *next;
+};
+
+// Copies of bucket pages kept in memory with options.index_cache, by page.
+// Pages are loaded at open and added as splits create them, until the budget
+// is spent, and stay until close.  The table is replaced as a whole when it
+// grows.  Writers update a copy along with the file, readers validate what
+// they copied out of it like any other lock-free read.
+struct hdb_page_table {
+    uint32_t capacity;
+    struct hdb_bucket *pages[]; // NULL for a page read from the file
+};
+
+// A key in the sorted index.  The nodes form a treap ordered by the bytes of
+// the keys, a shorter key first when one is a prefix of the other.
+struct hdb_key_node {
+    struct hdb_key_node *child[2];
+    uint32_t priority;
+    uint32_t key_length;
+    uint8_t key[];
+};
+
+// Every key in order, with HDB_OPEN_SORTED_INDEX.  Built by a scan of the data
+// file at open, then kept up to date by puts and deletes under the stripe
+// lock of the key, so it changes in the same order as the index.  Cursors
+// only hold the lock to find the key after the last one they returned.
+struct hdb_sorted_index {
+    pthread_mutex_t lock;
+    struct hdb_key_node *root;
+    uint64_t count;
+    uint32_t seed; // state of the priority generator
+};
+
+// A read view opened with db_snapshot_open.  It keeps its own copy of the
+// directory, and every bucket page a writer changes afterwards is saved for
+// it first, so it goes on seeing the index of the moment it was opened.  The
+// records that index points at stay in place because the snapshot pins the
+// data file: dead space is not reused and compaction does not run meanwhile.
+struct hdb_snapshot {
+    struct hdb *db;
+    uint64_t end; // of the data file when the snapshot was opened, later records are not in it
+    uint32_t global_depth;
+    uint32_t *directory;
+    uint32_t page_count; // pages at the time, later ones are new buckets it never looks at
+    uint64_t sequence; // of the first change it does not see, where a follower loaded from it starts
+    struct hdb_bucket **pages; // saved copies by page, NULL for a page not changed since
+    struct hdb_snapshot *prev; // open snapshots, linked with the lock held exclusively
+    struct hdb_snapshot *next;
+};
+
+struct hdb_filter {
+    uint64_t blocks; // of HDB_FILTER_BLOCK_BITS each
+    uint64_t capacity; // keys it was sized for
+    uint32_t probes; // bits set per key
+    uint32_t bits_per_key;
+    uint64_t bits[]; // HDB_FILTER_BLOCK_BITS / 64 words per block
+};
+
+// On disk form of the filter, written on close and claimed on open like the
+// free space.  It is only trusted if the index still matches the header.
+struct hdb_filter_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_count;
+    uint32_t page_count;
+    uint32_t bits_per_key;
+    uint64_t blocks;
+    uint64_t capacity;
+};
+
+// A latency distribution in nanoseconds.  Percentiles and the maximum are
+// the upper end of the histogram bucket they fall in, at most 12.5% high.
+struct hdb_latency {
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+// What db_stats returns, all zero with HDB_NO_STATS.
+struct hdb_stats {
+    uint64_t counters[HDB_STAT_COUNT]; // by HDB_STAT_*
+    struct hdb_latency latencies[HDB_LATENCY_COUNT]; // by HDB_LATENCY_*
+};
+
+struct hdb_stats_shard {
+    uint64_t counters[HDB_STAT_COUNT];
+    uint64_t latency_sums[HDB_LATENCY_COUNT];
+    uint64_t histograms[HDB_LATENCY_COUNT][HDB_HISTOGRAM_BUCKETS];
+} __attribute__((aligned(64)));
+
+// A data file page held by the buffer pool.
+struct hdb_pool_frame {
+    uint64_t page;
+    uint8_t *data; // HDB_PAGE_SIZE bytes, aligned for O_DIRECT
+    uint32_t length; // bytes of the page the file held when it was read
+    uint32_t referenced; // HDB_POOL_CLOCK: hit since the hand last passed
+    int32_t chain; // next frame in the same table bucket or on the free list, -1 for none
+    int32_t prev; // HDB_POOL_LRU: neighbours in recency order
+    int32_t next;
+};
+
+struct hdb_pool_shard {
+    pthread_mutex_t lock;
+    struct hdb_pool_frame *frames; // capacity of them, the first used ones have memory
+    uint8_t **blocks; // the memory of HDB_POOL_BLOCK frames each
+    uint32_t capacity; // frames the budget allows
+    uint32_t used; // frames handed out so far
+    uint32_t count; // frames holding a page
+    int32_t free; // first frame given back by an invalidation, -1 for none
+    int32_t *table; // frames by page, chained
+    uint32_t table_mask;
+    uint32_t hand; // HDB_POOL_CLOCK: next frame to consider for eviction
+    int32_t head; // HDB_POOL_LRU: most recently used frame
+    int32_t tail; // HDB_POOL_LRU: next to be evicted
+    uint64_t seq; // advanced by every invalidation, a page read before it is not kept
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64)));
+
+// The buffer pool of one data file, replaced along with it by compaction.
+struct hdb_pool {
+    FILE *file; // the data file the pages are of
+    int fd; // the same file opened for reading with O_DIRECT
+    uint32_t policy; // HDB_POOL_*
+    const struct hdb_allocator *allocator;
+    struct hdb_pool_shard shards[HDB_POOL_SHARDS];
+};
+
+// Counters of the value cache, summed over its shards by db_cache_stats.
+struct hdb_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries; // keys with their value in the cache
+    uint64_t bytes; // memory charged to them, entries included
+};
+
+// A key and value in the value cache, or the ghost of an evicted one.
+struct hdb_cache_entry {
+    uint64_t hash;
+    struct hdb_cache_entry *chain; // next entry in the same table bucket
+    struct hdb_cache_entry *prev; // neighbours in its queue
+    struct hdb_cache_entry *next;
+    uint8_t *data; // the key followed by the value, NULL for a ghost
+    size_t key_length;
+    size_t value_length;
+    uint32_t queue; // HDB_CACHE_*
+    uint32_t frequency; // hits since it was queued, up to HDB_CACHE_MAX_FREQUENCY
+};
+
+struct hdb_cache_queue {
+    struct hdb_cache_entry *head; // next to be evicted
+    struct hdb_cache_entry *tail;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+struct hdb_cache_shard {
+    pthread_mutex_t lock;
+    struct hdb_cache_entry **table; // chained by hash, ghosts included
+    uint64_t table_size; // a power of two
+    struct hdb_cache_queue queues[3]; // by HDB_CACHE_*
+    uint64_t budget; // bytes the small and main queues may hold
+    uint64_t seq; // advanced by every invalidation, a value read before it is not cached
+    uint64_t hits;
+    uint64_t misses;
+    struct hdb_slab entries;
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct hdb_slot) == HDB_SLOT_SIZE, "slots must stay cache line aligned");
+_Static_assert(sizeof(struct hdb_bucket) == HDB_PAGE_SIZE, "a bucket fills exactly one page");
+
 struct hdb {
+    struct hdb_allocator allocator; // as given in options.allocator, the C library otherwise
     FILE *hash_file;
     FILE *data_file;
     FILE *deleted_blocks;
-    int *deleted_blocks_array;
-    int deleted_blocks_array_size;
-    pthread_t fsync_thread;
-    bool stop_fsync_thread;
+    struct hdb_map hash_map; // with HDB_OPEN_MMAP
+    struct hdb_map *data_map; // with HDB_OPEN_MMAP, replaced as a whole when compaction swaps the file
+    struct hdb_pool *data_pool; // with HDB_OPEN_DIRECT, replaced along with the data file
+    struct hdb_page_table *index_cache; // with options.index_cache, grown with the lock held exclusively
+    uint64_t index_cache_bytes; // bytes of bucket pages copied into the index cache
+    struct hdb_cache_shard *value_cache; // HDB_CACHE_SHARDS of them with options.value_cache, NULL otherwise
+    struct hdb_filter *filter; // with options.filter_bits, replaced as a whole when it is rebuilt
+    bool filter_pending; // the filter file is still to be loaded, see hdb_touch_filter
+    pthread_mutex_t filter_lock; // one load of the filter file at a time
+    FILE *filter_file;
+    char *filter_filename;
+    uint64_t data_end; // length of the data file, records are placed up to here before they are written
+    uint64_t data_generation; // advanced whenever compaction swaps the data file
+    FILE *blob_file; // with options.blob_threshold or once the file exists, replaced when it is compacted
+    char *blob_filename;
+    uint64_t blob_generation; // advanced whenever blob compaction swaps the blob file
+    struct hdb_sorted_index *sorted; // with HDB_OPEN_SORTED_INDEX
+    struct hdb_snapshot *snapshots; // open ones, changed with the lock held exclusively
+#ifndef HDB_NO_STATS
+    struct hdb_stats_shard *stats; // HDB_STATS_SHARDS of them
+#endif
+    // Guarded by alloc_lock
+    pthread_mutex_t alloc_lock;
+    struct hdb_free_space free_space; // dead extents of the data file, persisted in deleted_blocks
+    bool free_space_pending; // the extents in deleted_blocks are still to be loaded
+    bool compacting; // a compaction is copying the data file, free space is not reused meanwhile
+    bool blob_compacting; // a compaction is copying the blob file, the data file is not compacted meanwhile
+    uint64_t blob_end; // length of the blob file, records are placed up to here before they are written
+    struct hdb_wheel *wheel; // records that expire, with background compaction
+    uint64_t expired_bytes; // of the records the wheel found expired since the last compaction
+    uint32_t pins; // open scans of the data file and snapshots, which hold off reuse and compaction too
+    uint64_t epoch; // advanced whenever something a ref points into is retired
+    struct hdb_ref *refs; // oldest held ref
+    struct hdb_ref *refs_tail;
+    struct hdb_limbo *limbo; // oldest retired mapping or extent still waiting for refs
+    struct hdb_limbo *limbo_tail;
+    // Concurrency control, see HDB_LOCK_STRIPES
+    uint32_t structure_seq; // odd while splits or compaction rewrite the directory or swap files
+    struct hdb_stripe stripes[HDB_LOCK_STRIPES];
+    struct hdb_reader_slot readers[HDB_READER_SLOTS];
+    uint32_t reader_phase; // read sections count under reader_phase & 1
+    pthread_mutex_t synchronize_lock; // one grace period at a time
+    pthread_t sync_thread;
+    bool stop_sync_thread;
     pthread_mutex_t fsync_mutex;
+    pthread_cond_t sync_cond; // signalled on close
+    struct hdb_wal wal;
+    char *wal_filename;
+    struct hdb_header header;
+    uint32_t start; // HDB_START_*, how the files were found at open
+    uint32_t *directory; // bucket page for every directory index
+    uint64_t (*hash)(const uint8_t *data, size_t length); // picked from header.hash_algorithm
+    struct hdb_options options; // as given to db_open_with_options with the defaults filled in
+    char *data_filename;
+    pthread_rwlock_t lock; // shared by writers, exclusive for splits and for compaction one chunk at a time
+    pthread_t compaction_thread;
+    pthread_mutex_t compaction_mutex;
+    pthread_cond_t compaction_cond; // signalled when dead space grows or on close
+    bool stop_compaction_thread;
 };
 
-uint32_t hash_function(const uint8_t *data, size_t length);
+// A database spread over independent ones, each key stored in the shard its
+// hash picks.  The shards are full databases with their own files, log,
+// sync and compaction threads, so writers to different shards never meet.
+struct hdb_sharded {
+    struct hdb_allocator allocator;
+    uint32_t count;
+    struct hdb *shards[HDB_MAX_SHARDS];
+};
+
+uint64_t hash_function(const uint8_t *data, size_t length);
+uint32_t hash_function_legacy(const uint8_t *data, size_t length);
+uint32_t fingerprint_function(const uint8_t *data, size_t length);
 
 void db_close(struct hdb *db);
-void decode_deleted_blocks_array(struct hdb *db);
-void encode_deleted_blocks_array(struct hdb *db);
+int decode_free_space(struct hdb *db);
+int encode_free_space(struct hdb *db);
+int hdb_claim_free_space(struct hdb *db);
+void hdb_free_space_clear(struct hdb_free_space *free_space);
 int db_delete(struct hdb *db, const uint8_t *key, size_t key_length);
+int hdb_compact(struct hdb *db, uint64_t rate);
+bool hdb_needs_compaction(struct hdb *db);
+void hdb_reap_expired(struct hdb *db);
+int hdb_compact_blobs(struct hdb *db, uint64_t rate);
+void db_put_abort(struct hdb_value_writer *writer);
+void db_get_close(struct hdb_value_reader *reader);
+bool hdb_needs_blob_compaction(struct hdb *db);
+int hdb_load_index(struct hdb *db, const struct hdb_options *options);
+int hdb_load_index_cache(struct hdb *db);
+int hdb_finish_swap(struct hdb *db);
+int hdb_finish_blob_swap(struct hdb *db);
+void hdb_free_index_cache(struct hdb *db);
+int hdb_open_value_cache(struct hdb *db);
+int hdb_claim_filter(struct hdb *db);
+int hdb_check_filter(struct hdb *db);
+int hdb_encode_filter(struct hdb *db);
+void hdb_free_value_cache(struct hdb *db);
+int hdb_write_header(struct hdb *db);
+void hdb_abort_open(struct hdb *db);
+void hdb_free_stream(struct hdb *db);
+bool hdb_codec_supported(uint32_t codec);
+int hdb_open_sorted_index(struct hdb *db);
+int hdb_build_sorted_index(struct hdb *db);
+void hdb_free_sorted_index(struct hdb *db);
+int hdb_snapshot_preserve(struct hdb *db, uint32_t page);
+uint64_t hdb_stats_clock(void);
+void hdb_count(struct hdb *db, uint32_t counter, uint64_t amount);
+void hdb_time(struct hdb *db, uint32_t latency, uint64_t start);
+int hdb_map_open(struct hdb_map *map, FILE *file, uint64_t chunk, uint64_t reserve);
+void hdb_map_close(struct hdb_map *map);
+struct hdb_pool* hdb_pool_open(const struct hdb_allocator *allocator, FILE *file, const char *filename,
+                               uint64_t budget, uint32_t policy);
+void hdb_pool_close(struct hdb_pool *pool);
+void hdb_pool_invalidate(struct hdb_pool *pool, uint64_t offset, uint64_t length);
+void hdb_drain_limbo(struct hdb *db, bool all);
+void hdb_synchronize(struct hdb *db);
+int hdb_open_wal(struct hdb *db);
+int hdb_wal_flush(struct hdb_wal *wal, uint64_t position, bool sync);
+uint64_t hdb_wal_size(struct hdb_wal *wal, uint64_t *end);
+int hdb_checkpoint(struct hdb *db);
+struct hdb_async;
+void db_async_close(struct hdb_async *async);
+int hdb_free_space_release(struct hdb_free_space *free_space, uint64_t offset, uint64_t length);
+int hdb_touch_filter(struct hdb *db);
+void hdb_load_free_space(struct hdb *db);
+int hdb_recover(struct hdb *db);
+void db_sharded_close(struct hdb_sharded *sharded);
+
+void* hdb_libc_reallocate(void *context, void *ptr, size_t size) {
+    (void)context;
+    if (size) return realloc(ptr, size);
+    free(ptr);
+    return NULL;
+}
+
+void* hdb_malloc(const struct hdb_allocator *allocator, size_t size) {
+    return allocator->reallocate(allocator->context, NULL, size ? size : 1);
+}
+
+void* hdb_calloc(const struct hdb_allocator *allocator, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void *ptr = hdb_malloc(allocator, count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void* hdb_realloc(const struct hdb_allocator *allocator, void *ptr, size_t size) {
+    return allocator->reallocate(allocator->context, ptr, size ? size : 1);
+}
+
+void hdb_free(const struct hdb_allocator *allocator, void *ptr) {
+    if (ptr) allocator->reallocate(allocator->context, ptr, 0);
+}
+
+char* hdb_strdup(const struct hdb_allocator *allocator, const char *string) {
+    size_t length = strlen(string) + 1;
+    char *copy = hdb_malloc(allocator, length);
+    if (copy) memcpy(copy, string, length);
+    return copy;
+}
+
+// Memory starting on a cache line, for structs whose parts must not share
+// one.  The block the allocator returned is stored right before it.
+void* hdb_aligned_alloc(const struct hdb_allocator *allocator, size_t size) {
+    uint8_t *block = hdb_malloc(allocator, size + 64 + sizeof(void*));
+    if (!block) return NULL;
+    uint8_t *aligned = (uint8_t*)(((uintptr_t)block + sizeof(void*) + 63) & ~(uintptr_t)63);
+    memcpy(aligned - sizeof(void*), &block, sizeof(void*));
+    return aligned;
+}
+
+void hdb_aligned_free(const struct hdb_allocator *allocator, void *ptr) {
+    if (!ptr) return;
+    void *block;
+    memcpy(&block, (uint8_t*)ptr - sizeof(void*), sizeof(void*));
+    hdb_free(allocator, block);
+}
+
+void hdb_slab_init(struct hdb_slab *slab, const struct hdb_allocator *allocator, size_t object_size) {
+    memset(slab, 0, sizeof(struct hdb_slab));
+    slab->allocator = allocator;
+    slab->object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    slab->chunk_objects = HDB_SLAB_FIRST_CHUNK;
+}
+
+void* hdb_slab_alloc(struct hdb_slab *slab) {
+    if (slab->free_list) {
+        void *object = slab->free_list;
+        memcpy(&slab->free_list, object, sizeof(void*));
+        return object;
+    }
+    if (slab->next == slab->end) {
+        // The link to the previous chunk takes the first object's place
+        size_t size = (slab->chunk_objects + 1) * slab->object_size;
+        uint8_t *chunk = hdb_malloc(slab->allocator, size);
+        if (!chunk) return NULL;
+        memcpy(chunk, &slab->chunks, sizeof(void*));
+        slab->chunks = chunk;
+        slab->next = chunk + slab->object_size;
+        slab->end = chunk + size;
+        if (slab->chunk_objects < HDB_SLAB_MAX_CHUNK) slab->chunk_objects *= 2;
+    }
+    void *object = slab->next;
+    slab->next += slab->object_size;
+    return object;
+}
+
+void hdb_slab_free(struct hdb_slab *slab, void *object) {
+    memcpy(object, &slab->free_list, sizeof(void*));
+    slab->free_list = object;
+}
+
+void hdb_slab_destroy(struct hdb_slab *slab) {
+    while (slab->chunks) {
+        void *chunk = slab->chunks;
+        memcpy(&slab->chunks, chunk, sizeof(void*));
+        hdb_free(slab->allocator, chunk);
+    }
+    slab->free_list = NULL;
+    slab->next = slab->end = NULL;
+}
+
+// Milliseconds since the epoch, the clock expiries are on.
+uint64_t hdb_wall_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-void* fsync_background(void* arg) {
+// Files entry in the first level whose slots still tell its tick apart from
+// the next one to reap, or the last level when it is even further out.  The
+// tick is rounded up, so an entry is never reaped before it expired.
+void hdb_wheel_place(struct hdb_wheel *wheel, struct hdb_wheel_entry *entry) {
+    uint64_t tick = (entry->expires + HDB_WHEEL_TICK - 1) / HDB_WHEEL_TICK;
+    if (tick < wheel->tick) tick = wheel->tick; // overdue, reaped next
+    uint32_t level = 0;
+    while (level + 1 < HDB_WHEEL_LEVELS && tick - wheel->tick >= (uint64_t)1 << (HDB_WHEEL_BITS * (level + 1))) level++;
+    uint64_t span = (uint64_t)1 << (HDB_WHEEL_BITS * HDB_WHEEL_LEVELS);
+    if (tick - wheel->tick >= span) tick = wheel->tick + span - 1; // comes round again before it is due
+    struct hdb_wheel_entry **slot = &wheel->slots[level][(tick >> (HDB_WHEEL_BITS * level)) & ((1u << HDB_WHEEL_BITS) - 1)];
+    entry->next = *slot;
+    *slot = entry;
+}
+
+int hdb_wheel_add(struct hdb_wheel *wheel, uint64_t expires, uint64_t position) {
+    struct hdb_wheel_entry *entry = hdb_slab_alloc(&wheel->entries);
+    if (!entry) return -1;
+    entry->expires = expires;
+    entry->position = position;
+    hdb_wheel_place(wheel, entry);
+    return 0;
+}
+
+// Drops every entry, the ticks go on from now.
+void hdb_wheel_clear(struct hdb_wheel *wheel, uint64_t now) {
+    hdb_slab_destroy(&wheel->entries);
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->tick = now / HDB_WHEEL_TICK;
+}
+
+// Reaps the ticks up to now and returns their entries.  Each slot of a higher
+// level is spread over the levels below before its first tick is reaped.
+struct hdb_wheel_entry* hdb_wheel_advance(struct hdb_wheel *wheel, uint64_t now) {
+    struct hdb_wheel_entry *due = NULL;
+    uint32_t mask = (1u << HDB_WHEEL_BITS) - 1;
+    for (; wheel->tick <= now / HDB_WHEEL_TICK; wheel->tick++) {
+        for (uint32_t level = HDB_WHEEL_LEVELS - 1; level > 0; --level) {
+            if (wheel->tick & (((uint64_t)1 << (HDB_WHEEL_BITS * level)) - 1)) continue;
+            struct hdb_wheel_entry **slot = &wheel->slots[level][(wheel->tick >> (HDB_WHEEL_BITS * level)) & mask];
+            struct hdb_wheel_entry *entry = *slot;
+            *slot = NULL;
+            while (entry) {
+                struct hdb_wheel_entry *next = entry->next;
+                hdb_wheel_place(wheel, entry);
+                entry = next;
+            }
+        }
+        struct hdb_wheel_entry **slot = &wheel->slots[0][wheel->tick & mask];
+        while (*slot) {
+            struct hdb_wheel_entry *entry = *slot;
+            *slot = entry->next;
+            entry->next = due;
+            due = entry;
+        }
+    }
+    return due;
+}
+
+// The wheel only feeds the compaction trigger, so without background
+// compaction there is none.  It starts empty, a compaction fills it again.
+int hdb_open_wheel(struct hdb *db) {
+    if (db->options.flags & HDB_OPEN_NO_COMPACTION) return 0;
+    db->wheel = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_wheel));
+    if (!db->wheel) return -1;
+    hdb_slab_init(&db->wheel->entries, &db->allocator, sizeof(struct hdb_wheel_entry));
+    hdb_wheel_clear(db->wheel, hdb_wall_clock());
+    return 0;
+}
+
+void hdb_free_wheel(struct hdb *db) {
+    if (!db->wheel) return;
+    hdb_slab_destroy(&db->wheel->entries);
+    hdb_free(&db->allocator, db->wheel);
+    db->wheel = NULL;
+}
+
+// Syncs the log every sync interval with HDB_DURABILITY_PERIODIC and
+// checkpoints once it has grown past the checkpoint size.
+void* sync_background(void* arg) {
     struct hdb *db = (struct hdb*)arg;
-    while (!db->stop_fsync_thread) {
-        sleep(2); // Periodically fsync every 2 seconds
-        pthread_mutex_lock(&db->fsync_mutex);
-        fsync(fileno(db->hash_file));
-        fsync(fileno(db->data_file));
-        fsync(fileno(db->deleted_blocks));
+    pthread_mutex_lock(&db->fsync_mutex);
+    while (!db->stop_sync_thread) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t nanoseconds = deadline.tv_nsec + (uint64_t)db->options.sync_interval * 1000000;
+        deadline.tv_sec += nanoseconds / 1000000000;
+        deadline.tv_nsec = nanoseconds % 1000000000;
+        pthread_cond_timedwait(&db->sync_cond, &db->fsync_mutex, &deadline);
+        if (db->stop_sync_thread) break;
         pthread_mutex_unlock(&db->fsync_mutex);
+
+        uint64_t end;
+        uint64_t size = hdb_wal_size(&db->wal, &end);
+        uint64_t start = hdb_stats_clock();
+        if (db->options.durability == HDB_DURABILITY_PERIODIC) {
+            hdb_wal_flush(&db->wal, end, true);
+            hdb_time(db, HDB_LATENCY_SYNC, start);
+        }
+        if (size >= db->options.wal_checkpoint_size) {
+            start = hdb_stats_clock();
+            hdb_checkpoint(db);
+            hdb_time(db, HDB_LATENCY_CHECKPOINT, start);
+        }
+        pthread_mutex_lock(&db->fsync_mutex);
     }
+    pthread_mutex_unlock(&db->fsync_mutex);
     return NULL;
 }
 
-struct hdb* db_open(const char *hash_filename, const char *data_filename, const char *deleted_blocks_filename) {
-    struct hdb *db = malloc(sizeof(struct hdb));
+// Waits for the dead share of the data file or the blob file to pass the
+// configured ratio and compacts it at the configured rate.
+void* compaction_background(void* arg) {
+    struct hdb *db = (struct hdb*)arg;
+    pthread_mutex_lock(&db->compaction_mutex);
+    while (!db->stop_compaction_thread) {
+        hdb_reap_expired(db);
+        if (hdb_needs_compaction(db)) {
+            pthread_mutex_unlock(&db->compaction_mutex);
+            int rc = hdb_compact(db, db->options.compaction_rate);
+            pthread_mutex_lock(&db->compaction_mutex);
+            if (rc == 0) continue;
+        }
+        if (hdb_needs_blob_compaction(db)) {
+            pthread_mutex_unlock(&db->compaction_mutex);
+            int rc = hdb_compact_blobs(db, db->options.compaction_rate);
+            pthread_mutex_lock(&db->compaction_mutex);
+            if (rc == 0) continue;
+        }
+        // Also recheck now and then, a failed compaction is retried after a pause
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&db->compaction_cond, &db->compaction_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&db->compaction_mutex);
+    return NULL;
+}
+
+// Replaces the zeroed fields of options with their defaults.
+void hdb_default_options(struct hdb_options *options) {
+    if (options->compaction_ratio <= 0) options->compaction_ratio = HDB_COMPACTION_RATIO;
+    if (!options->compaction_min_size) options->compaction_min_size = HDB_COMPACTION_MIN_SIZE;
+    if (!options->compaction_rate) options->compaction_rate = HDB_COMPACTION_RATE;
+    if (!options->mmap_chunk) options->mmap_chunk = HDB_MMAP_CHUNK;
+    if (!options->mmap_reserve) options->mmap_reserve = HDB_MMAP_RESERVE;
+    if (!options->durability) options->durability = HDB_DURABILITY_PERIODIC;
+    if (!options->sync_interval) options->sync_interval = HDB_SYNC_INTERVAL;
+    if (!options->wal_checkpoint_size) options->wal_checkpoint_size = HDB_WAL_CHECKPOINT_SIZE;
+    if (!options->compression_threshold) options->compression_threshold = HDB_COMPRESSION_THRESHOLD;
+    if (!options->compression_level) options->compression_level = HDB_ZSTD_LEVEL;
+    if (!options->buffer_pool) options->buffer_pool = HDB_POOL_SIZE;
+    if (!options->buffer_pool_policy) options->buffer_pool_policy = HDB_POOL_CLOCK;
+}
+
+struct hdb* db_open_with_options(const char *hash_filename, const char *data_filename, const char *deleted_blocks_filename,
+                                 const struct hdb_options *options) {
+    struct hdb_options defaults;
+    if (!options) {
+        memset(&defaults, 0, sizeof(struct hdb_options));
+        options = &defaults;
+    }
+
+    struct hdb_allocator allocator = {hdb_libc_reallocate, NULL};
+    if (options->allocator) allocator = *options->allocator;
+    struct hdb *db = hdb_aligned_alloc(&allocator, sizeof(struct hdb)); // keeps the stripes on their own cache lines
     if (!db) return NULL;
+    memset(db, 0, sizeof(struct hdb));
+    db->allocator = allocator;
 
     db->hash_file = fopen(hash_filename, "rb+");
     if (!db->hash_file) {
@@ -91,53 +1262,304 @@ struct hdb* db_open(const char *hash_filename, const char *data_filename, const
     if (!db->deleted_blocks) {
         db->deleted_blocks = fopen(deleted_blocks_filename, "wb+");
     }
-    db->deleted_blocks_array = NULL;
-    db->deleted_blocks_array_size = 0;
-    db->stop_fsync_thread = false;
+    memset(&db->hash_map, 0, sizeof(struct hdb_map));
+    db->data_map = NULL;
+    memset(&db->free_space, 0, sizeof(struct hdb_free_space));
+    db->free_space.seed = 2463534242u;
+    hdb_slab_init(&db->free_space.extents, &db->allocator, sizeof(struct hdb_extent));
+    db->compacting = false;
+    db->epoch = 0;
+    db->refs = NULL;
+    db->refs_tail = NULL;
+    db->limbo = NULL;
+    db->limbo_tail = NULL;
+    db->directory = NULL;
+    db->stop_sync_thread = false;
+    db->stop_compaction_thread = false;
+    db->data_filename = hdb_strdup(&db->allocator, data_filename);
     pthread_mutex_init(&db->fsync_mutex, NULL);
+    pthread_cond_init(&db->sync_cond, NULL);
+    pthread_mutex_init(&db->wal.lock, NULL);
+    pthread_cond_init(&db->wal.flushed, NULL);
+    pthread_mutex_init(&db->alloc_lock, NULL);
+    pthread_mutex_init(&db->filter_lock, NULL);
+    pthread_mutex_init(&db->synchronize_lock, NULL);
+    for (int i = 0; i < HDB_LOCK_STRIPES; ++i) pthread_mutex_init(&db->stripes[i].lock, NULL);
+    pthread_rwlock_init(&db->lock, NULL);
+    pthread_mutex_init(&db->compaction_mutex, NULL);
+    pthread_cond_init(&db->compaction_cond, NULL);
+
+    db->options = *options;
+    hdb_default_options(&db->options);
+    if (options->wal_filename) {
+        db->wal_filename = hdb_strdup(&db->allocator, options->wal_filename);
+    } else if ((db->wal_filename = hdb_malloc(&db->allocator, strlen(data_filename) + sizeof(".wal")))) {
+        strcpy(db->wal_filename, data_filename);
+        strcat(db->wal_filename, ".wal");
+    }
+    db->options.wal_filename = db->wal_filename;
+    if (db->options.filter_bits) {
+        if (options->filter_filename) {
+            db->filter_filename = hdb_strdup(&db->allocator, options->filter_filename);
+        } else if ((db->filter_filename = hdb_malloc(&db->allocator, strlen(hash_filename) + sizeof(".filter")))) {
+            strcpy(db->filter_filename, hash_filename);
+            strcat(db->filter_filename, ".filter");
+        }
+        if (db->filter_filename && !(db->filter_file = fopen(db->filter_filename, "rb+"))) {
+            db->filter_file = fopen(db->filter_filename, "wb+");
+        }
+        db->options.filter_filename = db->filter_filename;
+    }
+    if (options->blob_filename) {
+        db->blob_filename = hdb_strdup(&db->allocator, options->blob_filename);
+    } else if ((db->blob_filename = hdb_malloc(&db->allocator, strlen(data_filename) + sizeof(".blob")))) {
+        strcpy(db->blob_filename, data_filename);
+        strcat(db->blob_filename, ".blob");
+    }
+    db->options.blob_filename = db->blob_filename;
+    // Only created once values are to go there
+    if (db->blob_filename && !(db->blob_file = fopen(db->blob_filename, "rb+")) && db->options.blob_threshold) {
+        db->blob_file = fopen(db->blob_filename, "wb+");
+    }
 
-    if (!db->hash_file || !db->data_file || !db->deleted_blocks) {
-        db_close(db);
+#ifndef HDB_NO_STATS
+    if ((db->stats = hdb_aligned_alloc(&db->allocator, HDB_STATS_SHARDS * sizeof(struct hdb_stats_shard)))) {
+        memset(db->stats, 0, HDB_STATS_SHARDS * sizeof(struct hdb_stats_shard));
+    } else {
+        hdb_abort_open(db);
         return NULL;
     }
+#endif
 
-    decode_deleted_blocks_array(db);
+    struct stat st, blob_st;
+    if (!db->hash_file || !db->data_file || !db->deleted_blocks || !db->data_filename || !db->wal_filename ||
+        (db->options.filter_bits && !db->filter_file) || !db->blob_filename || (db->options.blob_threshold && !db->blob_file) ||
+        !hdb_codec_supported(db->options.compression) || fstat(fileno(db->data_file), &st) != 0 ||
+        (db->blob_file && fstat(fileno(db->blob_file), &blob_st) != 0)) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    db->data_end = st.st_size;
+    db->blob_end = db->blob_file ? blob_st.st_size : 0;
+    int rc = hdb_load_index(db, options);
+    if (rc != 0 || (db->start == HDB_START_CLAIM && hdb_claim_free_space(db) != 0)) {
+        hdb_abort_open(db);
+        if (rc == 1) errno = HDB_EFORMAT;
+        return NULL;
+    }
+    db->free_space_pending = db->start == HDB_START_CLEAN;
+    if ((db->options.flags & HDB_OPEN_MMAP) &&
+        (hdb_map_open(&db->hash_map, db->hash_file, db->options.mmap_chunk, db->options.mmap_reserve) != 0 ||
+         !(db->data_map = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_map))) ||
+         hdb_map_open(db->data_map, db->data_file, db->options.mmap_chunk, db->options.mmap_reserve) != 0)) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if ((db->options.flags & HDB_OPEN_DIRECT) &&
+        ((db->options.flags & HDB_OPEN_MMAP) || fflush(db->data_file) != 0 ||
+         !(db->data_pool = hdb_pool_open(&db->allocator, db->data_file, data_filename, db->options.buffer_pool,
+                                         db->options.buffer_pool_policy)))) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if (db->options.index_cache && !(db->options.flags & HDB_OPEN_MMAP) && hdb_load_index_cache(db) != 0) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if (db->options.value_cache && hdb_open_value_cache(db) != 0) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if (db->options.filter_bits && db->start == HDB_START_CLAIM && hdb_claim_filter(db) != 0) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    db->filter_pending = db->options.filter_bits && db->start == HDB_START_CLEAN;
+    if ((db->options.flags & HDB_OPEN_SORTED_INDEX) && hdb_open_sorted_index(db) != 0) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if (hdb_open_wheel(db) != 0) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if (db->options.replication_backlog && !(db->wal.stream = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_stream)))) {
+        hdb_abort_open(db);
+        return NULL;
+    }
+    if ((db->start == HDB_START_RECOVER && hdb_recover(db) != 0) || hdb_open_wal(db) != 0 || hdb_check_filter(db) != 0 || (db->sorted && hdb_build_sorted_index(db) != 0)) {
+        hdb_abort_open(db);
+        return NULL;
+    }
 
-    pthread_create(&db->fsync_thread, NULL, fsync_background, db);
+    if (db->options.durability != HDB_DURABILITY_NONE) {
+        pthread_create(&db->sync_thread, NULL, sync_background, db);
+    }
+    if (!(db->options.flags & HDB_OPEN_NO_COMPACTION)) {
+        pthread_create(&db->compaction_thread, NULL, compaction_background, db);
+    }
 
     return db;
 }
 
+struct hdb* db_open(const char *hash_filename, const char *data_filename, const char *deleted_blocks_filename) {
+    return db_open_with_options(hash_filename, data_filename, deleted_blocks_filename, NULL);
+}
+
+// Releases a handle whose background thread was never started.
+void hdb_abort_open(struct hdb *db) {
+    hdb_map_close(&db->hash_map);
+    if (db->data_map) {
+        hdb_map_close(db->data_map);
+        hdb_free(&db->allocator, db->data_map);
+    }
+    hdb_pool_close(db->data_pool);
+    if (db->hash_file) fclose(db->hash_file);
+    if (db->data_file) fclose(db->data_file);
+    if (db->deleted_blocks) fclose(db->deleted_blocks);
+    if (db->filter_file) fclose(db->filter_file);
+    if (db->blob_file) fclose(db->blob_file);
+    if (db->wal.file) fclose(db->wal.file);
+    if (db->directory) hdb_free(&db->allocator, db->directory);
+    hdb_free_index_cache(db);
+    hdb_free_value_cache(db);
+    hdb_free_sorted_index(db);
+    hdb_free_wheel(db);
+    hdb_free_stream(db);
+#ifndef HDB_NO_STATS
+    hdb_aligned_free(&db->allocator, db->stats);
+#endif
+    hdb_aligned_free(&db->allocator, db->filter);
+    hdb_free(&db->allocator, db->filter_filename);
+    hdb_free(&db->allocator, db->blob_filename);
+    if (db->data_filename) hdb_free(&db->allocator, db->data_filename);
+    if (db->wal_filename) hdb_free(&db->allocator, db->wal_filename);
+    hdb_free(&db->allocator, db->wal.buffer);
+    hdb_free(&db->allocator, db->wal.spare);
+    hdb_free_space_clear(&db->free_space);
+    hdb_slab_destroy(&db->free_space.extents);
+    pthread_mutex_destroy(&db->fsync_mutex);
+    pthread_cond_destroy(&db->sync_cond);
+    pthread_mutex_destroy(&db->wal.lock);
+    pthread_cond_destroy(&db->wal.flushed);
+    pthread_mutex_destroy(&db->alloc_lock);
+    pthread_mutex_destroy(&db->filter_lock);
+    pthread_mutex_destroy(&db->synchronize_lock);
+    for (int i = 0; i < HDB_LOCK_STRIPES; ++i) pthread_mutex_destroy(&db->stripes[i].lock);
+    pthread_rwlock_destroy(&db->lock);
+    pthread_mutex_destroy(&db->compaction_mutex);
+    pthread_cond_destroy(&db->compaction_cond);
+    struct hdb_allocator allocator = db->allocator;
+    hdb_aligned_free(&allocator, db);
+}
+
 void db_close(struct hdb *db) {
     if (db) {
-        db->stop_fsync_thread = true;
-        pthread_join(db->fsync_thread, NULL);
+        if (!(db->options.flags & HDB_OPEN_NO_COMPACTION)) {
+            pthread_mutex_lock(&db->compaction_mutex);
+            db->stop_compaction_thread = true;
+            pthread_cond_signal(&db->compaction_cond);
+            pthread_mutex_unlock(&db->compaction_mutex);
+            pthread_join(db->compaction_thread, NULL);
+        }
 
-        pthread_mutex_lock(&db->fsync_mutex);
-        if (db->deleted_blocks_array) {
-            encode_deleted_blocks_array(db);
+        if (db->options.durability != HDB_DURABILITY_NONE) {
+            pthread_mutex_lock(&db->fsync_mutex);
+            db->stop_sync_thread = true;
+            pthread_cond_signal(&db->sync_cond);
+            pthread_mutex_unlock(&db->fsync_mutex);
+            pthread_join(db->sync_thread, NULL);
         }
+
+        pthread_mutex_lock(&db->fsync_mutex);
+        bool clean = db->hash_file && db->data_file && db->deleted_blocks;
         if (db->hash_file) {
-            fsync(fileno(db->hash_file));
-            fclose(db->hash_file);
+            hdb_write_header(db);
+            hdb_map_close(&db->hash_map);
+            if (fsync(fileno(db->hash_file)) != 0) clean = false;
         }
         if (db->data_file) {
-            fsync(fileno(db->data_file));
+            if (fsync(fileno(db->data_file)) != 0) clean = false;
+            hdb_drain_limbo(db, true); // refs must not outlive the database
+            if (db->data_map) {
+                hdb_map_close(db->data_map);
+                hdb_free(&db->allocator, db->data_map);
+            }
+            hdb_pool_close(db->data_pool);
             fclose(db->data_file);
         }
+        if (db->blob_file) {
+            if (fsync(fileno(db->blob_file)) != 0) clean = false;
+            fclose(db->blob_file);
+        }
+        if (db->wal.file) {
+            // Both files are synced, a clean close leaves nothing to replay
+            fclose(db->wal.file);
+            remove(db->wal_filename);
+        }
         if (db->deleted_blocks) {
-            fsync(fileno(db->deleted_blocks));
+            // The file still holds the free space when none was loaded or released
+            if (db->free_space.count) hdb_load_free_space(db);
+            // Only once the dead flags it relies on are durable
+            if (!db->free_space_pending && encode_free_space(db) != 0) clean = false;
             fclose(db->deleted_blocks);
         }
-        if (db->deleted_blocks_array) free(db->deleted_blocks_array);
+        if (db->filter_file) {
+            // Only once the index it describes is durable, and unchanged when it was never loaded
+            if (!db->filter_pending && hdb_encode_filter(db) != 0) clean = false;
+            fclose(db->filter_file);
+        }
+        if (db->hash_file) {
+            // Last, so a clean header vouches for all of the above.  A swap
+            // not seen through is left for the next open to finish
+            if (db->header.state != HDB_STATE_SWAP && db->header.state != HDB_STATE_BLOB_SWAP) {
+                db->header.state = clean ? HDB_STATE_CLEAN : HDB_STATE_OPEN;
+            }
+            db->header.data_end = db->data_end;
+            db->header.blob_end = db->blob_end;
+            if (!db->free_space_pending) db->header.free_space_count = db->free_space.count;
+            hdb_write_header(db);
+            fsync(fileno(db->hash_file));
+            fclose(db->hash_file);
+        }
+        hdb_free_space_clear(&db->free_space);
+        hdb_slab_destroy(&db->free_space.extents);
+        if (db->directory) hdb_free(&db->allocator, db->directory);
+        hdb_free_index_cache(db);
+        hdb_free_value_cache(db);
+        hdb_free_sorted_index(db);
+        hdb_free_wheel(db);
+        hdb_free_stream(db);
+#ifndef HDB_NO_STATS
+        hdb_aligned_free(&db->allocator, db->stats);
+#endif
+        hdb_aligned_free(&db->allocator, db->filter);
+        hdb_free(&db->allocator, db->filter_filename);
+        hdb_free(&db->allocator, db->blob_filename);
+        hdb_free(&db->allocator, db->data_filename);
+        hdb_free(&db->allocator, db->wal_filename);
+        hdb_free(&db->allocator, db->wal.buffer);
+        hdb_free(&db->allocator, db->wal.spare);
         pthread_mutex_unlock(&db->fsync_mutex);
 
         pthread_mutex_destroy(&db->fsync_mutex);
-        free(db);
+        pthread_cond_destroy(&db->sync_cond);
+        pthread_mutex_destroy(&db->wal.lock);
+        pthread_cond_destroy(&db->wal.flushed);
+        pthread_mutex_destroy(&db->alloc_lock);
+        pthread_mutex_destroy(&db->filter_lock);
+        pthread_mutex_destroy(&db->synchronize_lock);
+        for (int i = 0; i < HDB_LOCK_STRIPES; ++i) pthread_mutex_destroy(&db->stripes[i].lock);
+        pthread_rwlock_destroy(&db->lock);
+        pthread_mutex_destroy(&db->compaction_mutex);
+        pthread_cond_destroy(&db->compaction_cond);
+        struct hdb_allocator allocator = db->allocator;
+        hdb_aligned_free(&allocator, db);
     }
 }
 
-uint32_t hash_function(const uint8_t *data, size_t length) {
+// The original hash_function, still picked with HDB_HASH_LEGACY32.
+uint32_t hash_function_legacy(const uint8_t *data, size_t length) {
     uint32_t hash = 0;
     uint32_t prime = 31;
     uint32_t prime2 = 37;
@@ -148,129 +1570,6779 @@ uint32_t hash_function(const uint8_t *data, size_t length) {
     return hash;
 }
 
-int db_put(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length) {
-    uint32_t hash = hash_function(key, key_length);
-    fseek(db->hash_file, hash % 128 * sizeof(uint32_t), SEEK_SET);
-    uint32_t stored_hash;
-    fread(&stored_hash, sizeof(uint32_t), 1, db->hash_file);
+uint64_t hdb_hash_legacy64(const uint8_t *data, size_t length) {
+    return hash_function_legacy(data, length);
+}
 
-    if (stored_hash == hash) {
-        // Key exists, delete the old value
-        db_delete(db, key, key_length);
-    }
+#define HDB_P0 0xa0761d6478bd642fULL
+#define HDB_P1 0xe7037ed1a0b428dbULL
+#define HDB_P2 0x8ebc6af09c88c6e3ULL
+#define HDB_P3 0x589965cc75374cc3ULL
+#define HDB_PRIME32 0x9e3779b1U
 
-    fseek(db->hash_file, hash % 128 * sizeof(uint32_t), SEEK_SET);
-    fwrite(&hash, sizeof(uint32_t), 1, db->hash_file);
+// Per lane keys of the striped loop
+const uint64_t hdb_hash_secret[8] = {
+    0xf2a74de452e6b438ULL, 0x6513270e269e0d37ULL, 0x0c5c7fd0a6a3a450ULL, 0xd23f0824128b2f33ULL,
+    0x1818e811892f902bULL, 0x9531985d5d9dc9f8ULL, 0xe8e25d940ed90475ULL, 0x36f675cc81e74ef5ULL,
+};
 
-    uint64_t position;
-    if (db->deleted_blocks_array_size > 0) {
-        position = db->deleted_blocks_array[--db->deleted_blocks_array_size];
-    } else {
-        fseek(db->data_file, 0, SEEK_END);
-        position = ftell(db->data_file);
-    }
-    fwrite(value, sizeof(uint8_t), value_length, db->data_file);
+// Reads are little endian whatever the host, so a file hashes the same everywhere
+uint64_t hdb_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
 
-    fseek(db->hash_file, hash % 128 * sizeof(uint64_t) * 2, SEEK_SET);
-    fwrite(&position, sizeof(uint64_t), 1, db->hash_file);
-    fwrite(&value_length, sizeof(uint64_t), 1, db->hash_file);
+uint64_t hdb_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
 
-    return 0;
+// Full 64x64 -> 128 bit multiply, low half into *a and high half into *b
+void hdb_mul128(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t high = ha * hb, middle0 = ha * lb, middle1 = hb * la, low = la * lb;
+    uint64_t t = low + (middle0 << 32), carry = t < low;
+    uint64_t lo = t + (middle1 << 32);
+    carry += lo < t;
+    *a = lo;
+    *b = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+#endif
 }
 
-int db_get(struct hdb *db, const uint8_t *key, size_t key_length, uint8_t *value, size_t *value_length) {
-    uint32_t hash = hash_function(key, key_length);
-    fseek(db->hash_file, hash % 128 * sizeof(uint32_t), SEEK_SET);
-    uint32_t stored_hash;
-    fread(&stored_hash, sizeof(uint32_t), 1, db->hash_file);
+uint64_t hdb_mix(uint64_t a, uint64_t b) {
+    hdb_mul128(&a, &b);
+    return a ^ b;
+}
 
-    if (stored_hash != hash) return -1;
+// One step of the striped loop for every lane: the lane's word folded with
+// its key through a 32x32 multiply, plus the neighbouring lane's raw word.
+// This is the reference the SIMD versions must match bit for bit.
+void hdb_hash_stripes_scalar(uint64_t acc[8], const uint8_t *p, size_t stripes) {
+    for (size_t s = 0; s < stripes; ++s, p += HDB_HASH_STRIPE) {
+        for (int i = 0; i < 8; ++i) {
+            uint64_t word = hdb_read64(p + 8 * i);
+            uint64_t keyed = word ^ hdb_hash_secret[i];
+            acc[i ^ 1] += word;
+            acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+    }
+}
+
+#ifdef HDB_HAVE_AVX2
+__attribute__((target("avx2")))
+void hdb_hash_stripes_avx2(uint64_t acc[8], const uint8_t *p, size_t stripes) {
+    __m256i acc0 = _mm256_loadu_si256((const __m256i*)acc);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i*)(acc + 4));
+    const __m256i secret0 = _mm256_loadu_si256((const __m256i*)hdb_hash_secret);
+    const __m256i secret1 = _mm256_loadu_si256((const __m256i*)(hdb_hash_secret + 4));
+    for (size_t s = 0; s < stripes; ++s, p += HDB_HASH_STRIPE) {
+        __m256i word0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i word1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+        __m256i keyed0 = _mm256_xor_si256(word0, secret0);
+        __m256i keyed1 = _mm256_xor_si256(word1, secret1);
+        __m256i product0 = _mm256_mul_epu32(keyed0, _mm256_srli_epi64(keyed0, 32));
+        __m256i product1 = _mm256_mul_epu32(keyed1, _mm256_srli_epi64(keyed1, 32));
+        // Swapping the 64-bit halves of each 128-bit lane pairs lane i with lane i ^ 1
+        __m256i swapped0 = _mm256_shuffle_epi32(word0, _MM_SHUFFLE(1, 0, 3, 2));
+        __m256i swapped1 = _mm256_shuffle_epi32(word1, _MM_SHUFFLE(1, 0, 3, 2));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(product0, swapped0));
+        acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(product1, swapped1));
+    }
+    _mm256_storeu_si256((__m256i*)acc, acc0);
+    _mm256_storeu_si256((__m256i*)(acc + 4), acc1);
+}
+#endif
+
+#ifdef HDB_HAVE_NEON
+void hdb_hash_stripes_neon(uint64_t acc[8], const uint8_t *p, size_t stripes) {
+    uint64x2_t lanes[4];
+    uint64x2_t secret[4];
+    for (int j = 0; j < 4; ++j) {
+        lanes[j] = vld1q_u64(acc + 2 * j);
+        secret[j] = vld1q_u64(hdb_hash_secret + 2 * j);
+    }
+    for (size_t s = 0; s < stripes; ++s, p += HDB_HASH_STRIPE) {
+        for (int j = 0; j < 4; ++j) {
+            uint64x2_t word = vreinterpretq_u64_u8(vld1q_u8(p + 16 * j));
+            uint64x2_t keyed = veorq_u64(word, secret[j]);
+            uint64x2_t product = vmull_u32(vmovn_u64(keyed), vshrn_n_u64(keyed, 32));
+            uint64x2_t swapped = vextq_u64(word, word, 1);
+            lanes[j] = vaddq_u64(lanes[j], vaddq_u64(product, swapped));
+        }
+    }
+    for (int j = 0; j < 4; ++j) vst1q_u64(acc + 2 * j, lanes[j]);
+}
+#endif
+
+typedef void (*hdb_stripes_fn)(uint64_t acc[8], const uint8_t *p, size_t stripes);
+
+hdb_stripes_fn hdb_hash_stripes_best(void) {
+#ifdef HDB_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) return hdb_hash_stripes_avx2;
+#endif
+#ifdef HDB_HAVE_NEON
+    return hdb_hash_stripes_neon;
+#endif
+    return hdb_hash_stripes_scalar;
+}
+
+// Long keys feed eight independent accumulators, which keeps the multipliers
+// busy and maps directly onto 256-bit or 128-bit vectors.
+uint64_t hdb_hash_long(const uint8_t *data, size_t length, hdb_stripes_fn stripes) {
+    uint64_t acc[8] = {HDB_P0, HDB_P1, HDB_P2, HDB_P3, ~HDB_P0, ~HDB_P1, ~HDB_P2, ~HDB_P3};
+    size_t total = (length - 1) / HDB_HASH_STRIPE; // the last, possibly partial, stripe is handled below
+    const uint8_t *p = data;
+    for (size_t done = 0; done < total; done += HDB_HASH_SCRAMBLE) {
+        size_t count = total - done < HDB_HASH_SCRAMBLE ? total - done : HDB_HASH_SCRAMBLE;
+        stripes(acc, p, count);
+        p += count * HDB_HASH_STRIPE;
+        if (count == HDB_HASH_SCRAMBLE) {
+            for (int i = 0; i < 8; ++i) {
+                acc[i] ^= acc[i] >> 47;
+                acc[i] ^= hdb_hash_secret[7 - i];
+                acc[i] *= HDB_PRIME32;
+            }
+        }
+    }
+    stripes(acc, data + length - HDB_HASH_STRIPE, 1); // overlaps the previous stripe when length is not a multiple
+
+    uint64_t hash = length * HDB_P0;
+    for (int i = 0; i < 8; i += 2) {
+        hash += hdb_mix(acc[i] ^ hdb_hash_secret[i + 1], acc[i + 1] ^ hdb_hash_secret[i]);
+    }
+    hash ^= hash >> 37;
+    hash *= 0x165667919e3779f9ULL;
+    return hash ^ (hash >> 32);
+}
+
+uint64_t hdb_hash_mix64(const uint8_t *data, size_t length, hdb_stripes_fn stripes) {
+    if (length >= HDB_HASH_LONG_KEY) return hdb_hash_long(data, length, stripes);
+
+    const uint8_t *p = data;
+    uint64_t seed = hdb_mix(HDB_P0, HDB_P1);
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (hdb_read32(p) << 32) | hdb_read32(p + ((length >> 3) << 2));
+            b = (hdb_read32(p + length - 4) << 32) | hdb_read32(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = hdb_mix(hdb_read64(p) ^ HDB_P1, hdb_read64(p + 8) ^ seed);
+                seed1 = hdb_mix(hdb_read64(p + 16) ^ HDB_P2, hdb_read64(p + 24) ^ seed1);
+                seed2 = hdb_mix(hdb_read64(p + 32) ^ HDB_P3, hdb_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hdb_mix(hdb_read64(p) ^ HDB_P1, hdb_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hdb_read64(p + i - 16);
+        b = hdb_read64(p + i - 8);
+    }
+    a ^= HDB_P1;
+    b ^= seed;
+    hdb_mul128(&a, &b);
+    return hdb_mix(a ^ HDB_P0 ^ length, b ^ HDB_P1);
+}
+
+// Word-at-a-time 64-bit hash.  Keys shorter than HDB_HASH_LONG_KEY are mixed
+// 16 or 48 bytes per step; longer keys use the striped loop, vectorised with
+// AVX2 or NEON where the CPU has it.
+uint64_t hash_function(const uint8_t *data, size_t length) {
+    static hdb_stripes_fn best = NULL;
+    if (length < HDB_HASH_LONG_KEY) return hdb_hash_mix64(data, length, hdb_hash_stripes_scalar);
+    // Threads racing to pick it all store the same function
+    hdb_stripes_fn stripes = __atomic_load_n(&best, __ATOMIC_RELAXED);
+    if (!stripes) {
+        stripes = hdb_hash_stripes_best();
+        __atomic_store_n(&best, stripes, __ATOMIC_RELAXED);
+    }
+    return hdb_hash_mix64(data, length, stripes);
+}
+
+// FNV-1a, unrelated to the index hash so keys whose hashes collide still
+// tell apart in the index.
+uint32_t fingerprint_function(const uint8_t *data, size_t length) {
+    uint32_t fingerprint = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        fingerprint ^= data[i];
+        fingerprint *= 16777619u;
+    }
+    return fingerprint;
+}
+
+// Positioned reads and writes, so threads never share a file position.
+int hdb_read_at(FILE *file, uint64_t offset, void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fileno(file), (uint8_t*)buffer + done, length - done, offset + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int hdb_write_at(FILE *file, uint64_t offset, const void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fileno(file), (const uint8_t*)buffer + done, length - done, offset + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Maps the file read only at the start of a fresh reserve of address space.
+// The reserve held may end up smaller than the one asked for.
+int hdb_map_open(struct hdb_map *map, FILE *file, uint64_t chunk, uint64_t reserve) {
+    struct stat st;
+    if (fflush(file) != 0 || fstat(fileno(file), &st) != 0) return -1;
+    map->chunk = (chunk + HDB_PAGE_SIZE - 1) / HDB_PAGE_SIZE * HDB_PAGE_SIZE;
+    map->reserve = (reserve + map->chunk - 1) / map->chunk * map->chunk;
+    map->capacity = ((uint64_t)st.st_size / map->chunk + 1) * map->chunk;
+    map->base = NULL;
+    if (map->capacity > map->reserve) return -1;
+    // Address space may be limited, by ulimit -v or a sanitizer, so smaller
+    // reserves are tried down to what the file takes now
+    void *base;
+    while ((base = mmap(NULL, map->reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED &&
+           map->reserve > map->capacity) {
+        uint64_t reserve = map->reserve / 2 / map->chunk * map->chunk;
+        map->reserve = reserve > map->capacity ? reserve : map->capacity;
+    }
+    if (base == MAP_FAILED) return -1;
+    if (mmap(base, map->capacity, PROT_READ, MAP_SHARED | MAP_FIXED, fileno(file), 0) == MAP_FAILED) {
+        munmap(base, map->reserve);
+        return -1;
+    }
+    map->base = base;
+    return 0;
+}
+
+void hdb_map_close(struct hdb_map *map) {
+    if (map->base) munmap(map->base, map->reserve);
+    map->base = NULL;
+}
+
+// Makes the mapping cover the file up to end.  Only the part past the current
+// capacity is mapped, what readers may be looking at stays where it is.  The
+// caller serializes extensions of the same map.
+int hdb_map_extend(struct hdb_map *map, FILE *file, uint64_t end) {
+    if (!map->base || end <= map->capacity) return 0;
+    uint64_t capacity = (end / map->chunk + 1) * map->chunk;
+    if (capacity > map->reserve) return -1;
+    if (mmap(map->base + map->capacity, capacity - map->capacity, PROT_READ, MAP_SHARED | MAP_FIXED,
+             fileno(file), map->capacity) == MAP_FAILED) return -1;
+    __atomic_store_n(&map->capacity, capacity, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Reads through the mapping when the file has one and with pread otherwise.
+int hdb_map_read(FILE *file, const struct hdb_map *map, uint64_t offset, void *buffer, size_t length) {
+    if (!map || !map->base) return hdb_read_at(file, offset, buffer, length);
+    uint64_t capacity = __atomic_load_n(&map->capacity, __ATOMIC_ACQUIRE);
+    if (offset > capacity || length > capacity - offset) return -1;
+    memcpy(buffer, map->base + offset, length);
+    return 0;
+}
+
+// Like hdb_aligned_alloc, but aligned to a page as O_DIRECT wants it.
+void* hdb_page_alloc(const struct hdb_allocator *allocator, size_t size) {
+    uint8_t *block = hdb_malloc(allocator, size + HDB_PAGE_SIZE + sizeof(void*));
+    if (!block) return NULL;
+    uint8_t *aligned = (uint8_t*)(((uintptr_t)block + sizeof(void*) + HDB_PAGE_SIZE - 1) & ~(uintptr_t)(HDB_PAGE_SIZE - 1));
+    memcpy(aligned - sizeof(void*), &block, sizeof(void*));
+    return aligned;
+}
+
+uint64_t hdb_pool_mix(uint64_t page) {
+    return page * 0x9E3779B97F4A7C15ull;
+}
+
+struct hdb_pool_shard* hdb_pool_shard_for(struct hdb_pool *pool, uint64_t page) {
+    return &pool->shards[(hdb_pool_mix(page) >> 60) % HDB_POOL_SHARDS];
+}
+
+// The rest are called with the shard locked.
+int32_t* hdb_pool_bucket(struct hdb_pool_shard *shard, uint64_t page) {
+    return &shard->table[(hdb_pool_mix(page) >> 32) & shard->table_mask];
+}
+
+// The frame holding page, -1 when the shard has none.
+int32_t hdb_pool_find(struct hdb_pool_shard *shard, uint64_t page) {
+    int32_t index = *hdb_pool_bucket(shard, page);
+    while (index >= 0 && shard->frames[index].page != page) index = shard->frames[index].chain;
+    return index;
+}
+
+void hdb_pool_list_remove(struct hdb_pool_shard *shard, int32_t index) {
+    struct hdb_pool_frame *frame = &shard->frames[index];
+    if (frame->prev >= 0) {
+        shard->frames[frame->prev].next = frame->next;
+    } else {
+        shard->head = frame->next;
+    }
+    if (frame->next >= 0) {
+        shard->frames[frame->next].prev = frame->prev;
+    } else {
+        shard->tail = frame->prev;
+    }
+}
+
+void hdb_pool_list_push(struct hdb_pool_shard *shard, int32_t index) {
+    struct hdb_pool_frame *frame = &shard->frames[index];
+    frame->prev = -1;
+    frame->next = shard->head;
+    if (shard->head >= 0) shard->frames[shard->head].prev = index;
+    shard->head = index;
+    if (shard->tail < 0) shard->tail = index;
+}
+
+// Drops the page a frame holds, leaving the frame to the caller.
+void hdb_pool_unlink(struct hdb_pool_shard *shard, int32_t index) {
+    struct hdb_pool_frame *frame = &shard->frames[index];
+    int32_t *link = hdb_pool_bucket(shard, frame->page);
+    while (*link != index) link = &shard->frames[*link].chain;
+    *link = frame->chain;
+    hdb_pool_list_remove(shard, index);
+    shard->count--;
+}
+
+// A frame to read a page into: given back by an invalidation, not handed out
+// yet, or taken from the page the policy picks.  -1 when there is no memory
+// for even one.
+int32_t hdb_pool_frame(struct hdb_pool *pool, struct hdb_pool_shard *shard) {
+    if (shard->free >= 0) {
+        int32_t index = shard->free;
+        shard->free = shard->frames[index].chain;
+        return index;
+    }
+    if (shard->used < shard->capacity && shard->used % HDB_POOL_BLOCK == 0) {
+        uint32_t frames = shard->capacity - shard->used < HDB_POOL_BLOCK ? shard->capacity - shard->used : HDB_POOL_BLOCK;
+        uint8_t *block = hdb_page_alloc(pool->allocator, (size_t)frames * HDB_PAGE_SIZE);
+        if (block) {
+            shard->blocks[shard->used / HDB_POOL_BLOCK] = block;
+            for (uint32_t i = 0; i < frames; ++i) shard->frames[shard->used + i].data = block + (size_t)i * HDB_PAGE_SIZE;
+        } else {
+            shard->capacity = shard->used; // the frames it has will have to do
+        }
+    }
+    if (shard->used < shard->capacity) return shard->used++;
+    if (!shard->used) return -1;
+
+    // With nothing on the free list every frame handed out holds a page
+    int32_t victim = shard->tail;
+    if (pool->policy == HDB_POOL_CLOCK) {
+        while (shard->frames[shard->hand].referenced) {
+            shard->frames[shard->hand].referenced = 0;
+            shard->hand = (shard->hand + 1) % shard->used;
+        }
+        victim = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->used;
+    }
+    hdb_pool_unlink(shard, victim);
+    return victim;
+}
+
+// Copies the part of [offset, offset + length) that falls in page out of the
+// page's bytes.  -1 when the page ends before it.
+int hdb_pool_extract(uint64_t page, const uint8_t *data, uint32_t valid, uint64_t offset, uint8_t *buffer, size_t length) {
+    uint64_t start = page * HDB_PAGE_SIZE;
+    uint64_t from = offset > start ? offset : start;
+    uint64_t to = offset + length < start + HDB_PAGE_SIZE ? offset + length : start + HDB_PAGE_SIZE;
+    if (to - start > valid) return -1;
+    memcpy(buffer + (from - offset), data + (from - start), to - from);
+    return 0;
+}
+
+// Copies what the read wants of page out of the pool.  Returns 0 on a hit,
+// 1 on a miss, with the seq a page read now has to be kept under, and -1 when
+// the page ends before the bytes wanted.
+int hdb_pool_copy(struct hdb_pool *pool, uint64_t page, uint64_t offset, uint8_t *buffer, size_t length, uint64_t *seq) {
+    struct hdb_pool_shard *shard = hdb_pool_shard_for(pool, page);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = hdb_pool_find(shard, page);
+    int rc = 1;
+    if (index >= 0) {
+        struct hdb_pool_frame *frame = &shard->frames[index];
+        rc = hdb_pool_extract(page, frame->data, frame->length, offset, buffer, length);
+        frame->referenced = 1;
+        if (pool->policy == HDB_POOL_LRU && shard->head != index) {
+            hdb_pool_list_remove(shard, index);
+            hdb_pool_list_push(shard, index);
+        }
+        shard->hits++;
+    } else {
+        *seq = shard->seq;
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return rc;
+}
+
+// Keeps a page read after seq was taken, unless an invalidation came in
+// between or another reader was quicker.
+void hdb_pool_insert(struct hdb_pool *pool, uint64_t page, const uint8_t *data, uint32_t length, uint64_t seq) {
+    struct hdb_pool_shard *shard = hdb_pool_shard_for(pool, page);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index;
+    if (shard->seq == seq && hdb_pool_find(shard, page) < 0 && (index = hdb_pool_frame(pool, shard)) >= 0) {
+        struct hdb_pool_frame *frame = &shard->frames[index];
+        frame->page = page;
+        frame->length = length;
+        frame->referenced = 1;
+        memcpy(frame->data, data, length);
+        int32_t *bucket = hdb_pool_bucket(shard, page);
+        frame->chain = *bucket;
+        *bucket = index;
+        hdb_pool_list_push(shard, index);
+        shard->count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Reads whole pages around [offset, offset + length) with one O_DIRECT read
+// into memory aligned for it.  Reports how many bytes from the first page
+// on the file held.
+uint8_t* hdb_pool_read_pages(struct hdb_pool *pool, uint64_t first, uint64_t pages, uint64_t *valid) {
+    uint8_t *data = hdb_page_alloc(pool->allocator, pages * HDB_PAGE_SIZE);
+    if (!data) return NULL;
+    uint64_t done = 0;
+    while (done < pages * HDB_PAGE_SIZE) {
+        ssize_t n = pread(pool->fd, data + done, pages * HDB_PAGE_SIZE - done, first * HDB_PAGE_SIZE + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            hdb_aligned_free(pool->allocator, data);
+            return NULL;
+        }
+        if (n == 0) break; // the end of the file
+        done += n;
+    }
+    *valid = done;
+    return data;
+}
+
+// Serves a read from the pool, reading what it misses from the first missing
+// page to the end of the read at once and keeping those pages.
+int hdb_pool_read(struct hdb_pool *pool, uint64_t offset, void *buffer, size_t length) {
+    if (!length) return 0;
+    uint64_t first = offset / HDB_PAGE_SIZE, last = (offset + length - 1) / HDB_PAGE_SIZE;
+    uint64_t valid;
+    if (last - first >= HDB_POOL_READ_PAGES) {
+        uint8_t *data = hdb_pool_read_pages(pool, first, last - first + 1, &valid);
+        if (!data) return -1;
+        int rc = offset + length - first * HDB_PAGE_SIZE <= valid ? 0 : -1;
+        if (rc == 0) memcpy(buffer, data + (offset - first * HDB_PAGE_SIZE), length);
+        hdb_aligned_free(pool->allocator, data);
+        return rc;
+    }
+
+    uint64_t seqs[HDB_POOL_READ_PAGES];
+    for (uint64_t page = first; page <= last; ++page) {
+        int rc = hdb_pool_copy(pool, page, offset, buffer, length, &seqs[0]);
+        if (rc < 0) return -1;
+        if (rc == 0) continue;
+        // Every page of the run is read again, the ones another reader brought in meanwhile are kept as they are
+        for (uint64_t next = page + 1; next <= last; ++next) {
+            struct hdb_pool_shard *shard = hdb_pool_shard_for(pool, next);
+            pthread_mutex_lock(&shard->lock);
+            seqs[next - page] = shard->seq;
+            pthread_mutex_unlock(&shard->lock);
+        }
+        uint8_t *data = hdb_pool_read_pages(pool, page, last - page + 1, &valid);
+        if (!data) return -1;
+        for (uint64_t next = page; next <= last && rc >= 0; ++next) {
+            uint64_t start = (next - page) * HDB_PAGE_SIZE;
+            uint32_t bytes = valid <= start ? 0 : valid - start < HDB_PAGE_SIZE ? valid - start : HDB_PAGE_SIZE;
+            rc = hdb_pool_extract(next, data + start, bytes, offset, buffer, length);
+            if (bytes) hdb_pool_insert(pool, next, data + start, bytes, seqs[next - page]);
+        }
+        hdb_aligned_free(pool->allocator, data);
+        return rc < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+// Drops the pages a write to [offset, offset + length) changes, called once
+// the write is done.
+void hdb_pool_invalidate(struct hdb_pool *pool, uint64_t offset, uint64_t length) {
+    if (!pool || !length) return;
+    for (uint64_t page = offset / HDB_PAGE_SIZE; page <= (offset + length - 1) / HDB_PAGE_SIZE; ++page) {
+        struct hdb_pool_shard *shard = hdb_pool_shard_for(pool, page);
+        pthread_mutex_lock(&shard->lock);
+        shard->seq++;
+        int32_t index = hdb_pool_find(shard, page);
+        if (index >= 0) {
+            hdb_pool_unlink(shard, index);
+            shard->frames[index].referenced = 0;
+            shard->frames[index].chain = shard->free;
+            shard->free = index;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void hdb_pool_close(struct hdb_pool *pool) {
+    if (!pool) return;
+    for (int i = 0; i < HDB_POOL_SHARDS; ++i) {
+        struct hdb_pool_shard *shard = &pool->shards[i];
+        for (uint32_t j = 0; shard->blocks && j * HDB_POOL_BLOCK < shard->used; ++j) hdb_aligned_free(pool->allocator, shard->blocks[j]);
+        hdb_free(pool->allocator, shard->blocks);
+        hdb_free(pool->allocator, shard->frames);
+        hdb_free(pool->allocator, shard->table);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    if (pool->fd >= 0) close(pool->fd);
+    hdb_aligned_free(pool->allocator, pool);
+}
+
+// A buffer pool of budget bytes for file, read through its own O_DIRECT
+// descriptor.  Where the file system refuses O_DIRECT the pool reads through
+// the page cache instead.  Memory for the pages is taken as they are read.
+struct hdb_pool* hdb_pool_open(const struct hdb_allocator *allocator, FILE *file, const char *filename,
+                               uint64_t budget, uint32_t policy) {
+    if (policy != HDB_POOL_CLOCK && policy != HDB_POOL_LRU) return NULL;
+    struct hdb_pool *pool = hdb_aligned_alloc(allocator, sizeof(struct hdb_pool));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(struct hdb_pool));
+    pool->file = file;
+    pool->policy = policy;
+    pool->allocator = allocator;
+    pool->fd = open(filename, O_RDONLY | HDB_O_DIRECT);
+    if (pool->fd < 0 && errno == EINVAL) pool->fd = open(filename, O_RDONLY);
+    uint64_t frames = budget / HDB_PAGE_SIZE / HDB_POOL_SHARDS;
+    if (frames < 1) frames = 1;
+    if (frames > INT32_MAX / 2) frames = INT32_MAX / 2;
+    int rc = pool->fd >= 0 ? 0 : -1;
+    for (int i = 0; i < HDB_POOL_SHARDS; ++i) {
+        struct hdb_pool_shard *shard = &pool->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = frames;
+        shard->free = shard->head = shard->tail = -1;
+        uint32_t table_size = 1;
+        while (table_size < frames) table_size <<= 1;
+        shard->table_mask = table_size - 1;
+        shard->frames = hdb_calloc(allocator, frames, sizeof(struct hdb_pool_frame));
+        shard->blocks = hdb_calloc(allocator, (frames + HDB_POOL_BLOCK - 1) / HDB_POOL_BLOCK, sizeof(uint8_t*));
+        shard->table = hdb_malloc(allocator, table_size * sizeof(int32_t));
+        if (!shard->frames || !shard->blocks || !shard->table) {
+            rc = -1;
+            continue;
+        }
+        memset(shard->table, 0xff, table_size * sizeof(int32_t)); // every bucket -1
+    }
+    if (rc != 0) {
+        hdb_pool_close(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Counters of the buffer pool, summed over its shards, all zero without one.
+// Entries are pages held and bytes the memory taken for them.
+void db_pool_stats(struct hdb *db, struct hdb_cache_stats *stats) {
+    memset(stats, 0, sizeof(struct hdb_cache_stats));
+    struct hdb_pool *pool = __atomic_load_n(&db->data_pool, __ATOMIC_ACQUIRE);
+    if (!pool) return;
+    for (int i = 0; i < HDB_POOL_SHARDS; ++i) {
+        struct hdb_pool_shard *shard = &pool->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->entries += shard->count;
+        stats->bytes += (uint64_t)shard->used * HDB_PAGE_SIZE;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Read sections.  hdb_synchronize flips the phase and waits for the sections
+// counted under the old one, so whatever was unpublished before the call can
+// be freed once it returns.  Readers never block in a section, so waiting
+// holds up no one.
+static _Thread_local uint32_t hdb_thread_slot = UINT32_MAX;
+static uint32_t hdb_next_thread_slot = 0;
+
+// A number for the calling thread, handed out in turn below HDB_READER_SLOTS.
+uint32_t hdb_thread_index(void) {
+    if (hdb_thread_slot == UINT32_MAX) {
+        hdb_thread_slot = __atomic_fetch_add(&hdb_next_thread_slot, 1, __ATOMIC_RELAXED) % HDB_READER_SLOTS;
+    }
+    return hdb_thread_slot;
+}
+
+uint32_t hdb_read_enter(struct hdb *db) {
+    hdb_thread_index();
+    for (;;) {
+        uint32_t phase = __atomic_load_n(&db->reader_phase, __ATOMIC_ACQUIRE) & 1;
+        __atomic_fetch_add(&db->readers[hdb_thread_slot].active[phase], 1, __ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(&db->reader_phase, __ATOMIC_SEQ_CST) & 1) == phase) return hdb_thread_slot * 2 + phase;
+        __atomic_fetch_sub(&db->readers[hdb_thread_slot].active[phase], 1, __ATOMIC_RELEASE);
+    }
+}
+
+void hdb_read_exit(struct hdb *db, uint32_t token) {
+    __atomic_fetch_sub(&db->readers[token / 2].active[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+void hdb_synchronize(struct hdb *db) {
+    pthread_mutex_lock(&db->synchronize_lock);
+    uint32_t phase = __atomic_fetch_add(&db->reader_phase, 1, __ATOMIC_SEQ_CST) & 1;
+    for (int i = 0; i < HDB_READER_SLOTS; ++i) {
+        while (__atomic_load_n(&db->readers[i].active[phase], __ATOMIC_ACQUIRE)) sched_yield();
+    }
+    pthread_mutex_unlock(&db->synchronize_lock);
+}
+
+// Statistics.  The counting functions compile to nothing with HDB_NO_STATS.
+const char *const hdb_stat_names[HDB_STAT_COUNT] = {
+    "gets", "get_misses", "puts", "deletes", "probes", "probe_retries",
+    "bytes_read", "bytes_written", "extent_reuses", "appends", "splits", "compactions",
+    "blob_writes", "blob_compactions", "expired", "in_place_updates",
+};
+
+const char *const hdb_latency_names[HDB_LATENCY_COUNT] = {"get", "put", "delete", "sync", "checkpoint"};
+
+// Monotonic nanoseconds to time an operation from, 0 with HDB_NO_STATS.
+uint64_t hdb_stats_clock(void) {
+#ifndef HDB_NO_STATS
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+void hdb_count(struct hdb *db, uint32_t counter, uint64_t amount) {
+#ifndef HDB_NO_STATS
+    struct hdb_stats_shard *shard = &db->stats[hdb_thread_index() % HDB_STATS_SHARDS];
+    __atomic_fetch_add(&shard->counters[counter], amount, __ATOMIC_RELAXED);
+#else
+    (void)db, (void)counter, (void)amount;
+#endif
+}
+
+// The bucket of a latency: exact below 1 << HDB_HISTOGRAM_SUB_BITS, then the
+// top HDB_HISTOGRAM_SUB_BITS bits after the leading one.
+uint32_t hdb_histogram_bucket(uint64_t value) {
+    if (value < (1u << HDB_HISTOGRAM_SUB_BITS)) return value;
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    uint32_t sub = (value >> (exponent - HDB_HISTOGRAM_SUB_BITS)) & ((1u << HDB_HISTOGRAM_SUB_BITS) - 1);
+    return ((exponent - HDB_HISTOGRAM_SUB_BITS + 1) << HDB_HISTOGRAM_SUB_BITS) + sub;
+}
+
+// The largest latency that lands in a bucket.
+uint64_t hdb_histogram_upper(uint32_t bucket) {
+    if (bucket < (1u << HDB_HISTOGRAM_SUB_BITS)) return bucket;
+    uint32_t exponent = (bucket >> HDB_HISTOGRAM_SUB_BITS) - 1 + HDB_HISTOGRAM_SUB_BITS;
+    uint64_t sub = bucket & ((1u << HDB_HISTOGRAM_SUB_BITS) - 1);
+    uint64_t width = (uint64_t)1 << (exponent - HDB_HISTOGRAM_SUB_BITS);
+    return (((uint64_t)1 << HDB_HISTOGRAM_SUB_BITS) + sub) * width + width - 1;
+}
+
+// Records the time since start, taken from hdb_stats_clock.
+void hdb_time(struct hdb *db, uint32_t latency, uint64_t start) {
+#ifndef HDB_NO_STATS
+    uint64_t elapsed = hdb_stats_clock() - start;
+    struct hdb_stats_shard *shard = &db->stats[hdb_thread_index() % HDB_STATS_SHARDS];
+    __atomic_fetch_add(&shard->latency_sums[latency], elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->histograms[latency][hdb_histogram_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+#else
+    (void)db, (void)latency, (void)start;
+#endif
+}
+
+// Sums the shards and works out the percentiles.  The shards are read while
+// others count, so the figures are not from one single instant.
+void db_stats(struct hdb *db, struct hdb_stats *stats) {
+    memset(stats, 0, sizeof(struct hdb_stats));
+#ifndef HDB_NO_STATS
+    for (uint32_t latency = 0; latency < HDB_LATENCY_COUNT; ++latency) {
+        uint64_t buckets[HDB_HISTOGRAM_BUCKETS] = {0};
+        uint64_t sum = 0, count = 0;
+        for (int i = 0; i < HDB_STATS_SHARDS; ++i) {
+            sum += __atomic_load_n(&db->stats[i].latency_sums[latency], __ATOMIC_RELAXED);
+            for (uint32_t bucket = 0; bucket < HDB_HISTOGRAM_BUCKETS; ++bucket) {
+                buckets[bucket] += __atomic_load_n(&db->stats[i].histograms[latency][bucket], __ATOMIC_RELAXED);
+            }
+        }
+        for (uint32_t bucket = 0; bucket < HDB_HISTOGRAM_BUCKETS; ++bucket) count += buckets[bucket];
+        struct hdb_latency *out = &stats->latencies[latency];
+        out->count = count;
+        if (!count) continue;
+        out->mean = sum / count;
+        const double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+        uint64_t *percentiles[4] = {&out->p50, &out->p90, &out->p99, &out->p999};
+        uint64_t seen = 0;
+        int next = 0;
+        for (uint32_t bucket = 0; bucket < HDB_HISTOGRAM_BUCKETS; ++bucket) {
+            if (!buckets[bucket]) continue;
+            seen += buckets[bucket];
+            while (next < 4 && seen >= quantiles[next] * count) *percentiles[next++] = hdb_histogram_upper(bucket);
+            out->max = hdb_histogram_upper(bucket);
+        }
+    }
+    for (int i = 0; i < HDB_STATS_SHARDS; ++i) {
+        for (uint32_t counter = 0; counter < HDB_STAT_COUNT; ++counter) {
+            stats->counters[counter] += __atomic_load_n(&db->stats[i].counters[counter], __ATOMIC_RELAXED);
+        }
+    }
+#else
+    (void)db;
+#endif
+}
+
+// Writes stats out as HDB_STATS_TEXT, one figure per line, or as one
+// HDB_STATS_JSON object.  Returns 0, or -1 when the write failed.
+int db_stats_print(const struct hdb_stats *stats, FILE *file, uint32_t format) {
+    bool json = format == HDB_STATS_JSON;
+    if (json) fprintf(file, "{\"counters\": {");
+    for (uint32_t counter = 0; counter < HDB_STAT_COUNT; ++counter) {
+        if (json) {
+            fprintf(file, "%s\"%s\": %" PRIu64, counter ? ", " : "", hdb_stat_names[counter], stats->counters[counter]);
+        } else {
+            fprintf(file, "%s %" PRIu64 "\n", hdb_stat_names[counter], stats->counters[counter]);
+        }
+    }
+    if (json) fprintf(file, "}, \"latencies\": {");
+    for (uint32_t latency = 0; latency < HDB_LATENCY_COUNT; ++latency) {
+        const struct hdb_latency *l = &stats->latencies[latency];
+        fprintf(file, json ? "%s\"%s\": {\"count\": %" PRIu64 ", \"mean\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+                             ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}"
+                           : "%s%s_latency count %" PRIu64 " mean %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+                             " p99 %" PRIu64 " p999 %" PRIu64 " max %" PRIu64 "\n",
+                json && latency ? ", " : "", hdb_latency_names[latency], l->count, l->mean, l->p50, l->p90, l->p99, l->p999, l->max);
+    }
+    if (json) fprintf(file, "}}\n");
+    return ferror(file) ? -1 : 0;
+}
+
+// Sequence counters.  A writer makes the counter odd for the time of its
+// change, a reader retries when the counter was odd or moved while it read.
+uint32_t hdb_seq_read(const uint32_t *seq) {
+    return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+bool hdb_seq_retry(const uint32_t *seq, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+void hdb_seq_write(uint32_t *seq) {
+    __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+}
+
+struct hdb_stripe* hdb_stripe_for(struct hdb *db, uint32_t page) {
+    return &db->stripes[page % HDB_LOCK_STRIPES];
+}
+
+// Queues something a held ref may point into and advances the epoch, so refs
+// taken from now on do not hold it back.  Called with alloc_lock held.
+void hdb_limbo_push(struct hdb *db, uint8_t *base, uint64_t reserve, uint64_t offset, uint64_t length) {
+    struct hdb_limbo *limbo = hdb_malloc(&db->allocator, sizeof(struct hdb_limbo));
+    if (!limbo) {
+        // Better to leak the mapping or the extent than to pull them from under a ref
+        return;
+    }
+    limbo->epoch = db->epoch++;
+    limbo->base = base;
+    limbo->reserve = reserve;
+    limbo->offset = offset;
+    limbo->length = length;
+    limbo->next = NULL;
+    if (db->limbo_tail) {
+        db->limbo_tail->next = limbo;
+    } else {
+        db->limbo = limbo;
+    }
+    db->limbo_tail = limbo;
+}
+
+// Frees what no held ref can point into any more, or everything.  Extents go
+// back to the free space right away, mappings are unmapped after a grace
+// period for the read sections, once alloc_lock is released.
+void hdb_drain_limbo(struct hdb *db, bool all) {
+    struct hdb_limbo *unmap = NULL;
+    pthread_mutex_lock(&db->alloc_lock);
+    while (db->limbo && (all || !db->refs || db->limbo->epoch < db->refs->epoch)) {
+        struct hdb_limbo *limbo = db->limbo;
+        db->limbo = limbo->next;
+        if (limbo->base) {
+            limbo->next = unmap;
+            unmap = limbo;
+            continue;
+        }
+        if (limbo->length && !db->compacting) {
+            hdb_free_space_release(&db->free_space, limbo->offset, limbo->length);
+        }
+        hdb_free(&db->allocator, limbo);
+    }
+    if (!db->limbo) db->limbo_tail = NULL;
+    pthread_mutex_unlock(&db->alloc_lock);
+
+    if (unmap) hdb_synchronize(db);
+    while (unmap) {
+        struct hdb_limbo *next = unmap->next;
+        munmap(unmap->base, unmap->reserve);
+        hdb_free(&db->allocator, unmap);
+        unmap = next;
+    }
+}
+
+// Unmaps a data file mapping once no ref or read section can use it.  Called
+// without alloc_lock.
+void hdb_retire_mapping(struct hdb *db, struct hdb_map *map) {
+    if (!map->base) return;
+    pthread_mutex_lock(&db->alloc_lock);
+    bool held = db->refs != NULL;
+    if (held) hdb_limbo_push(db, map->base, map->reserve, 0, 0);
+    pthread_mutex_unlock(&db->alloc_lock);
+    if (!held) {
+        hdb_synchronize(db);
+        munmap(map->base, map->reserve);
+    }
+    map->base = NULL;
+}
+
+// Hands a dead extent to the free space once no held ref can still read it.
+// Called with alloc_lock held.
+void hdb_retire_extent(struct hdb *db, uint64_t offset, uint64_t length) {
+    if (db->compacting) return; // extents of the old file die with it
+    if (db->refs) {
+        hdb_limbo_push(db, NULL, 0, offset, length);
+    } else {
+        hdb_free_space_release(&db->free_space, offset, length);
+    }
+}
+
+int hdb_hash_read(struct hdb *db, uint64_t offset, void *buffer, size_t length) {
+    return hdb_map_read(db->hash_file, &db->hash_map, offset, buffer, length);
+}
+
+// Only splits and new files grow the hash file, and they run alone.
+int hdb_hash_write(struct hdb *db, uint64_t offset, const void *buffer, size_t length) {
+    if (hdb_write_at(db->hash_file, offset, buffer, length) != 0) return -1;
+    return hdb_map_extend(&db->hash_map, db->hash_file, offset + length);
+}
+
+// The data file and its mapping as a reader sees them.  Compaction replaces
+// both, the old ones stay usable until the read section ends.
+FILE* hdb_data_file(struct hdb *db) {
+    return __atomic_load_n(&db->data_file, __ATOMIC_ACQUIRE);
+}
+
+struct hdb_map* hdb_data_map(struct hdb *db) {
+    return __atomic_load_n(&db->data_map, __ATOMIC_ACQUIRE);
+}
+
+struct hdb_pool* hdb_data_pool(struct hdb *db) {
+    return __atomic_load_n(&db->data_pool, __ATOMIC_ACQUIRE);
+}
+
+// Reads a data file as a reader found it: through its mapping, through the
+// buffer pool when the pool is still that of the file, or with pread.
+int hdb_file_read(struct hdb_pool *pool, FILE *file, const struct hdb_map *map, uint64_t offset, void *buffer, size_t length) {
+    if (pool && pool->file == file) return hdb_pool_read(pool, offset, buffer, length);
+    return hdb_map_read(file, map, offset, buffer, length);
+}
+
+int hdb_data_read(struct hdb *db, uint64_t offset, void *buffer, size_t length) {
+    return hdb_file_read(hdb_data_pool(db), hdb_data_file(db), hdb_data_map(db), offset, buffer, length);
+}
+
+// Writes within the data file, which the mapping already covers.
+int hdb_data_write(struct hdb *db, uint64_t offset, const void *buffer, size_t length) {
+    int rc = hdb_write_at(db->data_file, offset, buffer, length);
+    hdb_pool_invalidate(db->data_pool, offset, length);
+    return rc;
+}
+
+uint64_t hdb_page_offset(uint32_t page) {
+    return (uint64_t)page * HDB_PAGE_SIZE;
+}
+
+uint32_t hdb_directory_pages(uint32_t global_depth) {
+    uint64_t bytes = ((uint64_t)1 << global_depth) * sizeof(uint32_t);
+    return (bytes + HDB_PAGE_SIZE - 1) / HDB_PAGE_SIZE;
+}
+
+uint64_t hdb_header_checksum(const struct hdb_header *header) {
+    return hash_function((const uint8_t*)header, offsetof(struct hdb_header, checksum));
+}
+
+int hdb_write_header(struct hdb *db) {
+    // Sealed in a copy, writers may be counting meanwhile: dead bytes under
+    // alloc_lock, keys and changes with atomics
+    struct hdb_header header;
+    pthread_mutex_lock(&db->alloc_lock);
+    memcpy(&header, &db->header, offsetof(struct hdb_header, key_count));
+    header.key_count = __atomic_load_n(&db->header.key_count, __ATOMIC_RELAXED);
+    memcpy(&header.hash_algorithm, &db->header.hash_algorithm,
+           offsetof(struct hdb_header, sequence) - offsetof(struct hdb_header, hash_algorithm));
+    header.sequence = __atomic_load_n(&db->header.sequence, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&db->alloc_lock);
+    header.checksum = hdb_header_checksum(&header);
+    return hdb_hash_write(db, 0, &header, sizeof(struct hdb_header));
+}
+
+// The copy of the bucket at page in the index cache, NULL when it has none.
+struct hdb_bucket* hdb_cached_bucket(struct hdb *db, uint32_t page) {
+    struct hdb_page_table *table = __atomic_load_n(&db->index_cache, __ATOMIC_ACQUIRE);
+    if (!table || page >= table->capacity) return NULL;
+    return __atomic_load_n(&table->pages[page], __ATOMIC_ACQUIRE);
+}
+
+// Adds a copy of the bucket at page to the index cache while the budget lasts.
+// Called at open or with the lock held exclusively.
+int hdb_cache_bucket(struct hdb *db, uint32_t page, const struct hdb_bucket *bucket) {
+    struct hdb_page_table *table = db->index_cache;
+    if (!table || db->index_cache_bytes + sizeof(struct hdb_bucket) > db->options.index_cache) return 0;
+    if (page >= table->capacity) {
+        uint32_t capacity = table->capacity * 2 > page ? table->capacity * 2 : page + 1;
+        struct hdb_page_table *grown = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_page_table) + capacity * sizeof(struct hdb_bucket*));
+        if (!grown) return -1;
+        grown->capacity = capacity;
+        memcpy(grown->pages, table->pages, table->capacity * sizeof(struct hdb_bucket*));
+        __atomic_store_n(&db->index_cache, grown, __ATOMIC_RELEASE);
+        hdb_synchronize(db); // readers may still be looking pages up in the old table
+        hdb_free(&db->allocator, table);
+        table = grown;
+    }
+    struct hdb_bucket *copy = hdb_malloc(&db->allocator, sizeof(struct hdb_bucket));
+    if (!copy) return -1;
+    memcpy(copy, bucket, sizeof(struct hdb_bucket));
+    db->index_cache_bytes += sizeof(struct hdb_bucket);
+    __atomic_store_n(&table->pages[page], copy, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int hdb_read_bucket(struct hdb *db, uint32_t page, struct hdb_bucket *bucket) {
+    struct hdb_bucket *cached = hdb_cached_bucket(db, page);
+    if (cached) {
+        memcpy(bucket, cached, sizeof(struct hdb_bucket));
+        return 0;
+    }
+    return hdb_hash_read(db, hdb_page_offset(page), bucket, sizeof(struct hdb_bucket));
+}
+
+int hdb_write_bucket(struct hdb *db, uint32_t page, const struct hdb_bucket *bucket) {
+    if (db->snapshots && hdb_snapshot_preserve(db, page) != 0) return -1;
+    struct hdb_bucket *cached = hdb_cached_bucket(db, page);
+    if (cached) memcpy(cached, bucket, sizeof(struct hdb_bucket));
+    return hdb_hash_write(db, hdb_page_offset(page), bucket, sizeof(struct hdb_bucket));
+}
+
+// The depth is published after the directory it applies to, so a reader
+// never indexes past the end of the directory it loads.
+uint32_t hdb_bucket_page(struct hdb *db, uint64_t hash) {
+    uint32_t depth = __atomic_load_n(&db->header.global_depth, __ATOMIC_ACQUIRE);
+    const uint32_t *directory = __atomic_load_n(&db->directory, __ATOMIC_ACQUIRE);
+    uint64_t mask = ((uint64_t)1 << depth) - 1;
+    return __atomic_load_n(&directory[hash & mask], __ATOMIC_RELAXED);
+}
+
+uint64_t hdb_data_size(struct hdb *db) {
+    return __atomic_load_n(&db->data_end, __ATOMIC_ACQUIRE);
+}
+
+uint64_t hdb_record_size(uint64_t key_length, uint64_t value_length) {
+    return sizeof(struct hdb_record_header) + key_length + value_length;
+}
+
+// Compares the key stored in the record at position of a data file with key.
+bool hdb_record_has_key(struct hdb_pool *pool, FILE *file, const struct hdb_map *map, uint64_t position,
+                        const uint8_t *key, size_t key_length) {
+    struct hdb_record_header record;
+    if (hdb_file_read(pool, file, map, position, &record, sizeof(struct hdb_record_header)) != 0) return false;
+    if (record.key_length != key_length) return false;
+    position += sizeof(struct hdb_record_header);
+    if (map) {
+        uint64_t capacity = __atomic_load_n(&map->capacity, __ATOMIC_ACQUIRE);
+        if (position > capacity || key_length > capacity - position) return false;
+        return memcmp(map->base + position, key, key_length) == 0;
+    }
+
+    uint8_t buffer[BLOCK_SIZE];
+    size_t total_read = 0;
+    while (total_read < key_length) {
+        size_t to_read = (key_length - total_read > BLOCK_SIZE) ? BLOCK_SIZE : key_length - total_read;
+        if (hdb_file_read(pool, file, NULL, position + total_read, buffer, to_read) != 0) return false;
+        if (memcmp(buffer, key + total_read, to_read) != 0) return false;
+        total_read += to_read;
+    }
+    return true;
+}
+
+uint32_t hdb_home_slot(uint32_t fingerprint) {
+    return fingerprint % HDB_BUCKET_SLOTS;
+}
+
+// Walks the probe sequence of the key and returns the slot holding it, or -1.
+// The walk ends at the first unused slot, so a miss only looks at the keys
+// that share the neighbourhood of its home slot.
+int hdb_bucket_find(struct hdb *db, const struct hdb_bucket *bucket, uint64_t hash, uint32_t fingerprint,
+                    const uint8_t *key, size_t key_length) {
+    uint32_t index = hdb_home_slot(fingerprint);
+    for (uint32_t probe = 0; probe < HDB_MAX_PROBE; ++probe) {
+        const struct hdb_slot *slot = &bucket->slots[index];
+        if (!(slot->flags & HDB_SLOT_USED)) return -1;
+        if (slot->hash == hash && slot->fingerprint == fingerprint &&
+            hdb_record_has_key(db->data_pool, db->data_file, db->data_map, slot->position, key, key_length)) return index;
+        index = (index + 1) % HDB_BUCKET_SLOTS;
+    }
+    return -1;
+}
+
+// Places slot at the first unused position of its probe sequence.  Fails when
+// the bucket is too crowded around the home slot, in which case it must be split.
+int hdb_bucket_insert(struct hdb_bucket *bucket, const struct hdb_slot *slot) {
+    if (bucket->count + 1 >= HDB_BUCKET_SLOTS) return -1; // keep one slot free so probe runs never wrap into themselves
+
+    uint32_t index = hdb_home_slot(slot->fingerprint);
+    for (uint32_t probe = 0; probe < HDB_MAX_PROBE; ++probe) {
+        if (!(bucket->slots[index].flags & HDB_SLOT_USED)) {
+            bucket->slots[index] = *slot;
+            bucket->slots[index].flags |= HDB_SLOT_USED;
+            bucket->count++;
+            return index;
+        }
+        index = (index + 1) % HDB_BUCKET_SLOTS;
+    }
+    return -1;
+}
+
+// Clears a slot and shifts the following entries of the probe run back so no
+// lookup stops early at the hole.
+void hdb_bucket_remove(struct hdb_bucket *bucket, uint32_t index) {
+    uint32_t next = (index + 1) % HDB_BUCKET_SLOTS;
+    while (bucket->slots[next].flags & HDB_SLOT_USED) {
+        uint32_t home = hdb_home_slot(bucket->slots[next].fingerprint);
+        // The entry can move into the hole if the hole lies between its home and its current slot
+        uint32_t hole_distance = (index + HDB_BUCKET_SLOTS - home) % HDB_BUCKET_SLOTS;
+        uint32_t distance = (next + HDB_BUCKET_SLOTS - home) % HDB_BUCKET_SLOTS;
+        if (hole_distance < distance) {
+            bucket->slots[index] = bucket->slots[next];
+            index = next;
+        }
+        next = (next + 1) % HDB_BUCKET_SLOTS;
+    }
+    memset(&bucket->slots[index], 0, sizeof(struct hdb_slot));
+    bucket->count--;
+}
+
+uint64_t (*hdb_hash_for(uint32_t hash_algorithm))(const uint8_t *data, size_t length) {
+    switch (hash_algorithm) {
+        case HDB_HASH_LEGACY32: return hdb_hash_legacy64;
+        case HDB_HASH_MIX64: return hash_function;
+        default: return NULL;
+    }
+}
+
+// Whether the files are as the last db_close left them: the header says so,
+// no write reached the data file afterwards and no log waits for replay.
+bool hdb_clean_start(struct hdb *db) {
+    struct stat st;
+    if (db->header.state != HDB_STATE_CLEAN || db->header.data_end != db->data_end || db->header.blob_end != db->blob_end) return false;
+    if (access(db->wal_filename, F_OK) == 0 || fstat(fileno(db->deleted_blocks), &st) != 0) return false;
+    return (uint64_t)st.st_size == sizeof(struct hdb_free_space_header) + db->header.free_space_count * 2 * sizeof(uint64_t);
+}
+
+// Reads the header and the directory, or lays out an empty table with a
+// single bucket when the hash file is new.  Returns 1 for a hash file of a
+// format that cannot be read, see HDB_MAGIC.
+int hdb_load_index(struct hdb *db, const struct hdb_options *options) {
+    fseek(db->hash_file, 0, SEEK_END);
+    if (ftell(db->hash_file) == 0) {
+        memset(&db->header, 0, sizeof(struct hdb_header));
+        db->header.magic = HDB_MAGIC;
+        db->header.version = HDB_FORMAT_VERSION;
+        db->header.hash_algorithm = options->hash_algorithm ? options->hash_algorithm : HDB_HASH_MIX64;
+        db->hash = hdb_hash_for(db->header.hash_algorithm);
+        if (!db->hash) return -1;
+        db->header.global_depth = 0;
+        db->header.bucket_count = 1;
+        db->header.directory_page = 1;
+        db->header.page_count = 3; // header, directory and the first bucket
+
+        db->directory = hdb_malloc(&db->allocator, sizeof(uint32_t));
+        if (!db->directory) return -1;
+        db->directory[0] = 2;
+
+        struct hdb_bucket bucket;
+        memset(&bucket, 0, sizeof(struct hdb_bucket));
+        if (hdb_write_bucket(db, 2, &bucket) != 0) return -1;
+        if (hdb_hash_write(db, hdb_page_offset(1), db->directory, sizeof(uint32_t)) != 0) return -1;
+        return hdb_write_header(db);
+    }
+
+    if (hdb_hash_read(db, 0, &db->header, sizeof(struct hdb_header)) != 0) return -1;
+    if (db->header.magic != HDB_MAGIC || db->header.version != HDB_FORMAT_VERSION) return 1;
+    if (db->header.checksum != hdb_header_checksum(&db->header)) return -1;
+    db->start = hdb_clean_start(db) ? HDB_START_CLEAN : HDB_START_RECOVER;
+    if (db->header.state == HDB_STATE_CLEAN) {
+        // From the first change on the other files are stale until the next close
+        db->header.state = HDB_STATE_OPEN;
+        if (hdb_write_header(db) != 0 || fsync(fileno(db->hash_file)) != 0) return -1;
+    }
+    if (db->header.global_depth > HDB_MAX_DEPTH) return -1;
+    db->hash = hdb_hash_for(db->header.hash_algorithm);
+    if (!db->hash) return -1;
+
+    size_t entries = (size_t)1 << db->header.global_depth;
+    db->directory = hdb_malloc(&db->allocator, entries * sizeof(uint32_t));
+    if (!db->directory) return -1;
+    if (hdb_hash_read(db, hdb_page_offset(db->header.directory_page), db->directory, entries * sizeof(uint32_t)) != 0) return -1;
+    if (db->header.state == HDB_STATE_BLOB_SWAP) return hdb_finish_blob_swap(db);
+    return db->header.state == HDB_STATE_SWAP ? hdb_finish_swap(db) : 0;
+}
+
+// Fills the index cache with the bucket pages the directory points at, in
+// page order, until the budget is spent.
+int hdb_load_index_cache(struct hdb *db) {
+    uint32_t capacity = db->header.page_count;
+    db->index_cache = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_page_table) + capacity * sizeof(struct hdb_bucket*));
+    uint8_t *referenced = hdb_calloc(&db->allocator, capacity, 1);
+    if (!db->index_cache || !referenced) {
+        hdb_free(&db->allocator, referenced);
+        return -1;
+    }
+    db->index_cache->capacity = capacity;
+    size_t entries = (size_t)1 << db->header.global_depth;
+    for (size_t i = 0; i < entries; ++i) {
+        if (db->directory[i] < capacity) referenced[db->directory[i]] = 1;
+    }
+
+    int rc = 0;
+    struct hdb_bucket bucket;
+    for (uint32_t page = 0; page < capacity && rc == 0; ++page) {
+        if (!referenced[page]) continue;
+        if (db->index_cache_bytes + sizeof(struct hdb_bucket) > db->options.index_cache) break;
+        rc = hdb_read_bucket(db, page, &bucket);
+        if (rc == 0) rc = hdb_cache_bucket(db, page, &bucket);
+    }
+    hdb_free(&db->allocator, referenced);
+    return rc;
+}
+
+void hdb_free_index_cache(struct hdb *db) {
+    if (!db->index_cache) return;
+    for (uint32_t page = 0; page < db->index_cache->capacity; ++page) hdb_free(&db->allocator, db->index_cache->pages[page]);
+    hdb_free(&db->allocator, db->index_cache);
+    db->index_cache = NULL;
+}
+
+struct hdb_filter* hdb_filter_create(const struct hdb_allocator *allocator, uint64_t keys, uint32_t bits_per_key) {
+    uint64_t capacity = keys * 2 > HDB_FILTER_MIN_KEYS ? keys * 2 : HDB_FILTER_MIN_KEYS;
+    uint64_t blocks = (capacity * bits_per_key + HDB_FILTER_BLOCK_BITS - 1) / HDB_FILTER_BLOCK_BITS;
+    size_t size = sizeof(struct hdb_filter) + blocks * (HDB_FILTER_BLOCK_BITS / 8);
+    struct hdb_filter *filter = hdb_aligned_alloc(allocator, size);
+    if (!filter) return NULL;
+    memset(filter, 0, size);
+    filter->blocks = blocks;
+    filter->capacity = capacity;
+    filter->bits_per_key = bits_per_key;
+    filter->probes = (uint32_t)(bits_per_key * 0.69 + 0.5); // ln 2 bits per key minimises false positives
+    if (filter->probes < 1) filter->probes = 1;
+    if (filter->probes > 16) filter->probes = 16;
+    return filter;
+}
+
+// The block of a key and the start and step of its probes inside the block,
+// from both of its hashes so a weak hash still spreads well.
+uint64_t* hdb_filter_block(const struct hdb_filter *filter, uint64_t hash, uint32_t fingerprint, uint32_t *start, uint32_t *step) {
+    uint64_t mixed = (hash ^ ((uint64_t)fingerprint << 32 | fingerprint)) * 0x9E3779B97F4A7C15ull;
+    mixed ^= mixed >> 29;
+    *start = (uint32_t)mixed;
+    *step = (uint32_t)(mixed >> 32) | 1;
+    return (uint64_t*)filter->bits + (mixed % filter->blocks) * (HDB_FILTER_BLOCK_BITS / 64);
+}
+
+// Runs with the key's bucket locked and before the key is published, so a
+// reader that can find the key in the index also finds it in the filter.
+void hdb_filter_add(struct hdb_filter *filter, uint64_t hash, uint32_t fingerprint) {
+    uint32_t bit, step;
+    uint64_t *block = hdb_filter_block(filter, hash, fingerprint, &bit, &step);
+    for (uint32_t i = 0; i < filter->probes; ++i, bit += step) {
+        __atomic_fetch_or(&block[(bit % HDB_FILTER_BLOCK_BITS) / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+bool hdb_filter_may_contain(const struct hdb_filter *filter, uint64_t hash, uint32_t fingerprint) {
+    uint32_t bit, step;
+    const uint64_t *block = hdb_filter_block(filter, hash, fingerprint, &bit, &step);
+    for (uint32_t i = 0; i < filter->probes; ++i, bit += step) {
+        uint64_t word = __atomic_load_n(&block[(bit % HDB_FILTER_BLOCK_BITS) / 64], __ATOMIC_RELAXED);
+        if (!(word & ((uint64_t)1 << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+// Builds a filter from the slots of every bucket and swaps it in.  Called at
+// open or with the lock held exclusively.
+int hdb_rebuild_filter(struct hdb *db) {
+    struct hdb_filter *filter = hdb_filter_create(&db->allocator, db->header.key_count, db->options.filter_bits);
+    if (!filter) return -1;
+    size_t entries = (size_t)1 << db->header.global_depth;
+    for (size_t i = 0; i < entries; ++i) {
+        struct hdb_bucket bucket;
+        if (hdb_read_bucket(db, db->directory[i], &bucket) != 0) {
+            hdb_aligned_free(&db->allocator, filter);
+            return -1;
+        }
+        if (i >= ((size_t)1 << bucket.local_depth)) continue; // Already visited
+        for (uint32_t j = 0; j < HDB_BUCKET_SLOTS; ++j) {
+            const struct hdb_slot *slot = &bucket.slots[j];
+            if (slot->flags & HDB_SLOT_USED) hdb_filter_add(filter, slot->hash, slot->fingerprint);
+        }
+    }
+    struct hdb_filter *old = db->filter;
+    __atomic_store_n(&db->filter, filter, __ATOMIC_RELEASE);
+    if (old) {
+        hdb_synchronize(db); // readers may still be probing the old one
+        hdb_aligned_free(&db->allocator, old);
+    }
+    return 0;
+}
+
+// The filter written on the last clean close, NULL when the file holds none
+// that matches the index.
+struct hdb_filter* hdb_read_filter(struct hdb *db) {
+    struct hdb_filter_header header;
+    fseek(db->filter_file, 0, SEEK_SET);
+    if (fread(&header, sizeof(struct hdb_filter_header), 1, db->filter_file) != 1 ||
+        header.magic != HDB_FILTER_MAGIC || header.version != HDB_FILTER_VERSION ||
+        header.key_count != db->header.key_count || header.page_count != db->header.page_count ||
+        header.bits_per_key != db->options.filter_bits || !header.blocks ||
+        header.blocks > UINT64_MAX / HDB_FILTER_BLOCK_BITS) {
+        return NULL;
+    }
+    struct hdb_filter *filter = hdb_filter_create(&db->allocator, header.capacity / 2, header.bits_per_key);
+    if (filter && filter->blocks == header.blocks &&
+        fread(filter->bits, HDB_FILTER_BLOCK_BITS / 8, filter->blocks, db->filter_file) == filter->blocks) {
+        return filter;
+    }
+    hdb_aligned_free(&db->allocator, filter);
+    return NULL;
+}
+
+// Loads the filter written on the last clean close and empties its file, so
+// a crash cannot leave a filter that misses keys behind.  Without a usable
+// one the filter is rebuilt from the index.
+int hdb_claim_filter(struct hdb *db) {
+    db->filter = hdb_read_filter(db);
+    if (!db->filter && hdb_rebuild_filter(db) != 0) return -1;
+    fflush(db->filter_file);
+    if (ftruncate(fileno(db->filter_file), 0) != 0) return -1;
+    return fsync(fileno(db->filter_file));
+}
+
+// Loads the filter left by a clean close the first time a key is looked up
+// or written, or rebuilds it when the file holds none that fits.  Readers go
+// without one until then, writers must come through here first.  Called
+// without the lock held.
+int hdb_touch_filter(struct hdb *db) {
+    if (!__atomic_load_n(&db->filter_pending, __ATOMIC_ACQUIRE)) return 0;
+    int rc = 0;
+    pthread_mutex_lock(&db->filter_lock);
+    if (db->filter_pending) {
+        struct hdb_filter *filter = hdb_read_filter(db);
+        if (filter) {
+            __atomic_store_n(&db->filter, filter, __ATOMIC_RELEASE);
+        } else {
+            pthread_rwlock_wrlock(&db->lock);
+            rc = hdb_rebuild_filter(db);
+            pthread_rwlock_unlock(&db->lock);
+        }
+        if (rc == 0) __atomic_store_n(&db->filter_pending, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&db->filter_lock);
+    return rc;
+}
+
+// Rebuilds the filter larger once the index holds more keys than it was
+// sized for.
+int hdb_check_filter(struct hdb *db) {
+    struct hdb_filter *filter = __atomic_load_n(&db->filter, __ATOMIC_ACQUIRE);
+    if (!filter || __atomic_load_n(&db->header.key_count, __ATOMIC_RELAXED) <= filter->capacity) return 0;
+    pthread_rwlock_wrlock(&db->lock);
+    int rc = db->header.key_count > db->filter->capacity ? hdb_rebuild_filter(db) : 0;
+    pthread_rwlock_unlock(&db->lock);
+    return rc;
+}
+
+int hdb_encode_filter(struct hdb *db) {
+    if (!db->filter) return 0;
+    struct hdb_filter_header header = {HDB_FILTER_MAGIC, HDB_FILTER_VERSION, db->header.key_count, db->header.page_count,
+                                       db->filter->bits_per_key, db->filter->blocks, db->filter->capacity};
+    fseek(db->filter_file, 0, SEEK_SET);
+    if (fwrite(&header, sizeof(struct hdb_filter_header), 1, db->filter_file) != 1) return -1;
+    if (fwrite(db->filter->bits, HDB_FILTER_BLOCK_BITS / 8, db->filter->blocks, db->filter_file) != db->filter->blocks) return -1;
+    fflush(db->filter_file);
+    return fsync(fileno(db->filter_file));
+}
+
+// Doubles the directory.  The copy is written to freshly allocated pages and
+// the header is switched over afterwards, so the old directory stays valid
+// until the new one is complete.
+int hdb_grow_directory(struct hdb *db) {
+    if (db->header.global_depth == HDB_MAX_DEPTH) return -1;
+
+    size_t entries = (size_t)1 << db->header.global_depth;
+    uint32_t *directory = hdb_malloc(&db->allocator, entries * 2 * sizeof(uint32_t));
+    if (!directory) return -1;
+    memcpy(directory, db->directory, entries * sizeof(uint32_t));
+    memcpy(directory + entries, db->directory, entries * sizeof(uint32_t));
+
+    uint32_t page = db->header.page_count;
+    if (hdb_hash_write(db, hdb_page_offset(page), directory, entries * 2 * sizeof(uint32_t)) != 0) {
+        hdb_free(&db->allocator, directory);
+        return -1;
+    }
+    uint32_t *old = db->directory;
+    __atomic_store_n(&db->directory, directory, __ATOMIC_RELEASE);
+    db->header.page_count += hdb_directory_pages(db->header.global_depth + 1);
+    db->header.directory_page = page;
+    __atomic_store_n(&db->header.global_depth, db->header.global_depth + 1, __ATOMIC_RELEASE);
+    hdb_synchronize(db); // readers may still be indexing the old copy
+    hdb_free(&db->allocator, old);
+    return hdb_write_header(db);
+}
+
+// Splits one bucket by moving the keys whose next hash bit is set into a new
+// bucket page.  Only the directory entries that pointed at the old bucket change.
+int hdb_split_bucket(struct hdb *db, uint64_t hash, uint32_t page, struct hdb_bucket *bucket) {
+    uint32_t depth = bucket->local_depth;
+    if (depth == HDB_MAX_DEPTH) return -1;
+    if (depth == db->header.global_depth && hdb_grow_directory(db) != 0) return -1;
+
+    struct hdb_bucket old = *bucket;
+    struct hdb_bucket sibling;
+    memset(&sibling, 0, sizeof(struct hdb_bucket));
+    memset(bucket, 0, sizeof(struct hdb_bucket));
+    sibling.local_depth = depth + 1;
+    bucket->local_depth = depth + 1;
+    sibling.compaction = bucket->compaction = old.compaction;
+
+    // Reinserting in slot order, starting after a free slot, puts every entry
+    // at or before its old slot, so none ends up past the probe limit.
+    uint32_t start = 0;
+    while (old.slots[start].flags & HDB_SLOT_USED) start++;
+    for (uint32_t i = 1; i <= HDB_BUCKET_SLOTS; ++i) {
+        const struct hdb_slot *slot = &old.slots[(start + i) % HDB_BUCKET_SLOTS];
+        if (!(slot->flags & HDB_SLOT_USED)) continue;
+        hdb_bucket_insert(((slot->hash >> depth) & 1) ? &sibling : bucket, slot);
+    }
+
+    uint32_t sibling_page = db->header.page_count++;
+    db->header.bucket_count++;
+    hdb_count(db, HDB_STAT_SPLITS, 1);
+    if (hdb_write_bucket(db, sibling_page, &sibling) != 0) return -1;
+    if (hdb_cache_bucket(db, sibling_page, &sibling) != 0) return -1;
+
+    // Every directory index ending in the bucket's bit pattern followed by a 1 moves
+    size_t entries = (size_t)1 << db->header.global_depth;
+    size_t pattern = hash & (((size_t)1 << depth) - 1);
+    uint64_t directory_offset = hdb_page_offset(db->header.directory_page);
+    for (size_t i = pattern | ((size_t)1 << depth); i < entries; i += (size_t)1 << (depth + 1)) {
+        __atomic_store_n(&db->directory[i], sibling_page, __ATOMIC_RELAXED);
+        if (hdb_hash_write(db, directory_offset + i * sizeof(uint32_t), &sibling_page, sizeof(uint32_t)) != 0) return -1;
+    }
+
+    if (hdb_write_bucket(db, page, bucket) != 0) return -1;
+    return hdb_write_header(db);
+}
+
+int hdb_write_slot(struct hdb *db, uint32_t page, const struct hdb_bucket *bucket, uint32_t index) {
+    // Only the changed slot and the bucket header are written back
+    if (db->snapshots && hdb_snapshot_preserve(db, page) != 0) return -1;
+    struct hdb_bucket *cached = hdb_cached_bucket(db, page);
+    if (cached) {
+        cached->slots[index] = bucket->slots[index];
+        cached->local_depth = bucket->local_depth;
+        cached->count = bucket->count;
+    }
+    uint64_t bucket_offset = hdb_page_offset(page);
+    if (hdb_hash_write(db, bucket_offset + offsetof(struct hdb_bucket, slots) + index * sizeof(struct hdb_slot),
+                     &bucket->slots[index], sizeof(struct hdb_slot)) != 0) return -1;
+    return hdb_hash_write(db, bucket_offset, bucket, 2 * sizeof(uint32_t));
+}
+
+uint32_t hdb_record_padding(uint32_t flags) {
+    return flags >> HDB_RECORD_PADDING_SHIFT;
+}
+
+// Orders extents by offset in one tree and by length then offset in the other.
+bool hdb_extent_less(int tree, const struct hdb_extent *a, const struct hdb_extent *b) {
+    if (tree == HDB_BY_LENGTH && a->length != b->length) return a->length < b->length;
+    return a->offset < b->offset;
+}
+
+struct hdb_extent* hdb_treap_insert(int tree, struct hdb_extent *root, struct hdb_extent *node) {
+    if (!root) return node;
+    int dir = hdb_extent_less(tree, root, node);
+    root->child[tree][dir] = hdb_treap_insert(tree, root->child[tree][dir], node);
+    struct hdb_extent *top = root->child[tree][dir];
+    if (top->priority > root->priority) {
+        root->child[tree][dir] = top->child[tree][!dir];
+        top->child[tree][!dir] = root;
+        return top;
+    }
+    return root;
+}
+
+struct hdb_extent* hdb_treap_remove(int tree, struct hdb_extent *root, struct hdb_extent *node) {
+    if (!root) return NULL;
+    if (root == node) {
+        struct hdb_extent *left = node->child[tree][0];
+        struct hdb_extent *right = node->child[tree][1];
+        if (!left) return right;
+        if (!right) return left;
+        // Rotate the child with the higher priority up and keep sinking the node
+        int dir = left->priority > right->priority ? 0 : 1;
+        struct hdb_extent *top = node->child[tree][dir];
+        node->child[tree][dir] = top->child[tree][!dir];
+        top->child[tree][!dir] = hdb_treap_remove(tree, node, node);
+        return top;
+    }
+    int dir = hdb_extent_less(tree, root, node);
+    root->child[tree][dir] = hdb_treap_remove(tree, root->child[tree][dir], node);
+    return root;
+}
+
+void hdb_free_space_unlink(struct hdb_free_space *free_space, struct hdb_extent *extent) {
+    free_space->root[HDB_BY_OFFSET] = hdb_treap_remove(HDB_BY_OFFSET, free_space->root[HDB_BY_OFFSET], extent);
+    free_space->root[HDB_BY_LENGTH] = hdb_treap_remove(HDB_BY_LENGTH, free_space->root[HDB_BY_LENGTH], extent);
+    free_space->count--;
+    free_space->bytes -= extent->length;
+}
+
+int hdb_free_space_link(struct hdb_free_space *free_space, uint64_t offset, uint64_t length) {
+    struct hdb_extent *extent = hdb_slab_alloc(&free_space->extents);
+    if (!extent) return -1;
+    memset(extent, 0, sizeof(struct hdb_extent));
+    extent->offset = offset;
+    extent->length = length;
+    // xorshift32, priorities only need to look random
+    free_space->seed ^= free_space->seed << 13;
+    free_space->seed ^= free_space->seed >> 17;
+    free_space->seed ^= free_space->seed << 5;
+    extent->priority = free_space->seed;
+    free_space->root[HDB_BY_OFFSET] = hdb_treap_insert(HDB_BY_OFFSET, free_space->root[HDB_BY_OFFSET], extent);
+    free_space->root[HDB_BY_LENGTH] = hdb_treap_insert(HDB_BY_LENGTH, free_space->root[HDB_BY_LENGTH], extent);
+    free_space->count++;
+    free_space->bytes += length;
+    return 0;
+}
+
+// Gives an extent back, merged with the free extents right before and after it.
+int hdb_free_space_release(struct hdb_free_space *free_space, uint64_t offset, uint64_t length) {
+    struct hdb_extent *before = NULL, *after = NULL;
+    for (struct hdb_extent *node = free_space->root[HDB_BY_OFFSET]; node;) {
+        if (node->offset < offset) {
+            before = node;
+            node = node->child[HDB_BY_OFFSET][1];
+        } else {
+            after = node;
+            node = node->child[HDB_BY_OFFSET][0];
+        }
+    }
+    if (before && before->offset + before->length == offset) {
+        offset = before->offset;
+        length += before->length;
+        hdb_free_space_unlink(free_space, before);
+        hdb_slab_free(&free_space->extents, before);
+    }
+    if (after && offset + length == after->offset) {
+        length += after->length;
+        hdb_free_space_unlink(free_space, after);
+        hdb_slab_free(&free_space->extents, after);
+    }
+    return hdb_free_space_link(free_space, offset, length);
+}
+
+// Takes the smallest extent of at least size bytes out of the free space.
+// Returns its length, 0 when none is large enough.
+uint64_t hdb_free_space_take(struct hdb_free_space *free_space, uint64_t size, uint64_t *offset) {
+    struct hdb_extent *best = NULL;
+    for (struct hdb_extent *node = free_space->root[HDB_BY_LENGTH]; node;) {
+        if (node->length >= size) {
+            best = node;
+            node = node->child[HDB_BY_LENGTH][0];
+        } else {
+            node = node->child[HDB_BY_LENGTH][1];
+        }
+    }
+    if (!best) return 0;
+
+    *offset = best->offset;
+    uint64_t length = best->length;
+    hdb_free_space_unlink(free_space, best);
+    hdb_slab_free(&free_space->extents, best);
+    return length;
+}
+
+void hdb_extent_free_all(struct hdb_slab *extents, struct hdb_extent *node) {
+    if (!node) return;
+    hdb_extent_free_all(extents, node->child[HDB_BY_OFFSET][0]);
+    hdb_extent_free_all(extents, node->child[HDB_BY_OFFSET][1]);
+    hdb_slab_free(extents, node);
+}
+
+void hdb_free_space_clear(struct hdb_free_space *free_space) {
+    hdb_extent_free_all(&free_space->extents, free_space->root[HDB_BY_OFFSET]);
+    free_space->root[HDB_BY_OFFSET] = NULL;
+    free_space->root[HDB_BY_LENGTH] = NULL;
+    free_space->count = 0;
+    free_space->bytes = 0;
+}
+
+int hdb_key_compare(const uint8_t *a, size_t a_length, const uint8_t *b, size_t b_length) {
+    int order = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (order != 0) return order;
+    return a_length < b_length ? -1 : a_length > b_length;
+}
+
+struct hdb_key_node* hdb_key_insert(struct hdb_key_node *root, struct hdb_key_node *node) {
+    if (!root) return node;
+    int dir = hdb_key_compare(root->key, root->key_length, node->key, node->key_length) < 0;
+    root->child[dir] = hdb_key_insert(root->child[dir], node);
+    struct hdb_key_node *top = root->child[dir];
+    if (top->priority > root->priority) {
+        root->child[dir] = top->child[!dir];
+        top->child[!dir] = root;
+        return top;
+    }
+    return root;
+}
+
+// Takes key out of the treap, *removed receives its node or NULL.
+struct hdb_key_node* hdb_key_remove(struct hdb_key_node *root, const uint8_t *key, size_t key_length,
+                                    struct hdb_key_node **removed) {
+    if (!root) return NULL;
+    int order = hdb_key_compare(root->key, root->key_length, key, key_length);
+    if (order == 0) {
+        *removed = root;
+        struct hdb_key_node *left = root->child[0], *right = root->child[1];
+        if (!left) return right;
+        if (!right) return left;
+        // Rotate the child with the higher priority up and keep sinking the node
+        int dir = left->priority > right->priority ? 0 : 1;
+        struct hdb_key_node *top = root->child[dir];
+        root->child[dir] = top->child[!dir];
+        top->child[!dir] = hdb_key_remove(root, key, key_length, removed);
+        return top;
+    }
+    int dir = order < 0;
+    root->child[dir] = hdb_key_remove(root->child[dir], key, key_length, removed);
+    return root;
+}
+
+// The first key after key, or at it when inclusive.
+const struct hdb_key_node* hdb_key_next(const struct hdb_key_node *node, const uint8_t *key, size_t key_length, bool inclusive) {
+    const struct hdb_key_node *next = NULL;
+    while (node) {
+        int order = hdb_key_compare(node->key, node->key_length, key, key_length);
+        if (order > 0 || (order == 0 && inclusive)) {
+            next = node;
+            node = node->child[0];
+        } else {
+            node = node->child[1];
+        }
+    }
+    return next;
+}
+
+void hdb_key_free_all(const struct hdb_allocator *allocator, struct hdb_key_node *node) {
+    if (!node) return;
+    hdb_key_free_all(allocator, node->child[0]);
+    hdb_key_free_all(allocator, node->child[1]);
+    hdb_free(allocator, node);
+}
+
+int hdb_open_sorted_index(struct hdb *db) {
+    db->sorted = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_sorted_index));
+    if (!db->sorted) return -1;
+    pthread_mutex_init(&db->sorted->lock, NULL);
+    db->sorted->seed = 2463534242u;
+    return 0;
+}
+
+void hdb_free_sorted_index(struct hdb *db) {
+    if (!db->sorted) return;
+    hdb_key_free_all(&db->allocator, db->sorted->root);
+    pthread_mutex_destroy(&db->sorted->lock);
+    hdb_free(&db->allocator, db->sorted);
+    db->sorted = NULL;
+}
+
+// Adds key to the sorted index unless it is there already.
+int hdb_sorted_add(struct hdb *db, const uint8_t *key, size_t key_length) {
+    struct hdb_sorted_index *sorted = db->sorted;
+    if (!sorted) return 0;
+    pthread_mutex_lock(&sorted->lock);
+    const struct hdb_key_node *next = hdb_key_next(sorted->root, key, key_length, true);
+    if (next && hdb_key_compare(next->key, next->key_length, key, key_length) == 0) {
+        pthread_mutex_unlock(&sorted->lock);
+        return 0;
+    }
+    struct hdb_key_node *node = hdb_malloc(&db->allocator, sizeof(struct hdb_key_node) + key_length);
+    if (!node) {
+        pthread_mutex_unlock(&sorted->lock);
+        return -1;
+    }
+    node->child[0] = node->child[1] = NULL;
+    // xorshift32, priorities only need to look random
+    sorted->seed ^= sorted->seed << 13;
+    sorted->seed ^= sorted->seed >> 17;
+    sorted->seed ^= sorted->seed << 5;
+    node->priority = sorted->seed;
+    node->key_length = key_length;
+    memcpy(node->key, key, key_length);
+    sorted->root = hdb_key_insert(sorted->root, node);
+    sorted->count++;
+    pthread_mutex_unlock(&sorted->lock);
+    return 0;
+}
+
+void hdb_sorted_remove(struct hdb *db, const uint8_t *key, size_t key_length) {
+    struct hdb_sorted_index *sorted = db->sorted;
+    if (!sorted) return;
+    struct hdb_key_node *removed = NULL;
+    pthread_mutex_lock(&sorted->lock);
+    sorted->root = hdb_key_remove(sorted->root, key, key_length, &removed);
+    if (removed) sorted->count--;
+    pthread_mutex_unlock(&sorted->lock);
+    hdb_free(&db->allocator, removed);
+}
+
+// Whether this build can write and read values with codec.
+bool hdb_codec_supported(uint32_t codec) {
+#ifdef HDB_WITH_ZSTD
+    if (codec == HDB_CODEC_ZSTD) return true;
+#endif
+    return codec == HDB_CODEC_NONE || codec == HDB_CODEC_LZ4;
+}
+
+uint32_t hdb_lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+uint32_t hdb_lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HDB_LZ4_HASH_BITS);
+}
+
+uint8_t* hdb_lz4_write_length(uint8_t *out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+size_t hdb_lz4_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+// Greedy compression into the LZ4 block format.  Returns the compressed
+// length, 0 when it does not fit in capacity.
+size_t hdb_lz4_compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+    uint32_t table[1 << HDB_LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = in, *anchor = in, *end = in + length;
+    uint8_t *op = out, *op_end = out + capacity;
+    if (length > HDB_LZ4_MATCH_LIMIT) {
+        const uint8_t *match_limit = end - HDB_LZ4_MATCH_LIMIT;
+        const uint8_t *match_end = end - HDB_LZ4_LAST_LITERALS;
+        ip++;
+        while (ip < match_limit) {
+            uint32_t sequence = hdb_lz4_read32(ip);
+            uint32_t h = hdb_lz4_hash(sequence);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if (ref >= ip || ip - ref > HDB_LZ4_MAX_OFFSET || hdb_lz4_read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *match = ip + HDB_LZ4_MIN_MATCH, *from = ref + HDB_LZ4_MIN_MATCH;
+            while (match < match_end && *match == *from) {
+                match++;
+                from++;
+            }
+
+            size_t literals = ip - anchor, match_length = match - ip - HDB_LZ4_MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals + literals / 255 + 1 + 2 + match_length / 255 + 1) return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+            if (literals >= 15) op = hdb_lz4_write_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+            uint32_t offset = (uint32_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            *token |= (uint8_t)(match_length >= 15 ? 15 : match_length);
+            if (match_length >= 15) op = hdb_lz4_write_length(op, match_length - 15);
+            ip = anchor = match;
+            if (ip < match_limit) table[hdb_lz4_hash(hdb_lz4_read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+        }
+    }
+
+    size_t literals = end - anchor;
+    if ((size_t)(op_end - op) < 1 + literals + literals / 255 + 1) return 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) op = hdb_lz4_write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    return op + literals - out;
+}
+
+// Decodes an LZ4 block that must expand to exactly length bytes.  Malformed
+// input fails instead of reading or writing out of bounds.
+int hdb_lz4_decompress(const uint8_t *in, size_t in_length, uint8_t *out, size_t length) {
+    const uint8_t *ip = in, *end = in + in_length;
+    uint8_t *op = out, *op_end = out + length;
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip == end) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end) break; // the last sequence has no match
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) return -1;
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            uint8_t b;
+            do {
+                if (ip == end) return -1;
+                b = *ip++;
+                match_length += b;
+            } while (b == 255);
+        }
+        match_length += HDB_LZ4_MIN_MATCH;
+        if (match_length > (size_t)(op_end - op)) return -1;
+        const uint8_t *ref = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, ref, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; ++i) op[i] = ref[i]; // the match overlaps what it repeats
+        }
+        op += match_length;
+    }
+    return op == op_end ? 0 : -1;
+}
+
+uint32_t hdb_slot_codec(const struct hdb_slot *slot) {
+    return (slot->flags >> HDB_SLOT_CODEC_SHIFT) & 0xff;
+}
+
+// Compresses a value with the configured codec when it is long enough and
+// the result is smaller.  Returns the codec, with *stored pointing at a copy
+// to free, or HDB_CODEC_NONE with the value left as it is.  options must have
+// its defaults filled in.
+uint32_t hdb_compress_value(const struct hdb_options *options, const struct hdb_allocator *allocator, const uint8_t *value,
+                            size_t value_length, uint8_t **stored, size_t *stored_length) {
+    uint32_t codec = options->compression;
+    *stored = NULL;
+    *stored_length = value_length;
+    if (codec == HDB_CODEC_NONE || value_length < options->compression_threshold) return HDB_CODEC_NONE;
+    size_t bound = hdb_lz4_bound(value_length);
+#ifdef HDB_WITH_ZSTD
+    if (codec == HDB_CODEC_ZSTD) bound = ZSTD_compressBound(value_length);
+#endif
+    uint8_t *buffer = hdb_malloc(allocator, sizeof(uint64_t) + bound);
+    if (!buffer) return HDB_CODEC_NONE;
+    uint64_t length = value_length;
+    memcpy(buffer, &length, sizeof(uint64_t));
+    size_t compressed = 0;
+    if (codec == HDB_CODEC_LZ4) compressed = hdb_lz4_compress(value, value_length, buffer + sizeof(uint64_t), bound);
+#ifdef HDB_WITH_ZSTD
+    if (codec == HDB_CODEC_ZSTD) {
+        compressed = ZSTD_compress(buffer + sizeof(uint64_t), bound, value, value_length, options->compression_level);
+        if (ZSTD_isError(compressed)) compressed = 0;
+    }
+#endif
+    if (!compressed || sizeof(uint64_t) + compressed >= value_length) {
+        hdb_free(allocator, buffer);
+        return HDB_CODEC_NONE;
+    }
+    *stored = buffer;
+    *stored_length = sizeof(uint64_t) + compressed;
+    return codec;
+}
+
+uint32_t hdb_compress(struct hdb *db, const uint8_t *value, size_t value_length, uint8_t **stored, size_t *stored_length) {
+    return hdb_compress_value(&db->options, &db->allocator, value, value_length, stored, stored_length);
+}
+
+// The expiry a value stored with codec ends in, 0 when it has none.
+uint64_t hdb_expiry(uint32_t codec, const uint8_t *stored, uint64_t stored_length) {
+    uint64_t expires = 0;
+    if ((codec & HDB_CODEC_EXPIRES) && stored_length >= sizeof(uint64_t)) {
+        memcpy(&expires, stored + stored_length - sizeof(uint64_t), sizeof(uint64_t));
+    }
+    return expires;
+}
+
+bool hdb_expired(uint32_t codec, const uint8_t *stored, uint64_t stored_length) {
+    uint64_t expires = hdb_expiry(codec, stored, stored_length);
+    return expires && expires <= hdb_wall_clock();
+}
+
+// Length of the original of a value stored with codec.
+uint64_t hdb_decoded_length(uint32_t codec, const uint8_t *stored, uint64_t stored_length) {
+    if ((codec & HDB_CODEC_EXPIRES) && stored_length >= sizeof(uint64_t)) {
+        codec &= ~HDB_CODEC_EXPIRES;
+        stored_length -= sizeof(uint64_t);
+    }
+    if (codec == HDB_CODEC_NONE || stored_length < sizeof(uint64_t)) return stored_length;
+    uint64_t length;
+    memcpy(&length, stored, sizeof(uint64_t));
+    return length;
+}
+
+// Writes the original of a value stored with codec into value, which must
+// have room for it.  The stored bytes must not change meanwhile.
+int hdb_decode(uint32_t codec, const uint8_t *stored, uint64_t stored_length, uint8_t *value, size_t *value_length) {
+    if (codec == HDB_CODEC_NONE) {
+        memcpy(value, stored, stored_length);
+        *value_length = stored_length;
+        return 0;
+    }
+    if (stored_length < sizeof(uint64_t)) return -1;
+    uint64_t length = hdb_decoded_length(codec, stored, stored_length);
+    const uint8_t *compressed = stored + sizeof(uint64_t);
+    size_t compressed_length = stored_length - sizeof(uint64_t);
+    int rc = -1;
+    if (codec == HDB_CODEC_LZ4) rc = hdb_lz4_decompress(compressed, compressed_length, value, length);
+#ifdef HDB_WITH_ZSTD
+    if (codec == HDB_CODEC_ZSTD) rc = ZSTD_decompress(value, length, compressed, compressed_length) == length ? 0 : -1;
+#endif
+    if (rc == 0) *value_length = length;
+    return rc;
+}
+
+FILE* hdb_blob_file(struct hdb *db) {
+    return __atomic_load_n(&db->blob_file, __ATOMIC_ACQUIRE);
+}
+
+// Decodes a value as its record stores it, failing once it expired.  A value
+// that went to the blob file is read from blob, the blob file the reader
+// found along with the record, first.
+int hdb_decode_value(struct hdb *db, FILE *blob, uint32_t codec, const uint8_t *stored, uint64_t stored_length,
+                     uint8_t *value, size_t *value_length) {
+    if (codec & HDB_CODEC_EXPIRES) {
+        if (stored_length < sizeof(uint64_t) || hdb_expired(codec, stored, stored_length)) return -1;
+        codec &= ~HDB_CODEC_EXPIRES;
+        stored_length -= sizeof(uint64_t);
+    }
+    if (!(codec & HDB_CODEC_BLOB)) return hdb_decode(codec, stored, stored_length, value, value_length);
+    struct hdb_blob_ref ref;
+    if (!blob || stored_length != sizeof(struct hdb_blob_ref)) return -1;
+    memcpy(&ref, stored, sizeof(struct hdb_blob_ref));
+    codec &= ~HDB_CODEC_BLOB;
+    if (codec == HDB_CODEC_NONE) {
+        if (hdb_read_at(blob, ref.position, value, ref.stored_length) != 0) return -1;
+        *value_length = ref.stored_length;
+        return 0;
+    }
+    uint8_t *scratch = hdb_malloc(&db->allocator, ref.stored_length ? ref.stored_length : 1);
+    if (!scratch) return -1;
+    int rc = hdb_read_at(blob, ref.position, scratch, ref.stored_length);
+    if (rc == 0) rc = hdb_decode(codec, scratch, ref.stored_length, value, value_length);
+    hdb_free(&db->allocator, scratch);
+    return rc;
+}
+
+// Appends a record with the stored value of key to the blob file and fills
+// in the ref to it.  Runs with the lock held, blob compaction swaps the file
+// with it held exclusively.
+int hdb_blob_write(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *stored, size_t stored_length,
+                   uint32_t codec, struct hdb_blob_ref *ref) {
+    uint64_t size = hdb_record_size(key_length, stored_length);
+    pthread_mutex_lock(&db->alloc_lock);
+    uint64_t position = db->blob_end;
+    db->blob_end += size;
+    pthread_mutex_unlock(&db->alloc_lock);
+    hdb_count(db, HDB_STAT_BLOB_WRITES, 1);
+
+    struct hdb_record_header record = {key_length, codec << HDB_RECORD_CODEC_SHIFT, stored_length};
+    struct iovec io[3] = {{&record, sizeof(struct hdb_record_header)}, {(void*)key, key_length}, {(void*)stored, stored_length}};
+    if (pwritev(fileno(db->blob_file), io, 3, position) != (ssize_t)size) return -1;
+    ref->length = hdb_decoded_length(codec, stored, stored_length);
+    ref->position = position + sizeof(struct hdb_record_header) + key_length;
+    ref->stored_length = stored_length;
+    return 0;
+}
+
+// Moves a stored value of options.blob_threshold bytes or more to the blob
+// file.  The record then stores ref in its place, with HDB_CODEC_BLOB added
+// to the codec.  Runs with the lock held.
+int hdb_blob_store(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t **stored, size_t *stored_length,
+                   uint32_t *codec, struct hdb_blob_ref *ref) {
+    if (!db->options.blob_threshold || *stored_length < db->options.blob_threshold) return 0;
+    if (hdb_blob_write(db, key, key_length, *stored, *stored_length, *codec, ref) != 0) return -1;
+    *stored = (const uint8_t*)ref;
+    *stored_length = sizeof(struct hdb_blob_ref);
+    *codec |= HDB_CODEC_BLOB;
+    return 0;
+}
+
+// Flags the blob record of a dying data record dead.  Runs with the lock
+// held, so ref is into the current blob file.
+int hdb_blob_retire(struct hdb *db, const struct hdb_blob_ref *ref, uint32_t key_length) {
+    if (!db->blob_file) return -1;
+    uint64_t flags_offset = ref->position - key_length - sizeof(struct hdb_record_header) + offsetof(struct hdb_record_header, flags);
+    uint32_t flags;
+    if (hdb_read_at(db->blob_file, flags_offset, &flags, sizeof(uint32_t)) != 0) return -1;
+    flags |= HDB_RECORD_DEAD;
+    if (hdb_write_at(db->blob_file, flags_offset, &flags, sizeof(uint32_t)) != 0) return -1;
+    pthread_mutex_lock(&db->alloc_lock);
+    db->header.blob_dead_bytes += hdb_record_size(key_length, ref->stored_length);
+    pthread_mutex_unlock(&db->alloc_lock);
+    return 0;
+}
+
+// Claims size bytes at the end of the data file.  Called with alloc_lock held.
+int hdb_append_space(struct hdb *db, uint64_t size, uint64_t *position) {
+    *position = db->data_end;
+    if (db->data_map && hdb_map_extend(db->data_map, db->data_file, *position + size) != 0) return -1;
+    __atomic_store_n(&db->data_end, *position + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Writes a record to the data file and reports where it went.  A free extent
+// is reused when one fits, otherwise the record is appended.  Tombstones are
+// always appended so they stay after the record they cancel in the log.  The
+// room is claimed under alloc_lock, the record itself is written outside it.
+// A value that expires is followed by its expiry, and filed in the wheel.
+int hdb_write_record(struct hdb *db, uint32_t flags, const uint8_t *key, size_t key_length,
+                     const uint8_t *value, size_t value_length, uint64_t expires, uint64_t *position) {
+    if (expires) value_length += sizeof(uint64_t);
+    uint64_t size = hdb_record_size(key_length, value_length);
+    pthread_mutex_lock(&db->alloc_lock);
+    bool reuse = !db->compacting && !db->pins && !(flags & HDB_RECORD_TOMBSTONE);
+    if (reuse) hdb_load_free_space(db);
+    uint64_t extent = reuse ? hdb_free_space_take(&db->free_space, size, position) : 0;
+    if (extent) {
+        uint64_t rest = extent - size;
+        if (rest >= sizeof(struct hdb_record_header)) {
+            // A dead filler covers the rest of the extent, which stays free
+            struct hdb_record_header filler = {0, HDB_RECORD_DEAD, rest - sizeof(struct hdb_record_header)};
+            if (hdb_data_write(db, *position + size, &filler, sizeof(struct hdb_record_header)) != 0) {
+                pthread_mutex_unlock(&db->alloc_lock);
+                return -1;
+            }
+            hdb_free_space_link(&db->free_space, *position + size, rest);
+            db->header.dead_bytes -= size;
+        } else {
+            // Too short for a record header, the record absorbs it as padding
+            flags |= (uint32_t)rest << HDB_RECORD_PADDING_SHIFT;
+            db->header.dead_bytes -= extent;
+        }
+    } else if (hdb_append_space(db, size, position) != 0) {
+        pthread_mutex_unlock(&db->alloc_lock);
+        return -1;
+    }
+    if (expires && db->wheel && hdb_wheel_add(db->wheel, expires, *position) != 0) {
+        pthread_mutex_unlock(&db->alloc_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    hdb_count(db, extent ? HDB_STAT_EXTENT_REUSES : HDB_STAT_APPENDS, 1);
+    hdb_count(db, HDB_STAT_BYTES_WRITTEN, size);
+
+    struct hdb_record_header record = {key_length, flags, value_length};
+    struct iovec io[4] = {{&record, sizeof(struct hdb_record_header)}, {(void*)key, key_length},
+                          {(void*)value, value_length - (expires ? sizeof(uint64_t) : 0)}, {&expires, sizeof(uint64_t)}};
+    int rc = pwritev(fileno(db->data_file), io, expires ? 4 : 3, *position) == (ssize_t)size ? 0 : -1;
+    hdb_pool_invalidate(db->data_pool, *position, size);
+    return rc;
+}
+
+void hdb_add_dead_bytes(struct hdb *db, uint64_t bytes) {
+    pthread_mutex_lock(&db->alloc_lock);
+    db->header.dead_bytes += bytes;
+    pthread_mutex_unlock(&db->alloc_lock);
+}
+
+// Flags the record at position as dead and hands its extent to the free space.
+// Called after the slot stopped pointing at it.
+int hdb_retire_record(struct hdb *db, uint64_t position, uint64_t size) {
+    uint64_t flags_offset = position + offsetof(struct hdb_record_header, flags);
+    struct hdb_record_header record;
+    if (hdb_data_read(db, position, &record, sizeof(struct hdb_record_header)) != 0) return -1;
+    uint32_t flags = record.flags | HDB_RECORD_DEAD;
+    if (hdb_data_write(db, flags_offset, &flags, sizeof(uint32_t)) != 0) return -1;
+    if ((flags >> HDB_RECORD_CODEC_SHIFT) & HDB_CODEC_BLOB) {
+        struct hdb_blob_ref ref;
+        if (hdb_data_read(db, position + sizeof(struct hdb_record_header) + record.key_length, &ref, sizeof(struct hdb_blob_ref)) != 0 ||
+            hdb_blob_retire(db, &ref, record.key_length) != 0) return -1;
+    }
+
+    size += hdb_record_padding(flags);
+    pthread_mutex_lock(&db->alloc_lock);
+    db->header.dead_bytes += size;
+    hdb_retire_extent(db, position, size);
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_cond_signal(&db->compaction_cond);
+    return 0;
+}
+
+uint64_t hdb_wal_checksum(const uint8_t *record, size_t length) {
+    return hash_function(record + sizeof(uint64_t), length - sizeof(uint64_t));
+}
+
+void hdb_stream_clear(struct hdb *db) {
+    struct hdb_stream *stream = db->wal.stream;
+    if (!stream) return;
+    while (stream->head) {
+        struct hdb_stream_segment *next = stream->head->next;
+        hdb_free(&db->allocator, stream->head);
+        stream->head = next;
+    }
+    stream->tail = NULL;
+    stream->bytes = 0;
+}
+
+void hdb_free_stream(struct hdb *db) {
+    hdb_stream_clear(db);
+    hdb_free(&db->allocator, db->wal.stream);
+    db->wal.stream = NULL;
+}
+
+// Whether changes are numbered at all: with a change stream, and always on
+// a follower, which has to know where to resume.
+bool hdb_numbered(const struct hdb *db) {
+    return db->wal.stream || (db->options.flags & HDB_OPEN_FOLLOWER);
+}
+
+// Numbers a change and keeps it in the backlog, after wal_end, the position
+// of the log it was logged up to, or 0.  The oldest segments go once the
+// backlog outgrows options.replication_backlog.  Called with the lock of the
+// log held.  Without memory for the change the whole backlog goes, which
+// followers see as having fallen behind.
+void hdb_stream_publish(struct hdb *db, uint32_t type, const uint8_t *key, size_t key_length,
+                        const uint8_t *value, size_t value_length, uint64_t expires, uint64_t wal_end) {
+    struct hdb_stream *stream = db->wal.stream;
+    uint64_t sequence = __atomic_fetch_add(&db->header.sequence, 1, __ATOMIC_RELAXED);
+    if (!stream) return;
+    size_t size = sizeof(struct hdb_change) + key_length + value_length + (expires ? sizeof(uint64_t) : 0);
+    struct hdb_stream_segment *segment = stream->tail;
+    if (!segment || segment->length + sizeof(uint64_t) + size > segment->capacity) {
+        size_t capacity = sizeof(uint64_t) + size > HDB_STREAM_SEGMENT ? sizeof(uint64_t) + size : HDB_STREAM_SEGMENT;
+        if (!(segment = hdb_malloc(&db->allocator, sizeof(struct hdb_stream_segment) + capacity))) {
+            hdb_stream_clear(db);
+            return;
+        }
+        segment->next = NULL;
+        segment->first = sequence;
+        segment->length = 0;
+        segment->capacity = capacity;
+        if (stream->tail) {
+            stream->tail->next = segment;
+        } else {
+            stream->head = segment;
+        }
+        stream->tail = segment;
+        stream->bytes += capacity;
+    }
+
+    uint8_t *record = segment->data + segment->length + sizeof(uint64_t);
+    struct hdb_change change = {0, sequence, type, (uint32_t)key_length, size - sizeof(struct hdb_change) - key_length};
+    memcpy(record - sizeof(uint64_t), &wal_end, sizeof(uint64_t));
+    memcpy(record, &change, sizeof(struct hdb_change));
+    memcpy(record + sizeof(struct hdb_change), key, key_length);
+    if (value_length) memcpy(record + sizeof(struct hdb_change) + key_length, value, value_length);
+    if (expires) memcpy(record + sizeof(struct hdb_change) + key_length + value_length, &expires, sizeof(uint64_t));
+    change.checksum = hdb_wal_checksum(record, size);
+    memcpy(record, &change.checksum, sizeof(uint64_t));
+    segment->length += sizeof(uint64_t) + size;
+
+    while (stream->head != stream->tail && stream->bytes > db->options.replication_backlog) {
+        struct hdb_stream_segment *oldest = stream->head;
+        stream->head = oldest->next;
+        stream->bytes -= oldest->capacity;
+        hdb_free(&db->allocator, oldest);
+    }
+    // A change that was not logged can be read right away, the others once a flush made them durable
+    if (stream->waiters && !wal_end) pthread_cond_broadcast(&db->wal.flushed);
+}
+
+// Adds a record to the buffer of the log.  Called with its lock held.
+// Bytes the log record of a change takes.
+size_t hdb_wal_record_size(size_t key_length, size_t value_length, uint64_t expires) {
+    return sizeof(struct hdb_wal_record) + key_length + value_length + (expires ? sizeof(uint64_t) : 0);
+}
+
+// Grows one of the buffers of the log to at least needed bytes.  Called with
+// the lock of the log held.
+int hdb_wal_grow(struct hdb *db, uint8_t **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) return 0;
+    size_t grown = *capacity ? *capacity * 2 : HDB_WAL_BUFFER;
+    if (grown < needed) grown = needed;
+    uint8_t *grown_buffer = hdb_realloc(&db->allocator, *buffer, grown);
+    if (!grown_buffer) return -1;
+    *buffer = grown_buffer;
+    *capacity = grown;
+    return 0;
+}
+
+// Makes room for size bytes of records, so appending them cannot fail for
+// memory.  A write takes it before it changes anything, a failure then leaves
+// the store untouched, and hands it back with hdb_wal_release when it ends up
+// logging nothing.  The spare gets room too unless a flush is writing it out,
+// see hdb_wal_flush.
+int hdb_wal_reserve(struct hdb *db, size_t size) {
+    struct hdb_wal *wal = &db->wal;
+    if (!wal->file) return 0;
+    pthread_mutex_lock(&wal->lock);
+    int rc = hdb_wal_grow(db, &wal->buffer, &wal->capacity, wal->length + wal->reserved + size);
+    if (rc == 0 && !wal->flushing) rc = hdb_wal_grow(db, &wal->spare, &wal->spare_capacity, wal->reserved + size);
+    if (rc == 0) wal->reserved += size;
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+void hdb_wal_release(struct hdb *db, size_t size) {
+    struct hdb_wal *wal = &db->wal;
+    if (!wal->file) return;
+    pthread_mutex_lock(&wal->lock);
+    wal->reserved -= size;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// Appends a record to the buffer, into room reserved for it when reserved is
+// set, which cannot fail.  Called with the lock of the log held.
+int hdb_wal_buffer(struct hdb *db, uint32_t type, const uint8_t *key, size_t key_length,
+                   const uint8_t *value, size_t value_length, uint64_t expires, bool reserved) {
+    struct hdb_wal *wal = &db->wal;
+    size_t size = hdb_wal_record_size(key_length, value_length, expires);
+    if (reserved) {
+        wal->reserved -= size;
+    } else if (hdb_wal_grow(db, &wal->buffer, &wal->capacity, wal->length + wal->reserved + size) != 0) {
+        return -1;
+    }
+    uint8_t *record = wal->buffer + wal->length;
+    struct hdb_wal_record header = {0, type, (uint32_t)key_length, size - sizeof(struct hdb_wal_record) - key_length};
+    memcpy(record, &header, sizeof(struct hdb_wal_record));
+    if (key_length) memcpy(record + sizeof(struct hdb_wal_record), key, key_length);
+    if (value_length) memcpy(record + sizeof(struct hdb_wal_record) + key_length, value, value_length);
+    if (expires) memcpy(record + sizeof(struct hdb_wal_record) + key_length + value_length, &expires, sizeof(uint64_t));
+    header.checksum = hdb_wal_checksum(record, size);
+    memcpy(record, &header.checksum, sizeof(uint64_t));
+    wal->length += size;
+    wal->end += size;
+    return 0;
+}
+
+// Starts an empty log with the number of the next change, so a replay
+// numbers its records from there whatever the header says.  Called with the
+// lock of the log held.
+int hdb_wal_mark(struct hdb *db) {
+    if (!db->wal.file || !hdb_numbered(db)) return 0;
+    return hdb_wal_buffer(db, HDB_WAL_SEQUENCE, NULL, 0, (const uint8_t*)&db->header.sequence, sizeof(uint64_t), 0, false);
+}
+
+// Appends a record to the log and reports the position it ends at, 0 when
+// there is no log.  Called with the key's stripe locked, so the records of a
+// key are in the order its writes were applied.  A value that expires is
+// logged as HDB_WAL_PUT_EXPIRES, followed by its expiry.  With a change
+// stream the change is numbered along, in the same order.  The room for the
+// record must have been reserved with hdb_wal_reserve, so this cannot fail.
+int hdb_wal_append(struct hdb *db, uint32_t type, const uint8_t *key, size_t key_length,
+                   const uint8_t *value, size_t value_length, uint64_t expires, uint64_t *position) {
+    struct hdb_wal *wal = &db->wal;
+    *position = 0;
+    bool publish = wal->stream && !wal->replaying && !(db->options.flags & HDB_OPEN_FOLLOWER);
+    if (!wal->file && !publish) return 0;
+    if (expires) type = HDB_WAL_PUT_EXPIRES;
+    pthread_mutex_lock(&wal->lock);
+    int rc = wal->file ? hdb_wal_buffer(db, type, key, key_length, value, value_length, expires, true) : 0;
+    if (rc == 0 && wal->file) *position = wal->end;
+    if (rc == 0 && publish) hdb_stream_publish(db, type, key, key_length, value, value_length, expires, *position);
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+// Waits until the log is written out, and synced when sync is set, up to
+// position.  A caller finding no flush running does it for everyone, taking
+// whatever was appended meanwhile along.  This is the group commit.
+int hdb_wal_flush(struct hdb_wal *wal, uint64_t position, bool sync) {
+    if (!wal->file) return 0;
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->failed && (sync ? wal->durable : wal->written) < position) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed, &wal->lock);
+            continue;
+        }
+        wal->flushing = true;
+        uint8_t *buffer = wal->buffer;
+        size_t capacity = wal->capacity;
+        size_t length = wal->length;
+        uint64_t start = wal->written;
+        // The spare takes over along with the room writers reserved.  One too
+        // small for it, as it could not grow while it was being written out,
+        // stays put and the buffer is written out with appends kept waiting
+        bool swap = wal->spare_capacity >= wal->reserved;
+        if (swap) {
+            wal->buffer = wal->spare;
+            wal->capacity = wal->spare_capacity;
+            wal->length = 0;
+            wal->spare = buffer;
+            wal->spare_capacity = capacity;
+            pthread_mutex_unlock(&wal->lock);
+        }
+
+        int rc = length ? hdb_write_at(wal->file, start - wal->base, buffer, length) : 0;
+        if (rc == 0 && sync) rc = fdatasync(fileno(wal->file));
+
+        if (swap) pthread_mutex_lock(&wal->lock);
+        else wal->length = 0;
+        wal->flushing = false;
+        if (rc != 0) {
+            wal->failed = true;
+        } else {
+            wal->written = start + length;
+            if (sync) {
+                wal->durable = wal->written;
+                wal->syncs++;
+            }
+        }
+        pthread_cond_broadcast(&wal->flushed);
+    }
+    int rc = wal->failed ? -1 : 0;
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+// Bytes in the log since the last checkpoint, and the position it ends at.
+uint64_t hdb_wal_size(struct hdb_wal *wal, uint64_t *end) {
+    pthread_mutex_lock(&wal->lock);
+    uint64_t size = wal->end - wal->base;
+    *end = wal->end;
+    pthread_mutex_unlock(&wal->lock);
+    return size;
+}
+
+// Makes a write that ended at position in the log as durable as configured.
+// Called once the write let go of its locks, so others can join the sync.
+int hdb_wal_commit(struct hdb *db, uint64_t position) {
+    struct hdb_wal *wal = &db->wal;
+    if (!position) return 0;
+    if (db->options.durability == HDB_DURABILITY_COMMIT) {
+        uint64_t start = hdb_stats_clock();
+        int rc = hdb_wal_flush(wal, position, true);
+        hdb_time(db, HDB_LATENCY_SYNC, start);
+        return rc;
+    }
+    pthread_mutex_lock(&wal->lock);
+    bool full = wal->length >= HDB_WAL_BUFFER;
+    pthread_mutex_unlock(&wal->lock);
+    return full ? hdb_wal_flush(wal, position, false) : 0;
+}
+
+// Syncs the hash, data and blob files and empties the log, whose records
+// they now hold.  Called with the lock held exclusively, so no write is half
+// applied.
+int hdb_checkpoint_locked(struct hdb *db) {
+    if (hdb_write_header(db) != 0 || fsync(fileno(db->hash_file)) != 0 || fsync(fileno(db->data_file)) != 0 ||
+        (db->blob_file && fsync(fileno(db->blob_file)) != 0)) return -1;
+    // The pages the writes left in the page cache are clean now, the pool holds what is read
+    if (db->data_pool) posix_fadvise(fileno(db->data_file), 0, 0, POSIX_FADV_DONTNEED);
+    struct hdb_wal *wal = &db->wal;
+    if (!wal->file) return 0;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushing) pthread_cond_wait(&wal->flushed, &wal->lock);
+    int rc = ftruncate(fileno(wal->file), 0);
+    if (rc == 0) {
+        // Writers still waiting on their records are durable now as well
+        wal->length = 0;
+        wal->base = wal->written = wal->durable = wal->end;
+        rc = hdb_wal_mark(db);
+    }
+    pthread_cond_broadcast(&wal->flushed);
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+int hdb_checkpoint(struct hdb *db) {
+    pthread_rwlock_wrlock(&db->lock);
+    int rc = hdb_checkpoint_locked(db);
+    pthread_rwlock_unlock(&db->lock);
+    return rc;
+}
+
+// Writes bucket changes between two steps of the stripe's sequence counter,
+// so readers of the bucket notice them.
+int hdb_publish_slot(struct hdb *db, uint32_t page, const struct hdb_bucket *bucket, uint32_t index) {
+    struct hdb_stripe *stripe = hdb_stripe_for(db, page);
+    hdb_seq_write(&stripe->seq);
+    int rc = hdb_write_slot(db, page, bucket, index);
+    hdb_seq_write(&stripe->seq);
+    return rc;
+}
+
+int hdb_publish_bucket(struct hdb *db, uint32_t page, const struct hdb_bucket *bucket) {
+    struct hdb_stripe *stripe = hdb_stripe_for(db, page);
+    hdb_seq_write(&stripe->seq);
+    int rc = hdb_write_bucket(db, page, bucket);
+    hdb_seq_write(&stripe->seq);
+    return rc;
+}
+
+// Writes the record of a stored value and points slot at it.  A value that
+// expires keeps its expiry in the data file, also when it went to the blob file.
+int hdb_store_record(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length,
+                     uint32_t codec, uint64_t expires, struct hdb_slot *slot) {
+    struct hdb_blob_ref ref;
+    if (hdb_blob_store(db, key, key_length, &value, &value_length, &codec, &ref) != 0) return -1;
+    if (expires) codec |= HDB_CODEC_EXPIRES;
+    if (hdb_write_record(db, codec << HDB_RECORD_CODEC_SHIFT, key, key_length, value, value_length, expires, &slot->position) != 0) return -1;
+    slot->length = value_length + (expires ? sizeof(uint64_t) : 0);
+    slot->flags = HDB_SLOT_USED | codec << HDB_SLOT_CODEC_SHIFT;
+    return 0;
+}
+
+// Stores key in its bucket, with the record of value or, when written is
+// set, the record it describes, which the caller already wrote.  Runs with
+// the structure lock shared and the bucket's stripe locked, or with the
+// structure lock exclusive, and only then splits a full bucket.  Returns 1
+// when the bucket has to be split first, before anything was written.
+int hdb_put_locked(struct hdb *db, uint64_t hash, uint32_t fingerprint, const uint8_t *key, size_t key_length,
+                   const uint8_t *value, size_t value_length, uint32_t codec, uint64_t expires, bool exclusive,
+                   const struct hdb_slot *written) {
+    struct hdb_bucket bucket;
+    uint32_t page = hdb_bucket_page(db, hash);
+    if (hdb_read_bucket(db, page, &bucket) != 0) return -1;
+
+    int index = hdb_bucket_find(db, &bucket, hash, fingerprint, key, key_length);
+    if (index >= 0) {
+        // Key exists, point its slot at a new record and retire the old one
+        struct hdb_slot *slot = &bucket.slots[index];
+        uint64_t old_position = slot->position;
+        uint64_t old_size = hdb_record_size(key_length, slot->length);
+        if (written) {
+            slot->position = written->position;
+            slot->length = written->length;
+            slot->flags = written->flags;
+        } else if (hdb_store_record(db, key, key_length, value, value_length, codec, expires, slot) != 0) {
+            return -1;
+        }
+        if (hdb_publish_slot(db, page, &bucket, index) != 0) return -1;
+        return hdb_retire_record(db, old_position, old_size);
+    }
+
+    // Split until the key fits within the probe limit of its home slot
+    if (db->filter) hdb_filter_add(db->filter, hash, fingerprint);
+    struct hdb_slot slot = {hash, 0, value_length, fingerprint, codec << HDB_SLOT_CODEC_SHIFT};
+    while ((index = hdb_bucket_insert(&bucket, &slot)) < 0) {
+        if (!exclusive) return 1;
+        if (hdb_split_bucket(db, hash, page, &bucket) != 0) return -1;
+        page = hdb_bucket_page(db, hash);
+        if (hdb_read_bucket(db, page, &bucket) != 0) return -1;
+    }
+
+    // Only once the key has a slot, and taken out again when its record cannot be written
+    if (hdb_sorted_add(db, key, key_length) != 0) return -1;
+    if (written) {
+        bucket.slots[index].position = written->position;
+        bucket.slots[index].length = written->length;
+        bucket.slots[index].flags = written->flags;
+    } else if (hdb_store_record(db, key, key_length, value, value_length, codec, expires, &bucket.slots[index]) != 0) {
+        hdb_sorted_remove(db, key, key_length);
+        return -1;
+    }
+    if (hdb_publish_slot(db, page, &bucket, index) != 0) return -1;
+    __atomic_fetch_add(&db->header.key_count, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int hdb_put(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length, uint64_t expires) {
+    uint64_t hash = db->hash(key, key_length);
+    uint32_t fingerprint = fingerprint_function(key, key_length);
+    uint8_t *compressed;
+    size_t stored_length;
+    if (hdb_touch_filter(db) != 0) return -1;
+    uint32_t codec = hdb_compress(db, value, value_length, &compressed, &stored_length);
+    const uint8_t *stored = compressed ? compressed : value;
+
+    // The log keeps the value as given, replaying it compresses it again
+    size_t logged = hdb_wal_record_size(key_length, value_length, expires);
+    pthread_rwlock_rdlock(&db->lock);
+    struct hdb_stripe *stripe = hdb_stripe_for(db, hdb_bucket_page(db, hash));
+    pthread_mutex_lock(&stripe->lock);
+    uint64_t position = 0;
+    int rc = hdb_wal_reserve(db, logged);
+    bool reserved = rc == 0;
+    if (rc == 0) rc = hdb_put_locked(db, hash, fingerprint, key, key_length, stored, stored_length, codec, expires, false, NULL);
+    if (rc == 0) rc = hdb_wal_append(db, HDB_WAL_PUT, key, key_length, value, value_length, expires, &position);
+    pthread_mutex_unlock(&stripe->lock);
+    pthread_rwlock_unlock(&db->lock);
+
+    if (rc == 1) {
+        // The bucket is full, split it with everyone else kept out
+        pthread_rwlock_wrlock(&db->lock);
+        hdb_seq_write(&db->structure_seq);
+        rc = hdb_put_locked(db, hash, fingerprint, key, key_length, stored, stored_length, codec, expires, true, NULL);
+        if (rc == 0) rc = hdb_wal_append(db, HDB_WAL_PUT, key, key_length, value, value_length, expires, &position);
+        hdb_seq_write(&db->structure_seq);
+        pthread_rwlock_unlock(&db->lock);
+    }
+    if (rc != 0 && reserved) hdb_wal_release(db, logged); // nothing was changed, so nothing logged
+    hdb_free(&db->allocator, compressed);
+    return rc == 0 ? hdb_wal_commit(db, position) : rc;
+}
+
+int hdb_open_value_cache(struct hdb *db) {
+    db->value_cache = hdb_aligned_alloc(&db->allocator, HDB_CACHE_SHARDS * sizeof(struct hdb_cache_shard));
+    if (!db->value_cache) return -1;
+    memset(db->value_cache, 0, HDB_CACHE_SHARDS * sizeof(struct hdb_cache_shard));
+    for (int i = 0; i < HDB_CACHE_SHARDS; ++i) {
+        struct hdb_cache_shard *shard = &db->value_cache[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        hdb_slab_init(&shard->entries, &db->allocator, sizeof(struct hdb_cache_entry));
+        shard->budget = db->options.value_cache / HDB_CACHE_SHARDS;
+        shard->table_size = 64;
+        if (!(shard->table = hdb_calloc(&db->allocator, shard->table_size, sizeof(struct hdb_cache_entry*)))) return -1;
+    }
+    return 0;
+}
+
+void hdb_free_value_cache(struct hdb *db) {
+    if (!db->value_cache) return;
+    for (int i = 0; i < HDB_CACHE_SHARDS; ++i) {
+        struct hdb_cache_shard *shard = &db->value_cache[i];
+        for (int queue = 0; queue < 3; ++queue) {
+            struct hdb_cache_entry *entry = shard->queues[queue].head;
+            while (entry) {
+                struct hdb_cache_entry *next = entry->next;
+                hdb_free(&db->allocator, entry->data);
+                entry = next;
+            }
+        }
+        hdb_free(&db->allocator, shard->table);
+        hdb_slab_destroy(&shard->entries);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    hdb_aligned_free(&db->allocator, db->value_cache);
+    db->value_cache = NULL;
+}
+
+struct hdb_cache_shard* hdb_cache_shard_for(struct hdb *db, uint64_t hash) {
+    return &db->value_cache[(hash >> 32) % HDB_CACHE_SHARDS];
+}
+
+uint64_t hdb_cache_entry_size(size_t key_length, size_t value_length) {
+    return sizeof(struct hdb_cache_entry) + key_length + value_length;
+}
+
+void hdb_cache_push(struct hdb_cache_shard *shard, struct hdb_cache_entry *entry, uint32_t queue) {
+    struct hdb_cache_queue *target = &shard->queues[queue];
+    entry->queue = queue;
+    entry->prev = target->tail;
+    entry->next = NULL;
+    if (target->tail) target->tail->next = entry;
+    else target->head = entry;
+    target->tail = entry;
+    target->count++;
+    if (entry->data) target->bytes += hdb_cache_entry_size(entry->key_length, entry->value_length);
+}
+
+void hdb_cache_unlink(struct hdb_cache_shard *shard, struct hdb_cache_entry *entry) {
+    struct hdb_cache_queue *source = &shard->queues[entry->queue];
+    if (entry->prev) entry->prev->next = entry->next;
+    else source->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else source->tail = entry->prev;
+    source->count--;
+    if (entry->data) source->bytes -= hdb_cache_entry_size(entry->key_length, entry->value_length);
+}
+
+// Unlinks the entry from its queue and its table bucket and frees it.
+void hdb_cache_remove(struct hdb_cache_shard *shard, struct hdb_cache_entry *entry) {
+    hdb_cache_unlink(shard, entry);
+    struct hdb_cache_entry **link = &shard->table[entry->hash & (shard->table_size - 1)];
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    hdb_free(shard->entries.allocator, entry->data);
+    hdb_slab_free(&shard->entries, entry);
+}
+
+// The entry holding the key, or with key NULL the ghost of its hash.
+struct hdb_cache_entry* hdb_cache_find(struct hdb_cache_shard *shard, uint64_t hash, const uint8_t *key, size_t key_length) {
+    for (struct hdb_cache_entry *entry = shard->table[hash & (shard->table_size - 1)]; entry; entry = entry->chain) {
+        if (entry->hash != hash) continue;
+        if (!key ? !entry->data : entry->data && entry->key_length == key_length &&
+                                  memcmp(entry->data, key, key_length) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Doubles the table once it holds more entries than buckets.  Failing to
+// grow only makes the chains longer.
+void hdb_cache_grow(struct hdb_cache_shard *shard) {
+    uint64_t entries = shard->queues[HDB_CACHE_SMALL].count + shard->queues[HDB_CACHE_MAIN].count +
+                       shard->queues[HDB_CACHE_GHOST].count;
+    if (entries <= shard->table_size) return;
+    uint64_t size = shard->table_size * 2;
+    struct hdb_cache_entry **table = hdb_calloc(shard->entries.allocator, size, sizeof(struct hdb_cache_entry*));
+    if (!table) return;
+    for (uint64_t i = 0; i < shard->table_size; ++i) {
+        struct hdb_cache_entry *entry = shard->table[i];
+        while (entry) {
+            struct hdb_cache_entry *next = entry->chain;
+            entry->chain = table[entry->hash & (size - 1)];
+            table[entry->hash & (size - 1)] = entry;
+            entry = next;
+        }
+    }
+    hdb_free(shard->entries.allocator, shard->table);
+    shard->table = table;
+    shard->table_size = size;
+}
+
+// Evicts until room is left for size more bytes.
+void hdb_cache_evict(struct hdb_cache_shard *shard, uint64_t size) {
+    struct hdb_cache_queue *small_queue = &shard->queues[HDB_CACHE_SMALL];
+    struct hdb_cache_queue *main_queue = &shard->queues[HDB_CACHE_MAIN];
+    struct hdb_cache_queue *ghosts = &shard->queues[HDB_CACHE_GHOST];
+    while (small_queue->bytes + main_queue->bytes + size > shard->budget && (small_queue->head || main_queue->head)) {
+        if (small_queue->head && (small_queue->bytes * 100 > shard->budget * HDB_CACHE_SMALL_SHARE || !main_queue->head)) {
+            struct hdb_cache_entry *entry = small_queue->head;
+            hdb_cache_unlink(shard, entry);
+            if (entry->frequency > 0) {
+                entry->frequency = 0;
+                hdb_cache_push(shard, entry, HDB_CACHE_MAIN);
+                continue;
+            }
+            hdb_free(shard->entries.allocator, entry->data);
+            entry->data = NULL;
+            hdb_cache_push(shard, entry, HDB_CACHE_GHOST);
+            while (ghosts->count > main_queue->count + small_queue->count + 1) hdb_cache_remove(shard, ghosts->head);
+        } else {
+            struct hdb_cache_entry *entry = main_queue->head;
+            if (entry->frequency > 0) {
+                entry->frequency--;
+                hdb_cache_unlink(shard, entry);
+                hdb_cache_push(shard, entry, HDB_CACHE_MAIN);
+                continue;
+            }
+            hdb_cache_remove(shard, entry);
+        }
+    }
+}
+
+// Copies the cached value of the key into value.  Returns 0 on a hit, -1 on
+// a miss, which also hands out the sequence number hdb_cache_insert expects.
+int hdb_cache_get(struct hdb *db, uint64_t hash, const uint8_t *key, size_t key_length,
+                  uint8_t *value, size_t *value_length, uint64_t *seq) {
+    struct hdb_cache_shard *shard = hdb_cache_shard_for(db, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct hdb_cache_entry *entry = hdb_cache_find(shard, hash, key, key_length);
+    if (!entry) {
+        shard->misses++;
+        *seq = shard->seq;
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    shard->hits++;
+    if (entry->frequency < HDB_CACHE_MAX_FREQUENCY) entry->frequency++;
+    memcpy(value, entry->data + key_length, entry->value_length);
+    *value_length = entry->value_length;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// Caches a value read from the files, unless the key was written since seq
+// was handed out.  A value too large for the small queue is not cached.
+void hdb_cache_insert(struct hdb *db, uint64_t hash, const uint8_t *key, size_t key_length,
+                      const uint8_t *value, size_t value_length, uint64_t seq) {
+    struct hdb_cache_shard *shard = hdb_cache_shard_for(db, hash);
+    uint64_t size = hdb_cache_entry_size(key_length, value_length);
+    if (size * 100 > shard->budget * HDB_CACHE_SMALL_SHARE) return;
+    uint8_t *data = hdb_malloc(&db->allocator, key_length + value_length);
+    if (!data) return;
+    memcpy(data, key, key_length);
+    memcpy(data + key_length, value, value_length);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->seq != seq || hdb_cache_find(shard, hash, key, key_length)) {
+        pthread_mutex_unlock(&shard->lock);
+        hdb_free(&db->allocator, data);
+        return;
+    }
+    uint32_t queue = HDB_CACHE_SMALL;
+    struct hdb_cache_entry *entry = hdb_cache_find(shard, hash, NULL, 0);
+    if (entry) {
+        // Evicted too early last time
+        hdb_cache_unlink(shard, entry);
+        queue = HDB_CACHE_MAIN;
+    } else if ((entry = hdb_slab_alloc(&shard->entries))) {
+        entry->hash = hash;
+        entry->chain = shard->table[hash & (shard->table_size - 1)];
+        shard->table[hash & (shard->table_size - 1)] = entry;
+    } else {
+        pthread_mutex_unlock(&shard->lock);
+        hdb_free(&db->allocator, data);
+        return;
+    }
+    entry->data = data;
+    entry->key_length = key_length;
+    entry->value_length = value_length;
+    entry->frequency = 0;
+    hdb_cache_evict(shard, size);
+    hdb_cache_push(shard, entry, queue);
+    hdb_cache_grow(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Drops the cached value of a key that was just written.  Called once the
+// write is visible in the files, so a get that read the old value before
+// then sees the sequence number moved and does not cache it.
+void hdb_cache_invalidate(struct hdb *db, const uint8_t *key, size_t key_length) {
+    if (!db->value_cache) return;
+    uint64_t hash = db->hash(key, key_length);
+    struct hdb_cache_shard *shard = hdb_cache_shard_for(db, hash);
+    pthread_mutex_lock(&shard->lock);
+    shard->seq++;
+    struct hdb_cache_entry *entry = hdb_cache_find(shard, hash, key, key_length);
+    if (entry) hdb_cache_remove(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Sums the counters of the value cache over its shards, all zero without one.
+void db_cache_stats(struct hdb *db, struct hdb_cache_stats *stats) {
+    memset(stats, 0, sizeof(struct hdb_cache_stats));
+    if (!db->value_cache) return;
+    for (int i = 0; i < HDB_CACHE_SHARDS; ++i) {
+        struct hdb_cache_shard *shard = &db->value_cache[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->entries += shard->queues[HDB_CACHE_SMALL].count + shard->queues[HDB_CACHE_MAIN].count;
+        stats->bytes += shard->queues[HDB_CACHE_SMALL].bytes + shard->queues[HDB_CACHE_MAIN].bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Puts a value that expires at expires, or never when it is 0, and keeps
+// the caches and counters up to date.
+int hdb_put_key(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length, uint64_t expires) {
+    uint64_t start = hdb_stats_clock();
+    int rc = hdb_put(db, key, key_length, value, value_length, expires);
+    hdb_cache_invalidate(db, key, key_length);
+    if (rc == 0) rc = hdb_check_filter(db);
+    hdb_count(db, HDB_STAT_PUTS, 1);
+    hdb_time(db, HDB_LATENCY_PUT, start);
+    return rc;
+}
+
+// Puts a value that expires ttl milliseconds from now, or never when ttl is
+// 0.  Once it expired gets miss it and compaction drops the key.
+int db_put_ttl(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length, uint64_t ttl) {
+    if (db->options.flags & HDB_OPEN_FOLLOWER) return -1;
+    return hdb_put_key(db, key, key_length, value, value_length, ttl ? hdb_wall_clock() + ttl : 0);
+}
+
+int db_put(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length) {
+    return db_put_ttl(db, key, key_length, value, value_length, 0);
+}
+
+// Read-modify-writes run entirely under the stripe lock of the key, so no
+// other write to it gets in between.  The key keeps its expiry.  A new value
+// as long as the old one, both stored as they are, is written over the old
+// bytes where its record lies instead of in a new record, unless something
+// may still be looking at them.
+
+// Computes the new value of a read-modify-write from the current one, NULL
+// when the key is absent or expired.  Returns 0 with *value set, pointing at
+// memory that stays valid until the write is done, 1 to leave the key as it
+// is and -1 on failure.  Called again when a split makes the write start over.
+typedef int (*hdb_update_fn)(void *context, const uint8_t *current, size_t current_length,
+                             const uint8_t **value, size_t *value_length);
+
+// Copies out the value of the slot at index, with its expiry.  Runs with the
+// bucket's stripe locked.  *value is a copy to free, NULL once it expired.
+int hdb_read_current(struct hdb *db, const struct hdb_bucket *bucket, int index, size_t key_length,
+                     uint8_t **value, size_t *value_length, uint64_t *expires) {
+    const struct hdb_slot *slot = &bucket->slots[index];
+    uint32_t codec = hdb_slot_codec(slot);
+    uint64_t stored_length = slot->length;
+    *value = NULL;
+    *value_length = 0;
+    uint8_t *stored = hdb_malloc(&db->allocator, stored_length ? stored_length : 1);
+    if (!stored) return -1;
+    int rc = hdb_data_read(db, slot->position + sizeof(struct hdb_record_header) + key_length, stored, stored_length);
+    *expires = 0;
+    if (rc == 0 && !hdb_expired(codec, stored, stored_length)) {
+        *expires = hdb_expiry(codec, stored, stored_length);
+        uint64_t length = hdb_decoded_length(codec, stored, stored_length);
+        *value = hdb_malloc(&db->allocator, length ? length : 1);
+        rc = *value ? hdb_decode_value(db, db->blob_file, codec, stored, stored_length, *value, value_length) : -1;
+        if (rc != 0) {
+            hdb_free(&db->allocator, *value);
+            *value = NULL;
+        }
+    }
+    hdb_free(&db->allocator, stored);
+    return rc;
+}
+
+// Writes value over the stored bytes of the slot at index.  Only for a value
+// stored as it is, of the same length, and only while nothing can see the old
+// bytes: no compaction copying the file, no scan, snapshot, streamed value or,
+// with HDB_OPEN_MMAP, ref pinning them.  Those take alloc_lock to start, which
+// is held for the write.  Returns 1 when it cannot, before anything was written.
+int hdb_update_in_place(struct hdb *db, uint32_t page, struct hdb_bucket *bucket, int index, size_t key_length,
+                        const uint8_t *value, size_t value_length) {
+    struct hdb_slot *slot = &bucket->slots[index];
+    uint32_t codec = hdb_slot_codec(slot);
+    uint64_t stored_length = slot->length - (codec & HDB_CODEC_EXPIRES ? sizeof(uint64_t) : 0);
+    if ((codec & ~HDB_CODEC_EXPIRES) != HDB_CODEC_NONE || stored_length != value_length) return 1;
+
+    pthread_mutex_lock(&db->alloc_lock);
+    if (db->compacting || db->pins || (db->data_map && db->refs)) {
+        pthread_mutex_unlock(&db->alloc_lock);
+        return 1;
+    }
+    // Readers of the record see the stripe counter move and retry
+    struct hdb_stripe *stripe = hdb_stripe_for(db, page);
+    hdb_seq_write(&stripe->seq);
+    int rc = hdb_data_write(db, slot->position + sizeof(struct hdb_record_header) + key_length, value, value_length);
+    hdb_seq_write(&stripe->seq);
+    pthread_mutex_unlock(&db->alloc_lock);
+    if (rc == 0) hdb_count(db, HDB_STAT_IN_PLACE_UPDATES, 1);
+    return rc;
+}
+
+// Runs with the structure lock shared and the bucket's stripe locked, or
+// with the structure lock exclusive.  Returns 1 when the bucket has to be
+// split first, before anything was written.  *written tells whether update
+// asked for a write, position is that of its log record.
+int hdb_modify_locked(struct hdb *db, uint64_t hash, uint32_t fingerprint, const uint8_t *key, size_t key_length,
+                      hdb_update_fn update, void *context, bool exclusive, bool *written, uint64_t *position) {
+    struct hdb_bucket bucket;
+    uint32_t page = hdb_bucket_page(db, hash);
+    if (hdb_read_bucket(db, page, &bucket) != 0) return -1;
+    int index = hdb_bucket_find(db, &bucket, hash, fingerprint, key, key_length);
+    uint8_t *current = NULL;
+    size_t current_length = 0;
+    uint64_t expires = 0;
+    if (index >= 0 && hdb_read_current(db, &bucket, index, key_length, &current, &current_length, &expires) != 0) return -1;
+
+    const uint8_t *value;
+    size_t value_length;
+    int rc = update(context, current, current_length, &value, &value_length);
+    *written = rc == 0;
+    if (rc != 0) {
+        hdb_free(&db->allocator, current);
+        return rc == 1 ? 0 : -1;
+    }
+    size_t logged = hdb_wal_record_size(key_length, value_length, expires);
+    if (hdb_wal_reserve(db, logged) != 0) {
+        hdb_free(&db->allocator, current);
+        return -1;
+    }
+    rc = current ? hdb_update_in_place(db, page, &bucket, index, key_length, value, value_length) : 1;
+    if (rc == 1) {
+        uint8_t *compressed;
+        size_t stored_length;
+        uint32_t codec = hdb_compress(db, value, value_length, &compressed, &stored_length);
+        rc = hdb_put_locked(db, hash, fingerprint, key, key_length, compressed ? compressed : value, stored_length, codec,
+                            expires, exclusive, NULL);
+        hdb_free(&db->allocator, compressed);
+    }
+    if (rc == 0) rc = hdb_wal_append(db, HDB_WAL_PUT, key, key_length, value, value_length, expires, position);
+    else hdb_wal_release(db, logged);
+    hdb_free(&db->allocator, current);
+    return rc;
+}
+
+// Returns 0 when update wrote a new value, 1 when it left the key as it was.
+int hdb_modify(struct hdb *db, const uint8_t *key, size_t key_length, hdb_update_fn update, void *context) {
+    if (db->options.flags & HDB_OPEN_FOLLOWER) return -1;
+    uint64_t start = hdb_stats_clock();
+    uint64_t hash = db->hash(key, key_length);
+    uint32_t fingerprint = fingerprint_function(key, key_length);
+    if (hdb_touch_filter(db) != 0) return -1;
+
+    pthread_rwlock_rdlock(&db->lock);
+    struct hdb_stripe *stripe = hdb_stripe_for(db, hdb_bucket_page(db, hash));
+    pthread_mutex_lock(&stripe->lock);
+    bool written = false;
+    uint64_t position = 0;
+    int rc = hdb_modify_locked(db, hash, fingerprint, key, key_length, update, context, false, &written, &position);
+    pthread_mutex_unlock(&stripe->lock);
+    pthread_rwlock_unlock(&db->lock);
+
+    if (rc == 1) {
+        // The bucket is full, split it with everyone else kept out
+        pthread_rwlock_wrlock(&db->lock);
+        hdb_seq_write(&db->structure_seq);
+        rc = hdb_modify_locked(db, hash, fingerprint, key, key_length, update, context, true, &written, &position);
+        hdb_seq_write(&db->structure_seq);
+        pthread_rwlock_unlock(&db->lock);
+    }
+    if (rc == 0 && written) {
+        hdb_cache_invalidate(db, key, key_length);
+        rc = hdb_wal_commit(db, position);
+        if (rc == 0) rc = hdb_check_filter(db);
+        hdb_count(db, HDB_STAT_PUTS, 1);
+        hdb_time(db, HDB_LATENCY_PUT, start);
+    }
+    return rc != 0 ? rc : written ? 0 : 1;
+}
+
+struct hdb_cas {
+    const uint8_t *expected;
+    size_t expected_length;
+    const uint8_t *value;
+    size_t value_length;
+};
+
+int hdb_cas_update(void *context, const uint8_t *current, size_t current_length, const uint8_t **value, size_t *value_length) {
+    struct hdb_cas *cas = context;
+    if (!current != !cas->expected) return 1;
+    if (current && (current_length != cas->expected_length || memcmp(current, cas->expected, current_length) != 0)) return 1;
+    *value = cas->value;
+    *value_length = cas->value_length;
+    return 0;
+}
+
+// Puts value only when key holds expected, or is absent when expected is
+// NULL.  Returns 0 when it did, 1 when the key held something else and -1
+// on failure.
+int db_cas(struct hdb *db, const uint8_t *key, size_t key_length, const uint8_t *expected, size_t expected_length,
+           const uint8_t *value, size_t value_length) {
+    struct hdb_cas cas = {expected, expected_length, value, value_length};
+    return hdb_modify(db, key, key_length, hdb_cas_update, &cas);
+}
+
+struct hdb_incr {
+    int64_t delta;
+    int64_t result;
+};
+
+int hdb_incr_update(void *context, const uint8_t *current, size_t current_length, const uint8_t **value, size_t *value_length) {
+    struct hdb_incr *incr = context;
+    int64_t counter = 0;
+    if (current) {
+        if (current_length != sizeof(int64_t)) return -1;
+        memcpy(&counter, current, sizeof(int64_t));
+    }
+    incr->result = (int64_t)((uint64_t)counter + (uint64_t)incr->delta); // wraps around
+    *value = (const uint8_t*)&incr->result;
+    *value_length = sizeof(int64_t);
+    return 0;
+}
+
+// Adds delta to the counter stored under key, 8 bytes in host order, and
+// reports the sum in result unless it is NULL.  An absent key counts from 0.
+// Fails when the value is not 8 bytes long.
+int db_incr(struct hdb *db, const uint8_t *key, size_t key_length, int64_t delta, int64_t *result) {
+    struct hdb_incr incr = {delta, 0};
+    int rc = hdb_modify(db, key, key_length, hdb_incr_update, &incr);
+    if (rc == 0 && result) *result = incr.result;
+    return rc;
+}
+
+// What a lock-free read has to check before it trusts what it read.  The data
+// file is the one the slots were read against, a compaction swapping in the
+// next one meanwhile leaves it readable until the read section ends.
+struct hdb_read {
+    uint32_t structure_seq;
+    struct hdb_stripe *stripe;
+    uint32_t stripe_seq;
+    FILE *file;
+    struct hdb_map *map;
+    struct hdb_pool *pool;
+    FILE *blob;
+};
+
+bool hdb_read_valid(struct hdb *db, const struct hdb_read *read) {
+    return !hdb_seq_retry(&db->structure_seq, read->structure_seq) &&
+           !hdb_seq_retry(&read->stripe->seq, read->stripe_seq);
+}
+
+// Copies the probe run of fingerprint, the slots from its home slot up to the
+// first unused one, out of the bucket at page.  Returns how many there are.
+int hdb_read_probe_run(struct hdb *db, uint32_t page, uint32_t fingerprint, struct hdb_slot *run) {
+    const struct hdb_slot *slots;
+    struct hdb_bucket bucket;
+    uint64_t offset = hdb_page_offset(page);
+    const struct hdb_bucket *cached = hdb_cached_bucket(db, page);
+    if (cached) {
+        slots = cached->slots;
+    } else if (db->hash_map.base) {
+        if (offset + HDB_PAGE_SIZE > __atomic_load_n(&db->hash_map.capacity, __ATOMIC_ACQUIRE)) return -1;
+        slots = ((const struct hdb_bucket*)(db->hash_map.base + offset))->slots;
+    } else {
+        if (hdb_read_bucket(db, page, &bucket) != 0) return -1;
+        slots = bucket.slots;
+    }
+
+    int count = 0;
+    uint32_t index = hdb_home_slot(fingerprint);
+    while (count < HDB_MAX_PROBE) {
+        run[count] = slots[index];
+        if (!(run[count].flags & HDB_SLOT_USED)) break;
+        count++;
+        index = (index + 1) % HDB_BUCKET_SLOTS;
+    }
+    return count;
+}
+
+// Starts a lock-free read of the bucket the key hashes to and copies out the
+// slots of its probe run whose hash and fingerprint match.  Returns how many
+// there are, or -1 when a writer got in the way.
+int hdb_probe(struct hdb *db, const uint8_t *key, size_t key_length, struct hdb_read *read, struct hdb_slot *candidates) {
+    uint64_t hash = db->hash(key, key_length);
+    uint32_t fingerprint = fingerprint_function(key, key_length);
+    hdb_count(db, HDB_STAT_PROBES, 1);
+    read->structure_seq = hdb_seq_read(&db->structure_seq);
+    if (read->structure_seq & 1) {
+        hdb_count(db, HDB_STAT_PROBE_RETRIES, 1);
+        return -1;
+    }
+    read->file = hdb_data_file(db);
+    read->map = hdb_data_map(db);
+    read->pool = hdb_data_pool(db);
+    read->blob = hdb_blob_file(db);
+    uint32_t page = hdb_bucket_page(db, hash);
+    read->stripe = hdb_stripe_for(db, page);
+    read->stripe_seq = hdb_seq_read(&read->stripe->seq);
+    struct hdb_filter *filter = __atomic_load_n(&db->filter, __ATOMIC_ACQUIRE);
+    if (filter && !hdb_filter_may_contain(filter, hash, fingerprint)) return 0;
+
+    struct hdb_slot run[HDB_MAX_PROBE];
+    int count = hdb_read_probe_run(db, page, fingerprint, run);
+    if (!hdb_read_valid(db, read)) {
+        hdb_count(db, HDB_STAT_PROBE_RETRIES, 1);
+        return -1;
+    }
+    int found = 0;
+    for (int i = 0; i < count; ++i) {
+        if (run[i].hash == hash && run[i].fingerprint == fingerprint) candidates[found++] = run[i];
+    }
+    return found;
+}
+
+// Finds which of the candidates a probe found holds key and where its value
+// lies in the data file.  Returns 0 when found, -1 when not and 1 when a
+// writer got in the way.
+int hdb_lookup_candidates(struct hdb *db, const uint8_t *key, size_t key_length, struct hdb_read *read,
+                          const struct hdb_slot *candidates, int count, uint64_t *offset, uint64_t *length, uint32_t *codec) {
+    for (int i = 0; i < count; ++i) {
+        if (!hdb_record_has_key(read->pool, read->file, read->map, candidates[i].position, key, key_length)) continue;
+        *length = candidates[i].length;
+        *offset = candidates[i].position + sizeof(struct hdb_record_header) + key_length;
+        *codec = hdb_slot_codec(&candidates[i]);
+        return 0;
+    }
+    return hdb_read_valid(db, read) ? -1 : 1;
+}
+
+// Finds where the value of key lies in the data file without taking a lock.
+// Runs in a read section.  The slots are validated before the data file is
+// looked at, so only positions that were really published are followed.
+// Returns 0 when found, -1 when not and 1 when a writer got in the way.
+int hdb_lookup(struct hdb *db, const uint8_t *key, size_t key_length, struct hdb_read *read,
+               uint64_t *offset, uint64_t *length, uint32_t *codec) {
+    struct hdb_slot candidates[HDB_MAX_PROBE];
+    int count = hdb_probe(db, key, key_length, read, candidates);
+    if (count < 0) return 1;
+    return hdb_lookup_candidates(db, key, key_length, read, candidates, count, offset, length, codec);
+}
+// Copies a compressed value out of the mapping before it is decoded, so the
+// decoder only ever sees bytes the read was validated against.
+int hdb_get_compressed(struct hdb *db, const struct hdb_read *read, uint32_t codec, uint64_t offset, uint64_t length,
+                       uint8_t *value, size_t *value_length) {
+    uint8_t stack[HDB_GET_SCRATCH];
+    uint8_t *scratch = length > HDB_GET_SCRATCH ? hdb_malloc(&db->allocator, length) : stack;
+    if (!scratch) return -1;
+    int rc = hdb_file_read(read->pool, read->file, read->map, offset, scratch, length);
+    if (!hdb_read_valid(db, read)) {
+        rc = 1;
+    } else if (rc == 0) {
+        rc = hdb_decode_value(db, read->blob, codec, scratch, length, value, value_length);
+    }
+    if (scratch != stack) hdb_free(&db->allocator, scratch);
+    return rc;
+}
+
+// Also reports the codec the value was stored with.
+int hdb_get(struct hdb *db, const uint8_t *key, size_t key_length, uint8_t *value, size_t *value_length, uint32_t *codec) {
+    struct hdb_read read;
+    struct hdb_slot candidates[HDB_MAX_PROBE];
+    *codec = HDB_CODEC_NONE;
+    int count = hdb_probe(db, key, key_length, &read, candidates);
+    if (count < 0) return 1;
+    if (read.map) {
+        uint64_t offset, length;
+        int rc = hdb_lookup_candidates(db, key, key_length, &read, candidates, count, &offset, &length, codec);
+        if (rc != 0) return rc;
+        if (*codec != HDB_CODEC_NONE) return hdb_get_compressed(db, &read, *codec, offset, length, value, value_length);
+        rc = hdb_map_read(read.file, read.map, offset, value, length);
+        if (!hdb_read_valid(db, &read)) return 1; // the record may have been reused while it was copied
+        if (rc != 0) return -1;
+        *value_length = length;
+        return 0;
+    }
+
+    // Without a mapping every candidate record is read whole with one pread,
+    // so with the bucket in the index cache a hit costs a single disk read.
+    uint8_t stack[HDB_GET_SCRATCH];
+    uint8_t *scratch = stack;
+    int rc = -1;
+    for (int i = 0; i < count && rc == -1; ++i) {
+        uint64_t size = hdb_record_size(key_length, candidates[i].length);
+        if (size > HDB_GET_SCRATCH) {
+            if (scratch != stack) hdb_free(&db->allocator, scratch);
+            if (!(scratch = hdb_malloc(&db->allocator, size))) return -1;
+        }
+        struct hdb_record_header record;
+        if (hdb_file_read(read.pool, read.file, NULL, candidates[i].position, scratch, size) != 0) continue;
+        memcpy(&record, scratch, sizeof(struct hdb_record_header));
+        if (record.key_length != key_length ||
+            memcmp(scratch + sizeof(struct hdb_record_header), key, key_length) != 0) continue;
+        if (!hdb_read_valid(db, &read)) break; // the record may have been reused while it was read
+        *codec = hdb_slot_codec(&candidates[i]);
+        rc = hdb_decode_value(db, read.blob, *codec, scratch + sizeof(struct hdb_record_header) + key_length,
+                              candidates[i].length, value, value_length);
+        if (rc != 0) break;
+    }
+    if (scratch != stack) hdb_free(&db->allocator, scratch);
+    if (rc != 0 && !hdb_read_valid(db, &read)) return 1;
+    return rc;
+}
+
+// Looks key up through the value cache, and retries reads a writer got in the way of.
+int hdb_get_value(struct hdb *db, const uint8_t *key, size_t key_length, uint8_t *value, size_t *value_length) {
+    uint64_t hash = 0, seq = 0;
+    if (db->value_cache) {
+        hash = db->hash(key, key_length);
+        if (hdb_cache_get(db, hash, key, key_length, value, value_length, &seq) == 0) return 0;
+    }
+    for (;;) {
+        uint32_t codec;
+        uint32_t token = hdb_read_enter(db);
+        int rc = hdb_get(db, key, key_length, value, value_length, &codec);
+        hdb_read_exit(db, token);
+        // A value that expires would outlive its expiry in the cache
+        if (rc == 0 && db->value_cache && !(codec & HDB_CODEC_EXPIRES)) hdb_cache_insert(db, hash, key, key_length, value, *value_length, seq);
+        if (rc != 1) return rc;
+        sched_yield();
+    }
+}
+
+int db_get(struct hdb *db, const uint8_t *key, size_t key_length, uint8_t *value, size_t *value_length) {
+    uint64_t start = hdb_stats_clock();
+    hdb_touch_filter(db); // without one the lookup just reads the bucket
+    int rc = hdb_get_value(db, key, key_length, value, value_length);
+    hdb_count(db, HDB_STAT_GETS, 1);
+    if (rc == 0) {
+        hdb_count(db, HDB_STAT_BYTES_READ, *value_length);
+    } else {
+        hdb_count(db, HDB_STAT_GET_MISSES, 1);
+    }
+    hdb_time(db, HDB_LATENCY_GET, start);
+    return rc;
+}
+
+int hdb_get_ref(struct hdb *db, const uint8_t *key, size_t key_length, struct hdb_ref *ref) {
+    struct hdb_read read;
+    uint64_t offset, length;
+    uint32_t codec;
+    int rc = hdb_lookup(db, key, key_length, &read, &offset, &length, &codec);
+    if (rc != 0) return rc;
+
+    ref->db = db;
+    ref->length = length;
+    struct hdb_map *map = read.map;
+    if (codec != HDB_CODEC_NONE) {
+        // A compressed value is always decoded into a copy
+        uint8_t *stored = hdb_malloc(&db->allocator, length);
+        if (!stored) return -1;
+        rc = hdb_file_read(read.pool, read.file, map, offset, stored, length);
+        if (rc == 0 && hdb_read_valid(db, &read)) {
+            uint64_t decoded = hdb_decoded_length(codec, stored, length);
+            ref->copy = hdb_malloc(&db->allocator, decoded ? decoded : 1);
+            rc = ref->copy ? hdb_decode_value(db, read.blob, codec, stored, length, ref->copy, &ref->length) : -1;
+            if (rc != 0) hdb_free(&db->allocator, ref->copy);
+        } else if (rc == 0) {
+            rc = 1;
+        }
+        hdb_free(&db->allocator, stored);
+        if (rc != 0) return rc == 1 || !hdb_read_valid(db, &read) ? 1 : -1;
+        ref->data = ref->copy;
+        return 0;
+    }
+    if (!map) {
+        // Nothing to point into, the caller gets a copy it does not have to size
+        ref->copy = hdb_malloc(&db->allocator, length ? length : 1);
+        if (!ref->copy) return -1;
+        rc = hdb_file_read(read.pool, read.file, NULL, offset, ref->copy, length);
+        if (rc != 0 || !hdb_read_valid(db, &read)) {
+            hdb_free(&db->allocator, ref->copy);
+            return hdb_read_valid(db, &read) ? -1 : 1;
+        }
+        ref->data = ref->copy;
+        return 0;
+    }
+
+    uint64_t capacity = __atomic_load_n(&map->capacity, __ATOMIC_ACQUIRE);
+    if (offset > capacity || length > capacity - offset) return hdb_read_valid(db, &read) ? -1 : 1;
+    ref->copy = NULL;
+    ref->data = map->base + offset;
+
+    // Retiring the record or the mapping takes alloc_lock after the sequence
+    // counters moved, so either the check below sees the change or the
+    // retirement sees the ref.
+    pthread_mutex_lock(&db->alloc_lock);
+    bool valid = hdb_read_valid(db, &read);
+    if (valid) {
+        ref->epoch = db->epoch;
+        ref->next = NULL;
+        ref->prev = db->refs_tail;
+        if (db->refs_tail) {
+            db->refs_tail->next = ref;
+        } else {
+            db->refs = ref;
+        }
+        db->refs_tail = ref;
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    return valid ? 0 : 1;
+}
+
+// Looks key up without copying its value.  On success ref describes the value
+// until it is handed back with db_release_ref, which must happen before db_close.
+int db_get_ref(struct hdb *db, const uint8_t *key, size_t key_length, struct hdb_ref *ref) {
+    for (;;) {
+        uint32_t token = hdb_read_enter(db);
+        int rc = hdb_get_ref(db, key, key_length, ref);
+        hdb_read_exit(db, token);
+        if (rc != 1) return rc;
+        sched_yield();
+    }
+}
+
+void db_release_ref(struct hdb_ref *ref) {
+    if (ref->copy) {
+        hdb_free(&ref->db->allocator, ref->copy);
+        ref->copy = NULL;
+        return;
+    }
+    struct hdb *db = ref->db;
+    pthread_mutex_lock(&db->alloc_lock);
+    if (ref->prev) {
+        ref->prev->next = ref->next;
+    } else {
+        db->refs = ref->next;
+    }
+    if (ref->next) {
+        ref->next->prev = ref->prev;
+    } else {
+        db->refs_tail = ref->prev;
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    hdb_drain_limbo(db, false);
+}
+
+int hdb_writer_write(struct hdb_value_writer *writer, uint64_t offset, const void *buffer, size_t length) {
+    struct hdb *db = writer->db;
+    if (writer->blob) return hdb_write_at(db->blob_file, writer->position + offset, buffer, length);
+    return hdb_data_write(db, writer->position + offset, buffer, length);
+}
+
+// Gives back the room a writer claimed, its record flagged dead.
+void hdb_writer_release(struct hdb_value_writer *writer) {
+    struct hdb *db = writer->db;
+    uint64_t size = hdb_record_size(writer->key_length, writer->length);
+    pthread_mutex_lock(&db->alloc_lock);
+    if (writer->blob) {
+        db->header.blob_dead_bytes += size;
+    } else {
+        db->header.dead_bytes += size;
+        hdb_retire_extent(db, writer->position, size);
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_cond_signal(&db->compaction_cond);
+}
+
+void hdb_writer_free(struct hdb_value_writer *writer) {
+    struct hdb *db = writer->db;
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins--;
+    pthread_mutex_unlock(&db->alloc_lock);
+    hdb_free(&db->allocator, writer->key);
+    hdb_free(&db->allocator, writer);
+}
+
+// Starts a value of length bytes for key that is handed over in pieces with
+// db_put_append and replaces the old one at db_put_commit, so it never has to
+// be in memory whole.  Its room is claimed at the end of the blob file when
+// it reaches options.blob_threshold and of the data file otherwise, and it is
+// stored uncompressed.  Like a cursor the writer holds off compaction and the
+// reuse of free space, it must be committed or aborted before db_close.  Not
+// with a change stream, which carries every value whole, nor on a follower.
+struct hdb_value_writer* db_put_begin(struct hdb *db, const uint8_t *key, size_t key_length, uint64_t length) {
+    if (hdb_numbered(db)) return NULL;
+    struct hdb_value_writer *writer = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_value_writer));
+    if (!writer) return NULL;
+    writer->db = db;
+    writer->length = length;
+    writer->key_length = key_length;
+    writer->blob = db->blob_file && db->options.blob_threshold && length >= db->options.blob_threshold;
+    if (!(writer->key = hdb_malloc(&db->allocator, key_length ? key_length : 1))) {
+        hdb_free(&db->allocator, writer);
+        return NULL;
+    }
+    memcpy(writer->key, key, key_length);
+
+    // The lock keeps a compaction from swapping the file between the claim
+    // and the pin, which keeps it from doing so until the writer is done
+    uint64_t size = hdb_record_size(key_length, length);
+    pthread_rwlock_rdlock(&db->lock);
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins++;
+    int rc = 0;
+    if (writer->blob) {
+        writer->position = db->blob_end;
+        db->blob_end += size;
+    } else {
+        rc = hdb_append_space(db, size, &writer->position);
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_rwlock_unlock(&db->lock);
+    if (rc != 0) {
+        hdb_writer_free(writer);
+        return NULL;
+    }
+    hdb_count(db, writer->blob ? HDB_STAT_BLOB_WRITES : HDB_STAT_APPENDS, 1);
+    hdb_count(db, HDB_STAT_BYTES_WRITTEN, size);
+
+    // Dead until the commit, so scans and recovery step over it
+    struct hdb_record_header record = {key_length, HDB_RECORD_DEAD, length};
+    if (hdb_writer_write(writer, 0, &record, sizeof(struct hdb_record_header)) != 0 ||
+        hdb_writer_write(writer, sizeof(struct hdb_record_header), key, key_length) != 0) {
+        db_put_abort(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Writes the next length bytes of the value.
+int db_put_append(struct hdb_value_writer *writer, const uint8_t *data, size_t length) {
+    if (length > writer->length - writer->written) return -1;
+    if (hdb_writer_write(writer, sizeof(struct hdb_record_header) + writer->key_length + writer->written, data, length) != 0) return -1;
+    writer->written += length;
+    return 0;
+}
+
+// Points the key at the value once all of it was written, and frees the
+// writer either way.  The log cannot hold the value, so unless the
+// durability is HDB_DURABILITY_NONE the commit is made durable with a
+// checkpoint instead.
+int db_put_commit(struct hdb_value_writer *writer) {
+    struct hdb *db = writer->db;
+    const uint8_t *key = writer->key;
+    size_t key_length = writer->key_length;
+    bool durable = db->options.durability != HDB_DURABILITY_NONE;
+    if (writer->written != writer->length || hdb_touch_filter(db) != 0 ||
+        (durable && fdatasync(fileno(writer->blob ? db->blob_file : db->data_file)) != 0)) {
+        db_put_abort(writer);
+        return -1;
+    }
+
+    uint64_t hash = db->hash(key, key_length);
+    uint32_t fingerprint = fingerprint_function(key, key_length);
+    struct hdb_slot slot = {hash, writer->position, writer->length, fingerprint, HDB_SLOT_USED};
+    struct hdb_record_header record = {key_length, 0, writer->length};
+    pthread_rwlock_wrlock(&db->lock);
+    hdb_seq_write(&db->structure_seq);
+    int rc = hdb_writer_write(writer, 0, &record, sizeof(struct hdb_record_header));
+    if (rc != 0) hdb_writer_release(writer);
+    if (rc == 0 && writer->blob) {
+        // The data record holds a ref, as hdb_blob_store leaves it
+        struct hdb_blob_ref ref = {writer->length, writer->position + sizeof(struct hdb_record_header) + key_length, writer->length};
+        rc = hdb_write_record(db, HDB_CODEC_BLOB << HDB_RECORD_CODEC_SHIFT, key, key_length, (const uint8_t*)&ref,
+                              sizeof(struct hdb_blob_ref), 0, &slot.position);
+        if (rc != 0) hdb_writer_release(writer);
+        slot.length = sizeof(struct hdb_blob_ref);
+        slot.flags |= HDB_CODEC_BLOB << HDB_SLOT_CODEC_SHIFT;
+    }
+    if (rc == 0 && (rc = hdb_put_locked(db, hash, fingerprint, key, key_length, NULL, 0, HDB_CODEC_NONE, 0, true, &slot)) != 0) {
+        hdb_retire_record(db, slot.position, hdb_record_size(key_length, slot.length));
+    }
+    if (rc == 0 && durable) rc = hdb_checkpoint_locked(db);
+    hdb_seq_write(&db->structure_seq);
+    pthread_rwlock_unlock(&db->lock);
+
+    hdb_cache_invalidate(db, key, key_length);
+    if (rc == 0) rc = hdb_check_filter(db);
+    hdb_count(db, HDB_STAT_PUTS, 1);
+    hdb_writer_free(writer);
+    return rc;
+}
+
+// Drops a value that will not be committed, and frees the writer.
+void db_put_abort(struct hdb_value_writer *writer) {
+    if (!writer) return;
+    hdb_writer_release(writer);
+    hdb_writer_free(writer);
+}
+
+// Opens the value of key for db_read_at, or returns NULL when there is none.
+// A value stored uncompressed is read from the file a piece at a time, a
+// compressed one is decoded whole here.  Like a cursor the reader holds off
+// compaction and the reuse of free space, it must be closed before db_close.
+struct hdb_value_reader* db_get_open(struct hdb *db, const uint8_t *key, size_t key_length) {
+    struct hdb_value_reader *reader = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_value_reader));
+    if (!reader) return NULL;
+    reader->db = db;
+    hdb_touch_filter(db);
+
+    // Pinned first, the record found then stays where it is
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins++;
+    pthread_mutex_unlock(&db->alloc_lock);
+    uint64_t offset, length;
+    uint32_t codec;
+    int rc;
+    for (;;) {
+        struct hdb_read read;
+        uint32_t token = hdb_read_enter(db);
+        rc = hdb_lookup(db, key, key_length, &read, &offset, &length, &codec);
+        hdb_read_exit(db, token);
+        if (rc != 1) break;
+        sched_yield();
+    }
+    if (rc == 0 && (codec & HDB_CODEC_EXPIRES)) {
+        // Read as the stored value it follows, once it is known not to have passed
+        uint64_t expires;
+        uint32_t token = hdb_read_enter(db);
+        rc = length >= sizeof(uint64_t) ? hdb_data_read(db, offset + length - sizeof(uint64_t), &expires, sizeof(uint64_t)) : -1;
+        hdb_read_exit(db, token);
+        if (rc == 0 && expires <= hdb_wall_clock()) rc = -1;
+        codec &= ~HDB_CODEC_EXPIRES;
+        length -= sizeof(uint64_t);
+    }
+    reader->offset = offset;
+    reader->length = length;
+    if (rc == 0 && codec != HDB_CODEC_NONE) {
+        uint8_t *stored = hdb_malloc(&db->allocator, length ? length : 1);
+        uint32_t token = hdb_read_enter(db);
+        rc = stored ? hdb_data_read(db, offset, stored, length) : -1;
+        hdb_read_exit(db, token);
+        if (rc == 0 && codec == HDB_CODEC_BLOB) {
+            struct hdb_blob_ref ref;
+            memcpy(&ref, stored, length < sizeof(struct hdb_blob_ref) ? length : sizeof(struct hdb_blob_ref));
+            if (length != sizeof(struct hdb_blob_ref)) rc = -1;
+            reader->blob = true;
+            reader->offset = ref.position;
+            reader->length = ref.stored_length;
+        } else if (rc == 0) {
+            size_t decoded_length;
+            reader->length = hdb_decoded_length(codec, stored, length);
+            if (!(reader->decoded = hdb_malloc(&db->allocator, reader->length ? reader->length : 1)) ||
+                hdb_decode_value(db, hdb_blob_file(db), codec, stored, length, reader->decoded, &decoded_length) != 0) {
+                rc = -1;
+            }
+        }
+        hdb_free(&db->allocator, stored);
+    }
+    hdb_count(db, HDB_STAT_GETS, 1);
+    if (rc != 0) {
+        hdb_count(db, HDB_STAT_GET_MISSES, 1);
+        db_get_close(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// Reads the length bytes of the value at offset into buffer.  Returns -1
+// when they run past its end.
+int db_read_at(struct hdb_value_reader *reader, uint64_t offset, uint8_t *buffer, size_t length) {
+    struct hdb *db = reader->db;
+    if (offset > reader->length || length > reader->length - offset) return -1;
+    int rc = 0;
+    if (reader->decoded) {
+        memcpy(buffer, reader->decoded + offset, length);
+    } else {
+        uint32_t token = hdb_read_enter(db);
+        rc = reader->blob ? hdb_read_at(hdb_blob_file(db), reader->offset + offset, buffer, length)
+                          : hdb_data_read(db, reader->offset + offset, buffer, length);
+        hdb_read_exit(db, token);
+    }
+    if (rc == 0) hdb_count(db, HDB_STAT_BYTES_READ, length);
+    return rc;
+}
+
+void db_get_close(struct hdb_value_reader *reader) {
+    if (!reader) return;
+    struct hdb *db = reader->db;
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins--;
+    pthread_mutex_unlock(&db->alloc_lock);
+    hdb_free(&db->allocator, reader->decoded);
+    hdb_free(&db->allocator, reader);
+}
+
+int hdb_encode_extents(FILE *file, const struct hdb_extent *node) {
+    if (!node) return 0;
+    if (hdb_encode_extents(file, node->child[HDB_BY_OFFSET][0]) != 0) return -1;
+    uint64_t extent[2] = {node->offset, node->length};
+    if (fwrite(extent, sizeof(uint64_t), 2, file) != 2) return -1;
+    return hdb_encode_extents(file, node->child[HDB_BY_OFFSET][1]);
+}
+
+// Persists the free space as a sorted list of extents.
+int encode_free_space(struct hdb *db) {
+    struct hdb_free_space_header header = {HDB_FREE_SPACE_MAGIC, HDB_FREE_SPACE_VERSION, db->free_space.count};
+    fseek(db->deleted_blocks, 0, SEEK_SET);
+    if (fwrite(&header, sizeof(struct hdb_free_space_header), 1, db->deleted_blocks) != 1) return -1;
+    if (hdb_encode_extents(db->deleted_blocks, db->free_space.root[HDB_BY_OFFSET]) != 0) return -1;
+    fflush(db->deleted_blocks);
+    ftruncate(fileno(db->deleted_blocks), ftell(db->deleted_blocks));
+    return fsync(fileno(db->deleted_blocks));
+}
+
+int decode_free_space(struct hdb *db) {
+    fseek(db->deleted_blocks, 0, SEEK_END);
+    long size = ftell(db->deleted_blocks);
+    if (size == 0) return 0;
+
+    struct hdb_free_space_header header;
+    fseek(db->deleted_blocks, 0, SEEK_SET);
+    if (size < (long)sizeof(struct hdb_free_space_header) ||
+        fread(&header, sizeof(struct hdb_free_space_header), 1, db->deleted_blocks) != 1 ||
+        header.magic != HDB_FREE_SPACE_MAGIC) {
+        // The old format only kept int positions of dead records, their lengths are in the record headers
+        uint64_t data_size = hdb_data_size(db);
+        for (long i = 0; i + (long)sizeof(int) <= size; i += sizeof(int)) {
+            int position;
+            struct hdb_record_header record;
+            if (hdb_read_at(db->deleted_blocks, i, &position, sizeof(int)) != 0) return -1;
+            if (position < 0 || (uint64_t)position + sizeof(struct hdb_record_header) > data_size) continue;
+            if (hdb_data_read(db, position, &record, sizeof(struct hdb_record_header)) != 0) continue;
+            if (!(record.flags & HDB_RECORD_DEAD)) continue;
+            uint64_t length = hdb_record_size(record.key_length, record.value_length) + hdb_record_padding(record.flags);
+            if (position + length > data_size) continue;
+            if (hdb_free_space_release(&db->free_space, position, length) != 0) return -1;
+        }
+        return 0;
+    }
+    if (header.version != HDB_FREE_SPACE_VERSION) return -1;
+
+    for (uint64_t i = 0; i < header.count; ++i) {
+        uint64_t extent[2];
+        if (fread(extent, sizeof(uint64_t), 2, db->deleted_blocks) != 2) return -1;
+        if (hdb_free_space_release(&db->free_space, extent[0], extent[1]) != 0) return -1;
+    }
+    return 0;
+}
+
+// Loads the free space a clean close left the first time an extent is
+// wanted.  Extents released meanwhile died after the close and merge with
+// it.  Called with alloc_lock held.
+void hdb_load_free_space(struct hdb *db) {
+    if (!db->free_space_pending) return;
+    db->free_space_pending = false;
+    decode_free_space(db); // extents it could not read come back through compaction
+}
+
+// Loads the free space saved by the last close and empties the file, so a
+// crash before the next close leaves no stale extents behind.  Space freed
+// meanwhile is still counted as dead and comes back through compaction.
+int hdb_claim_free_space(struct hdb *db) {
+    if (decode_free_space(db) != 0) return -1;
+    fflush(db->deleted_blocks);
+    if (ftruncate(fileno(db->deleted_blocks), 0) != 0) return -1;
+    return fsync(fileno(db->deleted_blocks));
+}
+
+// Runs with the structure lock shared and the bucket's stripe locked.
+int hdb_delete_locked(struct hdb *db, uint64_t hash, uint32_t fingerprint, const uint8_t *key, size_t key_length) {
+    uint32_t page = hdb_bucket_page(db, hash);
+    struct hdb_bucket bucket;
+    if (hdb_read_bucket(db, page, &bucket) != 0) return -1;
+
+    int index = hdb_bucket_find(db, &bucket, hash, fingerprint, key, key_length);
+    if (index < 0) return -1; // Key not found.
+
+    uint64_t position = bucket.slots[index].position;
+    uint64_t size = hdb_record_size(key_length, bucket.slots[index].length);
+
+    hdb_bucket_remove(&bucket, index);
+    if (hdb_publish_bucket(db, page, &bucket) != 0) return -1;
+    __atomic_fetch_sub(&db->header.key_count, 1, __ATOMIC_RELAXED);
+    hdb_sorted_remove(db, key, key_length);
+
+    // The tombstone records the delete in the log, it is dead space from the start
+    uint64_t tombstone;
+    if (hdb_write_record(db, HDB_RECORD_TOMBSTONE, key, key_length, NULL, 0, 0, &tombstone) != 0) return -1;
+    hdb_add_dead_bytes(db, hdb_record_size(key_length, 0));
+
+    return hdb_retire_record(db, position, size);
+}
+
+int hdb_delete(struct hdb *db, const uint8_t *key, size_t key_length) {
+    uint64_t hash = db->hash(key, key_length);
+    uint32_t fingerprint = fingerprint_function(key, key_length);
+    if (hdb_touch_filter(db) != 0) return -1; // the key count a stored filter matches is about to change
+
+    pthread_rwlock_rdlock(&db->lock);
+    struct hdb_stripe *stripe = hdb_stripe_for(db, hdb_bucket_page(db, hash));
+    pthread_mutex_lock(&stripe->lock);
+    uint64_t position = 0;
+    size_t logged = hdb_wal_record_size(key_length, 0, 0);
+    if (hdb_wal_reserve(db, logged) != 0) {
+        pthread_mutex_unlock(&stripe->lock);
+        pthread_rwlock_unlock(&db->lock);
+        return -1;
+    }
+    int rc = hdb_delete_locked(db, hash, fingerprint, key, key_length);
+    if (rc == 0) rc = hdb_wal_append(db, HDB_WAL_DELETE, key, key_length, NULL, 0, 0, &position);
+    else hdb_wal_release(db, logged);
+    pthread_mutex_unlock(&stripe->lock);
+    pthread_rwlock_unlock(&db->lock);
+    return rc == 0 ? hdb_wal_commit(db, position) : rc;
+}
+
+int hdb_delete_key(struct hdb *db, const uint8_t *key, size_t key_length) {
+    uint64_t start = hdb_stats_clock();
+    int rc = hdb_delete(db, key, key_length);
+    hdb_cache_invalidate(db, key, key_length);
+    hdb_count(db, HDB_STAT_DELETES, 1);
+    hdb_time(db, HDB_LATENCY_DELETE, start);
+    return rc;
+}
+
+int db_delete(struct hdb *db, const uint8_t *key, size_t key_length) {
+    if (db->options.flags & HDB_OPEN_FOLLOWER) return -1;
+    return hdb_delete_key(db, key, key_length);
+}
+
+// Applies the records of a log left behind by a database that was not
+// closed.  Stops at the first torn or corrupt record, which was never
+// acknowledged with HDB_DURABILITY_COMMIT.
+int hdb_wal_replay(struct hdb *db, FILE *file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) return -1;
+    uint64_t size = st.st_size;
+    uint64_t offset = 0;
+    uint8_t *buffer = NULL;
+    size_t capacity = 0;
+    int rc = 0;
+    db->wal.replaying = true;
+    while (offset + sizeof(struct hdb_wal_record) <= size) {
+        struct hdb_wal_record record;
+        if (hdb_read_at(file, offset, &record, sizeof(struct hdb_wal_record)) != 0) break;
+        if (record.value_length > size || sizeof(struct hdb_wal_record) + record.key_length + record.value_length > size - offset) break;
+        size_t length = sizeof(struct hdb_wal_record) + record.key_length + record.value_length;
+        if (length > capacity) {
+            uint8_t *grown = hdb_realloc(&db->allocator, buffer, length);
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            buffer = grown;
+            capacity = length;
+        }
+        if (hdb_read_at(file, offset, buffer, length) != 0 || hdb_wal_checksum(buffer, length) != record.checksum) break;
+
+        const uint8_t *key = buffer + sizeof(struct hdb_wal_record);
+        if (record.type == HDB_WAL_PUT || (record.type == HDB_WAL_PUT_EXPIRES && record.value_length >= sizeof(uint64_t))) {
+            uint64_t expires = 0;
+            size_t value_length = record.value_length;
+            if (record.type == HDB_WAL_PUT_EXPIRES) {
+                value_length -= sizeof(uint64_t);
+                memcpy(&expires, key + record.key_length + value_length, sizeof(uint64_t));
+            }
+            if (hdb_put(db, key, record.key_length, key + record.key_length, value_length, expires) != 0) {
+                rc = -1;
+                break;
+            }
+        } else if (record.type == HDB_WAL_DELETE) {
+            hdb_delete(db, key, record.key_length); // the delete may have reached the files already
+        } else if (record.type == HDB_WAL_SEQUENCE && record.value_length == sizeof(uint64_t)) {
+            memcpy(&db->header.sequence, key + record.key_length, sizeof(uint64_t));
+            offset += length;
+            continue;
+        } else {
+            break;
+        }
+        if (hdb_numbered(db)) {
+            // Numbered again in the order they were first, from the number the checkpoint left
+            pthread_mutex_lock(&db->wal.lock);
+            hdb_stream_publish(db, record.type, key, record.key_length, key + record.key_length, record.value_length, 0, 0);
+            pthread_mutex_unlock(&db->wal.lock);
+        }
+        offset += length;
+    }
+    db->wal.replaying = false;
+    hdb_free(&db->allocator, buffer);
+    return rc;
+}
+
+// Replays the log found next to the data file, then starts an empty one
+// unless the database runs without.
+int hdb_open_wal(struct hdb *db) {
+    FILE *file = fopen(db->wal_filename, "rb");
+    if (file) {
+        int rc = hdb_wal_replay(db, file);
+        fclose(file);
+        if (rc != 0) return -1;
+        // What was replayed has to be in the files before the log goes
+        if (hdb_write_header(db) != 0 || fsync(fileno(db->hash_file)) != 0 || fsync(fileno(db->data_file)) != 0 ||
+            (db->blob_file && fsync(fileno(db->blob_file)) != 0)) return -1;
+    }
+    if (db->options.durability == HDB_DURABILITY_NONE) {
+        if (file) remove(db->wal_filename);
+        return 0;
+    }
+    db->wal.file = fopen(db->wal_filename, "wb+");
+    if (!db->wal.file) return -1;
+    pthread_mutex_lock(&db->wal.lock);
+    int rc = hdb_wal_mark(db);
+    pthread_mutex_unlock(&db->wal.lock);
+    return rc;
+}
+
+// Copies the changes from sequence on, as many whole ones as fit, that are
+// durable in the log.  Called with the lock of the log held.
+int hdb_stream_copy(struct hdb *db, uint64_t sequence, uint8_t *buffer, size_t capacity, size_t *length) {
+    struct hdb_stream *stream = db->wal.stream;
+    uint64_t oldest = stream->head ? stream->head->first : db->header.sequence;
+    if (sequence < oldest || sequence > db->header.sequence) return -1;
+    struct hdb_stream_segment *segment = stream->head;
+    while (segment && segment->next && segment->next->first <= sequence) segment = segment->next;
+    for (; segment; segment = segment->next) {
+        size_t offset = 0;
+        while (offset < segment->length) {
+            uint64_t wal_end;
+            struct hdb_change change;
+            memcpy(&wal_end, segment->data + offset, sizeof(uint64_t));
+            memcpy(&change, segment->data + offset + sizeof(uint64_t), sizeof(struct hdb_change));
+            size_t size = sizeof(struct hdb_change) + change.key_length + change.value_length;
+            if (change.sequence >= sequence) {
+                if (wal_end && (db->wal.failed || wal_end > db->wal.durable)) return 0;
+                if (*length + size > capacity) {
+                    if (*length) return 0;
+                    *length = size;
+                    return 1;
+                }
+                memcpy(buffer + *length, segment->data + offset + sizeof(uint64_t), size);
+                *length += size;
+            }
+            offset += sizeof(uint64_t) + size;
+        }
+    }
+    return 0;
+}
+
+// Copies the changes from sequence on into buffer, whole and in order, as
+// many as fit in capacity, and sets length to the bytes copied.  A change is
+// only handed out once the log made it durable, so a follower never gets
+// ahead of what the database would recover.  With none to hand out yet it
+// waits for one up to timeout milliseconds, and returns 0 with length 0 if
+// none came.  Returns 1 with length set to the size of the next change when
+// it does not fit, and -1 without a change stream or when sequence is not in
+// the backlog, in which case the follower has to start over from a snapshot.
+// Holds the lock of the log while it copies, a buffer of a few megabytes at
+// most keeps writers from waiting long.
+int db_changes_read(struct hdb *db, uint64_t sequence, uint8_t *buffer, size_t capacity, size_t *length, uint32_t timeout) {
+    struct hdb_wal *wal = &db->wal;
+    *length = 0;
+    if (!wal->stream) return -1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nanoseconds = deadline.tv_nsec + (uint64_t)timeout * 1000000;
+    deadline.tv_sec += nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    pthread_mutex_lock(&wal->lock);
+    int rc = hdb_stream_copy(db, sequence, buffer, capacity, length);
+    while (rc == 0 && !*length && timeout) {
+        wal->stream->waiters++;
+        int waited = pthread_cond_timedwait(&wal->flushed, &wal->lock, &deadline);
+        wal->stream->waiters--;
+        rc = hdb_stream_copy(db, sequence, buffer, capacity, length);
+        if (waited == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+// The oldest change the backlog still holds and the sequence the next one
+// gets.  On a follower next is the one it applies next.
+void db_changes_range(struct hdb *db, uint64_t *oldest, uint64_t *next) {
+    pthread_mutex_lock(&db->wal.lock);
+    *next = db->header.sequence;
+    *oldest = db->wal.stream && db->wal.stream->head ? db->wal.stream->head->first : *next;
+    pthread_mutex_unlock(&db->wal.lock);
+}
+
+int hdb_apply_change(struct hdb *db, const struct hdb_change *change, const uint8_t *key) {
+    const uint8_t *value = key + change->key_length;
+    size_t value_length = change->value_length;
+    uint64_t expires = 0;
+    int rc = -1;
+    if (change->type == HDB_WAL_PUT_EXPIRES && value_length >= sizeof(uint64_t)) {
+        value_length -= sizeof(uint64_t);
+        memcpy(&expires, value + value_length, sizeof(uint64_t));
+    }
+    if (change->type == HDB_WAL_PUT || (change->type == HDB_WAL_PUT_EXPIRES && expires)) {
+        rc = hdb_put_key(db, key, change->key_length, value, value_length, expires);
+    } else if (change->type == HDB_WAL_DELETE) {
+        hdb_delete_key(db, key, change->key_length); // the key may be gone already
+        rc = 0;
+    }
+    if (rc != 0) return -1;
+    // Numbered as the leader numbered it, and kept for followers of this one
+    pthread_mutex_lock(&db->wal.lock);
+    hdb_stream_publish(db, change->type, key, change->key_length, value, change->value_length, 0,
+                       db->wal.file ? db->wal.end : 0);
+    pthread_mutex_unlock(&db->wal.lock);
+    return 0;
+}
+
+// Applies changes db_changes_read handed out on the leader, in order, to a
+// database opened with HDB_OPEN_FOLLOWER.  Those it already has are
+// skipped, so changes can be sent again.  Returns -1 at a change that fails
+// its checksum, one that comes after a gap or a write that failed, the
+// changes before it being applied.  Runs on one thread at a time, readers of
+// the follower carry on meanwhile.
+int db_follower_apply(struct hdb *db, const uint8_t *changes, size_t length) {
+    if (!(db->options.flags & HDB_OPEN_FOLLOWER)) return -1;
+    size_t offset = 0;
+    while (offset < length) {
+        struct hdb_change change;
+        size_t left = length - offset;
+        if (left < sizeof(struct hdb_change)) return -1;
+        memcpy(&change, changes + offset, sizeof(struct hdb_change));
+        if (change.key_length > left - sizeof(struct hdb_change) ||
+            change.value_length > left - sizeof(struct hdb_change) - change.key_length) return -1;
+        size_t size = sizeof(struct hdb_change) + change.key_length + change.value_length;
+        if (hdb_wal_checksum(changes + offset, size) != change.checksum) return -1;
+        uint64_t next = __atomic_load_n(&db->header.sequence, __ATOMIC_RELAXED);
+        if (change.sequence > next) return -1;
+        if (change.sequence == next && hdb_apply_change(db, &change, changes + offset + sizeof(struct hdb_change)) != 0) return -1;
+        offset += size;
+    }
+    return 0;
+}
+
+// Sets the change a follower applies next, the sequence of the snapshot its
+// files were loaded from, and makes it durable.  Whatever it kept of the
+// changes numbered before is dropped.
+int db_follower_start(struct hdb *db, uint64_t sequence) {
+    if (!(db->options.flags & HDB_OPEN_FOLLOWER)) return -1;
+    pthread_rwlock_wrlock(&db->lock);
+    pthread_mutex_lock(&db->wal.lock);
+    hdb_stream_clear(db);
+    __atomic_store_n(&db->header.sequence, sequence, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&db->wal.lock);
+    int rc = hdb_checkpoint_locked(db);
+    pthread_rwlock_unlock(&db->lock);
+    return rc;
+}
+
+// A key of a batch, ordered by bucket page and then by its place in the batch
+// so later duplicates still win.
+struct hdb_batch_entry {
+    uint64_t hash;
+    uint32_t fingerprint;
+    uint32_t page;
+    size_t index;
+    uint32_t codec; // its value is stored with
+    uint64_t position; // of its record in the data file
+};
+
+int hdb_batch_order(const void *a, const void *b) {
+    const struct hdb_batch_entry *x = a, *y = b;
+    if (x->page != y->page) return x->page < y->page ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Writes the records of a batch back to back from start, in entry order.
+int hdb_write_records(struct hdb *db, const struct hdb_put_item *items, const struct hdb_batch_entry *entries,
+                      struct hdb_record_header *headers, size_t count, uint64_t start) {
+    struct iovec io[HDB_BATCH_IOV];
+    int used = 0;
+    uint64_t offset = start, size = 0;
+    for (size_t i = 0; i <= count; ++i) {
+        if (i == count || used == (int)(sizeof(io) / sizeof(io[0]))) {
+            ssize_t written = used ? pwritev(fileno(db->data_file), io, used, offset) : 0;
+            hdb_pool_invalidate(db->data_pool, offset, size);
+            if (written != (ssize_t)size) return -1;
+            offset += size;
+            size = 0;
+            used = 0;
+            if (i == count) break;
+        }
+        const struct hdb_put_item *item = &items[entries[i].index];
+        headers[i] = (struct hdb_record_header){item->key_length, entries[i].codec << HDB_RECORD_CODEC_SHIFT, item->value_length};
+        io[used++] = (struct iovec){&headers[i], sizeof(struct hdb_record_header)};
+        io[used++] = (struct iovec){(void*)item->key, item->key_length};
+        io[used++] = (struct iovec){(void*)item->value, item->value_length};
+        size += hdb_record_size(item->key_length, item->value_length);
+    }
+    return 0;
+}
+
+// Publishes a bucket a batch changed and retires the records it overwrote.
+int hdb_batch_publish(struct hdb *db, uint32_t page, const struct hdb_bucket *bucket, uint64_t (*retired)[2], size_t *retired_count) {
+    if (hdb_publish_bucket(db, page, bucket) != 0) return -1;
+    for (size_t i = 0; i < *retired_count; ++i) {
+        if (hdb_retire_record(db, retired[i][0], retired[i][1]) != 0) return -1;
+    }
+    *retired_count = 0;
+    return 0;
+}
+
+// Stores many keys at once.  The keys are hashed up front, their records
+// written back to back with as few pwritev calls as the iovec limit allows,
+// and every bucket is read and written once for all of its keys.  Holds the
+// lock exclusively for the whole batch, readers are not held up.  On failure
+// part of the batch may have been stored.
+int db_put_batch(struct hdb *db, const struct hdb_put_item *items, size_t count) {
+    if (db->options.flags & HDB_OPEN_FOLLOWER) return -1;
+    if (!count) return 0;
+    if (hdb_touch_filter(db) != 0) return -1;
+    struct hdb_batch_entry *entries = hdb_malloc(&db->allocator, count * sizeof(struct hdb_batch_entry));
+    struct hdb_record_header *headers = hdb_malloc(&db->allocator, count * sizeof(struct hdb_record_header));
+    uint64_t (*retired)[2] = hdb_malloc(&db->allocator, count * sizeof(*retired));
+    struct hdb_put_item *stored = hdb_malloc(&db->allocator, count * sizeof(struct hdb_put_item));
+    struct hdb_blob_ref *refs = db->options.blob_threshold ? hdb_malloc(&db->allocator, count * sizeof(struct hdb_blob_ref)) : NULL;
+    if (!entries || !headers || !retired || !stored || (db->options.blob_threshold && !refs)) {
+        hdb_free(&db->allocator, entries);
+        hdb_free(&db->allocator, headers);
+        hdb_free(&db->allocator, retired);
+        hdb_free(&db->allocator, stored);
+        hdb_free(&db->allocator, refs);
+        return -1;
+    }
+    // stored holds the items as they go to the data file, compressed or not,
+    // the WAL still gets the originals
+    for (size_t i = 0; i < count; ++i) {
+        entries[i].hash = db->hash(items[i].key, items[i].key_length);
+        entries[i].fingerprint = fingerprint_function(items[i].key, items[i].key_length);
+        entries[i].index = i;
+        stored[i] = items[i];
+        uint8_t *compressed;
+        entries[i].codec = hdb_compress(db, items[i].value, items[i].value_length, &compressed, &stored[i].value_length);
+        if (compressed) stored[i].value = compressed;
+    }
+
+    // Room for the log records first, so a failure leaves everything as it was
+    size_t logged = 0;
+    for (size_t i = 0; i < count; ++i) logged += hdb_wal_record_size(items[i].key_length, items[i].value_length, 0);
+    pthread_rwlock_wrlock(&db->lock);
+    uint64_t total = 0;
+    int rc = hdb_wal_reserve(db, logged);
+    bool reserved = rc == 0;
+    for (size_t i = 0; i < count; ++i) {
+        // Values long enough leave only a ref for the data file, a compressed
+        // copy is not needed past the blob record
+        const uint8_t *value = stored[i].value;
+        if (rc == 0 && refs && hdb_blob_store(db, stored[i].key, stored[i].key_length, &stored[i].value, &stored[i].value_length,
+                                              &entries[i].codec, &refs[i]) != 0) rc = -1;
+        if (stored[i].value != value && value != items[i].value) hdb_free(&db->allocator, (void*)value);
+        entries[i].page = hdb_bucket_page(db, entries[i].hash);
+        total += hdb_record_size(stored[i].key_length, stored[i].value_length);
+    }
+    qsort(entries, count, sizeof(struct hdb_batch_entry), hdb_batch_order);
+
+    uint64_t start = 0;
+    pthread_mutex_lock(&db->alloc_lock);
+    if (rc == 0) rc = hdb_append_space(db, total, &start);
+    pthread_mutex_unlock(&db->alloc_lock);
+    if (rc == 0) rc = hdb_write_records(db, stored, entries, headers, count, start);
+    if (rc == 0) {
+        hdb_count(db, HDB_STAT_PUTS, count);
+        hdb_count(db, HDB_STAT_APPENDS, count);
+        hdb_count(db, HDB_STAT_BYTES_WRITTEN, total);
+    }
+    uint64_t next = start;
+    for (size_t i = 0; i < count; ++i) {
+        entries[i].position = next;
+        next += hdb_record_size(stored[entries[i].index].key_length, stored[entries[i].index].value_length);
+    }
+
+    struct hdb_bucket bucket;
+    bool loaded = false;
+    uint32_t loaded_page = 0;
+    size_t retired_count = 0;
+    for (size_t i = 0; rc == 0 && i < count;) {
+        const struct hdb_batch_entry *entry = &entries[i];
+        const struct hdb_put_item *item = &stored[entry->index];
+        uint32_t page = hdb_bucket_page(db, entry->hash);
+        if (!loaded || page != loaded_page) {
+            if (loaded && hdb_batch_publish(db, loaded_page, &bucket, retired, &retired_count) != 0) rc = -1;
+            if (rc != 0 || hdb_read_bucket(db, page, &bucket) != 0) {
+                rc = -1;
+                break;
+            }
+            loaded = true;
+            loaded_page = page;
+        }
+
+        int index = hdb_bucket_find(db, &bucket, entry->hash, entry->fingerprint, item->key, item->key_length);
+        if (index >= 0) {
+            struct hdb_slot *slot = &bucket.slots[index];
+            retired[retired_count][0] = slot->position;
+            retired[retired_count][1] = hdb_record_size(item->key_length, slot->length);
+            retired_count++;
+            slot->position = entry->position;
+            slot->length = item->value_length;
+            slot->flags = HDB_SLOT_USED | entry->codec << HDB_SLOT_CODEC_SHIFT;
+            i++;
+            continue;
+        }
+        struct hdb_slot slot = {entry->hash, entry->position, item->value_length, entry->fingerprint,
+                                HDB_SLOT_USED | entry->codec << HDB_SLOT_CODEC_SHIFT};
+        if (db->filter) hdb_filter_add(db->filter, entry->hash, entry->fingerprint);
+        if (hdb_bucket_insert(&bucket, &slot) >= 0) {
+            // Only once the key has a slot, the bucket is not written out yet
+            if (hdb_sorted_add(db, item->key, item->key_length) != 0) {
+                rc = -1;
+                break;
+            }
+            __atomic_fetch_add(&db->header.key_count, 1, __ATOMIC_RELAXED);
+            i++;
+            continue;
+        }
+
+        // The bucket is full.  The split writes out both halves, pending
+        // changes included, and the key is tried again
+        hdb_seq_write(&db->structure_seq);
+        rc = hdb_split_bucket(db, entry->hash, page, &bucket);
+        hdb_seq_write(&db->structure_seq);
+        for (size_t j = 0; rc == 0 && j < retired_count; ++j) rc = hdb_retire_record(db, retired[j][0], retired[j][1]);
+        retired_count = 0;
+        loaded = false;
+    }
+    if (rc == 0 && loaded) rc = hdb_batch_publish(db, loaded_page, &bucket, retired, &retired_count);
+
+    uint64_t position = 0;
+    if (rc != 0 && reserved) hdb_wal_release(db, logged);
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        rc = hdb_wal_append(db, HDB_WAL_PUT, items[i].key, items[i].key_length, items[i].value, items[i].value_length, 0, &position);
+    }
+    pthread_rwlock_unlock(&db->lock);
+    for (size_t i = 0; i < count; ++i) hdb_cache_invalidate(db, items[i].key, items[i].key_length);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (stored[i].value != items[i].value && !(refs && stored[i].value == (const uint8_t*)&refs[i])) {
+            hdb_free(&db->allocator, (void*)stored[i].value);
+        }
+    }
+    hdb_free(&db->allocator, entries);
+    hdb_free(&db->allocator, headers);
+    hdb_free(&db->allocator, retired);
+    hdb_free(&db->allocator, stored);
+    hdb_free(&db->allocator, refs);
+    if (rc == 0) rc = hdb_wal_commit(db, position);
+    return rc == 0 ? hdb_check_filter(db) : rc;
+}
+
+// Finds the slot that should hold key without looking at the data file,
+// which a batch get reads later in one go.  Runs in a read section and
+// returns 0 when a candidate slot was found, -1 when none and 1 when a writer
+// got in the way.
+int hdb_lookup_slot(struct hdb *db, const uint8_t *key, size_t key_length, struct hdb_read *read, struct hdb_slot *slot) {
+    struct hdb_slot candidates[HDB_MAX_PROBE];
+    int count = hdb_probe(db, key, key_length, read, candidates);
+    if (count < 0) return 1;
+    if (count == 0) return -1;
+    *slot = candidates[0];
+    return 0;
+}
+
+// A key of a batch get and the slot found for it.
+struct hdb_batch_read {
+    struct hdb_read read;
+    struct hdb_slot slot;
+    size_t index;
+};
+
+int hdb_batch_read_order(const void *a, const void *b) {
+    const struct hdb_batch_read *x = a, *y = b;
+    return x->slot.position < y->slot.position ? -1 : x->slot.position > y->slot.position;
+}
+
+// Tells the kernel a record is about to be read, so the reads overlap.
+void hdb_prefetch(const struct hdb_read *read, uint64_t offset, uint64_t length) {
+    if (read->map) {
+        if (length < HDB_BATCH_PREFETCH) {
+            __builtin_prefetch(read->map->base + offset);
+            return;
+        }
+        uint64_t page = offset & ~(uint64_t)(HDB_PAGE_SIZE - 1);
+        uint64_t capacity = __atomic_load_n(&read->map->capacity, __ATOMIC_ACQUIRE);
+        if (offset + length <= capacity) madvise(read->map->base + page, offset + length - page, MADV_WILLNEED);
+    } else if (length >= HDB_BATCH_PREFETCH && !read->pool) {
+        posix_fadvise(fileno(read->file), offset, length, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Copies the value of the record a batch get found, reading the whole record
+// with one pread when the file is not mapped.  Returns 1 when the record
+// turned out to hold another key, which is then looked up on its own.
+int hdb_batch_copy(struct hdb *db, const struct hdb_batch_read *read, struct hdb_get_item *item,
+                   uint8_t **scratch, size_t *capacity) {
+    uint32_t codec = hdb_slot_codec(&read->slot);
+    uint64_t length = read->slot.length;
+    uint64_t size = hdb_record_size(item->key_length, length);
+    uint64_t value = read->slot.position + sizeof(struct hdb_record_header) + item->key_length;
+    if (read->read.map) {
+        if (!hdb_record_has_key(read->read.pool, read->read.file, read->read.map, read->slot.position, item->key, item->key_length)) return 1;
+        if (codec != HDB_CODEC_NONE) {
+            return hdb_get_compressed(db, &read->read, codec, value, length, item->value, &item->value_length);
+        }
+        item->value_length = length;
+        return hdb_map_read(read->read.file, read->read.map, value, item->value, length);
+    }
+    if (size > *capacity) {
+        uint8_t *grown = hdb_realloc(&db->allocator, *scratch, size);
+        if (!grown) return -1;
+        *scratch = grown;
+        *capacity = size;
+    }
+    if (hdb_file_read(read->read.pool, read->read.file, NULL, read->slot.position, *scratch, size) != 0) return 1;
+    struct hdb_record_header record;
+    memcpy(&record, *scratch, sizeof(struct hdb_record_header));
+    if (record.key_length != item->key_length ||
+        memcmp(*scratch + sizeof(struct hdb_record_header), item->key, item->key_length) != 0) return 1;
+    if (codec != HDB_CODEC_NONE && !hdb_read_valid(db, &read->read)) return 1; // decode only what the read vouches for
+    return hdb_decode_value(db, read->read.blob, codec, *scratch + sizeof(struct hdb_record_header) + item->key_length, length,
+                            item->value, &item->value_length);
+}
+
+// Looks up many keys at once.  The slots of all keys are found first, then
+// the records are prefetched and read whole in the order they lie in the data
+// file.  A key a writer got in the way of is looked up again on its own.
+int db_get_batch(struct hdb *db, struct hdb_get_item *items, size_t count) {
+    if (!count) return 0;
+    hdb_touch_filter(db);
+    struct hdb_batch_read *reads = hdb_malloc(&db->allocator, count * sizeof(struct hdb_batch_read));
+    if (!reads) return -1;
+    uint8_t *scratch = NULL;
+    size_t capacity = 0;
+
+    size_t found = 0;
+    uint32_t token = hdb_read_enter(db);
+    for (size_t i = 0; i < count; ++i) {
+        struct hdb_batch_read *read = &reads[found];
+        items[i].rc = hdb_lookup_slot(db, items[i].key, items[i].key_length, &read->read, &read->slot);
+        if (items[i].rc != 0) continue;
+        read->index = i;
+        found++;
+    }
+    qsort(reads, found, sizeof(struct hdb_batch_read), hdb_batch_read_order);
+    for (size_t i = 0; i < found; ++i) {
+        hdb_prefetch(&reads[i].read, reads[i].slot.position,
+                     hdb_record_size(items[reads[i].index].key_length, reads[i].slot.length));
+    }
+    for (size_t i = 0; i < found; ++i) {
+        struct hdb_batch_read *read = &reads[i];
+        struct hdb_get_item *item = &items[read->index];
+        int rc = hdb_batch_copy(db, read, item, &scratch, &capacity);
+        if (rc == 1 || !hdb_read_valid(db, &read->read)) {
+            item->rc = 1;
+        } else {
+            item->rc = rc;
+        }
+    }
+    hdb_read_exit(db, token);
+    hdb_free(&db->allocator, reads);
+    hdb_free(&db->allocator, scratch);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (items[i].rc == 1) items[i].rc = db_get(db, items[i].key, items[i].key_length, items[i].value, &items[i].value_length);
+    }
+    return 0;
+}
+
+// Counts the records whose expiry has passed since the last call towards the
+// dead share of the data file.  An entry whose record died or was rewritten
+// meanwhile is dropped, its bytes are counted as dead already.
+void hdb_reap_expired(struct hdb *db) {
+    if (!db->wheel) return;
+    pthread_rwlock_rdlock(&db->lock);
+    pthread_mutex_lock(&db->alloc_lock);
+    struct hdb_wheel_entry *due = hdb_wheel_advance(db->wheel, hdb_wall_clock());
+    pthread_mutex_unlock(&db->alloc_lock);
+    if (!due) {
+        pthread_rwlock_unlock(&db->lock);
+        return;
+    }
+
+    uint64_t expired = 0;
+    for (struct hdb_wheel_entry *entry = due; entry; entry = entry->next) {
+        struct hdb_record_header record;
+        uint64_t expires;
+        if (hdb_data_read(db, entry->position, &record, sizeof(struct hdb_record_header)) != 0) continue;
+        if ((record.flags & (HDB_RECORD_DEAD | HDB_RECORD_TOMBSTONE)) ||
+            !((record.flags >> HDB_RECORD_CODEC_SHIFT) & HDB_CODEC_EXPIRES) || record.value_length < sizeof(uint64_t)) continue;
+        uint64_t size = hdb_record_size(record.key_length, record.value_length);
+        if (hdb_data_read(db, entry->position + size - sizeof(uint64_t), &expires, sizeof(uint64_t)) != 0 ||
+            expires != entry->expires) continue;
+        expired += size + hdb_record_padding(record.flags);
+    }
+    pthread_mutex_lock(&db->alloc_lock);
+    db->expired_bytes += expired;
+    while (due) {
+        struct hdb_wheel_entry *next = due->next;
+        hdb_slab_free(&db->wheel->entries, due);
+        due = next;
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_rwlock_unlock(&db->lock);
+}
+
+bool hdb_needs_compaction(struct hdb *db) {
+    if (__atomic_load_n(&db->pins, __ATOMIC_RELAXED)) return false; // the swap would pull the file from under them
+    uint64_t size = hdb_data_size(db);
+    pthread_mutex_lock(&db->alloc_lock);
+    uint64_t dead_bytes = db->header.dead_bytes + db->expired_bytes; // expired records are gone once compaction drops them
+    pthread_mutex_unlock(&db->alloc_lock);
+    return size >= db->options.compaction_min_size && dead_bytes >= db->options.compaction_ratio * size;
+}
+
+// A ref of the data file to point at the copy of its blob record, journaled
+// before the compacted blob file is swapped in.
+struct hdb_blob_remap {
+    uint64_t record; // position of the data record holding the ref
+    uint64_t from; // ref.position before the swap of the blob file
+    uint64_t to; // and after
+};
+
+// State of a compaction in progress.  Live records are copied in the order of
+// the old file, so the old positions in the map are ascending.
+struct hdb_compaction {
+    FILE *source; // the file copied, the data file when NULL
+    FILE *file; // the new file
+    char *filename;
+    uint64_t scanned; // old data file offset copied up to
+    uint64_t written; // size of the new data file
+    uint64_t now; // records of the data file that expired by then are not copied
+    uint64_t *old_positions;
+    uint64_t *new_positions;
+    uint64_t *expiries; // when the copy expires, 0 for never
+    bool *referenced; // whether an index slot still points at the copy
+    size_t count;
+    size_t capacity;
+    bool resumed; // by hdb_finish_swap, the old data file is gone
+    struct hdb_blob_remap *remaps; // refs to rewrite, of a compaction of the blob file
+    size_t remap_count;
+    size_t remap_capacity;
+    uint8_t buffer[64 * BLOCK_SIZE];
+};
+
+int hdb_compaction_read(struct hdb *db, struct hdb_compaction *compaction, uint64_t position, void *buffer, size_t length) {
+    return compaction->source ? hdb_read_at(compaction->source, position, buffer, length) : hdb_data_read(db, position, buffer, length);
+}
+
+// Appends the record at position in the old file to the new one.  The
+// copy sits in an extent of its own size, so it is written without padding.
+int hdb_compaction_copy(struct hdb *db, struct hdb_compaction *compaction, uint64_t position,
+                        struct hdb_record_header record) {
+    uint64_t size = hdb_record_size(record.key_length, record.value_length);
+    record.flags &= (1u << HDB_RECORD_PADDING_SHIFT) - 1;
+    if (fseek(compaction->file, compaction->written, SEEK_SET) != 0) return -1;
+    if (fwrite(&record, sizeof(struct hdb_record_header), 1, compaction->file) != 1) return -1;
+    uint64_t total = sizeof(struct hdb_record_header);
+    while (total < size) {
+        size_t to_copy = (size - total > sizeof(compaction->buffer)) ? sizeof(compaction->buffer) : size - total;
+        if (hdb_compaction_read(db, compaction, position + total, compaction->buffer, to_copy) != 0) return -1;
+        if (fwrite(compaction->buffer, 1, to_copy, compaction->file) != to_copy) return -1;
+        total += to_copy;
+    }
+    compaction->written += size;
+    return 0;
+}
+
+// Copies the live records found between the scan position and end.  A record
+// of the data file that expired is left behind, its slot is dropped by the remap.
+int hdb_compaction_scan(struct hdb *db, struct hdb_compaction *compaction, uint64_t end) {
+    while (compaction->scanned + sizeof(struct hdb_record_header) <= end) {
+        struct hdb_record_header record;
+        uint64_t position = compaction->scanned;
+        if (hdb_compaction_read(db, compaction, position, &record, sizeof(struct hdb_record_header)) != 0) return -1;
+        uint64_t size = hdb_record_size(record.key_length, record.value_length);
+        uint32_t padding = hdb_record_padding(record.flags);
+        if (position + size + padding > end) break; // a torn record at the very end of the log
+
+        uint64_t expires = 0;
+        if (!compaction->source && ((record.flags >> HDB_RECORD_CODEC_SHIFT) & HDB_CODEC_EXPIRES) &&
+            record.value_length >= sizeof(uint64_t) &&
+            hdb_compaction_read(db, compaction, position + size - sizeof(uint64_t), &expires, sizeof(uint64_t)) != 0) return -1;
+
+        if (!(record.flags & (HDB_RECORD_DEAD | HDB_RECORD_TOMBSTONE)) && (!expires || expires > compaction->now)) {
+            if (compaction->count == compaction->capacity) {
+                size_t capacity = compaction->capacity ? compaction->capacity * 2 : 1024;
+                uint64_t *old_positions = hdb_realloc(&db->allocator, compaction->old_positions, capacity * sizeof(uint64_t));
+                if (!old_positions) return -1;
+                compaction->old_positions = old_positions;
+                uint64_t *new_positions = hdb_realloc(&db->allocator, compaction->new_positions, capacity * sizeof(uint64_t));
+                if (!new_positions) return -1;
+                compaction->new_positions = new_positions;
+                uint64_t *expiries = hdb_realloc(&db->allocator, compaction->expiries, capacity * sizeof(uint64_t));
+                if (!expiries) return -1;
+                compaction->expiries = expiries;
+                bool *referenced = hdb_realloc(&db->allocator, compaction->referenced, capacity * sizeof(bool));
+                if (!referenced) return -1;
+                compaction->referenced = referenced;
+                compaction->capacity = capacity;
+            }
+            compaction->old_positions[compaction->count] = position;
+            compaction->new_positions[compaction->count] = compaction->written;
+            compaction->expiries[compaction->count] = expires;
+            compaction->referenced[compaction->count] = false;
+            compaction->count++;
+            if (hdb_compaction_copy(db, compaction, position, record) != 0) return -1;
+        }
+        compaction->scanned = position + size + padding;
+    }
+    return 0;
+}
+
+// Looks up where the record at an old position was copied, or returns -1.
+int64_t hdb_compaction_find(const struct hdb_compaction *compaction, uint64_t position) {
+    size_t low = 0, high = compaction->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compaction->old_positions[middle] < position) low = middle + 1;
+        else high = middle;
+    }
+    return (low < compaction->count && compaction->old_positions[low] == position) ? (int64_t)low : -1;
+}
+
+// Drops the key of a record the scan left behind because it expired, along
+// with its blob record.  Runs before the swap, the record is still in the
+// data file.  What cannot be read is left to the next recovery.
+void hdb_compaction_expire(struct hdb *db, uint64_t position) {
+    __atomic_fetch_sub(&db->header.key_count, 1, __ATOMIC_RELAXED);
+    hdb_count(db, HDB_STAT_EXPIRED, 1);
+    struct hdb_record_header record;
+    if (hdb_data_read(db, position, &record, sizeof(struct hdb_record_header)) != 0) return;
+    uint8_t stack[HDB_GET_SCRATCH];
+    uint8_t *key = record.key_length > HDB_GET_SCRATCH ? hdb_malloc(&db->allocator, record.key_length) : stack;
+    if (!key) return;
+    int rc = hdb_data_read(db, position + sizeof(struct hdb_record_header), key, record.key_length);
+    if (rc == 0) hdb_sorted_remove(db, key, record.key_length);
+    if (key != stack) hdb_free(&db->allocator, key);
+    if (rc == 0 && ((record.flags >> HDB_RECORD_CODEC_SHIFT) & HDB_CODEC_BLOB)) {
+        struct hdb_blob_ref ref;
+        if (hdb_data_read(db, position + sizeof(struct hdb_record_header) + record.key_length, &ref, sizeof(struct hdb_blob_ref)) == 0) {
+            hdb_blob_retire(db, &ref, record.key_length);
+        }
+    }
+}
+
+// Points every slot at the copy of its record, and drops the slots of records
+// that expired.  Called with the lock exclusive once the scan has caught up
+// with the end of the log.  With apply false the index is only checked, so a
+// problem is found before anything is changed.  Applied, every bucket is
+// stamped with header.compactions, and one stamped already is left alone:
+// hdb_finish_swap picks up where a crash stopped.  A bucket that cannot be
+// written does not stop the others, the swap is past undoing by then.
+int hdb_compaction_remap(struct hdb *db, struct hdb_compaction *compaction, bool apply) {
+    int rc = 0;
+    size_t entries = (size_t)1 << db->header.global_depth;
+    for (size_t i = 0; i < entries; ++i) {
+        struct hdb_bucket bucket;
+        if (hdb_read_bucket(db, db->directory[i], &bucket) != 0) return -1;
+        if (i >= ((size_t)1 << bucket.local_depth)) continue; // Already visited
+        if (apply && bucket.compaction == db->header.compactions) continue; // remapped before a crash
+
+        bool expired = false;
+        for (uint32_t j = 0; j < HDB_BUCKET_SLOTS; ++j) {
+            struct hdb_slot *slot = &bucket.slots[j];
+            if (!(slot->flags & HDB_SLOT_USED)) continue; // Skip empty slots
+
+            int64_t copy = hdb_compaction_find(compaction, slot->position);
+            if (copy < 0 && (hdb_slot_codec(slot) & HDB_CODEC_EXPIRES)) {
+                // Resumed, the record is gone with the old file and recovery recounts the rest
+                if (apply && compaction->resumed) __atomic_fetch_sub(&db->header.key_count, 1, __ATOMIC_RELAXED);
+                else if (apply) hdb_compaction_expire(db, slot->position);
+                slot->position = UINT64_MAX; // removed below, so no slot is remapped twice
+                expired = true;
+                continue;
+            }
+            if (copy < 0) return -1; // the index points at a record that was not copied
+            slot->position = compaction->new_positions[copy];
+            compaction->referenced[copy] = true;
+        }
+        for (uint32_t j = 0; expired && j < HDB_BUCKET_SLOTS; ++j) {
+            if (!(bucket.slots[j].flags & HDB_SLOT_USED) || bucket.slots[j].position != UINT64_MAX) continue;
+            hdb_bucket_remove(&bucket, j);
+            j = UINT32_MAX; // an entry may have moved back into a slot already passed
+        }
+        bucket.compaction = db->header.compactions;
+        if (apply && hdb_write_bucket(db, db->directory[i], &bucket) != 0) rc = -1;
+    }
+    return rc;
+}
+
+void hdb_compaction_free(struct hdb *db, struct hdb_compaction *compaction) {
+    if (compaction->file) fclose(compaction->file);
+    if (compaction->filename) {
+        remove(compaction->filename);
+        hdb_free(&db->allocator, compaction->filename);
+    }
+    hdb_free(&db->allocator, compaction->old_positions);
+    hdb_free(&db->allocator, compaction->new_positions);
+    hdb_free(&db->allocator, compaction->expiries);
+    hdb_free(&db->allocator, compaction->referenced);
+    hdb_free(&db->allocator, compaction->remaps);
+    hdb_free(&db->allocator, compaction);
+}
+
+// A copy of name with suffix appended, NULL without memory.
+char* hdb_suffixed(const struct hdb_allocator *allocator, const char *name, const char *suffix) {
+    size_t name_length = strlen(name), suffix_length = strlen(suffix);
+    char *filename = hdb_malloc(allocator, name_length + suffix_length + 1);
+    if (!filename) return NULL;
+    memcpy(filename, name, name_length);
+    memcpy(filename + name_length, suffix, suffix_length + 1);
+    return filename;
+}
+
+// Makes the files created, renamed or removed in the directory of filename
+// so far survive a crash.
+int hdb_sync_directory(struct hdb *db, const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    size_t length = slash ? (size_t)(slash - filename) : 1;
+    char *directory = hdb_malloc(&db->allocator, length + 1);
+    if (!directory) return -1;
+    if (!slash) directory[0] = '.';
+    else if (length) memcpy(directory, filename, length);
+    else directory[length++] = '/';
+    directory[length] = '\0';
+    int fd = open(directory, O_RDONLY);
+    hdb_free(&db->allocator, directory);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// Starts a compaction into name with ".compact" appended.
+struct hdb_compaction* hdb_compaction_create(struct hdb *db, const char *name, FILE *source) {
+    struct hdb_compaction *compaction = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_compaction));
+    if (!compaction) return NULL;
+    compaction->source = source;
+    compaction->filename = hdb_suffixed(&db->allocator, name, ".compact");
+    if (!compaction->filename) {
+        hdb_compaction_free(db, compaction);
+        return NULL;
+    }
+    compaction->file = fopen(compaction->filename, "wb+");
+    if (!compaction->file) {
+        hdb_compaction_free(db, compaction);
+        return NULL;
+    }
+    return compaction;
+}
+
+// Flags the copies no index slot points at any more dead in the new file and
+// counts how many bytes they take.  Fails when one of them cannot be
+// flagged, it would be live to a scan once its extent is reused.
+int hdb_compaction_bury(struct hdb_compaction *compaction, uint64_t *dead_bytes) {
+    *dead_bytes = 0;
+    for (size_t i = 0; i < compaction->count; ++i) {
+        if (compaction->referenced[i]) continue;
+        uint64_t position = compaction->new_positions[i];
+        struct hdb_record_header record;
+        if (hdb_read_at(compaction->file, position, &record, sizeof(struct hdb_record_header)) != 0) return -1;
+        record.flags |= HDB_RECORD_DEAD;
+        if (hdb_write_at(compaction->file, position, &record, sizeof(struct hdb_record_header)) != 0) return -1;
+        *dead_bytes += hdb_record_size(record.key_length, record.value_length);
+    }
+    return 0;
+}
+
+// The remap journal of a compaction sits next to the file swapped, with
+// ".remap" appended: this header, then for the data file the old positions of
+// the copies and their new positions, for the blob file the refs to rewrite.
+#define HDB_REMAP_MAGIC 0x52424448 // "HDBR"
+
+struct hdb_remap_header {
+    uint32_t magic;
+    uint32_t compactions; // header.compactions of the swap it belongs to
+    uint64_t count;
+};
+
+// Drops the journal of a swap that did not go through.  A marked swap without
+// a journal is taken to have never happened, so with the mark maybe on disk
+// this returns 1 when the journal may be left behind.
+int hdb_compaction_unjournal(struct hdb *db, const char *name, bool marked) {
+    db->header.state = HDB_STATE_OPEN;
+    char *filename = hdb_suffixed(&db->allocator, name, ".remap");
+    bool dropped = filename && remove(filename) == 0 && hdb_sync_directory(db, name) == 0;
+    hdb_free(&db->allocator, filename);
+    return marked && !dropped ? 1 : -1;
+}
+
+// Journals count entries of size bytes from first, then from second unless it
+// is NULL, and marks the swap of name in the header with state, so a crash
+// from here on is rolled forward by the next open.  The copy itself must be
+// synced already.  Returns 1 when it failed with the mark maybe on disk and
+// the journal left behind.
+int hdb_compaction_journal(struct hdb *db, const char *name, uint32_t state, const struct hdb_remap_header *header,
+                           const void *first, const void *second, size_t size) {
+    char *filename = hdb_suffixed(&db->allocator, name, ".remap");
+    if (!filename) return -1;
+    FILE *file = fopen(filename, "wb");
+    size_t count = header->count;
+    bool marked = false;
+    int rc = file ? 0 : -1;
+    if (rc == 0 && (fwrite(header, sizeof(struct hdb_remap_header), 1, file) != 1 ||
+                    (count && (fwrite(first, size, count, file) != count ||
+                               (second && fwrite(second, size, count, file) != count))) ||
+                    fflush(file) != 0 || fsync(fileno(file)) != 0)) rc = -1;
+    if (file && fclose(file) != 0) rc = -1;
+    // The names of the copy and the journal have to outlive a crash before the header points at them
+    if (rc == 0) rc = hdb_sync_directory(db, name);
+    if (rc == 0) {
+        db->header.compactions = header->compactions;
+        db->header.state = state;
+        marked = true;
+        rc = hdb_checkpoint_locked(db); // no log record from before the swap is replayed after it
+    }
+    hdb_free(&db->allocator, filename);
+    return rc == 0 ? 0 : hdb_compaction_unjournal(db, name, marked);
+}
+
+// Clears the mark of the swap of name that went through, then drops its journal.
+int hdb_compaction_seal(struct hdb *db, const char *name) {
+    uint32_t state = db->header.state;
+    db->header.state = HDB_STATE_OPEN;
+    if (hdb_checkpoint_locked(db) != 0) {
+        db->header.state = state; // left for the next open to finish
+        return -1;
+    }
+    char *filename = hdb_suffixed(&db->allocator, name, ".remap");
+    if (filename) remove(filename);
+    hdb_free(&db->allocator, filename);
+    return 0;
+}
+
+// Finishes the swap of a compacted data file the last session marked in the
+// header but did not see through.  The copy is moved over the data file unless
+// it was already, then the buckets not stamped with the swap yet are remapped
+// from the journal.  Without a journal the swap never started.  Called at
+// open, before anything else reads the data file.
+int hdb_finish_swap(struct hdb *db) {
+    char *filename = hdb_suffixed(&db->allocator, db->data_filename, ".remap");
+    char *copy = hdb_suffixed(&db->allocator, db->data_filename, ".compact");
+    struct hdb_compaction *compaction = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_compaction));
+    int rc = filename && copy && compaction ? 0 : -1;
+    FILE *file = rc == 0 ? fopen(filename, "rb") : NULL;
+    if (rc == 0 && file) {
+        struct hdb_remap_header header;
+        struct stat st;
+        compaction->resumed = true;
+        if (fread(&header, sizeof(struct hdb_remap_header), 1, file) != 1 || header.magic != HDB_REMAP_MAGIC ||
+            header.compactions != db->header.compactions) rc = -1;
+        compaction->count = header.count;
+        if (rc == 0 && (!(compaction->old_positions = hdb_calloc(&db->allocator, compaction->count, sizeof(uint64_t))) ||
+                        !(compaction->new_positions = hdb_calloc(&db->allocator, compaction->count, sizeof(uint64_t))) ||
+                        !(compaction->referenced = hdb_calloc(&db->allocator, compaction->count, sizeof(bool))) ||
+                        fread(compaction->old_positions, sizeof(uint64_t), compaction->count, file) != compaction->count ||
+                        fread(compaction->new_positions, sizeof(uint64_t), compaction->count, file) != compaction->count)) rc = -1;
+        if (rc == 0 && access(copy, F_OK) == 0) {
+            FILE *data_file = NULL;
+            if (rename(copy, db->data_filename) != 0 || hdb_sync_directory(db, db->data_filename) != 0 ||
+                !(data_file = fopen(db->data_filename, "rb+")) || fstat(fileno(data_file), &st) != 0) {
+                if (data_file) fclose(data_file);
+                rc = -1;
+            } else {
+                fclose(db->data_file);
+                db->data_file = data_file;
+                db->data_end = st.st_size;
+            }
+        }
+        if (rc == 0) rc = hdb_compaction_remap(db, compaction, true);
+    }
+    if (file) fclose(file);
+    if (rc == 0) {
+        db->header.state = HDB_STATE_OPEN;
+        if (hdb_write_header(db) != 0 || fsync(fileno(db->hash_file)) != 0) rc = -1;
+    }
+    if (rc == 0) remove(filename);
+    hdb_free(&db->allocator, filename);
+    hdb_free(&db->allocator, copy);
+    if (compaction) {
+        hdb_free(&db->allocator, compaction->old_positions);
+        hdb_free(&db->allocator, compaction->new_positions);
+        hdb_free(&db->allocator, compaction->referenced);
+        hdb_free(&db->allocator, compaction);
+    }
+    return rc;
+}
+
+// Rewrites the live records of the data file into a new file and swaps it in.
+// The bulk of the copy runs in chunks next to the writers, reading at most rate
+// bytes per second.  The tail written meanwhile is copied, the index remapped
+// and the files swapped with the lock held exclusively.
+int hdb_compact(struct hdb *db, uint64_t rate) {
+    if (hdb_touch_filter(db) != 0) return -1; // it is rebuilt along with the index
+    struct hdb_compaction *compaction = hdb_compaction_create(db, db->data_filename, NULL);
+    if (!compaction) return -1;
+    compaction->now = hdb_wall_clock();
+
+    // With no writer in between, every record up to end is complete and stays
+    // where it is, because free space is not reused from now on.  The blob
+    // file is compacted on its own, the refs copied here must not move
+    pthread_rwlock_wrlock(&db->lock);
+    uint64_t end = hdb_data_size(db);
+    pthread_mutex_lock(&db->alloc_lock);
+    bool busy = db->blob_compacting || db->header.state != HDB_STATE_OPEN; // a swap still marked is the next open's
+    db->compacting = !busy;
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_rwlock_unlock(&db->lock);
+    if (busy) {
+        hdb_compaction_free(db, compaction);
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = 0;
+    while (compaction->scanned < end) {
+        pthread_rwlock_rdlock(&db->lock);
+        uint64_t chunk_end = compaction->scanned + HDB_COMPACTION_CHUNK < end ? compaction->scanned + HDB_COMPACTION_CHUNK : end;
+        uint64_t scanned = compaction->scanned;
+        rc = hdb_compaction_scan(db, compaction, chunk_end);
+        if (db->stop_compaction_thread || __atomic_load_n(&db->pins, __ATOMIC_RELAXED)) rc = -1;
+        pthread_rwlock_unlock(&db->lock);
+        if (rc != 0) break;
+        if (compaction->scanned == scanned) break; // torn record, the final pass stops there too
+
+        // Sleep off whatever the copy is ahead of the rate limit
+        if (rate != UINT64_MAX) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+            double ahead = (double)compaction->scanned / rate - elapsed;
+            if (ahead > 0) {
+                struct timespec pause = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&db->lock);
+    struct hdb_map *old_map = db->data_map;
+    struct hdb_map *data_map = NULL;
+    struct hdb_pool *old_pool = db->data_pool;
+    struct hdb_pool *data_pool = NULL;
+    if (rc == 0 && (db->pins ||
+        hdb_compaction_scan(db, compaction, hdb_data_size(db)) != 0 || hdb_compaction_remap(db, compaction, false) != 0 ||
+         fflush(compaction->file) != 0)) {
+        rc = -1;
+    }
+
+    // Copies whose key was overwritten or deleted during the scan are dead in
+    // the new file too
+    uint64_t dead_bytes = 0;
+    if (rc == 0 && (hdb_compaction_bury(compaction, &dead_bytes) != 0 || fflush(compaction->file) != 0 ||
+                    fsync(fileno(compaction->file)) != 0)) {
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        if (old_map && (!(data_map = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_map))) ||
+                        hdb_map_open(data_map, compaction->file, old_map->chunk, old_map->reserve) != 0)) {
+            rc = -1;
+        }
+        if (old_pool && !(data_pool = hdb_pool_open(&db->allocator, compaction->file, compaction->filename,
+                                                    db->options.buffer_pool, db->options.buffer_pool_policy))) {
+            rc = -1;
+        }
+    }
+    // From the journal on a crash leaves the swap to the next open
+    struct hdb_remap_header journal = {HDB_REMAP_MAGIC, db->header.compactions + 1, compaction->count};
+    int journaled = rc == 0 ? hdb_compaction_journal(db, db->data_filename, HDB_STATE_SWAP, &journal,
+                                                     compaction->old_positions, compaction->new_positions, sizeof(uint64_t)) : -1;
+    if (journaled != 0 || rename(compaction->filename, db->data_filename) != 0) {
+        if (journaled == 0) journaled = hdb_compaction_unjournal(db, db->data_filename, true);
+        if (journaled == 1) {
+            // The journal may outlive this, the next open then has to find the copy
+            db->header.state = HDB_STATE_SWAP;
+            hdb_free(&db->allocator, compaction->filename);
+            compaction->filename = NULL;
+        }
+        if (data_map) {
+            hdb_map_close(data_map);
+            hdb_free(&db->allocator, data_map);
+        }
+        hdb_pool_close(data_pool);
+        pthread_mutex_lock(&db->alloc_lock);
+        db->compacting = false;
+        pthread_mutex_unlock(&db->alloc_lock);
+        pthread_rwlock_unlock(&db->lock);
+        hdb_compaction_free(db, compaction);
+        return -1;
+    }
+
+    // The rename has to be durable before the mark is cleared
+    bool durable = hdb_sync_directory(db, db->data_filename) == 0;
+
+    // Readers that overlap the swap see the structure counter move and retry
+    hdb_seq_write(&db->structure_seq);
+    if (hdb_compaction_remap(db, compaction, true) != 0) durable = false;
+    pthread_mutex_lock(&db->fsync_mutex);
+    FILE *old_file = db->data_file;
+    __atomic_store_n(&db->data_map, data_map, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->data_pool, data_pool, __ATOMIC_RELEASE); // before the file, a pool is only used with its own
+    __atomic_store_n(&db->data_file, compaction->file, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->data_generation, db->data_generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->data_end, compaction->written, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&db->fsync_mutex);
+    hdb_seq_write(&db->structure_seq);
+    compaction->file = NULL;
+    hdb_free(&db->allocator, compaction->filename);
+    compaction->filename = NULL;
+
+    // The free space of the old file goes away with it, extents still waiting
+    // for refs included
+    pthread_mutex_lock(&db->alloc_lock);
+    hdb_free_space_clear(&db->free_space);
+    db->free_space_pending = false;
+    for (struct hdb_limbo *limbo = db->limbo; limbo; limbo = limbo->next) limbo->length = 0;
+    for (size_t i = 0; i < compaction->count; ++i) {
+        if (compaction->referenced[i]) continue;
+        uint64_t position = compaction->new_positions[i];
+        struct hdb_record_header record;
+        if (hdb_read_at(db->data_file, position, &record, sizeof(struct hdb_record_header)) != 0) continue;
+        hdb_free_space_release(&db->free_space, position, hdb_record_size(record.key_length, record.value_length));
+    }
+    db->header.dead_bytes = dead_bytes;
+    db->expired_bytes = 0;
+    if (db->wheel) {
+        // Refiled at the positions of the copies, the old ones go with the file
+        hdb_wheel_clear(db->wheel, hdb_wall_clock());
+        for (size_t i = 0; i < compaction->count; ++i) {
+            if (compaction->referenced[i] && compaction->expiries[i]) {
+                hdb_wheel_add(db->wheel, compaction->expiries[i], compaction->new_positions[i]);
+            }
+        }
+    }
+    db->compacting = false;
+    pthread_mutex_unlock(&db->alloc_lock);
+    // The remapped index must reach the disk before the mark goes, else the next open finishes it
+    rc = durable ? hdb_compaction_seal(db, db->data_filename) : -1;
+    if (db->filter) hdb_rebuild_filter(db); // drops the bits of keys deleted since the last rebuild
+    pthread_rwlock_unlock(&db->lock);
+
+    // Lock-free readers may still hold the old file and mapping
+    hdb_synchronize(db);
+    hdb_pool_close(old_pool);
+    fclose(old_file);
+    if (old_map) {
+        hdb_retire_mapping(db, old_map);
+        hdb_free(&db->allocator, old_map);
+    }
+
+    hdb_compaction_free(db, compaction);
+    hdb_count(db, HDB_STAT_COMPACTIONS, 1);
+    return rc;
+}
+
+// Compacts the data file right away, without a rate limit.
+int db_compact(struct hdb *db) {
+    return hdb_compact(db, UINT64_MAX);
+}
+
+bool hdb_needs_blob_compaction(struct hdb *db) {
+    if (!db->blob_file || __atomic_load_n(&db->pins, __ATOMIC_RELAXED)) return false;
+    pthread_mutex_lock(&db->alloc_lock);
+    uint64_t size = db->blob_end;
+    uint64_t dead_bytes = db->header.blob_dead_bytes;
+    pthread_mutex_unlock(&db->alloc_lock);
+    return size >= db->options.compaction_min_size && dead_bytes >= db->options.compaction_ratio * size;
+}
+
+// Finds the ref of every record that went to the blob file and where it has
+// to point once the copy of its blob record is swapped in.  Called with the
+// lock exclusive, like hdb_compaction_remap, before anything is changed.
+int hdb_compaction_remap_blobs(struct hdb *db, struct hdb_compaction *compaction) {
+    compaction->remap_count = 0;
+    size_t entries = (size_t)1 << db->header.global_depth;
+    for (size_t i = 0; i < entries; ++i) {
+        struct hdb_bucket bucket;
+        if (hdb_read_bucket(db, db->directory[i], &bucket) != 0) return -1;
+        if (i >= ((size_t)1 << bucket.local_depth)) continue; // Already visited
+
+        for (uint32_t j = 0; j < HDB_BUCKET_SLOTS; ++j) {
+            struct hdb_slot *slot = &bucket.slots[j];
+            if (!(slot->flags & HDB_SLOT_USED) || !(hdb_slot_codec(slot) & HDB_CODEC_BLOB)) continue;
+
+            struct hdb_record_header record;
+            struct hdb_blob_ref ref;
+            if (hdb_data_read(db, slot->position, &record, sizeof(struct hdb_record_header)) != 0) return -1;
+            uint64_t ref_position = slot->position + sizeof(struct hdb_record_header) + record.key_length;
+            if (hdb_data_read(db, ref_position, &ref, sizeof(struct hdb_blob_ref)) != 0) return -1;
+            uint64_t offset = sizeof(struct hdb_record_header) + record.key_length;
+            int64_t copy = hdb_compaction_find(compaction, ref.position - offset);
+            if (copy < 0) return -1; // the ref points at a blob record that was not copied
+            compaction->referenced[copy] = true;
+            if (compaction->new_positions[copy] == ref.position - offset) continue; // stays where it is
+            if (compaction->remap_count == compaction->remap_capacity) {
+                size_t capacity = compaction->remap_capacity ? compaction->remap_capacity * 2 : 1024;
+                struct hdb_blob_remap *remaps = hdb_realloc(&db->allocator, compaction->remaps, capacity * sizeof(struct hdb_blob_remap));
+                if (!remaps) return -1;
+                compaction->remaps = remaps;
+                compaction->remap_capacity = capacity;
+            }
+            struct hdb_blob_remap *remap = &compaction->remaps[compaction->remap_count++];
+            remap->record = slot->position;
+            remap->from = ref.position;
+            remap->to = compaction->new_positions[copy] + offset;
+        }
+    }
+    return 0;
+}
+
+// Points the refs at the copies of their blob records.  A ref that no longer
+// points where it did was rewritten already, so this runs again after a crash
+// just as well.  One that cannot be written does not stop the others.
+int hdb_blob_remap_apply(struct hdb *db, const struct hdb_blob_remap *remaps, size_t count) {
+    int rc = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct hdb_record_header record;
+        struct hdb_blob_ref ref;
+        if (hdb_data_read(db, remaps[i].record, &record, sizeof(struct hdb_record_header)) != 0) {
+            rc = -1;
+            continue;
+        }
+        if ((record.flags & HDB_RECORD_DEAD) || !((record.flags >> HDB_RECORD_CODEC_SHIFT) & HDB_CODEC_BLOB)) continue;
+        uint64_t ref_position = remaps[i].record + sizeof(struct hdb_record_header) + record.key_length;
+        if (hdb_data_read(db, ref_position, &ref, sizeof(struct hdb_blob_ref)) != 0) {
+            rc = -1;
+            continue;
+        }
+        if (ref.position != remaps[i].from) continue;
+        ref.position = remaps[i].to;
+        if (hdb_data_write(db, ref_position, &ref, sizeof(struct hdb_blob_ref)) != 0) rc = -1;
+    }
+    return rc;
+}
+
+// Finishes the swap of a compacted blob file the last session marked in the
+// header but did not see through, the way hdb_finish_swap does for the data
+// file: the copy is moved over the blob file unless it was already, then the
+// refs are rewritten from the journal.  Without a journal the swap never
+// started.  Called at open, before anything else reads either file.
+int hdb_finish_blob_swap(struct hdb *db) {
+    char *filename = hdb_suffixed(&db->allocator, db->blob_filename, ".remap");
+    char *copy = hdb_suffixed(&db->allocator, db->blob_filename, ".compact");
+    struct hdb_blob_remap *remaps = NULL;
+    int rc = filename && copy ? 0 : -1;
+    FILE *file = rc == 0 ? fopen(filename, "rb") : NULL;
+    if (rc == 0 && file) {
+        struct hdb_remap_header header;
+        struct stat st;
+        if (fread(&header, sizeof(struct hdb_remap_header), 1, file) != 1 || header.magic != HDB_REMAP_MAGIC ||
+            header.compactions != db->header.compactions) rc = -1;
+        if (rc == 0 && header.count &&
+            (!(remaps = hdb_calloc(&db->allocator, header.count, sizeof(struct hdb_blob_remap))) ||
+             fread(remaps, sizeof(struct hdb_blob_remap), header.count, file) != header.count)) rc = -1;
+        if (rc == 0 && access(copy, F_OK) == 0) {
+            FILE *blob_file = NULL;
+            if (rename(copy, db->blob_filename) != 0 || hdb_sync_directory(db, db->blob_filename) != 0 ||
+                !(blob_file = fopen(db->blob_filename, "rb+")) || fstat(fileno(blob_file), &st) != 0) {
+                if (blob_file) fclose(blob_file);
+                rc = -1;
+            } else {
+                if (db->blob_file) fclose(db->blob_file);
+                db->blob_file = blob_file;
+                db->blob_end = st.st_size;
+            }
+        }
+        // The refs have to be durable before the mark goes
+        if (rc == 0 && (hdb_blob_remap_apply(db, remaps, header.count) != 0 || fsync(fileno(db->data_file)) != 0)) rc = -1;
+    }
+    if (file) fclose(file);
+    if (rc == 0) {
+        db->header.state = HDB_STATE_OPEN;
+        if (hdb_write_header(db) != 0 || fsync(fileno(db->hash_file)) != 0) rc = -1;
+    }
+    if (rc == 0) remove(filename);
+    hdb_free(&db->allocator, filename);
+    hdb_free(&db->allocator, copy);
+    hdb_free(&db->allocator, remaps);
+    return rc;
+}
+
+// Rewrites the live records of the blob file into a new file and swaps it in,
+// the same way hdb_compact does the data file.  The refs are rewritten in
+// place in the data file, so the two never run at once.
+int hdb_compact_blobs(struct hdb *db, uint64_t rate) {
+    if (!db->blob_file) return -1;
+    struct hdb_compaction *compaction = hdb_compaction_create(db, db->blob_filename, db->blob_file);
+    if (!compaction) return -1;
+
+    // Blob records are only appended, every one up to end is complete
+    pthread_rwlock_wrlock(&db->lock);
+    pthread_mutex_lock(&db->alloc_lock);
+    uint64_t end = db->blob_end;
+    bool busy = db->compacting || db->blob_compacting || db->pins || db->header.state != HDB_STATE_OPEN;
+    db->blob_compacting = !busy;
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_rwlock_unlock(&db->lock);
+    if (busy) {
+        hdb_compaction_free(db, compaction);
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = 0;
+    while (compaction->scanned < end) {
+        pthread_rwlock_rdlock(&db->lock);
+        uint64_t chunk_end = compaction->scanned + HDB_COMPACTION_CHUNK < end ? compaction->scanned + HDB_COMPACTION_CHUNK : end;
+        uint64_t scanned = compaction->scanned;
+        rc = hdb_compaction_scan(db, compaction, chunk_end);
+        if (db->stop_compaction_thread || __atomic_load_n(&db->pins, __ATOMIC_RELAXED)) rc = -1;
+        pthread_rwlock_unlock(&db->lock);
+        if (rc != 0) break;
+        if (compaction->scanned == scanned) break;
+
+        if (rate != UINT64_MAX) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+            double ahead = (double)compaction->scanned / rate - elapsed;
+            if (ahead > 0) {
+                struct timespec pause = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&db->lock);
+    if (rc == 0 && (db->pins || hdb_compaction_scan(db, compaction, db->blob_end) != 0 ||
+                    hdb_compaction_remap_blobs(db, compaction) != 0 || fflush(compaction->file) != 0)) {
+        rc = -1;
+    }
+    uint64_t dead_bytes = 0;
+    if (rc == 0 && (hdb_compaction_bury(compaction, &dead_bytes) != 0 || fflush(compaction->file) != 0 ||
+                    fsync(fileno(compaction->file)) != 0)) {
+        rc = -1;
+    }
+    // From the journal on a crash leaves the swap to the next open
+    struct hdb_remap_header journal = {HDB_REMAP_MAGIC, db->header.compactions, compaction->remap_count};
+    int journaled = rc == 0 ? hdb_compaction_journal(db, db->blob_filename, HDB_STATE_BLOB_SWAP, &journal,
+                                                     compaction->remaps, NULL, sizeof(struct hdb_blob_remap)) : -1;
+    if (journaled != 0 || rename(compaction->filename, db->blob_filename) != 0) {
+        if (journaled == 0) journaled = hdb_compaction_unjournal(db, db->blob_filename, true);
+        if (journaled == 1) {
+            // The journal may outlive this, the next open then has to find the copy
+            db->header.state = HDB_STATE_BLOB_SWAP;
+            hdb_free(&db->allocator, compaction->filename);
+            compaction->filename = NULL;
+        }
+        pthread_mutex_lock(&db->alloc_lock);
+        db->blob_compacting = false;
+        pthread_mutex_unlock(&db->alloc_lock);
+        pthread_rwlock_unlock(&db->lock);
+        hdb_compaction_free(db, compaction);
+        return -1;
+    }
+
+    // The rename has to be durable before the mark is cleared
+    bool durable = hdb_sync_directory(db, db->blob_filename) == 0;
+
+    // Readers that overlap the swap see the structure counter move and retry
+    hdb_seq_write(&db->structure_seq);
+    if (hdb_blob_remap_apply(db, compaction->remaps, compaction->remap_count) != 0) durable = false;
+    pthread_mutex_lock(&db->fsync_mutex);
+    FILE *old_file = db->blob_file;
+    __atomic_store_n(&db->blob_file, compaction->file, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->blob_generation, db->blob_generation + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&db->fsync_mutex);
+    hdb_seq_write(&db->structure_seq);
+    compaction->file = NULL;
+    hdb_free(&db->allocator, compaction->filename);
+    compaction->filename = NULL;
+
+    pthread_mutex_lock(&db->alloc_lock);
+    db->blob_end = compaction->written;
+    db->header.blob_dead_bytes = dead_bytes;
+    db->blob_compacting = false;
+    pthread_mutex_unlock(&db->alloc_lock);
+    // The rewritten refs must reach the disk before the mark goes, the
+    // header may land before the data file within the checkpoint
+    if (durable && fsync(fileno(db->data_file)) != 0) durable = false;
+    rc = durable ? hdb_compaction_seal(db, db->blob_filename) : -1;
+    pthread_rwlock_unlock(&db->lock);
+
+    // Lock-free readers may still hold the old file
+    hdb_synchronize(db);
+    fclose(old_file);
+    hdb_compaction_free(db, compaction);
+    hdb_count(db, HDB_STAT_BLOB_COMPACTIONS, 1);
+    return rc;
+}
+
+// Compacts the blob file right away, without a rate limit.
+int db_compact_blobs(struct hdb *db) {
+    return hdb_compact_blobs(db, UINT64_MAX);
+}
+
+// Opens a read view of the database as it is now.  Gets through it see
+// neither the writes nor the deletes that come after, and
+// db_snapshot_cursor scans it, which makes for a consistent backup while
+// writers carry on.  Writers only pay for saving each bucket page they
+// change once per snapshot.  Must be released before db_close.
+struct hdb_snapshot* db_snapshot_open(struct hdb *db) {
+    struct hdb_snapshot *snapshot = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_snapshot));
+    if (!snapshot) return NULL;
+    snapshot->db = db;
+
+    // With no writer in between, the index matches the data file up to end
+    pthread_rwlock_wrlock(&db->lock);
+    size_t entries = (size_t)1 << db->header.global_depth;
+    snapshot->global_depth = db->header.global_depth;
+    snapshot->page_count = db->header.page_count;
+    snapshot->directory = hdb_malloc(&db->allocator, entries * sizeof(uint32_t));
+    snapshot->pages = hdb_calloc(&db->allocator, snapshot->page_count, sizeof(struct hdb_bucket*));
+    if (!snapshot->directory || !snapshot->pages) {
+        pthread_rwlock_unlock(&db->lock);
+        hdb_free(&db->allocator, snapshot->directory);
+        hdb_free(&db->allocator, snapshot->pages);
+        hdb_free(&db->allocator, snapshot);
+        return NULL;
+    }
+    memcpy(snapshot->directory, db->directory, entries * sizeof(uint32_t));
+    snapshot->end = hdb_data_size(db);
+    pthread_mutex_lock(&db->wal.lock);
+    snapshot->sequence = db->header.sequence;
+    pthread_mutex_unlock(&db->wal.lock);
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins++;
+    pthread_mutex_unlock(&db->alloc_lock);
+    snapshot->next = db->snapshots;
+    if (db->snapshots) db->snapshots->prev = snapshot;
+    db->snapshots = snapshot;
+    pthread_rwlock_unlock(&db->lock);
+    return snapshot;
+}
+
+void db_snapshot_release(struct hdb_snapshot *snapshot) {
+    if (!snapshot) return;
+    struct hdb *db = snapshot->db;
+    pthread_rwlock_wrlock(&db->lock);
+    if (snapshot->prev) {
+        snapshot->prev->next = snapshot->next;
+    } else {
+        db->snapshots = snapshot->next;
+    }
+    if (snapshot->next) snapshot->next->prev = snapshot->prev;
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins--;
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_rwlock_unlock(&db->lock);
+
+    for (uint32_t page = 0; page < snapshot->page_count; ++page) hdb_free(&db->allocator, snapshot->pages[page]);
+    hdb_free(&db->allocator, snapshot->pages);
+    hdb_free(&db->allocator, snapshot->directory);
+    hdb_free(&db->allocator, snapshot);
+}
+
+// Saves the bucket at page for every snapshot that still sees it as it is.
+// Called by whoever is about to change it, with the bucket's stripe locked or
+// the lock held exclusively, so the page cannot change under the copy.
+int hdb_snapshot_preserve(struct hdb *db, uint32_t page) {
+    for (struct hdb_snapshot *snapshot = db->snapshots; snapshot; snapshot = snapshot->next) {
+        if (page >= snapshot->page_count || snapshot->pages[page]) continue;
+        struct hdb_bucket *copy = hdb_malloc(&db->allocator, sizeof(struct hdb_bucket));
+        if (!copy) return -1;
+        if (hdb_read_bucket(db, page, copy) != 0) {
+            hdb_free(&db->allocator, copy);
+            return -1;
+        }
+        __atomic_store_n(&snapshot->pages[page], copy, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Copies out the slots of the probe run of key whose hash and fingerprint
+// match, as the snapshot sees them.  Returns how many there are, or -1 when a
+// writer got in the way.
+int hdb_snapshot_probe(struct hdb_snapshot *snapshot, const uint8_t *key, size_t key_length, struct hdb_slot *candidates) {
+    struct hdb *db = snapshot->db;
+    uint64_t hash = db->hash(key, key_length);
+    uint32_t fingerprint = fingerprint_function(key, key_length);
+    uint32_t page = snapshot->directory[hash & (((uint64_t)1 << snapshot->global_depth) - 1)];
+    struct hdb_read read;
+    read.structure_seq = hdb_seq_read(&db->structure_seq);
+    if (read.structure_seq & 1) return -1;
+    read.stripe = hdb_stripe_for(db, page);
+    read.stripe_seq = hdb_seq_read(&read.stripe->seq);
+
+    // A saved copy never changes, a page that has none is as the snapshot saw
+    // it unless a writer is about to save it right now
+    struct hdb_bucket bucket;
+    const struct hdb_bucket *saved = __atomic_load_n(&snapshot->pages[page], __ATOMIC_ACQUIRE);
+    if (saved) {
+        memcpy(&bucket, saved, sizeof(struct hdb_bucket));
+    } else if (hdb_read_bucket(db, page, &bucket) != 0 || !hdb_read_valid(db, &read)) {
+        return -1;
+    }
+
+    int found = 0;
+    uint32_t index = hdb_home_slot(fingerprint);
+    for (uint32_t probe = 0; probe < HDB_MAX_PROBE; ++probe) {
+        const struct hdb_slot *slot = &bucket.slots[index];
+        if (!(slot->flags & HDB_SLOT_USED)) break;
+        if (slot->hash == hash && slot->fingerprint == fingerprint) candidates[found++] = *slot;
+        index = (index + 1) % HDB_BUCKET_SLOTS;
+    }
+    return found;
+}
+
+// Finds the slot the snapshot has for key.  The records it points at stay
+// where they are while the snapshot is open, so they are read without checks.
+int hdb_snapshot_lookup(struct hdb_snapshot *snapshot, const uint8_t *key, size_t key_length, struct hdb_slot *slot) {
+    struct hdb *db = snapshot->db;
+    struct hdb_slot candidates[HDB_MAX_PROBE];
+    int count;
+    for (;;) {
+        uint32_t token = hdb_read_enter(db);
+        count = hdb_snapshot_probe(snapshot, key, key_length, candidates);
+        hdb_read_exit(db, token);
+        if (count >= 0) break;
+        sched_yield();
+    }
+    for (int i = 0; i < count; ++i) {
+        if (!hdb_record_has_key(hdb_data_pool(db), hdb_data_file(db), hdb_data_map(db), candidates[i].position, key, key_length)) continue;
+        *slot = candidates[i];
+        return 0;
+    }
+    return -1;
+}
+
+// Looks key up as it was when the snapshot was opened.  value must have room
+// for the value, as with db_get.
+int db_snapshot_get(struct hdb_snapshot *snapshot, const uint8_t *key, size_t key_length, uint8_t *value, size_t *value_length) {
+    struct hdb *db = snapshot->db;
+    struct hdb_slot slot;
+    if (hdb_snapshot_lookup(snapshot, key, key_length, &slot) != 0) return -1;
+    uint64_t offset = slot.position + sizeof(struct hdb_record_header) + key_length;
+    uint32_t codec = hdb_slot_codec(&slot);
+    uint64_t length = slot.length;
+    if (codec == HDB_CODEC_NONE) {
+        if (hdb_data_read(db, offset, value, length) != 0) return -1;
+        *value_length = length;
+        return 0;
+    }
+    uint8_t stack[HDB_GET_SCRATCH];
+    uint8_t *stored = length > HDB_GET_SCRATCH ? hdb_malloc(&db->allocator, length) : stack;
+    if (!stored) return -1;
+    int rc = hdb_data_read(db, offset, stored, length);
+    if (rc == 0) rc = hdb_decode_value(db, hdb_blob_file(db), codec, stored, length, value, value_length); // pinned, no blob compaction
+    if (stored != stack) hdb_free(&db->allocator, stored);
+    return rc;
+}
+
+// Whether the index still points key at the record at position.  Runs in a
+// read section, returns 0 when it does, -1 when not and 1 when a writer got
+// in the way.
+int hdb_record_live(struct hdb *db, const uint8_t *key, size_t key_length, uint64_t position) {
+    struct hdb_read read;
+    struct hdb_slot candidates[HDB_MAX_PROBE];
+    int count = hdb_probe(db, key, key_length, &read, candidates);
+    if (count < 0) return 1;
+    for (int i = 0; i < count; ++i) {
+        if (candidates[i].position == position) return 0;
+    }
+    return hdb_read_valid(db, &read) ? -1 : 1;
+}
+
+// Work shared by the threads that rebuild what a session that did not close
+// left stale.  Task 0 walks the data file, every other one adds a range of
+// the directory to a new filter.
+struct hdb_recovery {
+    struct hdb *db;
+    struct hdb_filter *filter; // with options.filter_bits
+    uint32_t ranges; // of the directory
+    uint32_t tasks;
+    uint32_t next_task;
+    uint64_t key_count; // found in the buckets
+    uint64_t blob_bytes; // of the blob records the buckets lead to
+    int rc;
+};
+
+// Rebuilds the free space and the dead byte count from the record headers
+// of the data file.  A dead record the index still points at is left out,
+// the log replayed afterwards retires it again.  The walk ends at the first
+// record that runs past the end of the file, which a crash cut short.
+int hdb_recover_free_space(struct hdb *db) {
+    uint8_t *buffer = hdb_malloc(&db->allocator, HDB_RECOVERY_CHUNK);
+    if (!buffer) return -1;
+    uint8_t *key = NULL;
+    size_t key_capacity = 0;
+    uint64_t size = db->data_end, dead_bytes = 0;
+    uint64_t start = 0, length = 0; // of the part of the file in buffer
+    int rc = 0;
+    for (uint64_t offset = 0; offset + sizeof(struct hdb_record_header) <= size;) {
+        if (offset + sizeof(struct hdb_record_header) > start + length) {
+            start = offset;
+            length = size - offset < HDB_RECOVERY_CHUNK ? size - offset : HDB_RECOVERY_CHUNK;
+            if ((rc = hdb_data_read(db, start, buffer, length)) != 0) break;
+        }
+        struct hdb_record_header record;
+        memcpy(&record, buffer + (offset - start), sizeof(struct hdb_record_header));
+        if (record.value_length > size) break;
+        uint64_t extent = hdb_record_size(record.key_length, record.value_length) + hdb_record_padding(record.flags);
+        if (extent > size - offset) break;
+
+        if (record.flags & HDB_RECORD_DEAD) {
+            const uint8_t *stored = buffer + (offset - start) + sizeof(struct hdb_record_header);
+            if (offset + sizeof(struct hdb_record_header) + record.key_length > start + length) {
+                if (record.key_length > key_capacity) {
+                    uint8_t *grown = hdb_realloc(&db->allocator, key, record.key_length);
+                    if (!grown) {
+                        rc = -1;
+                        break;
+                    }
+                    key = grown;
+                    key_capacity = record.key_length;
+                }
+                if ((rc = hdb_data_read(db, offset + sizeof(struct hdb_record_header), key, record.key_length)) != 0) break;
+                stored = key;
+            }
+            uint32_t token = hdb_read_enter(db);
+            int live = hdb_record_live(db, stored, record.key_length, offset);
+            hdb_read_exit(db, token);
+            if (live < 0) {
+                if ((rc = hdb_free_space_release(&db->free_space, offset, extent)) != 0) break;
+                dead_bytes += extent;
+            }
+        } else if (record.flags & HDB_RECORD_TOMBSTONE) {
+            dead_bytes += extent;
+        }
+        offset += extent;
+    }
+    hdb_free(&db->allocator, key);
+    hdb_free(&db->allocator, buffer);
+    if (rc == 0) db->header.dead_bytes = dead_bytes;
+    return rc;
+}
+
+// Adds the keys of the buckets first reached from one range of the
+// directory to the filter and counts them, along with the bytes of the blob
+// records they lead to.
+int hdb_recover_buckets(struct hdb_recovery *recovery, uint32_t range) {
+    struct hdb *db = recovery->db;
+    size_t entries = (size_t)1 << db->header.global_depth;
+    uint64_t keys = 0, blob_bytes = 0;
+    for (size_t i = entries * range / recovery->ranges; i < entries * (range + 1) / recovery->ranges; ++i) {
+        struct hdb_bucket bucket;
+        if (hdb_read_bucket(db, db->directory[i], &bucket) != 0) return -1;
+        if (i >= ((size_t)1 << bucket.local_depth)) continue; // Visited from a lower entry
+        for (uint32_t j = 0; j < HDB_BUCKET_SLOTS; ++j) {
+            const struct hdb_slot *slot = &bucket.slots[j];
+            if (!(slot->flags & HDB_SLOT_USED)) continue;
+            if (recovery->filter) hdb_filter_add(recovery->filter, slot->hash, slot->fingerprint);
+            keys++;
+            if (!(hdb_slot_codec(slot) & HDB_CODEC_BLOB)) continue;
+            struct hdb_record_header record;
+            struct hdb_blob_ref ref;
+            if (hdb_data_read(db, slot->position, &record, sizeof(struct hdb_record_header)) != 0 ||
+                hdb_data_read(db, slot->position + sizeof(struct hdb_record_header) + record.key_length, &ref, sizeof(struct hdb_blob_ref)) != 0) return -1;
+            blob_bytes += hdb_record_size(record.key_length, ref.stored_length);
+        }
+    }
+    __atomic_fetch_add(&recovery->key_count, keys, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&recovery->blob_bytes, blob_bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void* hdb_recovery_worker(void *arg) {
+    struct hdb_recovery *recovery = arg;
+    uint32_t task;
+    while ((task = __atomic_fetch_add(&recovery->next_task, 1, __ATOMIC_RELAXED)) < recovery->tasks) {
+        int rc = task == 0 ? hdb_recover_free_space(recovery->db) : hdb_recover_buckets(recovery, task - 1);
+        if (rc != 0) __atomic_store_n(&recovery->rc, -1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Rebuilds the free space, the dead byte counts and the filter after a
+// session that did not close, on up to one thread per core, before the log
+// is replayed.  The files the last clean close wrote are ignored, they may
+// hand out space that is in use again or miss keys written since.  Called at
+// open.
+int hdb_recover(struct hdb *db) {
+    struct hdb_recovery recovery;
+    memset(&recovery, 0, sizeof(struct hdb_recovery));
+    recovery.db = db;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cores < 1 ? 1 : cores > 64 ? 64 : cores;
+    if (db->options.filter_bits && !(recovery.filter = hdb_filter_create(&db->allocator, db->header.key_count, db->options.filter_bits))) {
+        return -1;
+    }
+    if (recovery.filter || db->blob_file) {
+        size_t entries = (size_t)1 << db->header.global_depth;
+        recovery.ranges = entries < threads * 4 ? entries : threads * 4;
+    }
+    recovery.tasks = 1 + recovery.ranges;
+
+    hdb_free_space_clear(&db->free_space);
+    pthread_t workers[64];
+    uint32_t count = recovery.tasks < threads ? recovery.tasks : threads;
+    uint32_t started = 0;
+    while (started + 1 < count && pthread_create(&workers[started], NULL, hdb_recovery_worker, &recovery) == 0) started++;
+    hdb_recovery_worker(&recovery);
+    for (uint32_t i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+    if (recovery.rc != 0) {
+        hdb_aligned_free(&db->allocator, recovery.filter);
+        return -1;
+    }
+    if (recovery.filter) {
+        // The header may predate keys that reached the index, the buckets do not
+        db->header.key_count = recovery.key_count;
+        db->filter = recovery.filter;
+    }
+    if (db->blob_file) {
+        // Whatever the live refs do not cover is dead, flagged so or not
+        db->header.blob_dead_bytes = db->blob_end > recovery.blob_bytes ? db->blob_end - recovery.blob_bytes : 0;
+    }
+    return 0;
+}
+
+// Scans every key in the order of the data file, reading it ahead in large
+// chunks.  The scan covers the data file as it was when the cursor was
+// opened: a key left alone meanwhile is returned once with its value, one
+// written or deleted meanwhile may be returned with either value or missed.
+// Writers carry on while the cursor is open, but dead space is not reused and
+// compaction does not run until it is closed.
+struct hdb_cursor* db_cursor_open(struct hdb *db) {
+    struct hdb_cursor *cursor = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_cursor));
+    if (!cursor) return NULL;
+    cursor->db = db;
+
+    // With no writer in between, every record up to end is complete and stays
+    // where it is, because free space is not reused from now on
+    pthread_rwlock_wrlock(&db->lock);
+    cursor->end = hdb_data_size(db);
+    pthread_mutex_lock(&db->alloc_lock);
+    db->pins++;
+    pthread_mutex_unlock(&db->alloc_lock);
+    pthread_rwlock_unlock(&db->lock);
+    return cursor;
+}
+
+// Scans the keys from start, included, up to end, excluded, in order.  Either
+// may be NULL for no bound.  Needs HDB_OPEN_SORTED_INDEX, and holds nobody up.
+// A key left alone meanwhile is returned once with its value.
+struct hdb_cursor* db_cursor_open_range(struct hdb *db, const uint8_t *start, size_t start_length,
+                                        const uint8_t *end, size_t end_length) {
+    if (!db->sorted) return NULL;
+    struct hdb_cursor *cursor = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_cursor));
+    if (!cursor) return NULL;
+    cursor->db = db;
+    cursor->sorted = true;
+    cursor->inclusive = true;
+    if (!start) start_length = 0;
+    if (!end) end_length = 0;
+    cursor->last = hdb_malloc(&db->allocator, start_length);
+    cursor->high = end ? hdb_malloc(&db->allocator, end_length) : NULL;
+    if (!cursor->last || (end && !cursor->high)) {
+        hdb_free(&db->allocator, cursor->last);
+        hdb_free(&db->allocator, cursor->high);
+        hdb_free(&db->allocator, cursor);
+        return NULL;
+    }
+    if (start_length) memcpy(cursor->last, start, start_length);
+    cursor->last_length = start_length;
+    cursor->last_capacity = start_length;
+    if (end_length) memcpy(cursor->high, end, end_length);
+    cursor->high_length = end_length;
+    return cursor;
+}
+
+// Scans the keys starting with prefix in order, as db_cursor_open_range.
+struct hdb_cursor* db_cursor_open_prefix(struct hdb *db, const uint8_t *prefix, size_t prefix_length) {
+    // The keys with the prefix end where the prefix with its last byte that
+    // can be incremented incremented, and the rest dropped, starts
+    uint8_t stack[256];
+    uint8_t *end = prefix_length > sizeof(stack) ? hdb_malloc(&db->allocator, prefix_length) : stack;
+    if (!end) return NULL;
+    size_t end_length = prefix_length;
+    if (prefix_length) memcpy(end, prefix, prefix_length);
+    while (end_length && end[end_length - 1] == 0xff) end_length--;
+    if (end_length) end[end_length - 1]++;
+    struct hdb_cursor *cursor = db_cursor_open_range(db, prefix, prefix_length, end_length ? end : NULL, end_length);
+    if (end != stack) hdb_free(&db->allocator, end);
+    return cursor;
+}
+
+// Makes sure the bytes of the data file from position on, length of them, are
+// in the read ahead buffer.
+int hdb_cursor_fill(struct hdb_cursor *cursor, uint64_t position, size_t length) {
+    if (position >= cursor->buffer_start && position + length <= cursor->buffer_start + cursor->buffer_length) return 0;
+    size_t size = length > HDB_CURSOR_CHUNK ? length : HDB_CURSOR_CHUNK;
+    if (size > cursor->end - position) size = cursor->end - position;
+    if (size > cursor->buffer_capacity) {
+        uint8_t *buffer = hdb_realloc(&cursor->db->allocator, cursor->buffer, size);
+        if (!buffer) return -1;
+        cursor->buffer = buffer;
+        cursor->buffer_capacity = size;
+    }
+    if (hdb_data_read(cursor->db, position, cursor->buffer, size) != 0) return -1;
+    cursor->buffer_start = position;
+    cursor->buffer_length = size;
+    return 0;
+}
 
-    fseek(db->hash_file, hash % 128 * sizeof(uint64_t) * 2, SEEK_SET);
-    uint64_t position, length;
-    fread(&position, sizeof(uint64_t), 1, db->hash_file);
-    fread(&length, sizeof(uint64_t), 1, db->hash_file);
+// Moves a scan of the data file to its next live record.  Without values only
+// the key is set.  Returns 0 for a record, 1 at the end and -1 on failure.
+int hdb_scan_next(struct hdb_cursor *cursor, bool values) {
+    struct hdb *db = cursor->db;
+    while (cursor->position + sizeof(struct hdb_record_header) <= cursor->end) {
+        uint64_t position = cursor->position;
+        struct hdb_record_header record;
+        if (hdb_cursor_fill(cursor, position, sizeof(struct hdb_record_header)) != 0) return -1;
+        memcpy(&record, cursor->buffer + (position - cursor->buffer_start), sizeof(struct hdb_record_header));
+        uint64_t size = hdb_record_size(record.key_length, record.value_length);
+        if (position + size + hdb_record_padding(record.flags) > cursor->end) break; // a torn record at the very end of the log
+        cursor->position = position + size + hdb_record_padding(record.flags);
 
-    fseek(db->data_file, position, SEEK_SET);
-    size_t total_read = 0;
-    while (total_read < length) {
-        size_t to_read = (length - total_read > BLOCK_SIZE) ? BLOCK_SIZE : length - total_read;
-        fread(value + total_read, sizeof(uint8_t), to_read, db->data_file);
-        total_read += to_read;
+        // The dead flag may be stale in the buffer, the index has the last
+        // word.  A record that died after the snapshot is still in it.
+        if (record.flags & HDB_RECORD_TOMBSTONE) continue;
+        if ((record.flags & HDB_RECORD_DEAD) && !cursor->snapshot) continue;
+        if (hdb_cursor_fill(cursor, position, size) != 0) return -1;
+        const uint8_t *key = cursor->buffer + (position - cursor->buffer_start) + sizeof(struct hdb_record_header);
+        int rc;
+        if (cursor->snapshot) {
+            struct hdb_slot slot;
+            rc = hdb_snapshot_lookup(cursor->snapshot, key, record.key_length, &slot) == 0 && slot.position == position ? 0 : -1;
+        } else {
+            for (;;) {
+                uint32_t token = hdb_read_enter(db);
+                rc = hdb_record_live(db, key, record.key_length, position);
+                hdb_read_exit(db, token);
+                if (rc != 1) break;
+                sched_yield();
+            }
+        }
+        if (rc != 0) continue;
+
+        const uint8_t *stored = key + record.key_length;
+        uint32_t codec = (record.flags >> HDB_RECORD_CODEC_SHIFT) & 0xff;
+        if (hdb_expired(codec, stored, record.value_length)) continue;
+        cursor->key = key;
+        cursor->key_length = record.key_length;
+        if (!values) return 0;
+        if (codec == HDB_CODEC_NONE) {
+            cursor->value = stored;
+            cursor->value_length = record.value_length;
+            return 0;
+        }
+        uint64_t length = hdb_decoded_length(codec, stored, record.value_length);
+        if (length > cursor->decoded_capacity) {
+            uint8_t *decoded = hdb_realloc(&db->allocator, cursor->decoded, length);
+            if (!decoded) return -1;
+            cursor->decoded = decoded;
+            cursor->decoded_capacity = length;
+        }
+        if (hdb_decode_value(db, hdb_blob_file(db), codec, stored, record.value_length, cursor->decoded, &cursor->value_length) != 0) return -1;
+        cursor->value = cursor->decoded;
+        return 0;
+    }
+    return 1;
+}
+
+// Scans every key of the snapshot in the order of the data file, as
+// db_cursor_open does for the live database.  Close the cursor before
+// releasing the snapshot.
+struct hdb_cursor* db_snapshot_cursor(struct hdb_snapshot *snapshot) {
+    struct hdb_cursor *cursor = hdb_calloc(&snapshot->db->allocator, 1, sizeof(struct hdb_cursor));
+    if (!cursor) return NULL;
+    cursor->db = snapshot->db;
+    cursor->snapshot = snapshot;
+    cursor->end = snapshot->end;
+    return cursor;
+}
+
+// Moves a scan of the sorted index to the next key that is still stored.
+int hdb_sorted_next(struct hdb_cursor *cursor) {
+    struct hdb *db = cursor->db;
+    struct hdb_sorted_index *sorted = db->sorted;
+    for (;;) {
+        pthread_mutex_lock(&sorted->lock);
+        const struct hdb_key_node *next = hdb_key_next(sorted->root, cursor->last, cursor->last_length, cursor->inclusive);
+        if (next && cursor->high && hdb_key_compare(next->key, next->key_length, cursor->high, cursor->high_length) >= 0) {
+            next = NULL;
+        }
+        if (next && next->key_length > cursor->last_capacity) {
+            uint8_t *last = hdb_realloc(&db->allocator, cursor->last, next->key_length);
+            if (!last) {
+                pthread_mutex_unlock(&sorted->lock);
+                return -1;
+            }
+            cursor->last = last;
+            cursor->last_capacity = next->key_length;
+        }
+        if (next) {
+            memcpy(cursor->last, next->key, next->key_length);
+            cursor->last_length = next->key_length;
+        }
+        pthread_mutex_unlock(&sorted->lock);
+        if (!next) return 1;
+        cursor->inclusive = false;
+
+        // A key deleted since is skipped
+        int rc = db_get_ref(db, cursor->last, cursor->last_length, &cursor->ref);
+        if (rc != 0) continue;
+        cursor->held = true;
+        cursor->key = cursor->last;
+        cursor->key_length = cursor->last_length;
+        cursor->value = cursor->ref.data;
+        cursor->value_length = cursor->ref.length;
+        return 0;
     }
-    *value_length = length;
+}
+
+// Moves the cursor to the next key.  Returns 0 with key and value set, 1 when
+// the scan is over and -1 on failure.  Cursors must be closed before db_close.
+int db_cursor_next(struct hdb_cursor *cursor) {
+    if (cursor->held) {
+        db_release_ref(&cursor->ref);
+        cursor->held = false;
+    }
+    return cursor->sorted ? hdb_sorted_next(cursor) : hdb_scan_next(cursor, true);
+}
+
+void db_cursor_close(struct hdb_cursor *cursor) {
+    if (!cursor) return;
+    struct hdb *db = cursor->db;
+    if (cursor->held) db_release_ref(&cursor->ref);
+    if (!cursor->sorted && !cursor->snapshot) {
+        pthread_mutex_lock(&db->alloc_lock);
+        db->pins--;
+        pthread_mutex_unlock(&db->alloc_lock);
+    }
+    hdb_free(&db->allocator, cursor->buffer);
+    hdb_free(&db->allocator, cursor->decoded);
+    hdb_free(&db->allocator, cursor->last);
+    hdb_free(&db->allocator, cursor->high);
+    hdb_free(&db->allocator, cursor);
+}
+
+// Fills the sorted index with every key of the data file, at open.
+int hdb_build_sorted_index(struct hdb *db) {
+    struct hdb_cursor *cursor = db_cursor_open(db);
+    if (!cursor) return -1;
+    int rc;
+    while ((rc = hdb_scan_next(cursor, false)) == 0) {
+        if (hdb_sorted_add(db, cursor->key, cursor->key_length) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    db_cursor_close(cursor);
+    return rc == 1 ? 0 : -1;
+}
+
+// Bulk loading builds the three files directly instead of going through
+// db_put.  Records go to the data file in the order they come, a chunk per
+// thread at a time, and the slots of the keys are sorted by their bit
+// reversed hash, which lays out the keys of every bucket, at any depth, next
+// to each other.  Buckets are then planned and written by several threads at
+// once, each over its own range of hash bits.
+uint64_t hdb_reverse64(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    return __builtin_bswap64(x);
+}
+
+// The first depth bits of a reversed hash, the low depth bits of the hash.
+uint64_t hdb_bulk_prefix(uint64_t reversed, uint32_t depth) {
+    return depth ? reversed >> (64 - depth) : 0;
+}
+
+// Records as read from the source, laid out as they go to the data file, and
+// their slots, whose hashes are kept reversed and positions relative to the
+// chunk until it is written.
+struct hdb_bulk_chunk {
+    uint8_t *records;
+    size_t size;
+    size_t capacity;
+    uint8_t *stored; // the records with their values compressed, NULL without compression
+    size_t stored_size;
+    size_t stored_capacity;
+    struct hdb_slot *slots;
+    size_t count;
+    size_t slot_capacity;
+};
+
+// The slots from start to end, whose reversed hashes start with the depth
+// bits of prefix, make up one bucket.
+struct hdb_bulk_bucket {
+    size_t start;
+    size_t end;
+    uint32_t depth;
+    uint64_t prefix;
+};
+
+// The keys whose reversed hashes start with the same HDB_BULK_PARTITION_BITS bits.
+struct hdb_bulk_partition {
+    struct hdb_slot *slots;
+    size_t count;
+    size_t capacity;
+    struct hdb_bulk_bucket *buckets;
+    size_t bucket_count;
+    size_t bucket_capacity;
+    uint32_t first_page; // of its buckets
+    uint64_t (*dead)[2]; // position and size of the records of keys that came again later
+    size_t dead_count;
+    size_t dead_capacity;
+};
+
+struct hdb_bulk {
+    struct hdb_options options; // with the defaults filled in
+    const struct hdb_allocator *allocator;
+    uint64_t (*hash)(const uint8_t *data, size_t length);
+    FILE *hash_file;
+    FILE *data_file;
+    uint64_t data_end;
+    uint32_t threads;
+    struct hdb_bulk_chunk *chunks; // one per thread
+    struct hdb_bulk_partition partitions[1 << HDB_BULK_PARTITION_BITS];
+    uint32_t depth; // of the buckets when the index is first cut up
+    uint64_t first_prefix; // of the buckets planned by the only partition, when depth is below HDB_BULK_PARTITION_BITS
+    uint32_t max_depth; // of any bucket
+    void (*work)(struct hdb_bulk *bulk, uint32_t task);
+    uint32_t tasks;
+    uint32_t next_task;
+    int rc;
+};
 
+// Grows an array to hold at least count elements.
+int hdb_bulk_reserve(const struct hdb_allocator *allocator, void **array, size_t *capacity, size_t count, size_t size) {
+    if (count <= *capacity) return 0;
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    if (grown < count) grown = count;
+    void *resized = hdb_realloc(allocator, *array, grown * size);
+    if (!resized) return -1;
+    *array = resized;
+    *capacity = grown;
     return 0;
 }
 
-void encode_deleted_blocks_array(struct hdb *db) {
-    fseek(db->deleted_blocks, 0, SEEK_SET);
-    fwrite(db->deleted_blocks_array, sizeof(int), db->deleted_blocks_array_size, db->deleted_blocks);
-    fsync(fileno(db->deleted_blocks));
+void* hdb_bulk_worker(void *arg) {
+    struct hdb_bulk *bulk = arg;
+    uint32_t task;
+    while ((task = __atomic_fetch_add(&bulk->next_task, 1, __ATOMIC_RELAXED)) < bulk->tasks) bulk->work(bulk, task);
+    return NULL;
 }
 
-void decode_deleted_blocks_array(struct hdb *db) {
-    fseek(db->deleted_blocks, 0, SEEK_END);
-    db->deleted_blocks_array_size = ftell(db->deleted_blocks) / sizeof(int);
-    fseek(db->deleted_blocks, 0, SEEK_SET);
-    db->deleted_blocks_array = malloc(db->deleted_blocks_array_size * sizeof(int));
-    fread(db->deleted_blocks_array, sizeof(int), db->deleted_blocks_array_size, db->deleted_blocks);
+void hdb_bulk_fail(struct hdb_bulk *bulk) {
+    __atomic_store_n(&bulk->rc, -1, __ATOMIC_RELAXED);
 }
 
-int db_delete(struct hdb *db, const uint8_t *key, size_t key_length) {
-    uint32_t hash = hash_function(key, key_length);
-    fseek(db->hash_file, hash % 128 * sizeof(uint32_t), SEEK_SET);
-    uint32_t stored_hash;
-    fread(&stored_hash, sizeof(uint32_t), 1, db->hash_file);
+// Runs work for every task up to tasks on up to one thread per core.
+int hdb_bulk_run(struct hdb_bulk *bulk, uint32_t tasks, void (*work)(struct hdb_bulk *bulk, uint32_t task)) {
+    pthread_t threads[64];
+    uint32_t count = tasks < bulk->threads ? tasks : bulk->threads;
+    bulk->work = work;
+    bulk->tasks = tasks;
+    bulk->next_task = 0;
+    uint32_t started = 0;
+    while (started + 1 < count && pthread_create(&threads[started], NULL, hdb_bulk_worker, bulk) == 0) started++;
+    hdb_bulk_worker(bulk);
+    for (uint32_t i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    return bulk->rc;
+}
+
+int hdb_bulk_append(struct hdb_bulk *bulk, struct hdb_bulk_chunk *chunk, const struct hdb_put_item *item) {
+    if (item->key_length > UINT32_MAX) return -1;
+    uint64_t size = hdb_record_size(item->key_length, item->value_length);
+    if (hdb_bulk_reserve(bulk->allocator, (void**)&chunk->records, &chunk->capacity, chunk->size + size, 1) != 0 ||
+        hdb_bulk_reserve(bulk->allocator, (void**)&chunk->slots, &chunk->slot_capacity, chunk->count + 1, sizeof(struct hdb_slot)) != 0) {
+        return -1;
+    }
+    struct hdb_record_header record = {item->key_length, 0, item->value_length};
+    memcpy(chunk->records + chunk->size, &record, sizeof(struct hdb_record_header));
+    memcpy(chunk->records + chunk->size + sizeof(struct hdb_record_header), item->key, item->key_length);
+    memcpy(chunk->records + chunk->size + sizeof(struct hdb_record_header) + item->key_length, item->value, item->value_length);
+    chunk->size += size;
+    chunk->count++;
+    return 0;
+}
+
+// Hashes the keys of a chunk and compresses its values.  Compression never
+// grows a record, so the compressed copy fits in the size of the original.
+void hdb_bulk_hash_chunk(struct hdb_bulk *bulk, uint32_t task) {
+    struct hdb_bulk_chunk *chunk = &bulk->chunks[task];
+    chunk->stored_size = 0;
+    if (bulk->options.compression != HDB_CODEC_NONE &&
+        hdb_bulk_reserve(bulk->allocator, (void**)&chunk->stored, &chunk->stored_capacity, chunk->size, 1) != 0) {
+        hdb_bulk_fail(bulk);
+        return;
+    }
+    uint64_t offset = 0;
+    for (size_t i = 0; i < chunk->count; ++i) {
+        struct hdb_record_header record;
+        memcpy(&record, chunk->records + offset, sizeof(struct hdb_record_header));
+        const uint8_t *key = chunk->records + offset + sizeof(struct hdb_record_header);
+        const uint8_t *value = key + record.key_length;
+        struct hdb_slot *slot = &chunk->slots[i];
+        slot->hash = hdb_reverse64(bulk->hash(key, record.key_length));
+        slot->fingerprint = fingerprint_function(key, record.key_length);
+        slot->position = offset;
+        slot->length = record.value_length;
+        slot->flags = HDB_SLOT_USED;
+        if (chunk->stored) {
+            uint8_t *compressed;
+            size_t stored_length;
+            uint32_t codec = hdb_compress_value(&bulk->options, bulk->allocator, value, record.value_length, &compressed, &stored_length);
+            struct hdb_record_header stored = {record.key_length, codec << HDB_RECORD_CODEC_SHIFT, stored_length};
+            uint8_t *out = chunk->stored + chunk->stored_size;
+            memcpy(out, &stored, sizeof(struct hdb_record_header));
+            memcpy(out + sizeof(struct hdb_record_header), key, record.key_length);
+            memcpy(out + sizeof(struct hdb_record_header) + record.key_length, compressed ? compressed : value, stored_length);
+            hdb_free(bulk->allocator, compressed);
+            slot->position = chunk->stored_size;
+            slot->length = stored_length;
+            slot->flags |= codec << HDB_SLOT_CODEC_SHIFT;
+            chunk->stored_size += hdb_record_size(record.key_length, stored_length);
+        }
+        offset += hdb_record_size(record.key_length, record.value_length);
+    }
+}
+
+// Appends a hashed chunk to the data file and hands its slots to their partitions.
+int hdb_bulk_write_chunk(struct hdb_bulk *bulk, struct hdb_bulk_chunk *chunk) {
+    const uint8_t *records = chunk->stored ? chunk->stored : chunk->records;
+    size_t size = chunk->stored ? chunk->stored_size : chunk->size;
+    if (hdb_write_at(bulk->data_file, bulk->data_end, records, size) != 0) return -1;
+    for (size_t i = 0; i < chunk->count; ++i) {
+        struct hdb_slot slot = chunk->slots[i];
+        slot.position += bulk->data_end;
+        struct hdb_bulk_partition *partition = &bulk->partitions[hdb_bulk_prefix(slot.hash, HDB_BULK_PARTITION_BITS)];
+        if (hdb_bulk_reserve(bulk->allocator, (void**)&partition->slots, &partition->capacity, partition->count + 1, sizeof(struct hdb_slot)) != 0) {
+            return -1;
+        }
+        partition->slots[partition->count++] = slot;
+    }
+    bulk->data_end += size;
+    chunk->size = 0;
+    chunk->count = 0;
+    return 0;
+}
+
+// Reads the source to its end, a chunk per thread at a time.
+int hdb_bulk_read(struct hdb_bulk *bulk, const struct hdb_bulk_source *source) {
+    int rc = 0;
+    while (rc == 0) {
+        uint32_t filled = 0;
+        while (rc == 0 && filled < bulk->threads) {
+            struct hdb_bulk_chunk *chunk = &bulk->chunks[filled];
+            struct hdb_put_item item;
+            while (chunk->size < HDB_BULK_CHUNK && (rc = source->next(source->context, &item)) == 0) {
+                if (hdb_bulk_append(bulk, chunk, &item) != 0) return -1;
+            }
+            if (chunk->count) filled++;
+        }
+        if (rc < 0 || hdb_bulk_run(bulk, filled, hdb_bulk_hash_chunk) != 0) return -1;
+        for (uint32_t i = 0; i < filled; ++i) {
+            if (hdb_bulk_write_chunk(bulk, &bulk->chunks[i]) != 0) return -1;
+        }
+    }
+    return rc == 1 ? 0 : -1;
+}
+
+int hdb_bulk_order(const void *a, const void *b) {
+    const struct hdb_slot *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->fingerprint != y->fingerprint) return x->fingerprint < y->fingerprint ? -1 : 1;
+    return x->position < y->position ? -1 : x->position > y->position;
+}
+
+// 1 when the records at a and b carry the same key, with the size of the
+// one at a, 0 when they do not and -1 on failure.
+int hdb_bulk_same_key(struct hdb_bulk *bulk, uint64_t a, uint64_t b, uint64_t *size) {
+    struct hdb_record_header x, y;
+    if (hdb_read_at(bulk->data_file, a, &x, sizeof(struct hdb_record_header)) != 0 ||
+        hdb_read_at(bulk->data_file, b, &y, sizeof(struct hdb_record_header)) != 0) return -1;
+    if (x.key_length != y.key_length) return 0;
+    *size = hdb_record_size(x.key_length, x.value_length);
+    uint8_t *key = hdb_malloc(bulk->allocator, x.key_length + 1);
+    if (!key) return -1;
+    int rc = hdb_read_at(bulk->data_file, a + sizeof(struct hdb_record_header), key, x.key_length) != 0 ? -1 :
+             hdb_record_has_key(NULL, bulk->data_file, NULL, b, key, x.key_length);
+    hdb_free(bulk->allocator, key);
+    return rc;
+}
+
+// Sorts a partition and drops every key that came again later, keeping the
+// last value as db_put would.  Equal keys have equal hashes and
+// fingerprints, so they end up next to each other.
+void hdb_bulk_sort_partition(struct hdb_bulk *bulk, uint32_t task) {
+    struct hdb_bulk_partition *partition = &bulk->partitions[task];
+    struct hdb_slot *slots = partition->slots;
+    if (partition->count > 1) qsort(slots, partition->count, sizeof(struct hdb_slot), hdb_bulk_order);
+    size_t kept = 0;
+    for (size_t i = 0; i < partition->count; ++i) {
+        bool later = false;
+        for (size_t j = i + 1; !later && j < partition->count && slots[j].hash == slots[i].hash && slots[j].fingerprint == slots[i].fingerprint; ++j) {
+            uint64_t size;
+            int same = hdb_bulk_same_key(bulk, slots[i].position, slots[j].position, &size);
+            if (same < 0 || (same && hdb_bulk_reserve(bulk->allocator, (void**)&partition->dead, &partition->dead_capacity,
+                                                       partition->dead_count + 1, sizeof(*partition->dead)) != 0)) {
+                hdb_bulk_fail(bulk);
+                return;
+            }
+            if (same) {
+                partition->dead[partition->dead_count][0] = slots[i].position;
+                partition->dead[partition->dead_count][1] = size;
+                partition->dead_count++;
+                later = true;
+            }
+        }
+        if (!later) slots[kept++] = slots[i];
+    }
+    partition->count = kept;
+}
+
+// Places count slots into a fresh bucket, turning their hashes back the right
+// way round.  Fails when they do not fit.
+int hdb_bulk_fill(struct hdb_bucket *bucket, const struct hdb_slot *slots, size_t count, uint32_t depth) {
+    memset(bucket, 0, sizeof(struct hdb_bucket));
+    bucket->local_depth = depth;
+    for (size_t i = 0; i < count; ++i) {
+        struct hdb_slot slot = slots[i];
+        slot.hash = hdb_reverse64(slot.hash);
+        if (hdb_bucket_insert(bucket, &slot) < 0) return -1;
+    }
+    return 0;
+}
+
+// Cuts the slots from start to end into buckets, one more hash bit at a time
+// until every bucket fits.
+int hdb_bulk_plan(struct hdb_bulk *bulk, struct hdb_bulk_partition *partition, struct hdb_bucket *scratch, size_t start, size_t end,
+                  uint32_t depth, uint64_t prefix) {
+    if (hdb_bulk_fill(scratch, partition->slots + start, end - start, depth) == 0) {
+        if (hdb_bulk_reserve(bulk->allocator, (void**)&partition->buckets, &partition->bucket_capacity, partition->bucket_count + 1,
+                             sizeof(struct hdb_bulk_bucket)) != 0) return -1;
+        partition->buckets[partition->bucket_count++] = (struct hdb_bulk_bucket){start, end, depth, prefix};
+        uint32_t max_depth = __atomic_load_n(&bulk->max_depth, __ATOMIC_RELAXED);
+        while (depth > max_depth && !__atomic_compare_exchange_n(&bulk->max_depth, &max_depth, depth, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        return 0;
+    }
+    if (depth == HDB_MAX_DEPTH) return -1;
+    size_t middle = start;
+    while (middle < end && hdb_bulk_prefix(partition->slots[middle].hash, depth + 1) == prefix << 1) middle++;
+    if (hdb_bulk_plan(bulk, partition, scratch, start, middle, depth + 1, prefix << 1) != 0) return -1;
+    return hdb_bulk_plan(bulk, partition, scratch, middle, end, depth + 1, prefix << 1 | 1);
+}
+
+// Gives every prefix of bulk->depth bits in a partition its buckets.
+void hdb_bulk_plan_partition(struct hdb_bulk *bulk, uint32_t task) {
+    struct hdb_bulk_partition *partition = &bulk->partitions[task];
+    uint64_t first = bulk->first_prefix, count = (uint64_t)1 << bulk->depth;
+    if (bulk->depth >= HDB_BULK_PARTITION_BITS) {
+        first = (uint64_t)task << (bulk->depth - HDB_BULK_PARTITION_BITS);
+        count = (uint64_t)1 << (bulk->depth - HDB_BULK_PARTITION_BITS);
+    }
+    struct hdb_bucket *scratch = hdb_malloc(bulk->allocator, sizeof(struct hdb_bucket));
+    if (!scratch) {
+        hdb_bulk_fail(bulk);
+        return;
+    }
+    size_t start = 0;
+    for (uint64_t prefix = first; prefix < first + count; ++prefix) {
+        size_t end = start;
+        while (end < partition->count && hdb_bulk_prefix(partition->slots[end].hash, bulk->depth) == prefix) end++;
+        if (hdb_bulk_plan(bulk, partition, scratch, start, end, bulk->depth, prefix) != 0) {
+            hdb_bulk_fail(bulk);
+            break;
+        }
+        start = end;
+    }
+    hdb_free(bulk->allocator, scratch);
+}
+
+// Writes the buckets of a partition to their pages, several at a time.
+void hdb_bulk_write_partition(struct hdb_bulk *bulk, uint32_t task) {
+    struct hdb_bulk_partition *partition = &bulk->partitions[task];
+    if (!partition->bucket_count) return;
+    struct hdb_bucket *pages = hdb_malloc(bulk->allocator, HDB_BULK_WRITE_PAGES * sizeof(struct hdb_bucket));
+    if (!pages) {
+        hdb_bulk_fail(bulk);
+        return;
+    }
+    for (size_t i = 0; i < partition->bucket_count; i += HDB_BULK_WRITE_PAGES) {
+        size_t count = partition->bucket_count - i < HDB_BULK_WRITE_PAGES ? partition->bucket_count - i : HDB_BULK_WRITE_PAGES;
+        for (size_t j = 0; j < count; ++j) {
+            const struct hdb_bulk_bucket *bucket = &partition->buckets[i + j];
+            hdb_bulk_fill(&pages[j], partition->slots + bucket->start, bucket->end - bucket->start, bucket->depth);
+        }
+        if (hdb_write_at(bulk->hash_file, hdb_page_offset(partition->first_page + i), pages, count * sizeof(struct hdb_bucket)) != 0) {
+            hdb_bulk_fail(bulk);
+            break;
+        }
+    }
+    hdb_free(bulk->allocator, pages);
+}
+
+// Chooses the depth that gives buckets about HDB_BULK_FILL keys and builds
+// the index over the loaded keys.  Below HDB_BULK_PARTITION_BITS the
+// partitions are joined into the first one and planned in one go.
+int hdb_bulk_build_index(struct hdb_bulk *bulk, struct hdb_header *header, uint32_t **directory) {
+    const uint32_t partitions = 1 << HDB_BULK_PARTITION_BITS;
+    if (hdb_bulk_run(bulk, partitions, hdb_bulk_sort_partition) != 0) return -1;
+    uint64_t keys = 0;
+    for (uint32_t i = 0; i < partitions; ++i) keys += bulk->partitions[i].count;
+    while (bulk->depth < HDB_MAX_DEPTH && ((uint64_t)HDB_BULK_FILL << bulk->depth) < keys) bulk->depth++;
+    bulk->max_depth = bulk->depth;
+
+    uint32_t tasks = partitions;
+    if (bulk->depth < HDB_BULK_PARTITION_BITS) {
+        struct hdb_bulk_partition *first = &bulk->partitions[0];
+        if (hdb_bulk_reserve(bulk->allocator, (void**)&first->slots, &first->capacity, keys, sizeof(struct hdb_slot)) != 0) return -1;
+        for (uint32_t i = 1; i < partitions; ++i) {
+            struct hdb_bulk_partition *partition = &bulk->partitions[i];
+            if (partition->count) memcpy(first->slots + first->count, partition->slots, partition->count * sizeof(struct hdb_slot));
+            first->count += partition->count;
+            partition->count = 0;
+        }
+        bulk->first_prefix = 0;
+        tasks = 1;
+    }
+    if (hdb_bulk_run(bulk, tasks, hdb_bulk_plan_partition) != 0) return -1;
+
+    // Bucket pages follow the header and the directory, partition after partition
+    uint32_t depth = bulk->max_depth;
+    uint64_t page = 1 + (uint64_t)hdb_directory_pages(depth);
+    for (uint32_t i = 0; i < tasks; ++i) {
+        bulk->partitions[i].first_page = page;
+        page += bulk->partitions[i].bucket_count;
+    }
+    if (page > UINT32_MAX) return -1;
+    size_t entries = (size_t)1 << depth;
+    if (!(*directory = hdb_malloc(bulk->allocator, entries * sizeof(uint32_t)))) return -1;
+    for (uint32_t i = 0; i < tasks; ++i) {
+        const struct hdb_bulk_partition *partition = &bulk->partitions[i];
+        for (size_t j = 0; j < partition->bucket_count; ++j) {
+            const struct hdb_bulk_bucket *bucket = &partition->buckets[j];
+            size_t pattern = bucket->depth ? hdb_reverse64(bucket->prefix << (64 - bucket->depth)) : 0;
+            for (size_t k = pattern; k < entries; k += (size_t)1 << bucket->depth) (*directory)[k] = partition->first_page + j;
+        }
+    }
+    if (hdb_bulk_run(bulk, tasks, hdb_bulk_write_partition) != 0) return -1;
+
+    memset(header, 0, sizeof(struct hdb_header));
+    header->magic = HDB_MAGIC;
+    header->version = HDB_FORMAT_VERSION;
+    header->global_depth = depth;
+    header->bucket_count = page - 1 - hdb_directory_pages(depth);
+    header->page_count = page;
+    header->directory_page = 1;
+    header->key_count = keys;
+    header->hash_algorithm = bulk->options.hash_algorithm;
+    if (hdb_write_at(bulk->hash_file, hdb_page_offset(1), *directory, entries * sizeof(uint32_t)) != 0) return -1;
+    return 0;
+}
+
+int hdb_bulk_extent_order(const void *a, const void *b) {
+    const uint64_t *x = a, *y = b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+// Marks the records of keys that came again later dead and lists them as
+// free space, ordered by offset like encode_free_space does.
+int hdb_bulk_free_space(struct hdb_bulk *bulk, FILE *deleted_blocks, struct hdb_header *header) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < (1 << HDB_BULK_PARTITION_BITS); ++i) count += bulk->partitions[i].dead_count;
+    uint64_t (*dead)[2] = hdb_malloc(bulk->allocator, (count ? count : 1) * sizeof(*dead));
+    if (!dead) return -1;
+    count = 0;
+    for (uint32_t i = 0; i < (1 << HDB_BULK_PARTITION_BITS); ++i) {
+        const struct hdb_bulk_partition *partition = &bulk->partitions[i];
+        if (partition->dead_count) memcpy(dead + count, partition->dead, partition->dead_count * sizeof(*dead));
+        count += partition->dead_count;
+    }
+    qsort(dead, count, sizeof(*dead), hdb_bulk_extent_order);
+    int rc = 0;
+    for (uint64_t i = 0; rc == 0 && i < count; ++i) {
+        struct hdb_record_header record;
+        rc = hdb_read_at(bulk->data_file, dead[i][0], &record, sizeof(struct hdb_record_header));
+        record.flags |= HDB_RECORD_DEAD;
+        if (rc == 0) rc = hdb_write_at(bulk->data_file, dead[i][0], &record, sizeof(struct hdb_record_header));
+        header->dead_bytes += dead[i][1];
+    }
+    header->free_space_count = count;
+    struct hdb_free_space_header free_space = {HDB_FREE_SPACE_MAGIC, HDB_FREE_SPACE_VERSION, count};
+    if (rc == 0 && fwrite(&free_space, sizeof(struct hdb_free_space_header), 1, deleted_blocks) != 1) rc = -1;
+    if (rc == 0 && count && fwrite(dead, sizeof(*dead), count, deleted_blocks) != count) rc = -1;
+    hdb_free(bulk->allocator, dead);
+    if (rc == 0 && fflush(deleted_blocks) != 0) rc = -1;
+    return rc == 0 ? fsync(fileno(deleted_blocks)) : rc;
+}
+
+void hdb_bulk_free(struct hdb_bulk *bulk) {
+    for (uint32_t i = 0; bulk->chunks && i < bulk->threads; ++i) {
+        hdb_free(bulk->allocator, bulk->chunks[i].records);
+        hdb_free(bulk->allocator, bulk->chunks[i].stored);
+        hdb_free(bulk->allocator, bulk->chunks[i].slots);
+    }
+    hdb_free(bulk->allocator, bulk->chunks);
+    for (uint32_t i = 0; i < (1 << HDB_BULK_PARTITION_BITS); ++i) {
+        hdb_free(bulk->allocator, bulk->partitions[i].slots);
+        hdb_free(bulk->allocator, bulk->partitions[i].buckets);
+        hdb_free(bulk->allocator, bulk->partitions[i].dead);
+    }
+}
+
+// Builds a database from every pair of source, replacing whatever the files
+// held, and opens it with options.  Much faster than db_put for bulk loads:
+// no log is written, records go to the data file in large sequential writes
+// and the index is built in one pass over all cores, with its buckets written
+// once.  When a key comes more than once the last value is kept.  Needs 32
+// bytes of memory per key while it runs.  Returns NULL on failure, leaving
+// the files incomplete.
+struct hdb* db_bulk_load(const char *hash_filename, const char *data_filename, const char *deleted_blocks_filename,
+                         const struct hdb_options *options, const struct hdb_bulk_source *source) {
+    struct hdb_options defaults;
+    if (!options) {
+        memset(&defaults, 0, sizeof(struct hdb_options));
+        options = &defaults;
+    }
+    struct hdb_allocator allocator = {hdb_libc_reallocate, NULL};
+    if (options->allocator) allocator = *options->allocator;
+    struct hdb_bulk *bulk = hdb_calloc(&allocator, 1, sizeof(struct hdb_bulk));
+    if (!bulk) return NULL;
+    bulk->options = *options;
+    hdb_default_options(&bulk->options);
+    if (!bulk->options.hash_algorithm) bulk->options.hash_algorithm = HDB_HASH_MIX64;
+    bulk->allocator = &allocator;
+    bulk->hash = hdb_hash_for(bulk->options.hash_algorithm);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    bulk->threads = cores < 1 ? 1 : cores > 64 ? 64 : cores;
+    bulk->chunks = hdb_calloc(&allocator, bulk->threads, sizeof(struct hdb_bulk_chunk));
+    bulk->hash_file = fopen(hash_filename, "wb+");
+    bulk->data_file = fopen(data_filename, "wb+");
+    FILE *deleted_blocks = fopen(deleted_blocks_filename, "wb");
+
+    struct hdb_header header;
+    uint32_t *directory = NULL;
+    int rc = bulk->hash && bulk->chunks && bulk->hash_file && bulk->data_file && deleted_blocks &&
+             hdb_codec_supported(bulk->options.compression) ? 0 : -1;
+    if (rc == 0) rc = hdb_bulk_read(bulk, source);
+    if (rc == 0) rc = hdb_bulk_build_index(bulk, &header, &directory);
+    if (rc == 0) rc = hdb_bulk_free_space(bulk, deleted_blocks, &header);
+    if (rc == 0) {
+        // Left as a clean close leaves it, the open reads nothing past the directory
+        header.state = HDB_STATE_CLEAN;
+        header.data_end = bulk->data_end;
+        header.checksum = hdb_header_checksum(&header);
+        rc = hdb_write_at(bulk->hash_file, 0, &header, sizeof(struct hdb_header));
+    }
+    if (rc == 0 && (fsync(fileno(bulk->data_file)) != 0 || fsync(fileno(bulk->hash_file)) != 0)) rc = -1;
+    hdb_free(&allocator, directory);
+    hdb_bulk_free(bulk);
+    if (bulk->hash_file) fclose(bulk->hash_file);
+    if (bulk->data_file) fclose(bulk->data_file);
+    if (deleted_blocks) fclose(deleted_blocks);
+    hdb_free(&allocator, bulk);
+    if (rc != 0) return NULL;
+
+    // A log, a filter or a blob file left by the database the files held would not match
+    char *filename = NULL;
+    if (options->wal_filename) {
+        remove(options->wal_filename);
+    } else if ((filename = hdb_malloc(&allocator, strlen(data_filename) + sizeof(".wal")))) {
+        strcpy(filename, data_filename);
+        strcat(filename, ".wal");
+        remove(filename);
+        hdb_free(&allocator, filename);
+    }
+    if (options->filter_filename) {
+        remove(options->filter_filename);
+    } else if ((filename = hdb_malloc(&allocator, strlen(hash_filename) + sizeof(".filter")))) {
+        strcpy(filename, hash_filename);
+        strcat(filename, ".filter");
+        remove(filename);
+        hdb_free(&allocator, filename);
+    }
+    if (options->blob_filename) {
+        remove(options->blob_filename);
+    } else if ((filename = hdb_malloc(&allocator, strlen(data_filename) + sizeof(".blob")))) {
+        strcpy(filename, data_filename);
+        strcat(filename, ".blob");
+        remove(filename);
+        hdb_free(&allocator, filename);
+    }
+    return db_open_with_options(hash_filename, data_filename, deleted_blocks_filename, options);
+}
+
+// A shard's part of an open, close or compaction run on all shards at once.
+struct hdb_shard_task {
+    struct hdb_sharded *sharded;
+    uint32_t index;
+    const char *directory;
+    const struct hdb_options *options;
+    int rc;
+};
+
+// Shard index of a key from the top half of its 64-bit hash, which the
+// shards themselves only use to tell keys apart, so every shard still gets
+// evenly spread buckets.  Always the HDB_HASH_MIX64 hash, whatever the shards use.
+uint32_t hdb_shard_index(const struct hdb_sharded *sharded, const uint8_t *key, size_t key_length) {
+    return (uint32_t)(((hash_function(key, key_length) >> 32) * sharded->count) >> 32);
+}
+
+struct hdb* db_sharded_shard(struct hdb_sharded *sharded, const uint8_t *key, size_t key_length) {
+    return sharded->shards[hdb_shard_index(sharded, key, key_length)];
+}
+
+// directory, a slash, then name for the shard index.
+char* hdb_shard_filename(const struct hdb_allocator *allocator, const char *directory, uint32_t index, const char *name) {
+    size_t length = strlen(directory) + strlen(name) + 32;
+    char *filename = hdb_malloc(allocator, length);
+    if (filename) snprintf(filename, length, "%s/shard%" PRIu32 "_%s", directory, index, name);
+    return filename;
+}
+
+void* hdb_shard_open(void *arg) {
+    struct hdb_shard_task *task = arg;
+    const struct hdb_allocator *allocator = &task->sharded->allocator;
+    char *hash_filename = hdb_shard_filename(allocator, task->directory, task->index, "hash.db");
+    char *data_filename = hdb_shard_filename(allocator, task->directory, task->index, "data.db");
+    char *deleted_filename = hdb_shard_filename(allocator, task->directory, task->index, "deleted.db");
+    if (hash_filename && data_filename && deleted_filename) {
+        task->sharded->shards[task->index] = db_open_with_options(hash_filename, data_filename, deleted_filename, task->options);
+    }
+    task->rc = task->sharded->shards[task->index] ? 0 : -1;
+    hdb_free(allocator, hash_filename);
+    hdb_free(allocator, data_filename);
+    hdb_free(allocator, deleted_filename);
+    return NULL;
+}
+
+void* hdb_shard_close(void *arg) {
+    struct hdb_shard_task *task = arg;
+    db_close(task->sharded->shards[task->index]);
+    task->sharded->shards[task->index] = NULL;
+    return NULL;
+}
+
+void* hdb_shard_compact(void *arg) {
+    struct hdb_shard_task *task = arg;
+    task->rc = db_compact(task->sharded->shards[task->index]);
+    return NULL;
+}
+
+// Runs work for every shard, each on its own thread, and returns -1 when any failed.
+int hdb_shards_run(struct hdb_sharded *sharded, void *(*work)(void *arg), const char *const *directories,
+                   const struct hdb_options *options) {
+    struct hdb_shard_task tasks[HDB_MAX_SHARDS];
+    pthread_t threads[HDB_MAX_SHARDS];
+    bool started[HDB_MAX_SHARDS];
+    for (uint32_t i = 0; i < sharded->count; ++i) {
+        tasks[i] = (struct hdb_shard_task){sharded, i, directories ? directories[i] : NULL, options, 0};
+        started[i] = pthread_create(&threads[i], NULL, work, &tasks[i]) == 0;
+        if (!started[i]) work(&tasks[i]);
+    }
+    int rc = 0;
+    for (uint32_t i = 0; i < sharded->count; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (tasks[i].rc != 0) rc = -1;
+    }
+    return rc;
+}
+
+// Checks the number of shards against the one recorded in the first
+// directory, recording it when there is none yet.
+int hdb_check_shards(struct hdb_sharded *sharded, const char *directory) {
+    size_t length = strlen(directory) + sizeof("/" HDB_SHARDS_FILENAME);
+    char *filename = hdb_malloc(&sharded->allocator, length);
+    if (!filename) return -1;
+    snprintf(filename, length, "%s/" HDB_SHARDS_FILENAME, directory);
+    uint32_t header[3] = {HDB_SHARDS_MAGIC, HDB_SHARDS_VERSION, sharded->count}, recorded[3];
+    int rc = -1;
+    FILE *file = fopen(filename, "rb");
+    if (file) {
+        if (fread(recorded, sizeof(recorded), 1, file) == 1 && memcmp(header, recorded, sizeof(header)) == 0) rc = 0;
+        fclose(file);
+    } else if ((file = fopen(filename, "wb"))) {
+        if (fwrite(header, sizeof(header), 1, file) == 1 && fflush(file) == 0 && fsync(fileno(file)) == 0) rc = 0;
+        fclose(file);
+    }
+    hdb_free(&sharded->allocator, filename);
+    return rc;
+}
+
+// Opens count shards, shard i in directories[i], which may repeat, with its
+// files named after its index.  Every shard gets options, except that each
+// keeps its log, filter and blob file next to its own files.  The shards open, and
+// replay their logs, in parallel.  The number of shards cannot change once
+// a database has been created.
+struct hdb_sharded* db_sharded_open(const char *const *directories, uint32_t count, const struct hdb_options *options) {
+    if (count == 0 || count > HDB_MAX_SHARDS) return NULL;
+    struct hdb_options shard_options;
+    memset(&shard_options, 0, sizeof(struct hdb_options));
+    if (options) shard_options = *options;
+    shard_options.wal_filename = NULL;
+    shard_options.filter_filename = NULL;
+    shard_options.blob_filename = NULL;
+    struct hdb_allocator allocator = {hdb_libc_reallocate, NULL};
+    if (shard_options.allocator) allocator = *shard_options.allocator;
+    struct hdb_sharded *sharded = hdb_calloc(&allocator, 1, sizeof(struct hdb_sharded));
+    if (!sharded) return NULL;
+    sharded->allocator = allocator;
+    sharded->count = count;
+    if (hdb_check_shards(sharded, directories[0]) != 0 || hdb_shards_run(sharded, hdb_shard_open, directories, &shard_options) != 0) {
+        db_sharded_close(sharded);
+        return NULL;
+    }
+    return sharded;
+}
+
+// Closes every shard, in parallel.
+void db_sharded_close(struct hdb_sharded *sharded) {
+    if (!sharded) return;
+    hdb_shards_run(sharded, hdb_shard_close, NULL, NULL); // shards that never opened are NULL, which db_close skips
+    struct hdb_allocator allocator = sharded->allocator;
+    hdb_free(&allocator, sharded);
+}
+
+int db_sharded_put(struct hdb_sharded *sharded, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length) {
+    return db_put(db_sharded_shard(sharded, key, key_length), key, key_length, value, value_length);
+}
+
+int db_sharded_get(struct hdb_sharded *sharded, const uint8_t *key, size_t key_length, uint8_t *value, size_t *value_length) {
+    return db_get(db_sharded_shard(sharded, key, key_length), key, key_length, value, value_length);
+}
+
+int db_sharded_delete(struct hdb_sharded *sharded, const uint8_t *key, size_t key_length) {
+    return db_delete(db_sharded_shard(sharded, key, key_length), key, key_length);
+}
+
+int db_sharded_cas(struct hdb_sharded *sharded, const uint8_t *key, size_t key_length, const uint8_t *expected,
+                   size_t expected_length, const uint8_t *value, size_t value_length) {
+    return db_cas(db_sharded_shard(sharded, key, key_length), key, key_length, expected, expected_length, value, value_length);
+}
+
+int db_sharded_incr(struct hdb_sharded *sharded, const uint8_t *key, size_t key_length, int64_t delta, int64_t *result) {
+    return db_incr(db_sharded_shard(sharded, key, key_length), key, key_length, delta, result);
+}
+
+// Compacts every shard, in parallel.
+int db_sharded_compact(struct hdb_sharded *sharded) {
+    return hdb_shards_run(sharded, hdb_shard_compact, NULL, NULL);
+}
+
+
+#ifdef HDB_HAVE_URING
+// A submission and completion queue pair set up by hand, so io_uring needs
+// nothing beyond the kernel headers.
+struct hdb_uring {
+    int fd;
+    uint8_t *sq_ring;
+    size_t sq_ring_size;
+    uint8_t *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned pending; // entries queued and not submitted yet
+};
+
+void hdb_uring_close(struct hdb_uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(struct hdb_uring));
+    ring->fd = -1;
+}
+
+int hdb_uring_open(struct hdb_uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    memset(ring, 0, sizeof(struct hdb_uring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    void *sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        hdb_uring_close(ring);
+        return -1;
+    }
+    ring->sq_ring = sq;
+    void *cq = single ? sq : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+        hdb_uring_close(ring);
+        return -1;
+    }
+    ring->cq_ring = cq;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        hdb_uring_close(ring);
+        return -1;
+    }
+    ring->sqes = sqes;
+
+    ring->sq_head = (unsigned*)(ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    return 0;
+}
+
+// Hands the queued entries to the kernel and waits for wait completions.
+int hdb_uring_enter(struct hdb_uring *ring, unsigned wait) {
+    for (;;) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0) {
+            ring->pending -= rc;
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+// Queues a vectored read.  The engine never has more reads in flight than
+// the ring has entries, so there is always room.
+void hdb_uring_readv(struct hdb_uring *ring, int fd, const struct iovec *io, unsigned count, uint64_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)io;
+    sqe->len = count;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+#endif
+
+#define HDB_OP_INDEX 1 // reading the bucket
+#define HDB_OP_RECORD 2 // reading the record of a candidate slot
+
+// A get in flight through io_uring.  It runs the lock-free lookup in steps,
+// the bucket and then the record are read asynchronously and validated as
+// db_get would.
+struct hdb_async_op {
+    struct hdb_request *request;
+    struct hdb_read read;
+    uint64_t hash;
+    uint32_t fingerprint;
+    uint32_t stage; // HDB_OP_*
+    uint32_t candidate; // slots of the probe run already looked at
+    struct hdb_slot slot;
+    struct hdb_bucket bucket;
+    uint8_t *record; // header and key of the record read
+    size_t record_capacity;
+    struct iovec io[2];
+    struct hdb_async_op *next;
+};
+
+// An asynchronous engine for one database.  Its functions are called from a
+// single thread, the one that polls.
+struct hdb_async {
+    struct hdb *db;
+    uint32_t engine; // HDB_ASYNC_*, the one actually running
+    uint32_t depth;
+    uint64_t in_flight; // submitted and not called back yet
+    struct hdb_request *done, *done_tail; // completed and waiting for db_async_poll
+#ifdef HDB_HAVE_URING
+    struct hdb_uring ring;
+    int event_fd; // the workers count finished requests here, a read of it sits in the ring
+    uint64_t wake;
+    struct iovec wake_io;
+    bool wake_armed;
+#endif
+    struct hdb_async_op *ops;
+    struct hdb_async_op *free_ops;
+    struct hdb_async_op *retry_ops; // gets a split or compaction got in the way of
+    struct hdb_request *backlog, *backlog_tail; // gets waiting for an op
+    int data_fd; // duplicate of the data file's descriptor, keeps a swapped out file readable
+    uint64_t data_generation;
+    // Worker threads
+    pthread_t *workers;
+    uint32_t worker_count;
+    uint64_t queued; // handed to the workers and not collected yet
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    struct hdb_request *queue, *queue_tail; // guarded by lock
+    struct hdb_request *results, *results_tail; // guarded by lock
+    bool stop;
+};
+
+void hdb_request_push(struct hdb_request **head, struct hdb_request **tail, struct hdb_request *request) {
+    request->next = NULL;
+    if (*tail) {
+        (*tail)->next = request;
+    } else {
+        *head = request;
+    }
+    *tail = request;
+}
+
+struct hdb_request* hdb_request_pop(struct hdb_request **head, struct hdb_request **tail) {
+    struct hdb_request *request = *head;
+    if (request) {
+        *head = request->next;
+        if (!*head) *tail = NULL;
+    }
+    return request;
+}
+
+void hdb_async_execute(struct hdb *db, struct hdb_request *request) {
+    switch (request->type) {
+    case HDB_REQUEST_GET:
+        request->rc = db_get(db, request->key, request->key_length, request->value, &request->value_length);
+        break;
+    case HDB_REQUEST_PUT:
+        request->rc = db_put(db, request->key, request->key_length, request->value, request->value_length);
+        break;
+    case HDB_REQUEST_DELETE:
+        request->rc = db_delete(db, request->key, request->key_length);
+        break;
+    default:
+        request->rc = -1;
+    }
+}
+
+void* hdb_async_worker(void *arg) {
+    struct hdb_async *async = (struct hdb_async*)arg;
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        while (!async->queue && !async->stop) pthread_cond_wait(&async->work, &async->lock);
+        struct hdb_request *request = hdb_request_pop(&async->queue, &async->queue_tail);
+        if (!request) break;
+        pthread_mutex_unlock(&async->lock);
+
+        hdb_async_execute(async->db, request);
+
+        pthread_mutex_lock(&async->lock);
+        hdb_request_push(&async->results, &async->results_tail, request);
+        pthread_cond_signal(&async->finished);
+#ifdef HDB_HAVE_URING
+        if (async->event_fd >= 0) {
+            uint64_t one = 1;
+            if (write(async->event_fd, &one, sizeof(uint64_t)) < 0) {
+                // The counter cannot overflow this side of 2^64 requests
+            }
+        }
+#endif
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+void hdb_async_complete(struct hdb_async *async, struct hdb_async_op *op, int rc) {
+    op->request->rc = rc;
+    hdb_request_push(&async->done, &async->done_tail, op->request);
+    op->request = NULL;
+    op->next = async->free_ops;
+    async->free_ops = op;
+}
+
+void hdb_async_retry(struct hdb_async *async, struct hdb_async_op *op) {
+    op->next = async->retry_ops;
+    async->retry_ops = op;
+}
+
+#ifdef HDB_HAVE_URING
+// Looks for the next slot of the probe run that may hold the key and reads
+// its record, or finishes the get when there is none.
+void hdb_async_next_candidate(struct hdb_async *async, struct hdb_async_op *op) {
+    struct hdb_request *request = op->request;
+    uint32_t index = (hdb_home_slot(op->fingerprint) + op->candidate) % HDB_BUCKET_SLOTS;
+    for (; op->candidate < HDB_MAX_PROBE; op->candidate++, index = (index + 1) % HDB_BUCKET_SLOTS) {
+        const struct hdb_slot *slot = &op->bucket.slots[index];
+        if (!(slot->flags & HDB_SLOT_USED)) break;
+        if (slot->hash != op->hash || slot->fingerprint != op->fingerprint) continue;
+
+        // The value goes straight to the caller, unless it has to be decoded
+        size_t head = sizeof(struct hdb_record_header) + request->key_length;
+        bool compressed = hdb_slot_codec(slot) != HDB_CODEC_NONE;
+        uint64_t length = slot->length;
+        size_t size = compressed ? head + length : head;
+        if (size > op->record_capacity) {
+            uint8_t *record = hdb_realloc(&async->db->allocator, op->record, size);
+            if (!record) {
+                hdb_async_complete(async, op, -1);
+                return;
+            }
+            op->record = record;
+            op->record_capacity = size;
+        }
+        op->slot = *slot;
+        op->stage = HDB_OP_RECORD;
+        op->io[0] = (struct iovec){op->record, size};
+        op->io[1] = (struct iovec){request->value, length};
+        hdb_uring_readv(&async->ring, async->data_fd, op->io, length && !compressed ? 2 : 1, slot->position, (uintptr_t)op);
+        return;
+    }
+    hdb_async_complete(async, op, -1);
+}
 
-    if (stored_hash != hash) return -1; // Hash doesn't match, key not found.
+// Starts or restarts a get.
+void hdb_async_start(struct hdb_async *async, struct hdb_async_op *op) {
+    struct hdb *db = async->db;
+    struct hdb_request *request = op->request;
+    if (db->hash_map.base && hdb_data_map(db)) {
+        // Nothing to wait for when both files are mapped
+        hdb_async_execute(db, request);
+        hdb_async_complete(async, op, request->rc);
+        return;
+    }
+
+    op->read.structure_seq = hdb_seq_read(&db->structure_seq);
+    if (op->read.structure_seq & 1) {
+        hdb_async_retry(async, op);
+        return;
+    }
+    uint64_t generation = __atomic_load_n(&db->data_generation, __ATOMIC_ACQUIRE);
+    if (generation != async->data_generation) {
+        uint32_t token = hdb_read_enter(db);
+        int fd = dup(fileno(hdb_data_file(db)));
+        hdb_read_exit(db, token);
+        if (fd < 0) {
+            hdb_async_complete(async, op, -1);
+            return;
+        }
+        if (async->data_fd >= 0) close(async->data_fd);
+        async->data_fd = fd;
+        async->data_generation = generation;
+    }
+    uint32_t token = hdb_read_enter(db);
+    struct hdb_filter *filter = __atomic_load_n(&db->filter, __ATOMIC_ACQUIRE);
+    bool absent = filter && !hdb_filter_may_contain(filter, op->hash, op->fingerprint);
+    hdb_read_exit(db, token);
+    if (absent) {
+        hdb_async_complete(async, op, -1);
+        return;
+    }
+    uint32_t page = hdb_bucket_page(db, op->hash);
+    op->read.stripe = hdb_stripe_for(db, page);
+    op->read.stripe_seq = hdb_seq_read(&op->read.stripe->seq);
+    op->candidate = 0;
+    op->stage = HDB_OP_INDEX;
+    op->io[0] = (struct iovec){&op->bucket, sizeof(struct hdb_bucket)};
+    hdb_uring_readv(&async->ring, fileno(db->hash_file), op->io, 1, hdb_page_offset(page), (uintptr_t)op);
+}
 
-    // Mark the hash entry as deleted by setting it to 0
-    fseek(db->hash_file, hash % 128 * sizeof(uint32_t), SEEK_SET);
-    uint32_t zero = 0;
-    fwrite(&zero, sizeof(uint32_t), 1, db->hash_file); // Clear the hash entry
+void hdb_async_read_done(struct hdb_async *async, struct hdb_async_op *op, int result) {
+    struct hdb *db = async->db;
+    struct hdb_request *request = op->request;
+    if (!hdb_read_valid(db, &op->read)) {
+        hdb_async_retry(async, op);
+        return;
+    }
+    if (op->stage == HDB_OP_INDEX) {
+        if (result != (int)sizeof(struct hdb_bucket)) {
+            hdb_async_complete(async, op, -1);
+            return;
+        }
+        hdb_async_next_candidate(async, op);
+        return;
+    }
 
-    fseek(db->hash_file, hash % 128 * sizeof(uint64_t) * 2, SEEK_SET);
-    uint64_t position, length;
-    fread(&position, sizeof(uint64_t), 1, db->hash_file);
-    fread(&length, sizeof(uint64_t), 1, db->hash_file);
+    size_t head = sizeof(struct hdb_record_header) + request->key_length;
+    struct hdb_record_header record;
+    uint64_t length = op->slot.length;
+    if (result < 0 || (uint64_t)result != head + length) {
+        hdb_async_complete(async, op, -1);
+        return;
+    }
+    memcpy(&record, op->record, sizeof(struct hdb_record_header));
+    if (record.key_length != request->key_length ||
+        memcmp(op->record + sizeof(struct hdb_record_header), request->key, request->key_length) != 0) {
+        op->candidate++; // same hash and fingerprint, another key
+        hdb_async_next_candidate(async, op);
+        return;
+    }
+    uint32_t codec = hdb_slot_codec(&op->slot);
+    if (codec & HDB_CODEC_BLOB) {
+        // The blob is read right away, from the file of the ref as long as no compaction swapped it since
+        uint32_t token = hdb_read_enter(db);
+        FILE *blob = hdb_blob_file(db);
+        int rc = hdb_read_valid(db, &op->read) ? hdb_decode_value(db, blob, codec, op->record + head, length, request->value, &request->value_length) : 1;
+        hdb_read_exit(db, token);
+        if (rc == 1) {
+            hdb_async_retry(async, op);
+        } else {
+            hdb_async_complete(async, op, rc);
+        }
+        return;
+    }
+    if (codec != HDB_CODEC_NONE) {
+        hdb_async_complete(async, op, hdb_decode_value(db, NULL, codec, op->record + head, length, request->value, &request->value_length));
+        return;
+    }
+    request->value_length = length;
+    hdb_async_complete(async, op, 0);
+}
 
-    // Mark the position of the deleted block
-    db->deleted_blocks_array = realloc(db->deleted_blocks_array, (db->deleted_blocks_array_size + 1) * sizeof(int));
-    db->deleted_blocks_array[db->deleted_blocks_array_size++] = position;
+void hdb_async_assign(struct hdb_async *async, struct hdb_request *request) {
+    struct hdb_async_op *op = async->free_ops;
+    async->free_ops = op->next;
+    op->request = request;
+    op->hash = async->db->hash(request->key, request->key_length);
+    op->fingerprint = fingerprint_function(request->key, request->key_length);
+    hdb_async_start(async, op);
+}
+#endif
 
-    // Shift the remaining data after the deleted entry
-    fseek(db->data_file, position + length, SEEK_SET);
-    size_t remaining_size = ftell(db->data_file) - (position + length);
-    uint8_t *buffer = malloc(remaining_size);
-    fread(buffer, sizeof(uint8_t), remaining_size, db->data_file);
-    fseek(db->data_file, position, SEEK_SET);
-    fwrite(buffer, sizeof(uint8_t), remaining_size, db->data_file);
-    free(buffer);
-    ftruncate(fileno(db->data_file), position + remaining_size); // Resize data file
+// Runs what can run without waiting: retries, queued gets, completions of
+// the ring and of the workers.
+void hdb_async_progress(struct hdb_async *async) {
+#ifdef HDB_HAVE_URING
+    if (async->engine == HDB_ASYNC_URING) {
+        unsigned head = *async->ring.cq_head;
+        while (head != __atomic_load_n(async->ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &async->ring.cqes[head & *async->ring.cq_mask];
+            if (cqe->user_data) {
+                hdb_async_read_done(async, (struct hdb_async_op*)(uintptr_t)cqe->user_data, cqe->res);
+            } else {
+                async->wake_armed = false;
+            }
+            head++;
+        }
+        __atomic_store_n(async->ring.cq_head, head, __ATOMIC_RELEASE);
 
-    // Update the hash file with the new data location
-    fseek(db->hash_file, 0, SEEK_SET);
-    for (int i = 0; i < 128; ++i) {
-        uint32_t temp_hash;
-        fread(&temp_hash, sizeof(uint32_t), 1, db->hash_file);
-        if (temp_hash == 0) continue; // Skip empty slots
+        // Completions may have freed ops for queued gets
+        struct hdb_async_op *retry = async->retry_ops;
+        async->retry_ops = NULL;
+        while (retry) {
+            struct hdb_async_op *next = retry->next;
+            hdb_async_start(async, retry);
+            retry = next;
+        }
+        while (async->backlog && async->free_ops) {
+            hdb_async_assign(async, hdb_request_pop(&async->backlog, &async->backlog_tail));
+        }
+        if (async->ring.pending) hdb_uring_enter(&async->ring, 0);
+    }
+#endif
+    if (async->queued) {
+        pthread_mutex_lock(&async->lock);
+        struct hdb_request *request;
+        while ((request = hdb_request_pop(&async->results, &async->results_tail))) {
+            hdb_request_push(&async->done, &async->done_tail, request);
+            async->queued--;
+        }
+        pthread_mutex_unlock(&async->lock);
+    }
+}
 
-        uint64_t temp_position, temp_length;
-        fread(&temp_position, sizeof(uint64_t), 1, db->hash_file);
-        fread(&temp_length, sizeof(uint64_t), 1, db->hash_file);
+// Blocks until something in flight may have finished.
+void hdb_async_wait(struct hdb_async *async) {
+#ifdef HDB_HAVE_URING
+    if (async->engine == HDB_ASYNC_URING) {
+        if (async->retry_ops) {
+            sched_yield(); // a writer is in the way, it never waits on us
+            return;
+        }
+        if (async->queued && !async->wake_armed) {
+            async->wake_io = (struct iovec){&async->wake, sizeof(uint64_t)};
+            hdb_uring_readv(&async->ring, async->event_fd, &async->wake_io, 1, 0, 0);
+            async->wake_armed = true;
+        }
+        hdb_uring_enter(&async->ring, 1);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&async->lock);
+    while (!async->results) pthread_cond_wait(&async->finished, &async->lock);
+    pthread_mutex_unlock(&async->lock);
+}
 
-        // If position is greater than the deleted one, adjust it
-        if (temp_position > position) {
-            temp_position -= length;
-            fseek(db->hash_file, -2 * sizeof(uint64_t), SEEK_CUR);
-            fwrite(&temp_position, sizeof(uint64_t), 1, db->hash_file);
-            fseek(db->hash_file, sizeof(uint64_t), SEEK_CUR);
+// Starts an engine for db.  engine is HDB_ASYNC_* and depth the number of
+// reads kept in flight, zero picks the defaults.  Where io_uring is not
+// available the engine falls back to worker threads.
+struct hdb_async* db_async_open(struct hdb *db, uint32_t engine, uint32_t depth) {
+    struct hdb_async *async = hdb_calloc(&db->allocator, 1, sizeof(struct hdb_async));
+    if (!async) return NULL;
+    async->db = db;
+    async->depth = depth ? depth : HDB_ASYNC_DEPTH;
+    async->data_fd = -1;
+    async->data_generation = UINT64_MAX;
+    if (!engine) engine = HDB_ASYNC_URING;
+#ifdef HDB_HAVE_URING
+    async->event_fd = -1;
+    async->ring.fd = -1;
+    if (engine == HDB_ASYNC_URING) {
+        // One more entry for the read of the event counter
+        async->ops = hdb_calloc(&db->allocator, async->depth, sizeof(struct hdb_async_op));
+        if (!async->ops || hdb_uring_open(&async->ring, async->depth + 1) != 0 ||
+            (async->event_fd = eventfd(0, 0)) < 0) {
+            hdb_uring_close(&async->ring);
+            hdb_free(&db->allocator, async->ops);
+            async->ops = NULL;
+            engine = HDB_ASYNC_THREADS;
+        } else {
+            for (uint32_t i = 0; i < async->depth; ++i) {
+                async->ops[i].next = async->free_ops;
+                async->free_ops = &async->ops[i];
+            }
         }
     }
+#else
+    engine = HDB_ASYNC_THREADS;
+#endif
+    async->engine = engine;
+
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->work, NULL);
+    pthread_cond_init(&async->finished, NULL);
+    uint32_t workers = engine == HDB_ASYNC_URING ? 1 : HDB_ASYNC_WORKERS;
+    async->workers = hdb_calloc(&db->allocator, workers, sizeof(pthread_t));
+    for (uint32_t i = 0; async->workers && i < workers; ++i) {
+        if (pthread_create(&async->workers[i], NULL, hdb_async_worker, async) != 0) break;
+        async->worker_count++;
+    }
+    if (!async->worker_count) {
+        db_async_close(async);
+        return NULL;
+    }
+    return async;
+}
 
+// Queues a request.  It completes in the background and its callback runs
+// from a later db_async_poll.
+int db_async_submit(struct hdb_async *async, struct hdb_request *request) {
+    async->in_flight++;
+#ifdef HDB_HAVE_URING
+    if (async->engine == HDB_ASYNC_URING && request->type == HDB_REQUEST_GET) {
+        if (async->free_ops) {
+            hdb_async_assign(async, request);
+            if (async->ring.pending) hdb_uring_enter(&async->ring, 0);
+        } else {
+            hdb_request_push(&async->backlog, &async->backlog_tail, request);
+        }
+        return 0;
+    }
+#endif
+    async->queued++;
+    pthread_mutex_lock(&async->lock);
+    hdb_request_push(&async->queue, &async->queue_tail, request);
+    pthread_cond_signal(&async->work);
+    pthread_mutex_unlock(&async->lock);
     return 0;
 }
 
+// Calls back completed requests, waiting until at least min_complete of
+// them did or nothing is left in flight.  Returns how many were called back.
+unsigned db_async_poll(struct hdb_async *async, unsigned min_complete) {
+    unsigned completed = 0;
+    for (;;) {
+        hdb_async_progress(async);
+        struct hdb_request *request;
+        while ((request = hdb_request_pop(&async->done, &async->done_tail))) {
+            async->in_flight--;
+            completed++;
+            if (request->callback) request->callback(request);
+        }
+        if (completed >= min_complete || !async->in_flight) return completed;
+        hdb_async_wait(async);
+    }
+}
+
+// Completes everything in flight and stops the engine.  Must be called
+// before db_close.
+void db_async_close(struct hdb_async *async) {
+    if (async->worker_count) db_async_poll(async, UINT32_MAX);
+    pthread_mutex_lock(&async->lock);
+    async->stop = true;
+    pthread_cond_broadcast(&async->work);
+    pthread_mutex_unlock(&async->lock);
+    for (uint32_t i = 0; i < async->worker_count; ++i) pthread_join(async->workers[i], NULL);
+#ifdef HDB_HAVE_URING
+    hdb_uring_close(&async->ring);
+    if (async->event_fd >= 0) close(async->event_fd);
+#endif
+    for (uint32_t i = 0; async->ops && i < async->depth; ++i) hdb_free(&async->db->allocator, async->ops[i].record);
+    if (async->data_fd >= 0) close(async->data_fd);
+    pthread_mutex_destroy(&async->lock);
+    pthread_cond_destroy(&async->work);
+    pthread_cond_destroy(&async->finished);
+    hdb_free(&async->db->allocator, async->ops);
+    hdb_free(&async->db->allocator, async->workers);
+    hdb_free(&async->db->allocator, async);
+}
 
 #endif // HDB_H
\ No newline at end of file
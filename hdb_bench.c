@@ -31,101 +31,490 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "hdb.h"
 
-// Benchmark the put operation
-void benchmark_put(struct hdb *db, int num_operations) {
-    uint8_t key[32];
-    uint8_t value[256];
-    
-    clock_t start = clock();
-    for (int i = 0; i < num_operations; ++i) {
-        // Generate a key and value
-        snprintf((char*)key, sizeof(key), "key%d", i);
-        snprintf((char*)value, sizeof(value), "value%d", i);
-
-        // Perform put operation
-        db_put(db, key, strlen((char*)key), value, strlen((char*)value));
-    }
-    clock_t end = clock();
+// A YCSB style harness.  A load phase stores the records, then every
+// workload given runs its mix of operations from several threads for a
+// number of operations, and reports wall clock throughput and latency
+// percentiles per kind of operation.
+//
+//   hdb_bench [-w workloads] [-r records] [-o operations] [-t threads]
+//             [-k key size] [-v value size or min-max] [-d uniform|zipfian|latest]
+//             [-b] [-c] [-m] [-s] [-S]
+//
+// -w takes the YCSB core workloads as letters, run in that order, ABCDEF by
+// default.  -b loads the records with db_bulk_load, -c drops the page cache and reopens the database between the load
+// and every workload, -m opens it with HDB_OPEN_MMAP, -s makes every write
+// wait for its sync and -S prints db_stats at the end.
+
+#define BENCH_HASH_FILE "benchmark_hash.db"
+#define BENCH_DATA_FILE "benchmark_data.db"
+#define BENCH_DELETED_FILE "benchmark_deleted.db"
+
+#define BENCH_READ 0
+#define BENCH_UPDATE 1
+#define BENCH_INSERT 2
+#define BENCH_SCAN 3
+#define BENCH_READ_MODIFY_WRITE 4
+#define BENCH_OPERATIONS 5
+
+#define BENCH_UNIFORM 0
+#define BENCH_ZIPFIAN 1
+#define BENCH_LATEST 2
+
+#define BENCH_ZIPFIAN_CONSTANT 0.99
+#define BENCH_MAX_SCAN 100
+#define BENCH_MAX_KEY 256
+
+const char *const bench_operation_names[BENCH_OPERATIONS] = {"read", "update", "insert", "scan", "read-modify-write"};
+
+// The share of each operation in a workload, in percent, and how it picks keys.
+struct bench_workload {
+    char name;
+    int mix[BENCH_OPERATIONS];
+    int distribution;
+};
+
+const struct bench_workload bench_workloads[] = {
+    {'A', {50, 50, 0, 0, 0}, BENCH_ZIPFIAN}, // update heavy
+    {'B', {95, 5, 0, 0, 0}, BENCH_ZIPFIAN}, // read mostly
+    {'C', {100, 0, 0, 0, 0}, BENCH_ZIPFIAN}, // read only
+    {'D', {95, 0, 5, 0, 0}, BENCH_LATEST}, // read latest
+    {'E', {0, 0, 5, 95, 0}, BENCH_ZIPFIAN}, // short ranges
+    {'F', {50, 0, 0, 0, 50}, BENCH_ZIPFIAN}, // read-modify-write
+};
+
+struct bench_config {
+    const char *workloads;
+    uint64_t records;
+    uint64_t operations;
+    int threads;
+    size_t key_size;
+    size_t value_min;
+    size_t value_max;
+    int distribution; // -1 for the one of the workload
+    bool bulk;
+    bool cold;
+    bool sync;
+    bool print_stats;
+    uint32_t flags; // HDB_OPEN_*
+};
+
+// Zipfian choice of 0 to items - 1 as in YCSB, after Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases".  zeta is summed once up front.
+struct bench_zipfian {
+    uint64_t items;
+    double theta;
+    double alpha;
+    double zeta;
+    double eta;
+    double half_pow_theta;
+};
+
+void bench_zipfian_init(struct bench_zipfian *zipfian, uint64_t items, double theta) {
+    double zeta = 0, zeta2 = 1 + pow(0.5, theta);
+    for (uint64_t i = 1; i <= items; ++i) zeta += 1 / pow((double)i, theta);
+    zipfian->items = items;
+    zipfian->theta = theta;
+    zipfian->alpha = 1 / (1 - theta);
+    zipfian->zeta = zeta;
+    zipfian->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zeta);
+    zipfian->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+// u is uniform in [0, 1).  Item 0 is the most popular, and items past the
+// ones zeta was summed for, inserted since, are treated as the rarest.
+uint64_t bench_zipfian_next(const struct bench_zipfian *zipfian, double u) {
+    double uz = u * zipfian->zeta;
+    if (uz < 1) return 0;
+    if (uz < zipfian->half_pow_theta) return 1;
+    uint64_t item = (uint64_t)(zipfian->items * pow(zipfian->eta * u - zipfian->eta + 1, zipfian->alpha));
+    return item < zipfian->items ? item : zipfian->items - 1;
+}
 
-    double duration = (double)(end - start) / CLOCKS_PER_SEC;
-    printf("Put operation benchmark completed: %d operations in %.6f seconds (%.6f ops/sec)\n",
-           num_operations, duration, num_operations / duration);
+// xorshift64*, one per thread
+uint64_t bench_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
 }
 
-// Benchmark the get operation
-void benchmark_get(struct hdb *db, int num_operations) {
-    uint8_t key[32];
-    uint8_t value[256];
-    size_t value_length;
+double bench_uniform(uint64_t *state) {
+    return (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Spreads item numbers over the key space, so popular items are not neighbours.
+uint64_t bench_scramble(uint64_t item) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+        hash ^= (item >> (i * 8)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    // Insert some data first
-    for (int i = 0; i < num_operations; ++i) {
-        snprintf((char*)key, sizeof(key), "key%d", i);
-        snprintf((char*)value, sizeof(value), "value%d", i);
-        db_put(db, key, strlen((char*)key), value, strlen((char*)value));
+// The key of item, "user" and a number, zero padded to the key size.
+size_t bench_key(const struct bench_config *config, uint64_t item, uint8_t *key) {
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%" PRIu64, bench_scramble(item));
+    size_t size = config->key_size > 4 + (size_t)length ? config->key_size : 4 + (size_t)length;
+    memcpy(key, "user", 4);
+    memset(key + 4, '0', size - 4 - length);
+    memcpy(key + size - length, digits, length);
+    return size;
+}
+
+size_t bench_value(const struct bench_config *config, uint64_t *state, uint8_t *value) {
+    size_t length = config->value_min;
+    if (config->value_max > config->value_min) length += bench_random(state) % (config->value_max - config->value_min + 1);
+    for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+        uint64_t word = bench_random(state);
+        memcpy(value + i, &word, length - i < sizeof(uint64_t) ? length - i : sizeof(uint64_t));
     }
+    return length;
+}
+
+// Latencies of one kind of operation, bucketed as hdb_time does.
+struct bench_histogram {
+    uint64_t buckets[HDB_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t failures;
+};
 
-    clock_t start = clock();
-    for (int i = 0; i < num_operations; ++i) {
-        snprintf((char*)key, sizeof(key), "key%d", i);
-        uint8_t retrieved_value[1024];
+void bench_record(struct bench_histogram *histogram, uint64_t nanoseconds, bool failed) {
+    histogram->buckets[hdb_histogram_bucket(nanoseconds)]++;
+    histogram->count++;
+    histogram->sum += nanoseconds;
+    if (failed) histogram->failures++;
+}
+
+void bench_merge(struct bench_histogram *into, const struct bench_histogram *from) {
+    for (int i = 0; i < HDB_HISTOGRAM_BUCKETS; ++i) into->buckets[i] += from->buckets[i];
+    into->count += from->count;
+    into->sum += from->sum;
+    into->failures += from->failures;
+}
 
-        // Perform get operation
-        db_get(db, key, strlen((char*)key), retrieved_value, &value_length);
+uint64_t bench_percentile(const struct bench_histogram *histogram, double quantile) {
+    uint64_t seen = 0;
+    for (int i = 0; i < HDB_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (histogram->buckets[i] && seen >= quantile * histogram->count) return hdb_histogram_upper(i);
     }
-    clock_t end = clock();
+    return 0;
+}
+
+uint64_t bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// State shared by the threads of one phase
+struct bench_run {
+    const struct bench_config *config;
+    const struct bench_workload *workload; // NULL for the load phase
+    struct hdb *db;
+    struct bench_zipfian zipfian;
+    uint64_t next_insert; // item number the next insert takes
+    uint64_t inserted; // items known to be stored, readers choose among these
+    pthread_barrier_t barrier;
+};
 
-    double duration = (double)(end - start) / CLOCKS_PER_SEC;
-    printf("Get operation benchmark completed: %d operations in %.6f seconds (%.6f ops/sec)\n",
-           num_operations, duration, num_operations / duration);
+struct bench_thread {
+    struct bench_run *run;
+    int index;
+    uint64_t random;
+    struct bench_histogram histograms[BENCH_OPERATIONS];
+};
+
+uint64_t bench_choose(struct bench_thread *thread, int distribution) {
+    struct bench_run *run = thread->run;
+    uint64_t inserted = __atomic_load_n(&run->inserted, __ATOMIC_ACQUIRE);
+    if (distribution == BENCH_UNIFORM) return bench_random(&thread->random) % inserted;
+    uint64_t item = bench_zipfian_next(&run->zipfian, bench_uniform(&thread->random));
+    if (item >= inserted) item = inserted - 1;
+    // The latest distribution favours the items inserted last
+    return distribution == BENCH_LATEST ? inserted - 1 - item : item;
 }
 
-// Benchmark the delete operation
-void benchmark_delete(struct hdb *db, int num_operations) {
-    uint8_t key[32];
-    uint8_t value[256];
+void* bench_thread_main(void *arg) {
+    struct bench_thread *thread = arg;
+    struct bench_run *run = thread->run;
+    const struct bench_config *config = run->config;
+    uint8_t key[BENCH_MAX_KEY];
+    uint8_t *value = malloc(config->value_max + sizeof(uint64_t));
+    uint8_t *read_value = malloc(config->value_max + sizeof(uint64_t));
+    assert(value && read_value);
+    size_t read_length;
+
+    // The load phase splits the records between the threads
+    uint64_t operations = config->operations / config->threads;
+    uint64_t first = 0;
+    if (!run->workload) {
+        uint64_t share = config->records / config->threads;
+        first = share * thread->index;
+        operations = thread->index == config->threads - 1 ? config->records - first : share;
+    }
+    int distribution = run->workload && config->distribution < 0 ? run->workload->distribution : config->distribution;
+
+    pthread_barrier_wait(&run->barrier);
+    for (uint64_t i = 0; i < operations; ++i) {
+        int operation = BENCH_INSERT;
+        if (run->workload) {
+            int roll = bench_random(&thread->random) % 100;
+            for (operation = 0; operation < BENCH_OPERATIONS - 1 && roll >= run->workload->mix[operation]; ++operation) {
+                roll -= run->workload->mix[operation];
+            }
+        }
+        uint64_t item;
+        if (!run->workload) {
+            item = first + i;
+        } else if (operation == BENCH_INSERT) {
+            item = __atomic_fetch_add(&run->next_insert, 1, __ATOMIC_RELAXED);
+        } else {
+            item = bench_choose(thread, distribution);
+        }
+        size_t key_length = bench_key(config, item, key);
+        size_t value_length = operation == BENCH_READ || operation == BENCH_SCAN ? 0 : bench_value(config, &thread->random, value);
 
-    // Insert some data first
-    for (int i = 0; i < num_operations; ++i) {
-        snprintf((char*)key, sizeof(key), "key%d", i);
-        snprintf((char*)value, sizeof(value), "value%d", i);
-        db_put(db, key, strlen((char*)key), value, strlen((char*)value));
+        uint64_t start = bench_now();
+        int rc = 0;
+        if (operation == BENCH_READ) {
+            rc = db_get(run->db, key, key_length, read_value, &read_length);
+        } else if (operation == BENCH_UPDATE || operation == BENCH_INSERT) {
+            rc = db_put(run->db, key, key_length, value, value_length);
+        } else if (operation == BENCH_READ_MODIFY_WRITE) {
+            rc = db_get(run->db, key, key_length, read_value, &read_length);
+            if (rc == 0) rc = db_put(run->db, key, key_length, value, value_length);
+        } else {
+            uint64_t length = 1 + bench_random(&thread->random) % BENCH_MAX_SCAN;
+            struct hdb_cursor *cursor = db_cursor_open_range(run->db, key, key_length, NULL, 0);
+            rc = cursor ? 0 : -1;
+            for (uint64_t scanned = 0; cursor && scanned < length && db_cursor_next(cursor) == 0; ++scanned) {}
+            db_cursor_close(cursor);
+        }
+        bench_record(&thread->histograms[operation], bench_now() - start, rc != 0);
+
+        // Inserts are read from once they are all in, up to the last one
+        if (operation == BENCH_INSERT && run->workload) {
+            uint64_t expected = item;
+            while (!__atomic_compare_exchange_n(&run->inserted, &expected, item + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                if (expected > item) break;
+                expected = item;
+                sched_yield();
+            }
+        }
     }
+    free(value);
+    free(read_value);
+    return NULL;
+}
+
+void bench_print_latency(const char *name, const struct bench_histogram *histogram) {
+    if (!histogram->count) return;
+    printf("  %-18s count %" PRIu64 " failed %" PRIu64 " mean %.1f us p50 %.1f us p99 %.1f us p999 %.1f us max %.1f us\n", name,
+           histogram->count, histogram->failures, histogram->sum / 1e3 / histogram->count, bench_percentile(histogram, 0.5) / 1e3,
+           bench_percentile(histogram, 0.99) / 1e3, bench_percentile(histogram, 0.999) / 1e3, bench_percentile(histogram, 1) / 1e3);
+}
 
-    clock_t start = clock();
-    for (int i = 0; i < num_operations; ++i) {
-        snprintf((char*)key, sizeof(key), "key%d", i);
+// Runs the load phase when workload is NULL, a workload otherwise, and
+// returns how many records there are afterwards.
+uint64_t bench_phase(const struct bench_config *config, const struct bench_workload *workload, struct hdb *db, uint64_t records) {
+    struct bench_run run;
+    memset(&run, 0, sizeof(struct bench_run));
+    run.config = config;
+    run.workload = workload;
+    run.db = db;
+    run.next_insert = records;
+    run.inserted = records;
+    if (workload) bench_zipfian_init(&run.zipfian, records, BENCH_ZIPFIAN_CONSTANT);
+    pthread_barrier_init(&run.barrier, NULL, config->threads + 1);
 
-        // Perform delete operation
-        db_delete(db, key, strlen((char*)key));
+    struct bench_thread *threads = calloc(config->threads, sizeof(struct bench_thread));
+    pthread_t *ids = calloc(config->threads, sizeof(pthread_t));
+    assert(threads && ids);
+    for (int i = 0; i < config->threads; ++i) {
+        threads[i].run = &run;
+        threads[i].index = i;
+        threads[i].random = 0x9e3779b97f4a7c15ULL * (i + 1) + (workload ? workload->name : 0);
+        pthread_create(&ids[i], NULL, bench_thread_main, &threads[i]);
     }
-    clock_t end = clock();
+    pthread_barrier_wait(&run.barrier);
+    uint64_t start = bench_now();
+    for (int i = 0; i < config->threads; ++i) pthread_join(ids[i], NULL);
+    double seconds = (bench_now() - start) / 1e9;
 
-    double duration = (double)(end - start) / CLOCKS_PER_SEC;
-    printf("Delete operation benchmark completed: %d operations in %.6f seconds (%.6f ops/sec)\n",
-           num_operations, duration, num_operations / duration);
+    struct bench_histogram total[BENCH_OPERATIONS];
+    memset(total, 0, sizeof(total));
+    uint64_t count = 0;
+    for (int i = 0; i < config->threads; ++i) {
+        for (int operation = 0; operation < BENCH_OPERATIONS; ++operation) bench_merge(&total[operation], &threads[i].histograms[operation]);
+    }
+    for (int operation = 0; operation < BENCH_OPERATIONS; ++operation) count += total[operation].count;
+    if (workload) {
+        printf("workload %c: %" PRIu64 " operations on %d threads in %.3f s, %.0f ops/s\n", workload->name, count, config->threads,
+               seconds, count / seconds);
+    } else {
+        printf("load: %" PRIu64 " records on %d threads in %.3f s, %.0f ops/s\n", count, config->threads, seconds, count / seconds);
+    }
+    for (int operation = 0; operation < BENCH_OPERATIONS; ++operation) bench_print_latency(bench_operation_names[operation], &total[operation]);
+
+    pthread_barrier_destroy(&run.barrier);
+    free(threads);
+    free(ids);
+    return workload ? run.next_insert : config->records;
 }
 
-int main() {
-    int num_operations = 1000; // Number of operations to benchmark
+void bench_options(const struct bench_config *config, struct hdb_options *options) {
+    memset(options, 0, sizeof(struct hdb_options));
+    options->flags = config->flags;
+    options->durability = config->sync ? HDB_DURABILITY_COMMIT : 0;
+}
 
-    // Open the database
-    struct hdb *db = db_open("benchmark_hash.db", "benchmark_data.db", "benchmark_deleted.db");
+struct hdb* bench_open(const struct bench_config *config) {
+    struct hdb_options options;
+    bench_options(config, &options);
+    struct hdb *db = db_open_with_options(BENCH_HASH_FILE, BENCH_DATA_FILE, BENCH_DELETED_FILE, &options);
     assert(db != NULL);
+    return db;
+}
+
+struct bench_source {
+    const struct bench_config *config;
+    uint64_t next;
+    uint64_t random;
+    uint8_t key[BENCH_MAX_KEY];
+    uint8_t *value;
+};
+
+int bench_source_next(void *context, struct hdb_put_item *item) {
+    struct bench_source *source = context;
+    if (source->next == source->config->records) return 1;
+    item->key = source->key;
+    item->key_length = bench_key(source->config, source->next++, source->key);
+    item->value = source->value;
+    item->value_length = bench_value(source->config, &source->random, source->value);
+    return 0;
+}
 
-    // Run the benchmarks
-    benchmark_put(db, num_operations);
-    benchmark_get(db, num_operations);
-    benchmark_delete(db, num_operations);
+// The load phase through db_bulk_load, which does its own threading.
+struct hdb* bench_bulk_load(const struct bench_config *config) {
+    struct hdb_options options;
+    bench_options(config, &options);
+    struct bench_source source = {config, 0, 0x9e3779b97f4a7c15ULL, {0}, malloc(config->value_max + sizeof(uint64_t))};
+    assert(source.value);
+    struct hdb_bulk_source bulk = {bench_source_next, &source};
+    uint64_t start = bench_now();
+    struct hdb *db = db_bulk_load(BENCH_HASH_FILE, BENCH_DATA_FILE, BENCH_DELETED_FILE, &options, &bulk);
+    assert(db != NULL);
+    double seconds = (bench_now() - start) / 1e9;
+    printf("bulk load: %" PRIu64 " records in %.3f s, %.0f records/s, %.1f MB/s of data file\n", config->records, seconds,
+           config->records / seconds, hdb_data_size(db) / 1e6 / seconds);
+    free(source.value);
+    return db;
+}
 
-    // Close the database
+// Closes the database and asks the kernel to forget the pages of its files,
+// so the next phase starts from the disk.  Needs root for the other caches.
+struct hdb* bench_cold(const struct bench_config *config, struct hdb *db) {
     db_close(db);
+    const char *files[] = {BENCH_HASH_FILE, BENCH_DATA_FILE, BENCH_DELETED_FILE};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        int fd = open(files[i], O_RDONLY);
+        if (fd < 0) continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    FILE *drop = fopen("/proc/sys/vm/drop_caches", "w");
+    if (drop) {
+        fputs("1\n", drop);
+        fclose(drop);
+    }
+    return bench_open(config);
+}
+
+void bench_remove(void) {
+    remove(BENCH_HASH_FILE);
+    remove(BENCH_DATA_FILE);
+    remove(BENCH_DELETED_FILE);
+    remove(BENCH_DATA_FILE ".wal");
+}
 
+int main(int argc, char **argv) {
+    struct bench_config config = {"ABCDEF", 100000, 100000, 4, 24, 100, 100, -1, false, false, false, false, 0};
+    int option;
+    while ((option = getopt(argc, argv, "w:r:o:t:k:v:d:bcmsS")) != -1) {
+        switch (option) {
+        case 'w': config.workloads = optarg; break;
+        case 'r': config.records = strtoull(optarg, NULL, 10); break;
+        case 'o': config.operations = strtoull(optarg, NULL, 10); break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'k': config.key_size = strtoull(optarg, NULL, 10); break;
+        case 'v':
+            config.value_min = config.value_max = strtoull(optarg, NULL, 10);
+            if (strchr(optarg, '-')) config.value_max = strtoull(strchr(optarg, '-') + 1, NULL, 10);
+            break;
+        case 'd':
+            config.distribution = !strcmp(optarg, "uniform") ? BENCH_UNIFORM : !strcmp(optarg, "latest") ? BENCH_LATEST : BENCH_ZIPFIAN;
+            break;
+        case 'b': config.bulk = true; break;
+        case 'c': config.cold = true; break;
+        case 'm': config.flags |= HDB_OPEN_MMAP; break;
+        case 's': config.sync = true; break;
+        case 'S': config.print_stats = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-w ABCDEF] [-r records] [-o operations] [-t threads] [-k key size] "
+                            "[-v size or min-max] [-d uniform|zipfian|latest] [-b] [-c] [-m] [-s] [-S]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.threads < 1 || config.records < 1 || config.key_size >= BENCH_MAX_KEY || config.value_max < config.value_min) {
+        fprintf(stderr, "%s: bad arguments\n", argv[0]);
+        return 1;
+    }
+    if (strchr(config.workloads, 'E')) config.flags |= HDB_OPEN_SORTED_INDEX; // its scans go through the sorted index
+
+    bench_remove();
+    struct hdb *db;
+    uint64_t records = config.records;
+    if (config.bulk) {
+        db = bench_bulk_load(&config);
+    } else {
+        db = bench_open(&config);
+        records = bench_phase(&config, NULL, db, 0);
+    }
+    for (const char *name = config.workloads; *name; ++name) {
+        const struct bench_workload *workload = NULL;
+        for (size_t i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); ++i) {
+            if (bench_workloads[i].name == *name) workload = &bench_workloads[i];
+        }
+        if (!workload) {
+            fprintf(stderr, "%s: no workload %c\n", argv[0], *name);
+            continue;
+        }
+        if (config.cold) db = bench_cold(&config, db);
+        records = bench_phase(&config, workload, db, records);
+    }
+
+    if (config.print_stats) {
+        struct hdb_stats stats;
+        db_stats(db, &stats);
+        db_stats_print(&stats, stdout, HDB_STATS_TEXT);
+    }
+    db_close(db);
+    bench_remove();
     return 0;
 }
@@ -37,10 +37,55 @@
 #include "hdb.h"
 
 // Test helper functions
+
+// Files a database named prefix leaves behind, from prefix_hash.db to the
+// sidecars of a compaction cut short
+const char *test_file_suffixes[] = {"_hash.db", "_data.db", "_deleted.db", "_hash.db.filter", "_data.db.wal",
+                                    "_data.db.compact", "_data.db.remap", "_data.db.blob", "_data.db.blob.compact",
+                                    "_data.db.blob.remap"};
+#define TEST_FILE_SUFFIXES (sizeof(test_file_suffixes) / sizeof(test_file_suffixes[0]))
+
+void remove_test_files(const char *prefix) {
+    char filename[128];
+    for (size_t i = 0; i < TEST_FILE_SUFFIXES; ++i) {
+        snprintf(filename, sizeof(filename), "%s%s", prefix, test_file_suffixes[i]);
+        remove(filename);
+    }
+}
+
+// Fills value with what key i of a check_keys run holds and returns its
+// length, or -1 when the key is not there
+typedef int (*expected_value)(int i, uint8_t *value, const void *context);
+
+// Reads keys prefix0 to prefix<count - 1> back, none are there when expected is NULL
+void check_keys(struct hdb *db, const char *prefix, int count, expected_value expected, const void *context) {
+    uint8_t key[64], value[4096], read_value[4096];
+    size_t read_length;
+    for (int i = 0; i < count; ++i) {
+        snprintf((char*)key, sizeof(key), "%s%d", prefix, i);
+        int rc = db_get(db, key, strlen((char*)key), read_value, &read_length);
+        int length = expected ? expected(i, value, context) : -1;
+        if (length < 0) {
+            assert(rc == -1);
+            continue;
+        }
+        assert(rc == 0 && read_length == (size_t)length && memcmp(read_value, value, read_length) == 0);
+    }
+}
 void test_hash_function() {
     uint8_t data[] = "hello";
-    uint32_t hash = hash_function(data, strlen((char*)data));
+    uint64_t hash = hash_function(data, strlen((char*)data));
     assert(hash != 0); // Ensure that the hash is not zero
+    assert(hash != hash_function(data, strlen((char*)data) - 1));
+
+    // The vectorised loop for long keys must agree with the portable one,
+    // whatever the length of the last stripe
+    uint8_t long_key[5000];
+    for (size_t i = 0; i < sizeof(long_key); ++i) long_key[i] = (uint8_t)(i * 131 + 7);
+    for (size_t length = HDB_HASH_LONG_KEY; length <= sizeof(long_key); length += 611) {
+        assert(hash_function(long_key, length) == hdb_hash_mix64(long_key, length, hdb_hash_stripes_scalar));
+    }
+    assert(hash_function(long_key, 1000) != hash_function(long_key, 1001));
     printf("hash_function test passed\n");
 }
 
@@ -48,6 +93,30 @@ void test_db_open_close() {
     struct hdb *db = db_open("test_hash.db", "test_data.db", "test_deleted.db");
     assert(db != NULL);
     db_close(db);
+
+    // A hash file from before the magic, with bare values in the data file, is refused
+    remove_test_files("test_legacy");
+    FILE *file = fopen("test_legacy_hash.db", "wb");
+    uint8_t table[128 * 2 * sizeof(uint64_t)] = {0};
+    uint32_t hash = 123456789;
+    memcpy(table, &hash, sizeof(uint32_t));
+    assert(file != NULL && fwrite(table, sizeof(table), 1, file) == 1);
+    fclose(file);
+    errno = 0;
+    assert(db_open("test_legacy_hash.db", "test_legacy_data.db", "test_legacy_deleted.db") == NULL);
+    assert(errno == HDB_EFORMAT);
+
+    // So is one with the magic but another format version
+    uint32_t version = HDB_FORMAT_VERSION + 1;
+    file = fopen("test_hash.db", "r+b");
+    assert(file != NULL && fseek(file, offsetof(struct hdb_header, version), SEEK_SET) == 0);
+    assert(fwrite(&version, sizeof(uint32_t), 1, file) == 1);
+    fclose(file);
+    errno = 0;
+    assert(db_open("test_hash.db", "test_data.db", "test_deleted.db") == NULL);
+    assert(errno == HDB_EFORMAT);
+    remove_test_files("test");
+    remove_test_files("test_legacy");
     printf("db_open and db_close test passed\n");
 }
 
@@ -94,27 +163,2311 @@ void test_db_delete() {
     printf("db_delete test passed\n");
 }
 
-void test_deleted_blocks_array() {
-    struct hdb *db = db_open("test_hash.db", "test_data.db", "test_deleted.db");
+void test_free_space() {
+    remove_test_files("test_free");
+    struct hdb_options options = {0};
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    struct hdb *db = db_open_with_options("test_free_hash.db", "test_free_data.db", "test_free_deleted.db", &options);
 
     uint8_t key1[] = "key1";
     uint8_t value1[] = "value1";
     uint8_t key2[] = "key2";
     uint8_t value2[] = "value2";
+    uint8_t key3[] = "key3";
+    uint8_t value3[] = "value3";
 
-    // Insert data
     assert(db_put(db, key1, strlen((char*)key1), value1, strlen((char*)value1)) == 0);
     assert(db_put(db, key2, strlen((char*)key2), value2, strlen((char*)value2)) == 0);
 
-    // Delete data
+    // The two neighbouring records coalesce into a single extent
     assert(db_delete(db, key1, strlen((char*)key1)) == 0);
     assert(db_delete(db, key2, strlen((char*)key2)) == 0);
+    uint64_t record_size = hdb_record_size(strlen((char*)key1), strlen((char*)value1));
+    assert(db->free_space.count == 1);
+    assert(db->free_space.bytes == 2 * record_size);
+    assert(db->free_space.root[HDB_BY_OFFSET]->offset == 0);
+
+    // A new record goes where key1 was instead of growing the file
+    uint64_t size_before = hdb_data_size(db);
+    assert(db_put(db, key3, strlen((char*)key3), value3, strlen((char*)value3)) == 0);
+    assert(hdb_data_size(db) == size_before);
+    assert(db->free_space.count == 1);
+    assert(db->free_space.root[HDB_BY_OFFSET]->offset == record_size);
+    db_close(db);
+
+    // The free space survives a reopen, loaded the first time an extent is wanted
+    db = db_open_with_options("test_free_hash.db", "test_free_data.db", "test_free_deleted.db", &options);
+    assert(db->free_space_pending && db->free_space.count == 0);
+    hdb_load_free_space(db);
+    assert(db->free_space.count == 1);
+    assert(db->free_space.bytes == record_size);
+    uint8_t value[BLOCK_SIZE];
+    size_t value_length;
+    assert(db_get(db, key3, strlen((char*)key3), value, &value_length) == 0);
+    assert(value_length == strlen((char*)value3) && memcmp(value, value3, value_length) == 0);
+    assert(db_get(db, key1, strlen((char*)key1), value, &value_length) == -1);
+    db_close(db);
+    printf("free space test passed\n");
+}
+
+void test_mmap() {
+    remove_test_files("test_mmap");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_MMAP | HDB_OPEN_NO_COMPACTION;
+    options.mmap_chunk = 64 * 1024; // small chunks so the mappings have to grow
+    struct hdb *db = db_open_with_options("test_mmap_hash.db", "test_mmap_data.db", "test_mmap_deleted.db", &options);
+    assert(db != NULL);
+    assert(db->hash_map.base != NULL && db->data_map != NULL && db->data_map->base != NULL);
+    uint8_t *first_mapping = db->data_map->base;
+
+    int num_keys = 5000;
+    uint8_t key[32];
+    uint8_t value[64];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    // The mapping grows in place, readers never see it move
+    assert(db->data_map->base == first_mapping && db->data_map->capacity > options.mmap_chunk);
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    assert(db_compact(db) == 0);
+    assert(db->data_map->base != NULL && db->data_map->capacity >= hdb_data_size(db));
+    db_close(db);
+
+    // The files are the same with or without the mappings
+    for (int pass = 0; pass < 2; ++pass) {
+        options.flags = pass ? HDB_OPEN_NO_COMPACTION : HDB_OPEN_MMAP | HDB_OPEN_NO_COMPACTION;
+        db = db_open_with_options("test_mmap_hash.db", "test_mmap_data.db", "test_mmap_deleted.db", &options);
+        assert(db != NULL);
+        uint8_t retrieved_value[1024];
+        size_t retrieved_value_length;
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            int rc = db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length);
+            if (i % 2 == 0) {
+                assert(rc == -1);
+                continue;
+            }
+            snprintf((char*)value, sizeof(value), "value%d", i);
+            assert(rc == 0);
+            assert(retrieved_value_length == strlen((char*)value));
+            assert(memcmp(retrieved_value, value, retrieved_value_length) == 0);
+        }
+        db_close(db);
+    }
+
+    // A reserve larger than the address space shrinks until it fits
+    options.flags = HDB_OPEN_MMAP | HDB_OPEN_NO_COMPACTION;
+    options.mmap_reserve = sizeof(void*) == 8 ? (uint64_t)1 << 62 : (uint64_t)1 << 31;
+    db = db_open_with_options("test_mmap_hash.db", "test_mmap_data.db", "test_mmap_deleted.db", &options);
+    assert(db != NULL && db->hash_map.base != NULL && db->data_map->base != NULL);
+    assert(db->data_map->reserve < options.mmap_reserve && db->data_map->reserve >= db->data_map->capacity);
+    assert(db_put(db, (const uint8_t*)"key0", 4, (const uint8_t*)"value0", 6) == 0);
+    uint8_t retrieved_value[1024];
+    size_t retrieved_value_length;
+    assert(db_get(db, (const uint8_t*)"key0", 4, retrieved_value, &retrieved_value_length) == 0);
+    assert(retrieved_value_length == 6 && memcmp(retrieved_value, "value0", 6) == 0);
+    db_close(db);
+    printf("mmap test passed\n");
+}
+
+void test_get_ref() {
+    remove_test_files("test_ref");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_MMAP | HDB_OPEN_NO_COMPACTION;
+    options.mmap_chunk = 64 * 1024;
+    struct hdb *db = db_open_with_options("test_ref_hash.db", "test_ref_data.db", "test_ref_deleted.db", &options);
+    assert(db != NULL);
+
+    // Larger than any fixed buffer a caller of db_get would pick
+    size_t blob_length = 100000;
+    uint8_t *blob = malloc(blob_length);
+    for (size_t i = 0; i < blob_length; ++i) blob[i] = (uint8_t)(i * 7);
+    uint8_t key[] = "blob";
+    assert(db_put(db, key, strlen((char*)key), blob, blob_length) == 0);
+
+    struct hdb_ref ref;
+    assert(db_get_ref(db, key, strlen((char*)key), &ref) == 0);
+    assert(ref.length == blob_length);
+    assert(ref.data >= db->data_map->base && ref.data < db->data_map->base + hdb_data_size(db));
+    assert(memcmp(ref.data, blob, blob_length) == 0);
+
+    // Overwrite and delete the key, grow the mapping and compact the file under the ref
+    uint8_t *other = calloc(1, blob_length);
+    assert(db_put(db, key, strlen((char*)key), other, blob_length) == 0);
+    assert(db_delete(db, key, strlen((char*)key)) == 0);
+    uint64_t capacity = db->data_map->capacity;
+    uint8_t small_key[32];
+    for (int i = 0; i < 200; ++i) {
+        snprintf((char*)small_key, sizeof(small_key), "key%d", i);
+        assert(db_put(db, small_key, strlen((char*)small_key), other, 1000) == 0);
+    }
+    assert(db->data_map->capacity > capacity);
+    assert(db_compact(db) == 0);
+    assert(memcmp(ref.data, blob, blob_length) == 0);
+    assert(db->limbo != NULL);
+
+    db_release_ref(&ref);
+    assert(db->limbo == NULL && db->refs == NULL);
+    assert(db_get_ref(db, key, strlen((char*)key), &ref) == -1);
+    db_close(db);
+
+    // Without the mappings the ref holds a copy
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    db = db_open_with_options("test_ref_hash.db", "test_ref_data.db", "test_ref_deleted.db", &options);
+    assert(db != NULL);
+    assert(db_get_ref(db, small_key, strlen((char*)small_key), &ref) == 0);
+    assert(ref.length == 1000 && memcmp(ref.data, other, 1000) == 0);
+    db_release_ref(&ref);
+    db_close(db);
+
+    free(blob);
+    free(other);
+    printf("get ref test passed\n");
+}
+
+// Values carry their key and a version, so a reader can tell a torn or
+// misdirected read from a late one.
+#define CONCURRENT_KEYS 512
+
+struct concurrent_state {
+    struct hdb *db;
+    int id;
+    volatile bool stop;
+    int reads;
+};
+
+void concurrent_key(uint8_t *key, int i) {
+    snprintf((char*)key, 32, "ckey%d", i);
+}
+
+size_t concurrent_value(uint8_t *value, int i, int version) {
+    // Lengths vary so overwrites move records around the free space
+    size_t length = 64 + (size_t)((i * 7 + version * 13) % 192);
+    memset(value, 'a' + version % 26, length);
+    snprintf((char*)value, length, "ckey%d/%d/", i, version);
+    return length;
+}
 
-    // Check that the deleted blocks array is populated
-    assert(db->deleted_blocks_array_size == 2);
+bool concurrent_value_valid(const uint8_t *value, size_t length, int i) {
+    char prefix[32];
+    int version;
+    snprintf(prefix, sizeof(prefix), "ckey%d/", i);
+    if (length < 64 || strncmp((const char*)value, prefix, strlen(prefix)) != 0) return false;
+    if (sscanf((const char*)value + strlen(prefix), "%d/", &version) != 1) return false;
+    uint8_t expected[256];
+    return concurrent_value(expected, i, version) == length && memcmp(value, expected, length) == 0;
+}
+
+void* concurrent_reader(void *arg) {
+    struct concurrent_state *state = arg;
+    uint8_t key[32];
+    uint8_t value[1024];
+    size_t value_length;
+    unsigned seed = state->id;
+    while (!state->stop) {
+        int i = rand_r(&seed) % CONCURRENT_KEYS;
+        concurrent_key(key, i);
+        if (seed & 1) {
+            if (db_get(state->db, key, strlen((char*)key), value, &value_length) == 0) {
+                assert(concurrent_value_valid(value, value_length, i));
+            }
+        } else {
+            struct hdb_ref ref;
+            if (db_get_ref(state->db, key, strlen((char*)key), &ref) == 0) {
+                assert(concurrent_value_valid(ref.data, ref.length, i));
+                db_release_ref(&ref);
+            }
+        }
+        state->reads++;
+    }
+    return NULL;
+}
+
+void* concurrent_writer(void *arg) {
+    struct concurrent_state *state = arg;
+    uint8_t key[32];
+    uint8_t value[256];
+    unsigned seed = state->id;
+    for (int n = 0; n < 3000; ++n) {
+        // Each writer owns the keys congruent to its id, so versions only grow
+        int i = (rand_r(&seed) % (CONCURRENT_KEYS / 2)) * 2 + state->id % 2;
+        concurrent_key(key, i);
+        if (rand_r(&seed) % 4 == 0) {
+            db_delete(state->db, key, strlen((char*)key));
+        } else {
+            size_t length = concurrent_value(value, i, n);
+            assert(db_put(state->db, key, strlen((char*)key), value, length) == 0);
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_access() {
+    remove_test_files("test_concurrent");
+    for (int pass = 0; pass < 2; ++pass) {
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = pass ? HDB_OPEN_NO_COMPACTION : HDB_OPEN_MMAP | HDB_OPEN_NO_COMPACTION;
+        options.mmap_chunk = 64 * 1024;
+        struct hdb *db = db_open_with_options("test_concurrent_hash.db", "test_concurrent_data.db",
+                                              "test_concurrent_deleted.db", &options);
+        assert(db != NULL);
+
+        pthread_t readers[4], writers[2];
+        struct concurrent_state reader_states[4], writer_states[2];
+        for (int i = 0; i < 4; ++i) {
+            reader_states[i] = (struct concurrent_state){db, i + 1, false, 0};
+            pthread_create(&readers[i], NULL, concurrent_reader, &reader_states[i]);
+        }
+        for (int i = 0; i < 2; ++i) {
+            writer_states[i] = (struct concurrent_state){db, i + pass * 2, false, 0};
+            pthread_create(&writers[i], NULL, concurrent_writer, &writer_states[i]);
+        }
+        // Compactions swap the file and the index under the readers
+        for (int i = 0; i < 5; ++i) {
+            usleep(20000);
+            assert(db_compact(db) == 0);
+        }
+        for (int i = 0; i < 2; ++i) pthread_join(writers[i], NULL);
+        for (int i = 0; i < 4; ++i) {
+            reader_states[i].stop = true;
+            pthread_join(readers[i], NULL);
+            assert(reader_states[i].reads > 0);
+        }
+
+        // Every key still found holds a whole value of its own
+        uint8_t key[32];
+        uint8_t value[1024];
+        size_t value_length;
+        uint64_t found = 0;
+        for (int i = 0; i < CONCURRENT_KEYS; ++i) {
+            concurrent_key(key, i);
+            if (db_get(db, key, strlen((char*)key), value, &value_length) != 0) continue;
+            assert(concurrent_value_valid(value, value_length, i));
+            found++;
+        }
+        assert(found == db->header.key_count);
+        db_close(db);
+    }
+    printf("concurrent access test passed\n");
+}
+
+void copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    assert(in != NULL && out != NULL);
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) assert(fwrite(buffer, 1, n, out) == n);
+    fclose(in);
+    fclose(out);
+}
+
+void* wal_writer(void *arg) {
+    struct hdb *db = arg;
+    uint8_t key[32];
+    uint8_t value[64];
+    pthread_t self = pthread_self();
+    for (int i = 0; i < 50; ++i) {
+        snprintf((char*)key, sizeof(key), "g%lu-%d", (unsigned long)self, i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    return NULL;
+}
+
+void test_wal() {
+    remove_test_files("test_wal");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.durability = HDB_DURABILITY_COMMIT;
+    struct hdb *db = db_open_with_options("test_wal_hash.db", "test_wal_data.db", "test_wal_deleted.db", &options);
+    assert(db != NULL);
+
+    int num_keys = 100;
+    uint8_t key[32];
+    uint8_t value[32];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_keys; i += 10) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    assert(db->wal.syncs > 0 && db->wal.durable == db->wal.end);
+
+    // Keep the log as a crash would have left it
+    copy_file("test_wal_data.db.wal", "test_wal_saved.wal");
+    db_close(db);
+    assert(access("test_wal_data.db.wal", F_OK) != 0); // a clean close leaves no log
+
+    // Replaying the log alone rebuilds the database, a torn record at its end is ignored
+    remove_test_files("test_wal");
+    assert(rename("test_wal_saved.wal", "test_wal_data.db.wal") == 0);
+    FILE *log = fopen("test_wal_data.db.wal", "ab");
+    struct hdb_wal_record torn = {12345, HDB_WAL_PUT, 4, 100};
+    fwrite(&torn, sizeof(torn), 1, log);
+    fwrite("torn", 1, 4, log);
+    fclose(log);
+    options.durability = 0;
+    db = db_open_with_options("test_wal_hash.db", "test_wal_data.db", "test_wal_deleted.db", &options);
+    assert(db != NULL);
+    assert(db->header.key_count == (uint64_t)(num_keys - num_keys / 10));
+    uint8_t retrieved_value[1024];
+    size_t retrieved_value_length;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        int rc = db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length);
+        if (i % 10 == 0) {
+            assert(rc == -1);
+            continue;
+        }
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(rc == 0);
+        assert(retrieved_value_length == strlen((char*)value));
+        assert(memcmp(retrieved_value, value, retrieved_value_length) == 0);
+    }
+    struct stat st;
+    assert(stat("test_wal_data.db.wal", &st) == 0 && st.st_size == 0); // replayed and checkpointed
+    assert(hdb_checkpoint(db) == 0);
+    db_close(db);
 
+    // Concurrent writers share syncs
+    options.durability = HDB_DURABILITY_COMMIT;
+    db = db_open_with_options("test_wal_hash.db", "test_wal_data.db", "test_wal_deleted.db", &options);
+    assert(db != NULL);
+    pthread_t writers[4];
+    for (int i = 0; i < 4; ++i) pthread_create(&writers[i], NULL, wal_writer, db);
+    for (int i = 0; i < 4; ++i) pthread_join(writers[i], NULL);
+    assert(db->wal.syncs > 0 && db->wal.syncs <= 200);
+    db_close(db);
+    printf("wal test passed\n");
+}
+
+void test_batch() {
+    remove_test_files("test_batch");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    struct hdb *db = db_open_with_options("test_batch_hash.db", "test_batch_data.db", "test_batch_deleted.db", &options);
+    assert(db != NULL);
+
+    // Some keys exist before the batch, and the batch repeats the last ones
+    int num_keys = 5000, repeats = 100;
+    uint8_t (*keys)[32] = malloc((num_keys + repeats) * sizeof(*keys));
+    uint8_t (*values)[32] = malloc((num_keys + repeats) * sizeof(*values));
+    struct hdb_put_item *puts = malloc((num_keys + repeats) * sizeof(struct hdb_put_item));
+    for (int i = 0; i < num_keys + repeats; ++i) {
+        int k = i < num_keys ? i : num_keys - 1 - (i - num_keys);
+        snprintf((char*)keys[i], sizeof(keys[i]), "key%d", k);
+        snprintf((char*)values[i], sizeof(values[i]), "%s%d", i < num_keys ? "value" : "again", k);
+        puts[i] = (struct hdb_put_item){keys[i], strlen((char*)keys[i]), values[i], strlen((char*)values[i])};
+    }
+    for (int i = 0; i < num_keys; i += 7) {
+        assert(db_put(db, keys[i], strlen((char*)keys[i]), (const uint8_t*)"old", 3) == 0);
+    }
+    assert(db_put_batch(db, puts, num_keys + repeats) == 0);
+    assert(db->header.key_count == (uint64_t)num_keys);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        // Every other key is missing from the lookup
+        int lookups = num_keys * 2;
+        struct hdb_get_item *gets = malloc(lookups * sizeof(struct hdb_get_item));
+        uint8_t (*missing)[32] = malloc(num_keys * sizeof(*missing));
+        uint8_t (*buffers)[64] = malloc(lookups * sizeof(*buffers));
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)missing[i], sizeof(missing[i]), "nokey%d", i);
+            gets[2 * i] = (struct hdb_get_item){keys[i], strlen((char*)keys[i]), buffers[2 * i], 0, 0};
+            gets[2 * i + 1] = (struct hdb_get_item){missing[i], strlen((char*)missing[i]), buffers[2 * i + 1], 0, 0};
+        }
+        assert(db_get_batch(db, gets, lookups) == 0);
+        for (int i = 0; i < num_keys; ++i) {
+            char expected[32];
+            snprintf(expected, sizeof(expected), "%s%d", i >= num_keys - repeats ? "again" : "value", i);
+            assert(gets[2 * i].rc == 0);
+            assert(gets[2 * i].value_length == strlen(expected));
+            assert(memcmp(gets[2 * i].value, expected, gets[2 * i].value_length) == 0);
+            assert(gets[2 * i + 1].rc == -1);
+        }
+        free(gets);
+        free(missing);
+        free(buffers);
+
+        // Again from the files, read through the mappings
+        db_close(db);
+        options.flags |= HDB_OPEN_MMAP;
+        db = db_open_with_options("test_batch_hash.db", "test_batch_data.db", "test_batch_deleted.db", &options);
+        assert(db != NULL);
+    }
     db_close(db);
-    printf("deleted blocks array test passed\n");
+    free(keys);
+    free(values);
+    free(puts);
+    printf("batch test passed\n");
+}
+
+struct async_get {
+    struct hdb_request request;
+    uint8_t key[32];
+    uint8_t value[64];
+    int expected; // index of the key, -1 when it does not exist
+};
+
+int async_called;
+
+void async_get_done(struct hdb_request *request) {
+    struct async_get *get = request->user_data;
+    async_called++;
+    if (get->expected < 0) {
+        assert(request->rc == -1);
+        return;
+    }
+    char expected[64];
+    snprintf(expected, sizeof(expected), "value%d", get->expected);
+    assert(request->rc == 0);
+    assert(request->value_length == strlen(expected));
+    assert(memcmp(request->value, expected, request->value_length) == 0);
+}
+
+void async_put_done(struct hdb_request *request) {
+    async_called++;
+    assert(request->rc == 0);
+}
+
+void test_async() {
+    remove_test_files("test_async");
+    int num_keys = 2000;
+    for (int pass = 0; pass < 3; ++pass) {
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION | (pass == 2 ? HDB_OPEN_MMAP : 0);
+        struct hdb *db = db_open_with_options("test_async_hash.db", "test_async_data.db", "test_async_deleted.db", &options);
+        assert(db != NULL);
+        struct hdb_async *async = db_async_open(db, pass == 1 ? HDB_ASYNC_THREADS : HDB_ASYNC_URING, 64);
+        assert(async != NULL);
+
+        // Puts first, each pass rewrites the same values
+        struct async_get *gets = calloc(num_keys * 2, sizeof(struct async_get));
+        async_called = 0;
+        for (int i = 0; i < num_keys; ++i) {
+            struct async_get *put = &gets[i];
+            snprintf((char*)put->key, sizeof(put->key), "key%d", i);
+            snprintf((char*)put->value, sizeof(put->value), "value%d", i);
+            put->request = (struct hdb_request){HDB_REQUEST_PUT, put->key, strlen((char*)put->key), put->value,
+                                                strlen((char*)put->value), 0, async_put_done, put, NULL};
+            assert(db_async_submit(async, &put->request) == 0);
+        }
+        db_async_poll(async, num_keys);
+        assert(async_called == num_keys);
+
+        // More gets than the depth, so some wait for a free slot
+        async_called = 0;
+        for (int i = 0; i < num_keys * 2; ++i) {
+            struct async_get *get = &gets[i];
+            get->expected = i % 2 ? -1 : i / 2;
+            snprintf((char*)get->key, sizeof(get->key), i % 2 ? "nokey%d" : "key%d", i / 2);
+            get->request = (struct hdb_request){HDB_REQUEST_GET, get->key, strlen((char*)get->key), get->value,
+                                                0, 0, async_get_done, get, NULL};
+            assert(db_async_submit(async, &get->request) == 0);
+            if (i % 500 == 0) db_async_poll(async, 0);
+        }
+        db_async_poll(async, UINT32_MAX);
+        assert(async_called == num_keys * 2);
+
+        // A compaction between submitting and polling swaps the file under the reads
+        async_called = 0;
+        for (int i = 0; i < num_keys * 2; i += 2) {
+            assert(db_async_submit(async, &gets[i].request) == 0);
+        }
+        assert(db_compact(db) == 0);
+        db_async_poll(async, UINT32_MAX);
+        assert(async_called == num_keys);
+
+        db_async_close(async);
+        db_close(db);
+        free(gets);
+    }
+    printf("async test passed\n");
+}
+
+void test_index_cache() {
+    remove_test_files("test_cache");
+    int num_keys = 5000;
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+
+    // A budget of a few pages: the splits that follow find it spent, yet
+    // lookups in cached and uncached buckets alike see every write
+    options.index_cache = 4 * sizeof(struct hdb_bucket);
+    struct hdb *db = db_open_with_options("test_cache_hash.db", "test_cache_data.db", "test_cache_deleted.db", &options);
+    assert(db != NULL);
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    assert(db->header.bucket_count > 4);
+    assert(db->index_cache_bytes == 4 * sizeof(struct hdb_bucket));
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        int rc = db_get(db, key, strlen((char*)key), read_value, &read_length);
+        if (i % 2 == 0) {
+            assert(rc == -1);
+        } else {
+            assert(rc == 0 && read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+        }
+    }
+    db_close(db);
+
+    // With room for everything every bucket is loaded at open, and lookups
+    // no longer need the bucket pages in the file
+    options.index_cache = UINT64_MAX;
+    db = db_open_with_options("test_cache_hash.db", "test_cache_data.db", "test_cache_deleted.db", &options);
+    assert(db != NULL);
+    assert(db->index_cache_bytes == (uint64_t)db->header.bucket_count * sizeof(struct hdb_bucket));
+    struct hdb_bucket empty;
+    memset(&empty, 0, sizeof(struct hdb_bucket));
+    for (size_t i = 0; i < ((size_t)1 << db->header.global_depth); ++i) {
+        assert(pwrite(fileno(db->hash_file), &empty, sizeof(empty), hdb_page_offset(db->directory[i])) == sizeof(empty));
+    }
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        int rc = db_get(db, key, strlen((char*)key), read_value, &read_length);
+        if (i % 2 == 0) {
+            assert(rc == -1);
+        } else {
+            assert(rc == 0 && read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+        }
+        snprintf((char*)key, sizeof(key), "nokey%d", i);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == -1);
+    }
+
+    // New buckets join the cache as they are split off
+    uint32_t buckets = db->header.bucket_count;
+    for (int i = num_keys; i < num_keys * 2; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    assert(db->header.bucket_count > buckets);
+    assert(db->index_cache_bytes == (uint64_t)db->header.bucket_count * sizeof(struct hdb_bucket));
+    for (int i = num_keys; i < num_keys * 2; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+        assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+    }
+    db_close(db);
+
+    remove_test_files("test_cache");
+    printf("index cache test passed\n");
+}
+
+void test_value_cache() {
+    remove_test_files("test_vcache");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.value_cache = HDB_CACHE_SHARDS * 4096;
+    struct hdb *db = db_open_with_options("test_vcache_hash.db", "test_vcache_data.db", "test_vcache_deleted.db", &options);
+    assert(db != NULL);
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    struct hdb_cache_stats stats;
+
+    // The first get misses, the ones after it hit
+    int hot_keys = 50;
+    for (int i = 0; i < hot_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "hot%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < hot_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "hot%d", i);
+            snprintf((char*)value, sizeof(value), "value%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+        }
+    }
+    db_cache_stats(db, &stats);
+    assert(stats.misses == (uint64_t)hot_keys && stats.hits == (uint64_t)hot_keys * 2);
+    assert(stats.entries == (uint64_t)hot_keys && stats.bytes <= options.value_cache);
+
+    // A scan of many more keys than fit stays within the budget and leaves the hot keys cached
+    for (int i = 0; i < 5000; ++i) {
+        snprintf((char*)key, sizeof(key), "cold%d", i);
+        assert(db_put(db, key, strlen((char*)key), key, strlen((char*)key)) == 0);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+    }
+    db_cache_stats(db, &stats);
+    assert(stats.bytes <= options.value_cache);
+    uint64_t hits = stats.hits;
+    for (int i = 0; i < hot_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "hot%d", i);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+    }
+    db_cache_stats(db, &stats);
+    assert(stats.hits == hits + hot_keys);
+
+    // Writes drop what the cache holds, single or batched
+    uint8_t hot[] = "hot1";
+    uint8_t updated[] = "updated";
+    assert(db_put(db, hot, strlen((char*)hot), updated, strlen((char*)updated)) == 0);
+    assert(db_get(db, hot, strlen((char*)hot), read_value, &read_length) == 0);
+    assert(read_length == strlen((char*)updated) && memcmp(read_value, updated, read_length) == 0);
+    assert(db_delete(db, hot, strlen((char*)hot)) == 0);
+    assert(db_get(db, hot, strlen((char*)hot), read_value, &read_length) == -1);
+    uint8_t batched[] = "batched";
+    struct hdb_put_item item = {(const uint8_t*)"hot2", 4, batched, strlen((char*)batched)};
+    assert(db_put_batch(db, &item, 1) == 0);
+    assert(db_get(db, item.key, item.key_length, read_value, &read_length) == 0);
+    assert(read_length == strlen((char*)batched) && memcmp(read_value, batched, read_length) == 0);
+
+    db_close(db);
+    remove_test_files("test_vcache");
+    printf("value cache test passed\n");
+}
+
+void test_filter() {
+    remove_test_files("test_filter");
+    int num_keys = 20000;
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.filter_bits = 10;
+    struct hdb *db = db_open_with_options("test_filter_hash.db", "test_filter_data.db", "test_filter_deleted.db", &options);
+    assert(db != NULL && db->filter != NULL);
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    assert(db->filter->capacity >= db->header.key_count); // rebuilt larger as the keys came in
+
+    // Every key is let through, few absent ones are
+    int passed = 0;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+        snprintf((char*)key, sizeof(key), "nokey%d", i);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == -1);
+        passed += hdb_filter_may_contain(db->filter, db->hash(key, strlen((char*)key)),
+                                         fingerprint_function(key, strlen((char*)key)));
+    }
+    assert(passed < num_keys / 20);
+
+    // Compaction forgets deleted keys
+    for (int i = 0; i < num_keys / 2; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    assert(db_compact(db) == 0);
+    passed = 0;
+    for (int i = 0; i < num_keys / 2; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        passed += hdb_filter_may_contain(db->filter, db->hash(key, strlen((char*)key)),
+                                         fingerprint_function(key, strlen((char*)key)));
+    }
+    assert(passed < num_keys / 40);
+    uint64_t blocks = db->filter->blocks;
+    db_close(db);
+
+    // The filter written on close is loaded again on the first lookup
+    FILE *file = fopen("test_filter_hash.db.filter", "rb");
+    assert(file != NULL);
+    fseek(file, 0, SEEK_END);
+    assert(ftell(file) == (long)(sizeof(struct hdb_filter_header) + blocks * (HDB_FILTER_BLOCK_BITS / 8)));
+    fclose(file);
+    db = db_open_with_options("test_filter_hash.db", "test_filter_data.db", "test_filter_deleted.db", &options);
+    assert(db != NULL && db->filter == NULL);
+    snprintf((char*)key, sizeof(key), "key%d", num_keys - 1);
+    assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+    assert(db->filter != NULL && db->filter->blocks == blocks);
+    db_close(db);
+
+    // A filter that missed writes made without it is not trusted
+    db = db_open("test_filter_hash.db", "test_filter_data.db", "test_filter_deleted.db");
+    uint8_t late[] = "late";
+    assert(db_put(db, late, strlen((char*)late), late, strlen((char*)late)) == 0);
+    db_close(db);
+    db = db_open_with_options("test_filter_hash.db", "test_filter_data.db", "test_filter_deleted.db", &options);
+    assert(db != NULL);
+    assert(db_get(db, late, strlen((char*)late), read_value, &read_length) == 0);
+    for (int i = num_keys / 2; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+    }
+    db_close(db);
+
+    remove_test_files("test_filter");
+    printf("filter test passed\n");
+}
+
+struct counting_allocator {
+    uint64_t allocations;
+    int64_t live; // blocks allocated and not freed yet
+    size_t fail_above; // requests for more bytes fail, 0 for none
+};
+
+void* counting_reallocate(void *context, void *ptr, size_t size) {
+    struct counting_allocator *counts = context;
+    if (!size) {
+        counts->live--;
+        free(ptr);
+        return NULL;
+    }
+    if (counts->fail_above && size > counts->fail_above) return NULL;
+    void *block = realloc(ptr, size);
+    if (block && !ptr) {
+        counts->allocations++;
+        counts->live++;
+    }
+    return block;
+}
+
+void test_allocator() {
+    remove_test_files("test_alloc");
+    struct counting_allocator counts = {0, 0, 0};
+    struct hdb_allocator allocator = {counting_reallocate, &counts};
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.allocator = &allocator;
+    options.index_cache = UINT64_MAX;
+    options.value_cache = 1 << 20;
+    options.filter_bits = 10;
+    struct hdb *db = db_open_with_options("test_alloc_hash.db", "test_alloc_data.db", "test_alloc_deleted.db", &options);
+    assert(db != NULL);
+    assert(counts.live > 0);
+
+    int num_keys = 20000;
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+    }
+
+    // Every other key, so no two dead records coalesce: one extent each,
+    // carved from a few chunks rather than allocated one by one
+    uint64_t allocations = counts.allocations;
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    assert(db->free_space.count == (uint64_t)num_keys / 2);
+    assert(counts.allocations - allocations < 64);
+
+    // A write whose log record finds no room changes nothing
+    size_t big_length = 2 << 20;
+    uint8_t *big = calloc(1, big_length);
+    uint8_t *big_read = malloc(big_length);
+    uint64_t key_count = db->header.key_count;
+    counts.fail_above = big_length / 2 + big_length / 4;
+    assert(db_put(db, (const uint8_t*)"big", 3, big, big_length) == -1);
+    struct hdb_put_item item = {(const uint8_t*)"big", 3, big, big_length};
+    assert(db_put_batch(db, &item, 1) == -1);
+    counts.fail_above = 0;
+    assert(db->header.key_count == key_count);
+    assert(db_get(db, (const uint8_t*)"big", 3, big_read, &read_length) == -1);
+    assert(db_put(db, (const uint8_t*)"big", 3, big, big_length) == 0);
+    assert(db_get(db, (const uint8_t*)"big", 3, big_read, &read_length) == 0 && read_length == big_length);
+    free(big);
+    free(big_read);
+
+    assert(db_compact(db) == 0);
+    db_close(db);
+    assert(counts.live == 0);
+
+    remove_test_files("test_alloc");
+    printf("allocator test passed\n");
+}
+
+void test_compression() {
+    remove_test_files("test_codec");
+
+    // The codec itself, on data that compresses and data that does not
+    size_t length = 70000;
+    uint8_t *original = malloc(length), *packed = malloc(hdb_lz4_bound(length)), *unpacked = malloc(length);
+    for (int kind = 0; kind < 2; ++kind) {
+        srand(7);
+        for (size_t i = 0; i < length; ++i) original[i] = kind ? (uint8_t)rand() : (uint8_t)("abcabd"[i % 6] + i / 5000);
+        size_t packed_length = hdb_lz4_compress(original, length, packed, hdb_lz4_bound(length));
+        assert(packed_length > 0);
+        if (!kind) assert(packed_length < length / 4);
+        assert(hdb_lz4_decompress(packed, packed_length, unpacked, length) == 0);
+        assert(memcmp(original, unpacked, length) == 0);
+        assert(hdb_lz4_decompress(packed, packed_length - 1, unpacked, length) == -1);
+    }
+    free(original);
+    free(packed);
+    free(unpacked);
+
+    int num_keys = 500;
+    uint8_t key[32], value[1024], read_value[1024];
+    size_t read_length;
+    for (int pass = 0; pass < 2; ++pass) {
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION | (pass ? HDB_OPEN_MMAP : 0);
+        options.compression = HDB_CODEC_LZ4;
+        struct hdb *db = db_open_with_options("test_codec_hash.db", "test_codec_data.db", "test_codec_deleted.db", &options);
+        assert(db != NULL);
+
+        // Document-like values well above the threshold, and one below it
+        uint64_t start = hdb_data_size(db);
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            int n = snprintf((char*)value, sizeof(value), "{\"id\": %d, \"name\": \"user%d\", \"tags\": [", i, i);
+            while (n < 900) n += snprintf((char*)value + n, sizeof(value) - n, "\"tag%d\", ", n % 7);
+            assert(db_put(db, key, strlen((char*)key), value, n) == 0);
+        }
+        assert(hdb_data_size(db) - start < (uint64_t)num_keys * 900 / 3);
+        uint8_t small[] = "a short value, stored as it is";
+        assert(db_put(db, (uint8_t*)"small", 5, small, sizeof(small)) == 0);
+        struct hdb_slot slot;
+        struct hdb_read read;
+        assert(hdb_lookup_slot(db, (uint8_t*)"small", 5, &read, &slot) == 0);
+        assert(hdb_slot_codec(&slot) == HDB_CODEC_NONE);
+        assert(hdb_lookup_slot(db, (uint8_t*)"key0", 4, &read, &slot) == 0);
+        assert(hdb_slot_codec(&slot) == HDB_CODEC_LZ4);
+
+        // Every way of reading gives back the original
+        struct hdb_get_item gets[16];
+        uint8_t batch_keys[16][32], batch_values[16][1024];
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(read_length >= 900 && read_length < sizeof(value));
+            snprintf((char*)value, sizeof(value), "{\"id\": %d, ", i);
+            assert(memcmp(read_value, value, strlen((char*)value)) == 0);
+            struct hdb_ref ref;
+            assert(db_get_ref(db, key, strlen((char*)key), &ref) == 0);
+            assert(ref.length == read_length && memcmp(ref.data, read_value, read_length) == 0);
+            db_release_ref(&ref);
+        }
+        for (int i = 0; i < 16; ++i) {
+            snprintf((char*)batch_keys[i], sizeof(batch_keys[i]), "key%d", i * 31);
+            gets[i] = (struct hdb_get_item){batch_keys[i], strlen((char*)batch_keys[i]), batch_values[i], 0, 0};
+        }
+        assert(db_get_batch(db, gets, 16) == 0);
+        for (int i = 0; i < 16; ++i) {
+            assert(gets[i].rc == 0 && gets[i].value_length >= 900);
+            snprintf((char*)value, sizeof(value), "{\"id\": %d, ", i * 31);
+            assert(memcmp(batch_values[i], value, strlen((char*)value)) == 0);
+        }
+        assert(db_get(db, (uint8_t*)"small", 5, read_value, &read_length) == 0);
+        assert(read_length == sizeof(small) && memcmp(read_value, small, sizeof(small)) == 0);
+
+        // Batched puts compress too, and the async engine decodes
+        struct hdb_put_item puts[16];
+        for (int i = 0; i < 16; ++i) {
+            snprintf((char*)batch_keys[i], sizeof(batch_keys[i]), "batch%d", i);
+            memset(batch_values[i], 'a' + i, sizeof(batch_values[i]));
+            puts[i] = (struct hdb_put_item){batch_keys[i], strlen((char*)batch_keys[i]), batch_values[i], sizeof(batch_values[i])};
+        }
+        start = hdb_data_size(db);
+        assert(db_put_batch(db, puts, 16) == 0);
+        assert(hdb_data_size(db) - start < 16 * sizeof(batch_values[0]) / 4);
+        struct hdb_async *async = db_async_open(db, HDB_ASYNC_URING, 8);
+        assert(async != NULL);
+        struct hdb_request requests[16];
+        for (int i = 0; i < 16; ++i) {
+            memset(batch_values[i], 0, sizeof(batch_values[i]));
+            requests[i] = (struct hdb_request){HDB_REQUEST_GET, batch_keys[i], strlen((char*)batch_keys[i]), batch_values[i],
+                                               0, 0, NULL, NULL, NULL};
+            assert(db_async_submit(async, &requests[i]) == 0);
+        }
+        db_async_poll(async, UINT32_MAX);
+        for (int i = 0; i < 16; ++i) {
+            assert(requests[i].rc == 0 && requests[i].value_length == sizeof(batch_values[i]));
+            for (size_t j = 0; j < sizeof(batch_values[i]); ++j) assert(batch_values[i][j] == 'a' + i);
+        }
+        db_async_close(async);
+
+        // Compressed and plain records both survive compaction and a reopen
+        assert(db_compact(db) == 0);
+        db_close(db);
+        db = db_open_with_options("test_codec_hash.db", "test_codec_data.db", "test_codec_deleted.db", &options);
+        assert(db != NULL);
+        for (int i = 0; i < num_keys; i += 7) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            snprintf((char*)value, sizeof(value), "{\"id\": %d, ", i);
+            assert(memcmp(read_value, value, strlen((char*)value)) == 0);
+        }
+        assert(db_get(db, (uint8_t*)"small", 5, read_value, &read_length) == 0);
+        assert(read_length == sizeof(small));
+        db_close(db);
+    }
+
+    remove_test_files("test_codec");
+    printf("compression test passed\n");
+}
+
+struct cursor_writer {
+    struct hdb *db;
+    volatile bool stop;
+    int written;
+};
+
+void* cursor_writer_thread(void *arg) {
+    struct cursor_writer *writer = arg;
+    uint8_t key[32], value[32];
+    while (!writer->stop) {
+        snprintf((char*)key, sizeof(key), "writer%d", writer->written % 1000);
+        snprintf((char*)value, sizeof(value), "value%d", writer->written);
+        assert(db_put(writer->db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        writer->written++;
+    }
+    return NULL;
+}
+
+void test_cursor() {
+    remove_test_files("test_cursor");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION | HDB_OPEN_SORTED_INDEX;
+    struct hdb *db = db_open_with_options("test_cursor_hash.db", "test_cursor_data.db", "test_cursor_deleted.db", &options);
+    assert(db != NULL);
+
+    // Every third key deleted and every fifth overwritten, so the log holds
+    // dead records and tombstones to skip
+    int num_keys = 3000;
+    uint8_t key[32], value[32];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%05d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%05d", i);
+        if (i % 3 == 0) {
+            assert(db_delete(db, key, strlen((char*)key)) == 0);
+        } else if (i % 5 == 0) {
+            snprintf((char*)value, sizeof(value), "new%d", i);
+            assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        }
+    }
+
+    // A full scan while another thread writes keys of its own: every other key
+    // comes back exactly once, with its last value
+    struct cursor_writer writer = {db, false, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, cursor_writer_thread, &writer);
+    int *seen = calloc(num_keys, sizeof(int));
+    struct hdb_cursor *cursor = db_cursor_open(db);
+    assert(cursor != NULL);
+    int rc;
+    while ((rc = db_cursor_next(cursor)) == 0) {
+        if (cursor->key_length > 6 && memcmp(cursor->key, "writer", 6) == 0) continue;
+        assert(cursor->key_length == 8 && memcmp(cursor->key, "key", 3) == 0);
+        int i = atoi((const char*)cursor->key + 3);
+        assert(i >= 0 && i < num_keys && i % 3 != 0);
+        seen[i]++;
+        snprintf((char*)value, sizeof(value), i % 5 == 0 ? "new%d" : "value%d", i);
+        assert(cursor->value_length == strlen((char*)value) && memcmp(cursor->value, value, cursor->value_length) == 0);
+    }
+    assert(rc == 1);
+    assert(db_compact(db) == -1); // not while a scan of the data file is open
+    db_cursor_close(cursor);
+    writer.stop = true;
+    pthread_join(thread, NULL);
+    assert(writer.written > 0);
+    for (int i = 0; i < num_keys; ++i) assert(seen[i] == (i % 3 ? 1 : 0));
+
+    // Ranges and prefixes come out in order, deleted keys left out
+    for (int pass = 0; pass < 2; ++pass) {
+        cursor = db_cursor_open_range(db, (const uint8_t*)"key00100", 8, (const uint8_t*)"key00200", 8);
+        assert(cursor != NULL);
+        int expected = 100, count = 0;
+        while ((rc = db_cursor_next(cursor)) == 0) {
+            while (expected % 3 == 0) expected++;
+            snprintf((char*)key, sizeof(key), "key%05d", expected++);
+            assert(cursor->key_length == 8 && memcmp(cursor->key, key, 8) == 0);
+            snprintf((char*)value, sizeof(value), (expected - 1) % 5 == 0 ? "new%d" : "value%d", expected - 1);
+            assert(cursor->value_length == strlen((char*)value) && memcmp(cursor->value, value, cursor->value_length) == 0);
+            count++;
+        }
+        assert(rc == 1 && count == 67);
+        db_cursor_close(cursor);
+
+        cursor = db_cursor_open_prefix(db, (const uint8_t*)"key012", 6);
+        count = 0;
+        uint8_t previous[32] = "";
+        while (db_cursor_next(cursor) == 0) {
+            assert(cursor->key_length == 8 && memcmp(cursor->key, "key012", 6) == 0);
+            assert(memcmp(previous, cursor->key, 8) < 0);
+            memcpy(previous, cursor->key, 8);
+            count++;
+        }
+        assert(count == 66);
+        db_cursor_close(cursor);
+
+        cursor = db_cursor_open_range(db, NULL, 0, NULL, 0);
+        count = 0;
+        while (db_cursor_next(cursor) == 0) count++;
+        assert(count == 2000 + (writer.written < 1000 ? writer.written : 1000));
+        db_cursor_close(cursor);
+
+        // The sorted index is rebuilt from the data file on open
+        db_close(db);
+        db = db_open_with_options("test_cursor_hash.db", "test_cursor_data.db", "test_cursor_deleted.db", &options);
+        assert(db != NULL);
+    }
+    assert(db_compact(db) == 0);
+    db_close(db);
+
+    // Without the sorted index only the full scan is there
+    db = db_open("test_cursor_hash.db", "test_cursor_data.db", "test_cursor_deleted.db");
+    assert(db != NULL);
+    assert(db_cursor_open_prefix(db, (const uint8_t*)"key", 3) == NULL);
+    cursor = db_cursor_open(db);
+    int count = 0;
+    while (db_cursor_next(cursor) == 0) count++;
+    assert(count == 2000 + (writer.written < 1000 ? writer.written : 1000));
+    db_cursor_close(cursor);
+    db_close(db);
+    free(seen);
+
+    remove_test_files("test_cursor");
+    printf("cursor test passed\n");
+}
+
+void test_snapshot() {
+    remove_test_files("test_snapshot");
+    int num_keys = 2000;
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    for (int pass = 0; pass < 2; ++pass) {
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION | (pass ? HDB_OPEN_MMAP : 0);
+        options.index_cache = pass ? 0 : UINT64_MAX;
+        struct hdb *db = db_open_with_options("test_snapshot_hash.db", "test_snapshot_data.db", "test_snapshot_deleted.db", &options);
+        assert(db != NULL);
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "old%d", i);
+            assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        }
+        struct hdb_snapshot *snapshot = db_snapshot_open(db);
+        assert(snapshot != NULL);
+
+        // Overwrites, deletes and enough new keys to split buckets, all after the snapshot
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            if (i % 4 == 0) {
+                assert(db_delete(db, key, strlen((char*)key)) == 0);
+            } else {
+                snprintf((char*)value, sizeof(value), "new%d", i);
+                assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+            }
+            snprintf((char*)key, sizeof(key), "later%d", i);
+            assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        }
+        assert(db_compact(db) == -1); // the snapshot still needs the old records
+
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "old%d", i);
+            assert(db_snapshot_get(snapshot, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+            assert((db_get(db, key, strlen((char*)key), read_value, &read_length) == 0) == (i % 4 != 0));
+            snprintf((char*)key, sizeof(key), "later%d", i);
+            assert(db_snapshot_get(snapshot, key, strlen((char*)key), read_value, &read_length) == -1);
+        }
+
+        // A scan of the snapshot while a writer keeps going sees exactly the old keys
+        struct cursor_writer writer = {db, false, 0};
+        pthread_t thread;
+        pthread_create(&thread, NULL, cursor_writer_thread, &writer);
+        int *seen = calloc(num_keys, sizeof(int));
+        struct hdb_cursor *cursor = db_snapshot_cursor(snapshot);
+        assert(cursor != NULL);
+        int count = 0;
+        while (db_cursor_next(cursor) == 0) {
+            assert(cursor->key_length > 3 && memcmp(cursor->key, "key", 3) == 0);
+            int i = atoi((const char*)cursor->key + 3);
+            seen[i]++;
+            snprintf((char*)value, sizeof(value), "old%d", i);
+            assert(cursor->value_length == strlen((char*)value) && memcmp(cursor->value, value, cursor->value_length) == 0);
+            count++;
+        }
+        db_cursor_close(cursor);
+        writer.stop = true;
+        pthread_join(thread, NULL);
+        assert(count == num_keys);
+        for (int i = 0; i < num_keys; ++i) assert(seen[i] == 1);
+        free(seen);
+
+        db_snapshot_release(snapshot);
+        assert(db_compact(db) == 0);
+        for (int i = 1; i < num_keys; i += 4) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "new%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+        }
+        db_close(db);
+        remove_test_files("test_snapshot");
+    }
+    printf("snapshot test passed\n");
+}
+
+void test_stats() {
+    remove_test_files("test_stats");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.durability = HDB_DURABILITY_COMMIT;
+    struct hdb *db = db_open_with_options("test_stats_hash.db", "test_stats_data.db", "test_stats_deleted.db", &options);
+    assert(db != NULL);
+
+    int num_keys = 2000;
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < num_keys * 2; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        if (db_get(db, key, strlen((char*)key), read_value, &read_length) == 0) bytes += read_length;
+    }
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    snprintf((char*)value, sizeof(value), "again");
+    assert(db_put(db, (uint8_t*)"key1", 4, value, strlen((char*)value)) == 0); // fits where "value1" was
+
+    struct hdb_stats stats;
+    db_stats(db, &stats);
+#ifndef HDB_NO_STATS
+    assert(stats.counters[HDB_STAT_PUTS] == (uint64_t)num_keys + 1);
+    assert(stats.counters[HDB_STAT_GETS] == (uint64_t)num_keys * 2);
+    assert(stats.counters[HDB_STAT_GET_MISSES] == (uint64_t)num_keys);
+    assert(stats.counters[HDB_STAT_DELETES] == (uint64_t)num_keys / 2);
+    assert(stats.counters[HDB_STAT_BYTES_READ] == bytes);
+    assert(stats.counters[HDB_STAT_PROBES] >= (uint64_t)num_keys * 2);
+    assert(stats.counters[HDB_STAT_SPLITS] > 0);
+    assert(stats.counters[HDB_STAT_EXTENT_REUSES] == 1);
+    assert(stats.counters[HDB_STAT_APPENDS] == (uint64_t)num_keys * 3 / 2); // tombstones included
+    const struct hdb_latency *get = &stats.latencies[HDB_LATENCY_GET];
+    assert(get->count == (uint64_t)num_keys * 2);
+    assert(get->p50 > 0 && get->p50 <= get->p90 && get->p90 <= get->p99 && get->p99 <= get->p999 && get->p999 <= get->max);
+    assert(get->mean <= get->max);
+    assert(stats.latencies[HDB_LATENCY_PUT].count == (uint64_t)num_keys + 1);
+    assert(stats.latencies[HDB_LATENCY_SYNC].count == (uint64_t)num_keys * 3 / 2 + 1); // one per committed write
+#endif
+
+    // Both forms carry every figure
+    FILE *file = tmpfile();
+    assert(db_stats_print(&stats, file, HDB_STATS_JSON) == 0);
+    char text[4096];
+    rewind(file);
+    size_t length = fread(text, 1, sizeof(text) - 1, file);
+    text[length] = '\0';
+    char expected[64];
+    snprintf(expected, sizeof(expected), "\"gets\": %" PRIu64, stats.counters[HDB_STAT_GETS]);
+    assert(text[0] == '{' && strstr(text, expected) != NULL);
+    assert(strstr(text, "\"sync\": {\"count\": ") != NULL);
+    rewind(file);
+    assert(db_stats_print(&stats, file, HDB_STATS_TEXT) == 0);
+    rewind(file);
+    length = fread(text, 1, sizeof(text) - 1, file);
+    text[length] = '\0';
+    snprintf(expected, sizeof(expected), "gets %" PRIu64 "\n", stats.counters[HDB_STAT_GETS]);
+    assert(strncmp(text, expected, strlen(expected)) == 0 && strstr(text, "\nget_latency count ") != NULL);
+    fclose(file);
+
+    db_close(db);
+    remove_test_files("test_stats");
+    printf("stats test passed\n");
+}
+
+struct bulk_source {
+    int next;
+    int keys;
+    int repeats; // the last keys come again with new values
+    uint8_t key[32];
+    uint8_t value[700];
+};
+
+// Every tenth value is long enough to compress
+size_t bulk_value(int i, bool again, uint8_t *value) {
+    int length = snprintf((char*)value, 32, "%s%d", again ? "again" : "value", i);
+    if (i % 10 == 0) {
+        while (length < 600) length += snprintf((char*)value + length, 32, "-%d", i);
+    }
+    return length;
+}
+
+int bulk_next(void *context, struct hdb_put_item *item) {
+    struct bulk_source *source = context;
+    if (source->next == source->keys + source->repeats) return 1;
+    int i = source->next < source->keys ? source->next : source->keys - 1 - (source->next - source->keys);
+    snprintf((char*)source->key, sizeof(source->key), "key%d", i);
+    *item = (struct hdb_put_item){source->key, strlen((char*)source->key), source->value,
+                                  bulk_value(i, source->next >= source->keys, source->value)};
+    source->next++;
+    return 0;
+}
+
+void test_bulk_load() {
+    remove_test_files("test_bulk");
+
+    // Whatever the files held before is replaced
+    struct hdb *db = db_open("test_bulk_hash.db", "test_bulk_data.db", "test_bulk_deleted.db");
+    assert(db != NULL);
+    assert(db_put(db, (uint8_t*)"stale", 5, (uint8_t*)"value", 5) == 0);
+    db_close(db);
+
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION | HDB_OPEN_SORTED_INDEX;
+    options.compression = HDB_CODEC_LZ4;
+    options.filter_bits = 10;
+    uint8_t key[32], expected[700], read_value[700];
+    size_t read_length;
+    // Large enough to be built in parts, small enough for one, and empty
+    int sizes[] = {30000, 500, 0};
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); ++n) {
+        struct bulk_source source = {0, sizes[n], sizes[n] / 10, {0}, {0}};
+        struct hdb_bulk_source bulk = {bulk_next, &source};
+        db = db_bulk_load("test_bulk_hash.db", "test_bulk_data.db", "test_bulk_deleted.db", &options, &bulk);
+        assert(db != NULL);
+        assert(db->header.key_count == (uint64_t)source.keys);
+        assert((db->header.dead_bytes > 0) == (source.repeats > 0));
+        assert(db_get(db, (uint8_t*)"stale", 5, read_value, &read_length) == -1);
+
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int i = 0; i < source.keys; ++i) {
+                snprintf((char*)key, sizeof(key), "key%d", i);
+                size_t length = bulk_value(i, i >= source.keys - source.repeats, expected);
+                assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+                assert(read_length == length && memcmp(read_value, expected, length) == 0);
+                snprintf((char*)key, sizeof(key), "nokey%d", i);
+                assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == -1);
+            }
+            int seen = 0;
+            struct hdb_cursor *cursor = db_cursor_open_prefix(db, (uint8_t*)"key", 3);
+            assert(cursor != NULL);
+            while (db_cursor_next(cursor) == 0) seen++;
+            db_cursor_close(cursor);
+            assert(seen == source.keys);
+
+            // The result takes writes like any other database
+            assert(db_put(db, (uint8_t*)"extra", 5, (uint8_t*)"value", 5) == 0);
+            if (source.keys) assert(db_delete(db, (uint8_t*)"key0", 4) == 0);
+            assert(db_get(db, (uint8_t*)"extra", 5, read_value, &read_length) == 0);
+            assert(db_get(db, (uint8_t*)"key0", 4, read_value, &read_length) == -1);
+            if (source.keys) assert(db_put(db, (uint8_t*)"key0", 4, expected, bulk_value(0, false, expected)) == 0);
+            assert(db_delete(db, (uint8_t*)"extra", 5) == 0);
+
+            // And gives the space of the replaced values back
+            assert(db_compact(db) == 0);
+            assert(db->header.dead_bytes == 0);
+            db_close(db);
+            db = db_open_with_options("test_bulk_hash.db", "test_bulk_data.db", "test_bulk_deleted.db", &options);
+            assert(db != NULL);
+        }
+        db_close(db);
+    }
+    remove_test_files("test_bulk");
+    printf("bulk load test passed\n");
+}
+
+void remove_shards(const char *const *directories, int count) {
+    char prefix[64];
+    for (int i = 0; i < count; ++i) {
+        snprintf(prefix, sizeof(prefix), "%s/shard%d", directories[i], i);
+        remove_test_files(prefix);
+    }
+}
+
+struct sharded_writer {
+    struct hdb_sharded *sharded;
+    int first;
+    int count;
+};
+
+void* sharded_writer_thread(void *arg) {
+    struct sharded_writer *writer = arg;
+    uint8_t key[32], value[32];
+    for (int i = writer->first; i < writer->first + writer->count; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_sharded_put(writer->sharded, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    return NULL;
+}
+
+void test_sharded() {
+    // Two directories standing in for two disks, shared by four shards
+    mkdir("test_shards_a", 0755);
+    mkdir("test_shards_b", 0755);
+    const char *directories[] = {"test_shards_a", "test_shards_b", "test_shards_a", "test_shards_b"};
+    int num_shards = 4;
+    remove_shards(directories, num_shards);
+    remove("test_shards_a/" HDB_SHARDS_FILENAME);
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    struct hdb_sharded *sharded = db_sharded_open(directories, num_shards, &options);
+    assert(sharded != NULL);
+
+    int num_threads = 4, per_thread = 2000, num_keys = num_threads * per_thread;
+    pthread_t threads[4];
+    struct sharded_writer writers[4];
+    for (int i = 0; i < num_threads; ++i) {
+        writers[i] = (struct sharded_writer){sharded, i * per_thread, per_thread};
+        pthread_create(&threads[i], NULL, sharded_writer_thread, &writers[i]);
+    }
+    for (int i = 0; i < num_threads; ++i) pthread_join(threads[i], NULL);
+
+    uint8_t key[32], value[32], read_value[32];
+    size_t read_length;
+    for (int i = 0; i < num_keys; i += 3) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_sharded_delete(sharded, key, strlen((char*)key)) == 0);
+    }
+    for (int reopen = 0; reopen < 2; ++reopen) {
+        // Every shard holds its share and only keys routed to it
+        uint64_t total = 0;
+        for (int i = 0; i < num_shards; ++i) {
+            assert(sharded->shards[i]->header.key_count > (uint64_t)num_keys / num_shards / 2);
+            total += sharded->shards[i]->header.key_count;
+        }
+        assert(total == (uint64_t)(num_keys - (num_keys + 2) / 3));
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "value%d", i);
+            int rc = db_sharded_get(sharded, key, strlen((char*)key), read_value, &read_length);
+            if (i % 3 == 0) {
+                assert(rc == -1);
+                continue;
+            }
+            assert(rc == 0 && read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+            struct hdb *shard = db_sharded_shard(sharded, key, strlen((char*)key));
+            for (int j = 0; j < num_shards; ++j) {
+                if (sharded->shards[j] != shard) assert(db_get(sharded->shards[j], key, strlen((char*)key), read_value, &read_length) == -1);
+            }
+        }
+        assert(db_sharded_compact(sharded) == 0);
+        db_sharded_close(sharded);
+
+        // The files remember how many shards there are
+        assert(db_sharded_open(directories, num_shards - 1, &options) == NULL);
+        sharded = db_sharded_open(directories, num_shards, &options);
+        assert(sharded != NULL);
+    }
+    db_sharded_close(sharded);
+    remove_shards(directories, num_shards);
+    remove("test_shards_a/" HDB_SHARDS_FILENAME);
+    rmdir("test_shards_a");
+    rmdir("test_shards_b");
+    printf("sharded test passed\n");
+}
+
+// Every fourth key is deleted, every fifth rewritten
+int fast_open_value(int i, uint8_t *value, const void *context) {
+    (void)context;
+    if (i % 4 == 0) return -1;
+    return sprintf((char*)value, "%s%d", i % 5 == 0 ? "rewritten" : "value", i);
+}
+
+void test_fast_open() {
+    remove_test_files("test_fast");
+    remove_test_files("test_crash");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.durability = HDB_DURABILITY_NONE;
+    options.filter_bits = 10;
+    struct hdb *db = db_open_with_options("test_fast_hash.db", "test_fast_data.db", "test_fast_deleted.db", &options);
+    assert(db != NULL && db->start == HDB_START_CLAIM);
+
+    int num_keys = 4000;
+    uint8_t key[32], value[32];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_keys; i += 5) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "rewritten%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_keys; i += 4) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    uint64_t key_count = db->header.key_count, free_extents = db->free_space.count;
+    assert(free_extents > 0);
+    db_close(db);
+
+    // After a clean close nothing but the header and the directory is read at open
+    db = db_open_with_options("test_fast_hash.db", "test_fast_data.db", "test_fast_deleted.db", &options);
+    assert(db != NULL && db->start == HDB_START_CLEAN);
+    assert(db->free_space_pending && db->free_space.count == 0);
+    assert(db->filter_pending && db->filter == NULL);
+    assert(db->header.key_count == key_count);
+    check_keys(db, "key", num_keys, fast_open_value, NULL);
+    assert(!db->filter_pending && db->filter != NULL && db->free_space_pending); // lookups only load the filter
+    assert(db_put(db, (const uint8_t*)"key1", 4, (const uint8_t*)"value1", 6) == 0);
+    assert(!db->free_space_pending && db->free_space.count >= free_extents - 1);
+    db_close(db);
+
+    // Opened but never written, the close leaves the other files as they were
+    db = db_open_with_options("test_fast_hash.db", "test_fast_data.db", "test_fast_deleted.db", &options);
+    assert(db != NULL && db->start == HDB_START_CLEAN);
+    db_close(db);
+    db = db_open_with_options("test_fast_hash.db", "test_fast_data.db", "test_fast_deleted.db", &options);
+    assert(db != NULL && db->start == HDB_START_CLEAN);
+    check_keys(db, "key", num_keys, fast_open_value, NULL);
+    for (int i = 0; i < num_keys; i += 3) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "%s%d", i % 5 == 0 ? "rewritten" : "value", i);
+        if (i % 4) assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    assert(db_put(db, (const uint8_t*)"extra", 5, (const uint8_t*)"value", 5) == 0);
+
+    // Files taken while the database is open look like a crash: the free
+    // space and filter files are stale and rebuilt from the data file
+    copy_file("test_fast_hash.db", "test_crash_hash.db");
+    copy_file("test_fast_data.db", "test_crash_data.db");
+    copy_file("test_fast_deleted.db", "test_crash_deleted.db");
+    copy_file("test_fast_hash.db.filter", "test_crash_hash.db.filter");
+    uint64_t free_bytes = db->free_space.bytes, dead_bytes = db->header.dead_bytes;
+    free_extents = db->free_space.count;
+    key_count = db->header.key_count;
+    db_close(db);
+    struct hdb *crashed = db_open_with_options("test_crash_hash.db", "test_crash_data.db", "test_crash_deleted.db", &options);
+    assert(crashed != NULL && crashed->start == HDB_START_RECOVER);
+    assert(!crashed->free_space_pending && !crashed->filter_pending && crashed->filter != NULL);
+    assert(crashed->free_space.count == free_extents && crashed->free_space.bytes == free_bytes);
+    assert(crashed->header.dead_bytes == dead_bytes && crashed->header.key_count == key_count);
+    check_keys(crashed, "key", num_keys, fast_open_value, NULL);
+    uint8_t read_value[32];
+    size_t read_length;
+    assert(db_get(crashed, (const uint8_t*)"extra", 5, read_value, &read_length) == 0 && read_length == 5);
+    db_close(crashed);
+    crashed = db_open_with_options("test_crash_hash.db", "test_crash_data.db", "test_crash_deleted.db", &options);
+    assert(crashed != NULL && crashed->start == HDB_START_CLEAN);
+    check_keys(crashed, "key", num_keys, fast_open_value, NULL);
+    db_close(crashed);
+
+    // A header that does not match its checksum is refused
+    FILE *file = fopen("test_fast_hash.db", "rb+");
+    assert(file != NULL);
+    uint64_t corrupt = key_count + 1;
+    assert(fseek(file, offsetof(struct hdb_header, key_count), SEEK_SET) == 0 && fwrite(&corrupt, sizeof(uint64_t), 1, file) == 1);
+    fclose(file);
+    assert(db_open_with_options("test_fast_hash.db", "test_fast_data.db", "test_fast_deleted.db", &options) == NULL);
+    remove_test_files("test_fast");
+    remove_test_files("test_crash");
+    printf("fast open test passed\n");
+}
+
+// Keys from *deleted_from on are deleted, the ones below that are a multiple of three rewritten
+int buffer_pool_value(int i, uint8_t *value, const void *deleted_from) {
+    if (i >= *(const int*)deleted_from) return -1;
+    return sprintf((char*)value, "%s%d", i % 3 == 0 ? "rewritten" : "value", i);
+}
+
+void test_buffer_pool() {
+    uint32_t policies[] = {HDB_POOL_CLOCK, HDB_POOL_LRU};
+    for (int p = 0; p < 2; ++p) {
+        remove_test_files("test_pool");
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION | HDB_OPEN_DIRECT;
+        options.durability = HDB_DURABILITY_NONE;
+        options.buffer_pool = HDB_POOL_SHARDS * 4 * HDB_PAGE_SIZE;
+        options.buffer_pool_policy = policies[p];
+        struct hdb *db = db_open_with_options("test_pool_hash.db", "test_pool_data.db", "test_pool_deleted.db", &options);
+        assert(db != NULL && db->data_pool != NULL);
+
+        int num_keys = 20000;
+        int deleted_from = num_keys / 2;
+        uint8_t key[32], value[32], read_value[32];
+        size_t read_length;
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "value%d", i);
+            assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        }
+
+        // A file many times the pool is read back through it without the pool outgrowing its budget
+        struct hdb_cache_stats stats;
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "value%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+        }
+        db_pool_stats(db, &stats);
+        assert(stats.misses > 0 && stats.hits > stats.misses);
+        assert(stats.entries <= HDB_POOL_SHARDS * 4 && stats.bytes <= options.buffer_pool);
+        assert(db_get(db, (const uint8_t*)"key7", 4, read_value, &read_length) == 0);
+        db_pool_stats(db, &stats);
+        uint64_t hits = stats.hits, misses = stats.misses;
+        assert(db_get(db, (const uint8_t*)"key7", 4, read_value, &read_length) == 0);
+        db_pool_stats(db, &stats);
+        assert(stats.hits > hits && stats.misses == misses);
+
+        // Overwrites and deletes drop the pages they change, the next read sees them
+        for (int i = 0; i < num_keys; i += 3) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            snprintf((char*)value, sizeof(value), "rewritten%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        }
+        for (int i = num_keys / 2; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            assert(db_get(db, key, strlen((char*)key), read_value, &read_length) == 0);
+            assert(db_delete(db, key, strlen((char*)key)) == 0);
+        }
+        check_keys(db, "key", num_keys, buffer_pool_value, &deleted_from);
+
+        // A value spanning more pages than a pool read is read around the pool
+        size_t big_length = (HDB_POOL_READ_PAGES + 8) * HDB_PAGE_SIZE;
+        uint8_t *big = malloc(big_length), *read_big = malloc(big_length);
+        uint64_t state = 88172645463325252ull;
+        for (size_t i = 0; i < big_length; ++i) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            big[i] = (uint8_t)state;
+        }
+        assert(db_put(db, (const uint8_t*)"big", 3, big, big_length) == 0);
+        db_pool_stats(db, &stats);
+        uint64_t entries = stats.entries;
+        size_t read_big_length;
+        assert(db_get(db, (const uint8_t*)"big", 3, read_big, &read_big_length) == 0);
+        assert(read_big_length == big_length && memcmp(read_big, big, big_length) == 0);
+        db_pool_stats(db, &stats);
+        assert(stats.entries <= entries + 2);
+
+        // Compaction moves to a new file with a pool of its own
+        struct hdb_pool *pool = db->data_pool;
+        assert(db_compact(db) == 0);
+        assert(db->data_pool != NULL && db->data_pool != pool);
+        check_keys(db, "key", num_keys, buffer_pool_value, &deleted_from);
+        assert(db_get(db, (const uint8_t*)"big", 3, read_big, &read_big_length) == 0);
+        assert(read_big_length == big_length && memcmp(read_big, big, big_length) == 0);
+        db_close(db);
+
+        db = db_open_with_options("test_pool_hash.db", "test_pool_data.db", "test_pool_deleted.db", &options);
+        assert(db != NULL);
+        check_keys(db, "key", num_keys, buffer_pool_value, &deleted_from);
+        db_close(db);
+        free(big);
+        free(read_big);
+    }
+
+    // The pool and the mappings are two ways of reading the same file, only one can be asked for
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION | HDB_OPEN_DIRECT | HDB_OPEN_MMAP;
+    assert(db_open_with_options("test_pool_hash.db", "test_pool_data.db", "test_pool_deleted.db", &options) == NULL);
+    remove_test_files("test_pool");
+    printf("buffer pool test passed\n");
+}
+
+void fill_blob_value(uint8_t *value, size_t length, int seed) {
+    for (size_t i = 0; i < length; ++i) value[i] = (uint8_t)(seed * 31 + i * 7 + (i >> 8));
+}
+
+// Big keys below *rewritten_below hold the value of seed i + 1000
+int blob_value(int i, uint8_t *value, const void *rewritten_below) {
+    fill_blob_value(value, 2000 + i, i < *(const int*)rewritten_below ? i + 1000 : i);
+    return 2000 + i;
+}
+
+void test_blob() {
+    remove_test_files("test_blob");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.durability = HDB_DURABILITY_NONE;
+    options.blob_threshold = 1024;
+    struct hdb *db = db_open_with_options("test_blob_hash.db", "test_blob_data.db", "test_blob_deleted.db", &options);
+    assert(db != NULL && db->blob_file != NULL);
+
+    // Short values stay in the data file next to the blobs
+    int num_small = 1000;
+    uint8_t key[32], value[4096], read_value[4096];
+    size_t read_length;
+    for (int i = 0; i < num_small; ++i) {
+        snprintf((char*)key, sizeof(key), "small%d", i);
+        snprintf((char*)value, sizeof(value), "v%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_small; i += 2) {
+        snprintf((char*)key, sizeof(key), "small%d", i);
+        snprintf((char*)value, sizeof(value), "no longer short %d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 1; i < num_small; i += 4) {
+        snprintf((char*)key, sizeof(key), "small%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    for (int i = 0; i < num_small; ++i) {
+        snprintf((char*)key, sizeof(key), "small%d", i);
+        int rc = db_get(db, key, strlen((char*)key), read_value, &read_length);
+        if (i % 4 == 1) {
+            assert(rc == -1);
+            continue;
+        }
+        snprintf((char*)value, sizeof(value), i % 2 == 0 ? "no longer short %d" : "v%d", i);
+        assert(rc == 0 && read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+    }
+
+    // Long values go to the blob file and read back through every path
+    int num_big = 200;
+    int rewritten_below = num_big / 2;
+    for (int i = 0; i < num_big - 16; ++i) {
+        snprintf((char*)key, sizeof(key), "big%d", i);
+        fill_blob_value(value, 2000 + i, i);
+        assert(db_put(db, key, strlen((char*)key), value, 2000 + i) == 0);
+    }
+    struct hdb_put_item puts[16];
+    uint8_t (*batch_keys)[32] = malloc(16 * sizeof(*batch_keys));
+    uint8_t (*batch_values)[4096] = malloc(16 * sizeof(*batch_values));
+    for (int i = 0; i < 16; ++i) {
+        int k = num_big - 16 + i;
+        snprintf((char*)batch_keys[i], sizeof(batch_keys[i]), "big%d", k);
+        fill_blob_value(batch_values[i], 2000 + k, k);
+        puts[i] = (struct hdb_put_item){batch_keys[i], strlen((char*)batch_keys[i]), batch_values[i], 2000 + k};
+    }
+    assert(db_put_batch(db, puts, 16) == 0);
+    struct hdb_stats stats;
+    db_stats(db, &stats);
+    assert(stats.counters[HDB_STAT_BLOB_WRITES] == (uint64_t)num_big);
+    check_keys(db, "big", num_big, blob_value, &(int){0});
+
+    struct hdb_ref ref;
+    fill_blob_value(value, 2007, 7);
+    assert(db_get_ref(db, (const uint8_t*)"big7", 4, &ref) == 0);
+    assert(ref.length == 2007 && memcmp(ref.data, value, 2007) == 0);
+    db_release_ref(&ref);
+
+    struct hdb_get_item gets[16];
+    for (int i = 0; i < 16; ++i) gets[i] = (struct hdb_get_item){batch_keys[i], strlen((char*)batch_keys[i]), batch_values[i], 0, 0};
+    assert(db_get_batch(db, gets, 16) == 0);
+    for (int i = 0; i < 16; ++i) {
+        int k = num_big - 16 + i;
+        fill_blob_value(value, 2000 + k, k);
+        assert(gets[i].rc == 0 && gets[i].value_length == (size_t)(2000 + k) && memcmp(batch_values[i], value, 2000 + k) == 0);
+    }
+
+    int bigs = 0;
+    struct hdb_cursor *cursor = db_cursor_open(db);
+    assert(cursor != NULL);
+    while (db_cursor_next(cursor) == 0) {
+        if (cursor->key_length < 3 || cursor->key_length >= sizeof(key) || memcmp(cursor->key, "big", 3) != 0) continue;
+        memcpy(key, cursor->key, cursor->key_length);
+        key[cursor->key_length] = 0;
+        int i = atoi((const char*)key + 3);
+        fill_blob_value(value, 2000 + i, i);
+        assert(cursor->value_length == (size_t)(2000 + i) && memcmp(cursor->value, value, cursor->value_length) == 0);
+        bigs++;
+    }
+    db_cursor_close(cursor);
+    assert(bigs == num_big);
+
+    // Overwrites leave dead blob records, which its own compaction drops
+    struct hdb_snapshot *snapshot = db_snapshot_open(db);
+    assert(snapshot != NULL);
+    for (int i = 0; i < num_big / 2; ++i) {
+        snprintf((char*)key, sizeof(key), "big%d", i);
+        fill_blob_value(value, 2000 + i, i + 1000);
+        assert(db_put(db, key, strlen((char*)key), value, 2000 + i) == 0);
+    }
+    fill_blob_value(value, 2003, 3);
+    assert(db_snapshot_get(snapshot, (const uint8_t*)"big3", 4, read_value, &read_length) == 0);
+    assert(read_length == 2003 && memcmp(read_value, value, read_length) == 0);
+    assert(db_compact_blobs(db) == -1); // not while the snapshot needs the old records
+    db_snapshot_release(snapshot);
+    assert(db->header.blob_dead_bytes > 0);
+    uint64_t blob_end = db->blob_end;
+    assert(db_compact_blobs(db) == 0);
+    assert(db->blob_end < blob_end && db->header.blob_dead_bytes == 0);
+    db_stats(db, &stats);
+    assert(stats.counters[HDB_STAT_BLOB_COMPACTIONS] == 1);
+    check_keys(db, "big", num_big, blob_value, &rewritten_below);
+
+    // The data file compacts with the refs in it
+    assert(db_compact(db) == 0);
+    check_keys(db, "big", num_big, blob_value, &rewritten_below);
+    snprintf((char*)value, sizeof(value), "v%d", 3);
+    assert(db_get(db, (const uint8_t*)"small3", 6, read_value, &read_length) == 0);
+    assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+    db_close(db);
+
+    // Without either option the values are still found where they went
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    db = db_open_with_options("test_blob_hash.db", "test_blob_data.db", "test_blob_deleted.db", &options);
+    assert(db != NULL && db->header.blob_dead_bytes == 0);
+    check_keys(db, "big", num_big, blob_value, &rewritten_below);
+    assert(db_get(db, (const uint8_t*)"small3", 6, read_value, &read_length) == 0);
+    assert(read_length == strlen((char*)value) && memcmp(read_value, value, read_length) == 0);
+    assert(db_delete(db, (const uint8_t*)"big5", 4) == 0);
+    assert(db->header.blob_dead_bytes == hdb_record_size(4, 2005));
+    db_close(db);
+    free(batch_keys);
+    free(batch_values);
+    remove_test_files("test_blob");
+    printf("blob test passed\n");
+}
+
+uint8_t stream_byte(uint64_t i, int seed) {
+    return (uint8_t)(i * 131 + (i >> 11) + seed);
+}
+
+// Streams a value of length bytes in chunks of chunk
+int put_stream_value(struct hdb *db, const char *key, uint64_t length, size_t chunk, int seed) {
+    struct hdb_value_writer *writer = db_put_begin(db, (const uint8_t*)key, strlen(key), length);
+    if (!writer) return -1;
+    uint8_t *buffer = malloc(chunk);
+    for (uint64_t done = 0; done < length; done += chunk) {
+        size_t n = length - done < chunk ? length - done : chunk;
+        for (size_t i = 0; i < n; ++i) buffer[i] = stream_byte(done + i, seed);
+        if (db_put_append(writer, buffer, n) != 0) {
+            free(buffer);
+            db_put_abort(writer);
+            return -1;
+        }
+    }
+    free(buffer);
+    return db_put_commit(writer);
+}
+
+void check_stream_value(struct hdb *db, const char *key, uint64_t length, int seed) {
+    struct hdb_value_reader *reader = db_get_open(db, (const uint8_t*)key, strlen(key));
+    assert(reader != NULL && reader->length == length);
+    size_t chunk = 50000;
+    uint8_t *buffer = malloc(chunk);
+    for (uint64_t done = 0; done < length; done += chunk) {
+        size_t n = length - done < chunk ? length - done : chunk;
+        assert(db_read_at(reader, done, buffer, n) == 0);
+        for (size_t i = 0; i < n; ++i) assert(buffer[i] == stream_byte(done + i, seed));
+    }
+    assert(db_read_at(reader, length - 10, buffer, 11) == -1);
+    assert(db_read_at(reader, length, buffer, 0) == 0);
+    free(buffer);
+    db_get_close(reader);
+}
+
+void test_streaming() {
+    for (int config = 0; config < 2; ++config) {
+        remove_test_files("test_stream");
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION;
+        if (config == 1) {
+            options.blob_threshold = 4096;
+            options.compression = HDB_CODEC_LZ4;
+        }
+        struct hdb *db = db_open_with_options("test_stream_hash.db", "test_stream_data.db", "test_stream_deleted.db", &options);
+        assert(db != NULL);
+
+        // A streamed value replaces the one put before, and reads back whole or in pieces
+        uint64_t length = 3 * 1024 * 1024 + 123;
+        assert(db_put(db, (const uint8_t*)"large", 5, (const uint8_t*)"small", 5) == 0);
+        assert(put_stream_value(db, "large", length, 65536, 1) == 0);
+        check_stream_value(db, "large", length, 1);
+        uint8_t *whole = malloc(length);
+        size_t whole_length;
+        assert(db_get(db, (const uint8_t*)"large", 5, whole, &whole_length) == 0 && whole_length == length);
+        for (uint64_t i = 0; i < length; i += 4099) assert(whole[i] == stream_byte(i, 1));
+        assert(put_stream_value(db, "new", 100, 7, 2) == 0);
+        check_stream_value(db, "new", 100, 2);
+        assert(put_stream_value(db, "empty", 0, 1, 0) == 0);
+        check_stream_value(db, "empty", 0, 0);
+
+        // Nothing shows before the commit, and an abort or a short value leaves the key alone
+        struct hdb_value_writer *writer = db_put_begin(db, (const uint8_t*)"new", 3, 50);
+        assert(writer != NULL);
+        assert(db_put_append(writer, whole, 30) == 0);
+        assert(db_put_append(writer, whole, 21) == -1);
+        check_stream_value(db, "new", 100, 2);
+        db_put_abort(writer);
+        check_stream_value(db, "new", 100, 2);
+        writer = db_put_begin(db, (const uint8_t*)"new", 3, 50);
+        assert(writer != NULL && db_put_append(writer, whole, 49) == 0);
+        assert(db_put_commit(writer) == -1);
+        check_stream_value(db, "new", 100, 2);
+        assert(db_get_open(db, (const uint8_t*)"missing", 7) == NULL);
+
+        // A reader keeps the value it opened through an overwrite, and holds compaction off
+        struct hdb_value_reader *reader = db_get_open(db, (const uint8_t*)"large", 5);
+        assert(reader != NULL);
+        assert(put_stream_value(db, "large", length / 2, 100000, 3) == 0);
+        assert(db_compact(db) == -1);
+        uint8_t piece[4096];
+        assert(db_read_at(reader, length - sizeof(piece), piece, sizeof(piece)) == 0);
+        for (size_t i = 0; i < sizeof(piece); ++i) assert(piece[i] == stream_byte(length - sizeof(piece) + i, 1));
+        db_get_close(reader);
+        check_stream_value(db, "large", length / 2, 3);
+
+        // A value put whole reads back through a reader too, decoded when it was compressed
+        for (uint64_t i = 0; i < length; ++i) whole[i] = stream_byte(i, 4);
+        assert(db_put(db, (const uint8_t*)"whole", 5, whole, 200000) == 0);
+        check_stream_value(db, "whole", 200000, 4);
+
+        assert(db_compact(db) == 0);
+        check_stream_value(db, "large", length / 2, 3);
+        db_close(db);
+        db = db_open_with_options("test_stream_hash.db", "test_stream_data.db", "test_stream_deleted.db", &options);
+        assert(db != NULL);
+        check_stream_value(db, "large", length / 2, 3);
+        check_stream_value(db, "new", 100, 2);
+        check_stream_value(db, "whole", 200000, 4);
+        db_close(db);
+        free(whole);
+    }
+    remove_test_files("test_stream");
+    printf("streaming test passed\n");
+}
+
+// Puts count keys named after prefix, expiring ttl milliseconds from now
+void put_ttl_keys(struct hdb *db, const char *prefix, int count, uint64_t ttl) {
+    uint8_t key[32];
+    uint8_t value[600];
+    for (int i = 0; i < count; ++i) {
+        snprintf((char*)key, sizeof(key), "%s%d", prefix, i);
+        for (size_t j = 0; j < sizeof(value); ++j) value[j] = (uint8_t)('a' + (i + j / 16) % 26);
+        assert(db_put_ttl(db, key, strlen((char*)key), value, 100 + i * 10, ttl) == 0);
+    }
+}
+
+int ttl_value(int i, uint8_t *value, const void *context) {
+    (void)context;
+    for (int j = 0; j < 100 + i * 10; ++j) value[j] = (uint8_t)('a' + (i + j / 16) % 26);
+    return 100 + i * 10;
+}
+
+void test_ttl() {
+    int num_keys = 50;
+    for (int config = 0; config < 2; ++config) {
+        remove_test_files("test_ttl");
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION;
+        options.durability = HDB_DURABILITY_COMMIT;
+        if (config == 1) {
+            options.blob_threshold = 300;
+            options.compression = HDB_CODEC_LZ4;
+        }
+        struct hdb *db = db_open_with_options("test_ttl_hash.db", "test_ttl_data.db", "test_ttl_deleted.db", &options);
+        assert(db != NULL);
+        put_ttl_keys(db, "short", num_keys, 300);
+        put_ttl_keys(db, "long", num_keys, 3600 * 1000);
+        put_ttl_keys(db, "plain", num_keys, 0);
+        check_keys(db, "short", num_keys, ttl_value, NULL);
+        copy_file("test_ttl_data.db.wal", "test_ttl_saved.wal");
+        usleep(400000);
+
+        // An expired key is gone for every way of reading it
+        check_keys(db, "short", num_keys, NULL, NULL);
+        check_keys(db, "long", num_keys, ttl_value, NULL);
+        check_keys(db, "plain", num_keys, ttl_value, NULL);
+        struct hdb_ref ref;
+        assert(db_get_ref(db, (const uint8_t*)"short1", 6, &ref) == -1);
+        assert(db_get_open(db, (const uint8_t*)"short1", 6) == NULL);
+        uint8_t values[2][600];
+        struct hdb_get_item gets[2] = {{(const uint8_t*)"short2", 6, values[0], 0, 0}, {(const uint8_t*)"long2", 5, values[1], 0, 0}};
+        assert(db_get_batch(db, gets, 2) == 0);
+        assert(gets[0].rc == -1 && gets[1].rc == 0 && gets[1].value_length == 120);
+        struct hdb_cursor *cursor = db_cursor_open(db);
+        int count = 0;
+        while (db_cursor_next(cursor) == 0) {
+            assert(cursor->key_length < 5 || memcmp(cursor->key, "short", 5) != 0);
+            count++;
+        }
+        db_cursor_close(cursor);
+        assert(count == 2 * num_keys);
+
+        // Compaction drops them for good
+        struct stat st;
+        assert(stat("test_ttl_data.db", &st) == 0);
+        off_t before = st.st_size;
+        assert(db_compact(db) == 0);
+        struct hdb_stats stats;
+        db_stats(db, &stats);
+        assert(stats.counters[HDB_STAT_EXPIRED] == (uint64_t)num_keys);
+        assert(db->header.key_count == (uint64_t)num_keys * 2);
+        assert(stat("test_ttl_data.db", &st) == 0 && st.st_size < before);
+        check_keys(db, "short", num_keys, NULL, NULL);
+        check_keys(db, "long", num_keys, ttl_value, NULL);
+        put_ttl_keys(db, "short", 1, 0);
+        db_close(db);
+        db = db_open_with_options("test_ttl_hash.db", "test_ttl_data.db", "test_ttl_deleted.db", &options);
+        assert(db != NULL && db->header.key_count == (uint64_t)num_keys * 2 + 1);
+        check_keys(db, "short", 1, ttl_value, NULL);
+        check_keys(db, "long", num_keys, ttl_value, NULL);
+        check_keys(db, "plain", num_keys, ttl_value, NULL);
+        db_close(db);
+
+        // The log keeps the expiry of each put
+        remove_test_files("test_ttl");
+        assert(rename("test_ttl_saved.wal", "test_ttl_data.db.wal") == 0);
+        db = db_open_with_options("test_ttl_hash.db", "test_ttl_data.db", "test_ttl_deleted.db", &options);
+        assert(db != NULL);
+        check_keys(db, "short", num_keys, NULL, NULL);
+        check_keys(db, "long", num_keys, ttl_value, NULL);
+        check_keys(db, "plain", num_keys, ttl_value, NULL);
+        db_close(db);
+    }
+
+    // With background compaction the bytes that expire set it off
+    remove_test_files("test_ttl");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.compaction_min_size = 1;
+    struct hdb *db = db_open_with_options("test_ttl_hash.db", "test_ttl_data.db", "test_ttl_deleted.db", &options);
+    assert(db != NULL);
+    put_ttl_keys(db, "short", num_keys, 1000);
+    put_ttl_keys(db, "plain", 2, 0);
+    struct hdb_stats stats;
+    for (int i = 0; i < 100; ++i) {
+        db_stats(db, &stats);
+        if (stats.counters[HDB_STAT_EXPIRED] == (uint64_t)num_keys) break;
+        usleep(50000);
+    }
+    assert(stats.counters[HDB_STAT_COMPACTIONS] >= 1 && stats.counters[HDB_STAT_EXPIRED] == (uint64_t)num_keys);
+    check_keys(db, "short", num_keys, NULL, NULL);
+    check_keys(db, "plain", 2, ttl_value, NULL);
+    db_close(db);
+    remove_test_files("test_ttl");
+    printf("ttl test passed\n");
+}
+
+#define INCR_THREADS 4
+#define INCR_ROUNDS 500
+
+void* incr_worker(void *arg) {
+    struct hdb *db = arg;
+    for (int i = 0; i < INCR_ROUNDS; ++i) assert(db_incr(db, (const uint8_t*)"shared", 6, 1, NULL) == 0);
+    return NULL;
+}
+
+void test_cas_and_incr() {
+    for (int config = 0; config < 2; ++config) {
+        remove_test_files("test_modify");
+        struct hdb_options options;
+        memset(&options, 0, sizeof(struct hdb_options));
+        options.flags = HDB_OPEN_NO_COMPACTION | (config == 1 ? HDB_OPEN_MMAP : 0);
+        struct hdb *db = db_open_with_options("test_modify_hash.db", "test_modify_data.db", "test_modify_deleted.db", &options);
+        assert(db != NULL);
+
+        // A compare and swap only puts over the value it expects
+        uint8_t value[64];
+        size_t value_length;
+        const uint8_t *key = (const uint8_t*)"cas";
+        assert(db_cas(db, key, 3, (const uint8_t*)"one", 3, (const uint8_t*)"two", 3) == 1);
+        assert(db_get(db, key, 3, value, &value_length) == -1);
+        assert(db_cas(db, key, 3, NULL, 0, (const uint8_t*)"one", 3) == 0);
+        assert(db_cas(db, key, 3, NULL, 0, (const uint8_t*)"two", 3) == 1);
+        assert(db_cas(db, key, 3, (const uint8_t*)"on", 2, (const uint8_t*)"two", 3) == 1);
+        assert(db_cas(db, key, 3, (const uint8_t*)"one", 3, (const uint8_t*)"three", 5) == 0);
+        assert(db_get(db, key, 3, value, &value_length) == 0);
+        assert(value_length == 5 && memcmp(value, "three", 5) == 0);
+
+        // Counters start from 0, and one of the same length is updated where it lies
+        int64_t result;
+        struct hdb_stats stats;
+        assert(db_incr(db, (const uint8_t*)"counter", 7, 5, &result) == 0 && result == 5);
+        uint64_t size = hdb_data_size(db);
+        assert(db_incr(db, (const uint8_t*)"counter", 7, -7, &result) == 0 && result == -2);
+        assert(db_incr(db, (const uint8_t*)"counter", 7, 3, &result) == 0 && result == 1);
+        assert(hdb_data_size(db) == size);
+        db_stats(db, &stats);
+        assert(stats.counters[HDB_STAT_IN_PLACE_UPDATES] == 2);
+        assert(db_get(db, (const uint8_t*)"counter", 7, value, &value_length) == 0);
+        assert(value_length == sizeof(int64_t) && memcmp(value, &result, sizeof(int64_t)) == 0);
+        assert(db_incr(db, key, 3, 1, &result) == -1); // not a counter
+
+        // Something still looking at the old bytes gets a new record instead
+        struct hdb_snapshot *snapshot = db_snapshot_open(db);
+        assert(snapshot != NULL);
+        assert(db_incr(db, (const uint8_t*)"counter", 7, 1, &result) == 0 && result == 2);
+        assert(hdb_data_size(db) > size);
+        assert(db_snapshot_get(snapshot, (const uint8_t*)"counter", 7, value, &value_length) == 0);
+        memcpy(&result, value, sizeof(int64_t));
+        assert(result == 1);
+        db_snapshot_release(snapshot);
+        struct hdb_ref ref;
+        assert(db_get_ref(db, (const uint8_t*)"counter", 7, &ref) == 0);
+        assert(db_incr(db, (const uint8_t*)"counter", 7, 1, &result) == 0 && result == 3);
+        memcpy(&result, ref.data, sizeof(int64_t));
+        assert(result == 2);
+        db_release_ref(&ref);
+
+        // Concurrent increments are never lost
+        pthread_t threads[INCR_THREADS];
+        for (int i = 0; i < INCR_THREADS; ++i) assert(pthread_create(&threads[i], NULL, incr_worker, db) == 0);
+        for (int i = 0; i < INCR_THREADS; ++i) pthread_join(threads[i], NULL);
+        assert(db_incr(db, (const uint8_t*)"shared", 6, 0, &result) == 0 && result == INCR_THREADS * INCR_ROUNDS);
+
+        // An expiry outlives the increments, and an expired counter starts over
+        assert(db_put_ttl(db, (const uint8_t*)"ttl", 3, (const uint8_t*)&result, sizeof(int64_t), 200) == 0);
+        assert(db_incr(db, (const uint8_t*)"ttl", 3, 1, &result) == 0 && result == INCR_THREADS * INCR_ROUNDS + 1);
+        usleep(300000);
+        assert(db_get(db, (const uint8_t*)"ttl", 3, value, &value_length) == -1);
+        assert(db_incr(db, (const uint8_t*)"ttl", 3, 1, &result) == 0 && result == 1);
+        db_close(db);
+
+        // Both are logged and survive a reopen
+        db = db_open_with_options("test_modify_hash.db", "test_modify_data.db", "test_modify_deleted.db", &options);
+        assert(db != NULL);
+        assert(db_incr(db, (const uint8_t*)"counter", 7, 0, &result) == 0 && result == 3);
+        assert(db_incr(db, (const uint8_t*)"ttl", 3, 0, &result) == 0 && result == 1);
+        assert(db_get(db, key, 3, value, &value_length) == 0);
+        assert(value_length == 5 && memcmp(value, "three", 5) == 0);
+        db_close(db);
+    }
+    remove_test_files("test_modify");
+    printf("cas and incr test passed\n");
+}
+
+void remove_replication_files() {
+    remove_test_files("test_leader");
+    remove_test_files("test_follower");
+    remove_test_files("test_replica");
+    remove("test_leader_saved.wal");
+}
+
+// Applies everything the leader has to the follower.
+void replicate(struct hdb *leader, struct hdb *follower) {
+    static uint8_t buffer[1 << 16];
+    size_t length;
+    for (;;) {
+        uint64_t oldest, next;
+        db_changes_range(follower, &oldest, &next);
+        assert(db_changes_read(leader, next, buffer, sizeof(buffer), &length, 0) == 0);
+        if (!length) break;
+        assert(db_follower_apply(follower, buffer, length) == 0);
+    }
+}
+
+void check_replica(struct hdb *leader, struct hdb *follower, int num_keys) {
+    uint8_t key[32], value[64], replica_value[64];
+    size_t value_length, replica_length;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        int rc = db_get(leader, key, strlen((char*)key), value, &value_length);
+        assert(db_get(follower, key, strlen((char*)key), replica_value, &replica_length) == rc);
+        assert(rc != 0 || (replica_length == value_length && memcmp(replica_value, value, value_length) == 0));
+    }
+    uint64_t oldest, leader_next, follower_next;
+    db_changes_range(leader, &oldest, &leader_next);
+    db_changes_range(follower, &oldest, &follower_next);
+    assert(follower_next == leader_next);
+}
+
+void* late_writer(void *arg) {
+    usleep(100000);
+    assert(db_put(arg, (const uint8_t*)"late", 4, (const uint8_t*)"value", 5) == 0);
+    return NULL;
+}
+
+int snapshot_source(void *context, struct hdb_put_item *item) {
+    struct hdb_cursor *cursor = context;
+    int rc = db_cursor_next(cursor);
+    if (rc != 0) return rc;
+    *item = (struct hdb_put_item){cursor->key, cursor->key_length, cursor->value, cursor->value_length};
+    return 0;
+}
+
+void test_replication() {
+    remove_replication_files();
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.durability = HDB_DURABILITY_COMMIT;
+    options.replication_backlog = 4 << 20;
+    struct hdb_options follower_options = options;
+    follower_options.flags |= HDB_OPEN_FOLLOWER;
+    follower_options.replication_backlog = 0;
+    struct hdb *leader = db_open_with_options("test_leader_hash.db", "test_leader_data.db", "test_leader_deleted.db", &options);
+    struct hdb *follower = db_open_with_options("test_follower_hash.db", "test_follower_data.db", "test_follower_deleted.db",
+                                                &follower_options);
+    assert(leader != NULL && follower != NULL);
+
+    // A follower only changes through the stream, which carries every value whole
+    assert(db_put(follower, (const uint8_t*)"key", 3, (const uint8_t*)"value", 5) == -1);
+    assert(db_delete(follower, (const uint8_t*)"key", 3) == -1);
+    assert(db_incr(follower, (const uint8_t*)"key", 3, 1, NULL) == -1);
+    assert(db_put_begin(follower, (const uint8_t*)"key", 3, 10) == NULL);
+    assert(db_put_begin(leader, (const uint8_t*)"key", 3, 10) == NULL);
+
+    int num_keys = 200;
+    uint8_t key[32], value[64];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(leader, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_keys; i += 10) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(leader, key, strlen((char*)key)) == 0);
+    }
+    assert(db_put_ttl(leader, (const uint8_t*)"key1", 4, (const uint8_t*)"expires", 7, 3600 * 1000) == 0);
+    assert(db_incr(leader, (const uint8_t*)"key2", 4, 1, NULL) == -1); // not a counter, nothing changes
+    assert(db_cas(leader, (const uint8_t*)"key3", 4, (const uint8_t*)"value3", 6, (const uint8_t*)"swapped", 7) == 0);
+    struct hdb_put_item items[2] = {{(const uint8_t*)"key4", 4, (const uint8_t*)"batch4", 6},
+                                    {(const uint8_t*)"key5", 4, (const uint8_t*)"batch5", 6}};
+    assert(db_put_batch(leader, items, 2) == 0);
+    uint64_t oldest, next;
+    db_changes_range(leader, &oldest, &next);
+    assert(oldest == 0 && next == (uint64_t)num_keys + num_keys / 10 + 4);
+    replicate(leader, follower);
+    check_replica(leader, follower, num_keys);
+
+    // Changes sent again are skipped, a gap is refused and a change has to fit
+    uint8_t buffer[4096];
+    size_t length;
+    assert(db_changes_read(leader, next - 3, buffer, sizeof(buffer), &length, 0) == 0 && length > 0);
+    assert(db_follower_apply(follower, buffer, length) == 0);
+    check_replica(leader, follower, num_keys);
+    assert(db_put(leader, (const uint8_t*)"key6", 4, (const uint8_t*)"gap", 3) == 0);
+    assert(db_put(leader, (const uint8_t*)"key7", 4, (const uint8_t*)"gap", 3) == 0);
+    assert(db_changes_read(leader, next + 1, buffer, sizeof(buffer), &length, 0) == 0 && length > 0);
+    assert(db_follower_apply(follower, buffer, length) == -1);
+    assert(db_changes_read(leader, next, buffer, 8, &length, 0) == 1 && length > 8);
+    assert(db_changes_read(leader, next + 3, buffer, sizeof(buffer), &length, 0) == -1); // not numbered yet
+    replicate(leader, follower);
+    check_replica(leader, follower, num_keys);
+
+    // A reader waits for the next change
+    pthread_t writer;
+    db_changes_range(leader, &oldest, &next);
+    assert(db_changes_read(leader, next, buffer, sizeof(buffer), &length, 10) == 0 && length == 0);
+    assert(pthread_create(&writer, NULL, late_writer, leader) == 0);
+    assert(db_changes_read(leader, next, buffer, sizeof(buffer), &length, 5000) == 0 && length > 0);
+    pthread_join(writer, NULL);
+    assert(db_follower_apply(follower, buffer, length) == 0);
+    uint8_t read_value[64];
+    size_t read_length;
+    assert(db_get(follower, (const uint8_t*)"late", 4, read_value, &read_length) == 0 && read_length == 5);
+
+    // Both resume where they were after a close, the backlog starts over
+    db_close(follower);
+    db_close(leader);
+    leader = db_open_with_options("test_leader_hash.db", "test_leader_data.db", "test_leader_deleted.db", &options);
+    follower = db_open_with_options("test_follower_hash.db", "test_follower_data.db", "test_follower_deleted.db",
+                                    &follower_options);
+    assert(leader != NULL && follower != NULL);
+    uint64_t follower_next;
+    db_changes_range(leader, &oldest, &next);
+    db_changes_range(follower, &oldest, &follower_next);
+    assert(follower_next == next);
+    assert(db_changes_read(leader, next - 1, buffer, sizeof(buffer), &length, 0) == -1);
+    assert(db_put(leader, (const uint8_t*)"key8", 4, (const uint8_t*)"reopened", 8) == 0);
+    replicate(leader, follower);
+    check_replica(leader, follower, num_keys);
+
+    // A log replayed on its own numbers its changes as they were numbered at first
+    assert(hdb_checkpoint(leader) == 0);
+    for (int i = 0; i < 5; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_put(leader, key, strlen((char*)key), (const uint8_t*)"logged", 6) == 0);
+    }
+    db_changes_range(leader, &oldest, &next);
+    copy_file("test_leader_data.db.wal", "test_leader_saved.wal");
+    db_close(leader);
+    remove_test_files("test_leader");
+    assert(rename("test_leader_saved.wal", "test_leader_data.db.wal") == 0);
+    leader = db_open_with_options("test_leader_hash.db", "test_leader_data.db", "test_leader_deleted.db", &options);
+    assert(leader != NULL);
+    uint64_t replayed_oldest, replayed_next;
+    db_changes_range(leader, &replayed_oldest, &replayed_next);
+    assert(replayed_oldest == next - 5 && replayed_next == next);
+    replicate(leader, follower);
+    assert(db_get(follower, (const uint8_t*)"key3", 4, read_value, &read_length) == 0);
+    assert(read_length == 6 && memcmp(read_value, "logged", 6) == 0);
+    db_close(leader);
+    db_close(follower);
+
+    // A new replica loads a snapshot, then follows from where the snapshot stands
+    remove_replication_files();
+    leader = db_open_with_options("test_leader_hash.db", "test_leader_data.db", "test_leader_deleted.db", &options);
+    assert(leader != NULL);
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(leader, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    struct hdb_snapshot *snapshot = db_snapshot_open(leader);
+    assert(snapshot != NULL && snapshot->sequence == (uint64_t)num_keys);
+    for (int i = 0; i < num_keys; i += 3) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(leader, key, strlen((char*)key)) == 0);
+    }
+    struct hdb_cursor *cursor = db_snapshot_cursor(snapshot);
+    struct hdb_bulk_source source = {snapshot_source, cursor};
+    struct hdb *replica = db_bulk_load("test_replica_hash.db", "test_replica_data.db", "test_replica_deleted.db",
+                                       &follower_options, &source);
+    assert(replica != NULL);
+    db_cursor_close(cursor);
+    db_snapshot_release(snapshot);
+    assert(db_follower_start(replica, (uint64_t)num_keys) == 0);
+    replicate(leader, replica);
+    check_replica(leader, replica, num_keys);
+    db_close(replica);
+    db_close(leader);
+
+    // Only the latest changes are kept
+    remove_replication_files();
+    options.replication_backlog = 1;
+    leader = db_open_with_options("test_leader_hash.db", "test_leader_data.db", "test_leader_deleted.db", &options);
+    assert(leader != NULL);
+    uint8_t large[1024];
+    memset(large, 'v', sizeof(large));
+    for (int i = 0; i < 3000; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_put(leader, key, strlen((char*)key), large, sizeof(large)) == 0);
+    }
+    db_changes_range(leader, &oldest, &next);
+    assert(oldest > 0 && oldest < next);
+    assert(db_changes_read(leader, 0, buffer, sizeof(buffer), &length, 0) == -1);
+    assert(db_changes_read(leader, next - 1, buffer, sizeof(buffer), &length, 0) == 0 && length > sizeof(large));
+    db_close(leader);
+    remove_replication_files();
+    printf("replication test passed\n");
 }
 
 void test_concurrent_fsync_thread() {
@@ -135,13 +2488,425 @@ void test_concurrent_fsync_thread() {
     printf("concurrent fsync background thread test passed\n");
 }
 
+void test_index_growth() {
+    remove_test_files("test_growth");
+    struct hdb *db = db_open("test_growth_hash.db", "test_growth_data.db", "test_growth_deleted.db");
+    assert(db != NULL);
+
+    // Far more keys than a single bucket can hold
+    int num_keys = 20000;
+    uint8_t key[32];
+    uint8_t value[32];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    uint32_t bucket_count = db->header.bucket_count;
+    assert(bucket_count > 1);
+    db_close(db);
+
+    // Reopening reattaches to the grown table
+    db = db_open("test_growth_hash.db", "test_growth_data.db", "test_growth_deleted.db");
+    assert(db != NULL);
+    assert(db->header.bucket_count == bucket_count);
+    assert(db->header.key_count == (uint64_t)num_keys);
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        uint8_t retrieved_value[1024];
+        size_t retrieved_value_length;
+        assert(db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length) == 0);
+        assert(retrieved_value_length == strlen((char*)value));
+        assert(memcmp(retrieved_value, value, retrieved_value_length) == 0);
+    }
+
+    db_close(db);
+    printf("index growth test passed\n");
+}
+
+void test_colliding_hashes() {
+    remove_test_files("test_collide");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.hash_algorithm = HDB_HASH_LEGACY32;
+    struct hdb *db = db_open_with_options("test_collide_hash.db", "test_collide_data.db", "test_collide_deleted.db", &options);
+    assert(db != NULL);
+
+    // These two keys share the same legacy hash value
+    uint8_t key1[] = "key76934";
+    uint8_t key2[] = "key90512";
+    assert(hash_function_legacy(key1, strlen((char*)key1)) == hash_function_legacy(key2, strlen((char*)key2)));
+
+    uint8_t value1[] = "value1";
+    uint8_t value2[] = "value2";
+    assert(db_put(db, key1, strlen((char*)key1), value1, strlen((char*)value1)) == 0);
+    assert(db_put(db, key2, strlen((char*)key2), value2, strlen((char*)value2)) == 0);
+
+    uint8_t retrieved_value[1024];
+    size_t retrieved_value_length;
+    assert(db_get(db, key1, strlen((char*)key1), retrieved_value, &retrieved_value_length) == 0);
+    assert(retrieved_value_length == strlen((char*)value1));
+    assert(memcmp(retrieved_value, value1, retrieved_value_length) == 0);
+    assert(db_get(db, key2, strlen((char*)key2), retrieved_value, &retrieved_value_length) == 0);
+    assert(retrieved_value_length == strlen((char*)value2));
+    assert(memcmp(retrieved_value, value2, retrieved_value_length) == 0);
+
+    db_close(db);
+
+    // The file keeps the hash it was created with
+    db = db_open("test_collide_hash.db", "test_collide_data.db", "test_collide_deleted.db");
+    assert(db != NULL);
+    assert(db->header.hash_algorithm == HDB_HASH_LEGACY32);
+    assert(db_get(db, key1, strlen((char*)key1), retrieved_value, &retrieved_value_length) == 0);
+    assert(memcmp(retrieved_value, value1, retrieved_value_length) == 0);
+
+    db_close(db);
+    printf("colliding hashes test passed\n");
+}
+
+void test_delete_keeps_neighbours() {
+    remove_test_files("test_probe");
+    struct hdb *db = db_open("test_probe_hash.db", "test_probe_data.db", "test_probe_deleted.db");
+    assert(db != NULL);
+
+    int num_keys = 2000;
+    uint8_t key[32];
+    uint8_t value[32];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+
+    // Removing every other key must not hide the keys probed past them
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+
+    uint8_t retrieved_value[1024];
+    size_t retrieved_value_length;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        int rc = db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length);
+        if (i % 2 == 0) {
+            assert(rc == -1);
+        } else {
+            assert(rc == 0);
+            assert(retrieved_value_length == strlen((char*)value));
+            assert(memcmp(retrieved_value, value, retrieved_value_length) == 0);
+        }
+    }
+
+    // A key that was never stored is not found
+    uint8_t missing[] = "missingkey";
+    assert(db_get(db, missing, strlen((char*)missing), retrieved_value, &retrieved_value_length) == -1);
+
+    db_close(db);
+    printf("delete keeps neighbours test passed\n");
+}
+
+void test_compaction() {
+    remove_test_files("test_compact");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    struct hdb *db = db_open_with_options("test_compact_hash.db", "test_compact_data.db", "test_compact_deleted.db", &options);
+    assert(db != NULL);
+
+    int num_keys = 3000;
+    uint8_t key[32];
+    uint8_t value[64];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    // Overwrite a third of the keys and delete another third
+    for (int i = 0; i < num_keys; i += 3) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "newvalue%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        snprintf((char*)key, sizeof(key), "key%d", i + 1);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+    uint64_t size_before = hdb_data_size(db);
+    assert(db->header.dead_bytes > 0);
+
+    assert(db_compact(db) == 0);
+    assert(db->header.dead_bytes == 0);
+    assert(hdb_data_size(db) < size_before);
+    db_close(db);
+
+    // The compacted file is what the index now points into, also after reopening
+    db = db_open_with_options("test_compact_hash.db", "test_compact_data.db", "test_compact_deleted.db", &options);
+    assert(db != NULL);
+    uint8_t retrieved_value[1024];
+    size_t retrieved_value_length;
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        int rc = db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length);
+        if (i % 3 == 1) {
+            assert(rc == -1);
+            continue;
+        }
+        snprintf((char*)value, sizeof(value), i % 3 == 0 ? "newvalue%d" : "value%d", i);
+        assert(rc == 0);
+        assert(retrieved_value_length == strlen((char*)value));
+        assert(memcmp(retrieved_value, value, retrieved_value_length) == 0);
+    }
+    db_close(db);
+    printf("compaction test passed\n");
+}
+
+// Copies the files of a database that are there, as a crash would leave them.
+void copy_crashed(const char *from, const char *to) {
+    char source[64], target[64];
+    for (size_t i = 0; i < TEST_FILE_SUFFIXES; ++i) {
+        snprintf(source, sizeof(source), "%s%s", from, test_file_suffixes[i]);
+        snprintf(target, sizeof(target), "%s%s", to, test_file_suffixes[i]);
+        remove(target);
+        if (access(source, F_OK) == 0) copy_file(source, target);
+    }
+}
+
+void test_compaction_crash() {
+    const char *crashes[] = {"test_swap_journaled", "test_swap_renamed", "test_swap_remapped"};
+    remove_test_files("test_swap");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    struct hdb *db = db_open_with_options("test_swap_hash.db", "test_swap_data.db", "test_swap_deleted.db", &options);
+    assert(db != NULL);
+    int num_keys = 3000;
+    uint8_t key[32];
+    uint8_t value[64];
+    for (int i = 0; i < num_keys; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "value%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+    }
+    for (int i = 0; i < num_keys; i += 3) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        snprintf((char*)value, sizeof(value), "newvalue%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, strlen((char*)value)) == 0);
+        snprintf((char*)key, sizeof(key), "key%d", i + 1);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+
+    // The steps of hdb_compact, with the files copied where a crash could stop it
+    struct hdb_compaction *compaction = hdb_compaction_create(db, db->data_filename, NULL);
+    assert(compaction != NULL);
+    compaction->now = hdb_wall_clock();
+    pthread_rwlock_wrlock(&db->lock);
+    db->compacting = true;
+    uint64_t dead_bytes;
+    assert(hdb_compaction_scan(db, compaction, hdb_data_size(db)) == 0 && hdb_compaction_remap(db, compaction, false) == 0);
+    assert(hdb_compaction_bury(compaction, &dead_bytes) == 0 && fflush(compaction->file) == 0);
+    struct hdb_remap_header journal = {HDB_REMAP_MAGIC, db->header.compactions + 1, compaction->count};
+    assert(hdb_compaction_journal(db, db->data_filename, HDB_STATE_SWAP, &journal, compaction->old_positions,
+                                  compaction->new_positions, sizeof(uint64_t)) == 0);
+    copy_crashed("test_swap", crashes[0]);
+    assert(rename(compaction->filename, db->data_filename) == 0);
+    copy_crashed("test_swap", crashes[1]);
+    assert(hdb_compaction_remap(db, compaction, true) == 0);
+    copy_crashed("test_swap", crashes[2]);
+    pthread_rwlock_unlock(&db->lock);
+    hdb_compaction_free(db, compaction);
+    db_close(db);
+    remove_test_files("test_swap");
+
+    // Each open finishes the swap, whatever step it stopped at
+    for (int c = 0; c < 3; ++c) {
+        char hash_filename[64], data_filename[64], deleted_filename[64], remap_filename[64];
+        snprintf(hash_filename, sizeof(hash_filename), "%s_hash.db", crashes[c]);
+        snprintf(data_filename, sizeof(data_filename), "%s_data.db", crashes[c]);
+        snprintf(deleted_filename, sizeof(deleted_filename), "%s_deleted.db", crashes[c]);
+        snprintf(remap_filename, sizeof(remap_filename), "%s_data.db.remap", crashes[c]);
+        db = db_open_with_options(hash_filename, data_filename, deleted_filename, &options);
+        assert(db != NULL);
+        assert(db->header.state == HDB_STATE_OPEN && access(remap_filename, F_OK) != 0);
+        uint8_t retrieved_value[1024];
+        size_t retrieved_value_length;
+        for (int i = 0; i < num_keys; ++i) {
+            snprintf((char*)key, sizeof(key), "key%d", i);
+            int rc = db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length);
+            if (i % 3 == 1) {
+                assert(rc == -1);
+                continue;
+            }
+            snprintf((char*)value, sizeof(value), i % 3 == 0 ? "newvalue%d" : "value%d", i);
+            assert(rc == 0);
+            assert(retrieved_value_length == strlen((char*)value));
+            assert(memcmp(retrieved_value, value, retrieved_value_length) == 0);
+        }
+        assert(db->header.dead_bytes == dead_bytes);
+        assert(db_put(db, (const uint8_t*)"after", 5, (const uint8_t*)"swap", 4) == 0);
+        assert(db_compact(db) == 0);
+        db_close(db);
+        remove_test_files(crashes[c]);
+    }
+    printf("compaction crash test passed\n");
+}
+
+void test_blob_compaction_crash() {
+    const char *crashes[] = {"test_blob_swap_journaled", "test_blob_swap_renamed", "test_blob_swap_halfway", "test_blob_swap_remapped"};
+    remove_test_files("test_blob_swap");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.flags = HDB_OPEN_NO_COMPACTION;
+    options.blob_threshold = 1024;
+    struct hdb *db = db_open_with_options("test_blob_swap_hash.db", "test_blob_swap_data.db", "test_blob_swap_deleted.db", &options);
+    assert(db != NULL);
+    int num_big = 100;
+    int rewritten_below = num_big / 2;
+    uint8_t key[32], value[4096];
+    for (int i = 0; i < num_big; ++i) {
+        snprintf((char*)key, sizeof(key), "big%d", i);
+        fill_blob_value(value, 2000 + i, i);
+        assert(db_put(db, key, strlen((char*)key), value, 2000 + i) == 0);
+    }
+    for (int i = 0; i < num_big / 2; ++i) {
+        snprintf((char*)key, sizeof(key), "big%d", i);
+        fill_blob_value(value, 2000 + i, i + 1000);
+        assert(db_put(db, key, strlen((char*)key), value, 2000 + i) == 0);
+    }
+
+    // The steps of hdb_compact_blobs, with the files copied where a crash
+    // could stop it, once with only half of the refs rewritten
+    struct hdb_compaction *compaction = hdb_compaction_create(db, db->blob_filename, db->blob_file);
+    assert(compaction != NULL);
+    pthread_rwlock_wrlock(&db->lock);
+    db->blob_compacting = true;
+    uint64_t dead_bytes;
+    assert(hdb_compaction_scan(db, compaction, db->blob_end) == 0 && hdb_compaction_remap_blobs(db, compaction) == 0);
+    assert(compaction->remap_count > 1);
+    assert(hdb_compaction_bury(compaction, &dead_bytes) == 0 && fflush(compaction->file) == 0);
+    struct hdb_remap_header journal = {HDB_REMAP_MAGIC, db->header.compactions, compaction->remap_count};
+    assert(hdb_compaction_journal(db, db->blob_filename, HDB_STATE_BLOB_SWAP, &journal, compaction->remaps, NULL,
+                                  sizeof(struct hdb_blob_remap)) == 0);
+    copy_crashed("test_blob_swap", crashes[0]);
+    assert(rename(compaction->filename, db->blob_filename) == 0);
+    copy_crashed("test_blob_swap", crashes[1]);
+    assert(hdb_blob_remap_apply(db, compaction->remaps, compaction->remap_count / 2) == 0);
+    copy_crashed("test_blob_swap", crashes[2]);
+    assert(hdb_blob_remap_apply(db, compaction->remaps, compaction->remap_count) == 0);
+    copy_crashed("test_blob_swap", crashes[3]);
+    uint64_t blob_end = compaction->written;
+    db->blob_compacting = false;
+    pthread_rwlock_unlock(&db->lock);
+    hdb_compaction_free(db, compaction);
+    db_close(db);
+    remove_test_files("test_blob_swap");
+
+    // Each open finishes the swap, whatever step it stopped at
+    for (int c = 0; c < 4; ++c) {
+        char hash_filename[64], data_filename[64], deleted_filename[64], remap_filename[64];
+        snprintf(hash_filename, sizeof(hash_filename), "%s_hash.db", crashes[c]);
+        snprintf(data_filename, sizeof(data_filename), "%s_data.db", crashes[c]);
+        snprintf(deleted_filename, sizeof(deleted_filename), "%s_deleted.db", crashes[c]);
+        snprintf(remap_filename, sizeof(remap_filename), "%s_data.db.blob.remap", crashes[c]);
+        db = db_open_with_options(hash_filename, data_filename, deleted_filename, &options);
+        assert(db != NULL);
+        assert(db->header.state == HDB_STATE_OPEN && access(remap_filename, F_OK) != 0);
+        assert(db->blob_end == blob_end && db->header.blob_dead_bytes == dead_bytes);
+        check_keys(db, "big", num_big, blob_value, &rewritten_below);
+        fill_blob_value(value, 2000, 1000);
+        assert(db_put(db, (const uint8_t*)"big0", 4, value, 2000) == 0);
+        assert(db_compact_blobs(db) == 0);
+        check_keys(db, "big", num_big, blob_value, &rewritten_below);
+        db_close(db);
+        remove_test_files(crashes[c]);
+    }
+    printf("blob compaction crash test passed\n");
+}
+
+void test_background_compaction() {
+    remove_test_files("test_bgcompact");
+    struct hdb_options options;
+    memset(&options, 0, sizeof(struct hdb_options));
+    options.compaction_min_size = 4096;
+    struct hdb *db = db_open_with_options("test_bgcompact_hash.db", "test_bgcompact_data.db", "test_bgcompact_deleted.db", &options);
+    assert(db != NULL);
+
+    uint8_t key[32];
+    uint8_t value[256];
+    memset(value, 'v', sizeof(value));
+    for (int i = 0; i < 200; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_put(db, key, strlen((char*)key), value, sizeof(value)) == 0);
+    }
+    pthread_rwlock_wrlock(&db->lock);
+    uint64_t size_before = hdb_data_size(db);
+    pthread_rwlock_unlock(&db->lock);
+    for (int i = 0; i < 150; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_delete(db, key, strlen((char*)key)) == 0);
+    }
+
+    // The compaction thread picks the dead space up on its own.  It may start
+    // while the deletes are still going, so only the end state is checked.
+    bool pending = true;
+    for (int i = 0; i < 50 && pending; ++i) {
+        usleep(100000);
+        pthread_rwlock_wrlock(&db->lock);
+        pending = hdb_needs_compaction(db) || db->compacting;
+        pthread_rwlock_unlock(&db->lock);
+    }
+    assert(!pending);
+    pthread_rwlock_wrlock(&db->lock);
+    assert(hdb_data_size(db) < size_before / 2);
+    pthread_rwlock_unlock(&db->lock);
+
+    uint8_t retrieved_value[1024];
+    size_t retrieved_value_length;
+    for (int i = 0; i < 200; ++i) {
+        snprintf((char*)key, sizeof(key), "key%d", i);
+        assert(db_get(db, key, strlen((char*)key), retrieved_value, &retrieved_value_length) == (i < 150 ? -1 : 0));
+    }
+    db_close(db);
+    printf("background compaction test passed\n");
+}
+
 int main() {
     // Run tests
     test_hash_function();
     test_db_open_close();
     test_db_put_and_db_get();
     test_db_delete();
-    test_deleted_blocks_array();
+    test_free_space();
+    test_index_growth();
+    test_colliding_hashes();
+    test_delete_keeps_neighbours();
+    test_compaction();
+    test_compaction_crash();
+    test_blob_compaction_crash();
+    test_background_compaction();
+    test_mmap();
+    test_get_ref();
+    test_concurrent_access();
+    test_wal();
+    test_batch();
+    test_async();
+    test_index_cache();
+    test_value_cache();
+    test_filter();
+    test_allocator();
+    test_compression();
+    test_cursor();
+    test_snapshot();
+    test_stats();
+    test_bulk_load();
+    test_sharded();
+    test_fast_open();
+    test_buffer_pool();
+    test_blob();
+    test_streaming();
+    test_ttl();
+    test_cas_and_incr();
+    test_replication();
     test_concurrent_fsync_thread();
 
     printf("All tests passed\n");